@@ -0,0 +1,585 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h> /* memset, memcmp, strcmp */
+#include <unistd.h> /* close */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h> /* htonl */
+
+#include <event2/event.h>
+
+#include "transmission.h"
+#include "announcer-udp.h"
+#include "net.h"
+#include "utils.h"
+
+#undef VERBOSE
+
+static int test = 0;
+
+#ifdef VERBOSE
+  #define check( A ) \
+    { \
+        ++test; \
+        if( A ){ \
+            fprintf( stderr, "PASS test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+        } else { \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#else
+  #define check( A ) \
+    { \
+        ++test; \
+        if( !( A ) ){ \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#endif
+
+enum
+{
+    /* shortened so that the retransmit tests don't take minutes */
+    RETRY_MSEC = 40,
+
+    /* give up on a test after this long */
+    DEADLINE_SECS = 10
+};
+
+static void
+writeU32( uint8_t * buf, uint32_t val )
+{
+    val = htonl( val );
+    memcpy( buf, &val, 4 );
+}
+
+static uint32_t
+readU32( const uint8_t * buf )
+{
+    uint32_t val;
+    memcpy( &val, buf, 4 );
+    return ntohl( val );
+}
+
+static int
+bindLoopback( tr_address * setme_addr, tr_port * setme_port )
+{
+    int fd;
+    struct sockaddr_in sin;
+    socklen_t len = sizeof( sin );
+
+    if(( fd = socket( AF_INET, SOCK_DGRAM, 0 )) < 0 )
+        return -1;
+
+    memset( &sin, 0, sizeof( sin ) );
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    if( ( bind( fd, (struct sockaddr*)&sin, sizeof( sin ) ) < 0 )
+        || ( getsockname( fd, (struct sockaddr*)&sin, &len ) < 0 ) )
+    {
+        close( fd );
+        return -1;
+    }
+
+    evutil_make_socket_nonblocking( fd );
+    tr_netAddressFromSockaddr( setme_addr, setme_port, (struct sockaddr*)&sin, len );
+    return fd;
+}
+
+/***
+****  A stand-in tracker that speaks just enough BEP 15
+***/
+
+#define PROTOCOL_ID_HI 0x417
+#define PROTOCOL_ID_LO 0x27101980
+
+struct tracker
+{
+    int fd;
+    tr_port port;
+    tr_address addr;
+    struct event * event;
+    char url[128];
+
+    uint32_t connectionId;
+
+    /* drop the next n requests that arrive */
+    int dropCount;
+
+    /* answer announces and scrapes with an error */
+    tr_bool sendError;
+
+    /* what we've been sent */
+    int connects;
+    int announces;
+    int scrapes;
+    int badConnectionIds;
+    int lastScrapeHashCount;
+    uint32_t lastEvent;
+    uint16_t lastPort;
+};
+
+static void
+trackerRead( int fd, short what UNUSED, void * vtracker )
+{
+    struct tracker * t = vtracker;
+    uint8_t buf[2048];
+    uint8_t reply[2048];
+
+    for( ;; )
+    {
+        size_t replyLen = 0;
+        struct sockaddr_storage from;
+        socklen_t fromlen = sizeof( from );
+        const ssize_t n = recvfrom( fd, buf, sizeof( buf ), 0, (struct sockaddr*)&from, &fromlen );
+        uint32_t action;
+
+        if( n <= 0 )
+            break;
+        if( n < 16 )
+            continue;
+
+        action = readU32( buf + 8 );
+        if( action == 0 ) ++t->connects;
+        if( action == 1 ) ++t->announces;
+        if( action == 2 ) ++t->scrapes;
+
+        if( t->dropCount > 0 ) {
+            --t->dropCount;
+            continue;
+        }
+
+        writeU32( reply, action );
+        memcpy( reply + 4, buf + 12, 4 ); /* transaction id */
+
+        if( action == 0 )
+        {
+            if( ( readU32( buf ) != PROTOCOL_ID_HI ) || ( readU32( buf + 4 ) != PROTOCOL_ID_LO ) )
+                continue;
+            writeU32( reply + 8, 0 );
+            writeU32( reply + 12, ++t->connectionId );
+            replyLen = 16;
+        }
+        else if( ( readU32( buf ) != 0 ) || ( readU32( buf + 4 ) != t->connectionId ) )
+        {
+            ++t->badConnectionIds;
+            continue;
+        }
+        else if( t->sendError )
+        {
+            writeU32( reply, 3 );
+            memcpy( reply + 8, "go away", 7 );
+            replyLen = 15;
+        }
+        else if( ( action == 1 ) && ( n == 98 ) )
+        {
+            static const uint8_t peers[12] = { 1, 2, 3, 4, 0x16, 0x2e,
+                                               5, 6, 7, 8, 0x27, 0x0f };
+            t->lastEvent = readU32( buf + 80 );
+            t->lastPort = ( buf[96] << 8 ) | buf[97];
+            writeU32( reply + 8, 1800 ); /* interval */
+            writeU32( reply + 12, 3 );   /* leechers */
+            writeU32( reply + 16, 7 );   /* seeders */
+            memcpy( reply + 20, peers, sizeof( peers ) );
+            replyLen = 20 + sizeof( peers );
+        }
+        else if( action == 2 )
+        {
+            /* make up the counts from the info_hash so that
+             * the client can tell that they went to the right place */
+            int i;
+            const int hashCount = ( n - 16 ) / SHA_DIGEST_LENGTH;
+            t->lastScrapeHashCount = hashCount;
+            for( i=0; i<hashCount; ++i ) {
+                const uint8_t * hash = buf + 16 + i * SHA_DIGEST_LENGTH;
+                writeU32( reply + 8 + i*12, hash[0] );
+                writeU32( reply + 8 + i*12 + 4, hash[1] );
+                writeU32( reply + 8 + i*12 + 8, hash[2] );
+            }
+            replyLen = 8 + hashCount * 12;
+        }
+
+        if( replyLen > 0 )
+            sendto( fd, reply, replyLen, 0, (struct sockaddr*)&from, fromlen );
+    }
+}
+
+static tr_bool
+trackerInit( struct tracker * t, struct event_base * base )
+{
+    memset( t, 0, sizeof( struct tracker ) );
+
+    if(( t->fd = bindLoopback( &t->addr, &t->port )) < 0 )
+        return FALSE;
+
+    tr_snprintf( t->url, sizeof( t->url ), "udp://127.0.0.1:%d/announce", (int)ntohs( t->port ) );
+    t->event = event_new( base, t->fd, EV_READ | EV_PERSIST, trackerRead, t );
+    event_add( t->event, NULL );
+    return TRUE;
+}
+
+static void
+trackerDestruct( struct tracker * t )
+{
+    event_free( t->event );
+    close( t->fd );
+}
+
+/***
+****  The client under test, on its own loopback socket
+***/
+
+struct client
+{
+    int fd;
+    tr_port port;
+    tr_address addr;
+    struct event * event;
+    struct event * deadline;
+    struct event_base * base;
+    tr_announcer_udp * udp;
+
+    /* how many callbacks to wait for */
+    int pending;
+    tr_bool timedOut;
+
+    tr_announce_udp_response announce;
+    char errmsg[128];
+    uint8_t peers[64];
+    int scrapeCount;
+    int scrapeMismatches;
+};
+
+static void
+clientSendTo( void * vclient, const void * buf, size_t buflen,
+              const tr_address * addr, tr_port port )
+{
+    struct client * c = vclient;
+    struct sockaddr_storage to;
+    const socklen_t tolen = tr_netSetupSockaddr( addr, port, &to );
+
+    sendto( c->fd, buf, buflen, 0, (struct sockaddr*)&to, tolen );
+}
+
+static void
+clientRead( int fd, short what UNUSED, void * vclient )
+{
+    struct client * c = vclient;
+    uint8_t buf[2048];
+
+    for( ;; )
+    {
+        tr_port port;
+        tr_address addr;
+        struct sockaddr_storage from;
+        socklen_t fromlen = sizeof( from );
+        const ssize_t n = recvfrom( fd, buf, sizeof( buf ), 0, (struct sockaddr*)&from, &fromlen );
+
+        if( n <= 0 )
+            break;
+
+        if( tr_netAddressFromSockaddr( &addr, &port, (struct sockaddr*)&from, fromlen ) )
+            tr_announcerUdpProcess( c->udp, buf, n, &addr, port );
+    }
+}
+
+static void
+onDeadline( int fd UNUSED, short what UNUSED, void * vclient )
+{
+    struct client * c = vclient;
+    c->timedOut = TRUE;
+    event_base_loopbreak( c->base );
+}
+
+static tr_bool
+clientInit( struct client * c, struct event_base * base )
+{
+    memset( c, 0, sizeof( struct client ) );
+
+    if(( c->fd = bindLoopback( &c->addr, &c->port )) < 0 )
+        return FALSE;
+
+    c->base = base;
+    c->udp = tr_announcerUdpNew( base, clientSendTo, c );
+    tr_announcerUdpSetRetryInterval( c->udp, RETRY_MSEC );
+    c->event = event_new( base, c->fd, EV_READ | EV_PERSIST, clientRead, c );
+    event_add( c->event, NULL );
+    c->deadline = evtimer_new( base, onDeadline, c );
+    return TRUE;
+}
+
+static void
+clientDestruct( struct client * c )
+{
+    tr_announcerUdpFree( c->udp );
+    event_free( c->deadline );
+    event_free( c->event );
+    close( c->fd );
+}
+
+/* run the loop until every callback we're waiting on has been called */
+static void
+clientWait( struct client * c )
+{
+    struct timeval tv = { DEADLINE_SECS, 0 };
+
+    evtimer_add( c->deadline, &tv );
+    if( c->pending > 0 )
+        event_base_dispatch( c->base );
+    evtimer_del( c->deadline );
+}
+
+static void
+onAnnounceDone( const tr_announce_udp_response * response, void * vclient )
+{
+    struct client * c = vclient;
+
+    c->announce = *response;
+    c->announce.errmsg = NULL;
+    c->announce.peers = NULL;
+    *c->errmsg = '\0';
+    if( response->errmsg != NULL )
+        tr_strlcpy( c->errmsg, response->errmsg, sizeof( c->errmsg ) );
+    if( response->peersLen <= sizeof( c->peers ) )
+        memcpy( c->peers, response->peers, response->peersLen );
+
+    if( !--c->pending )
+        event_base_loopbreak( c->base );
+}
+
+static void
+onScrapeDone( const tr_scrape_udp_response * response, void * vclient )
+{
+    struct client * c = vclient;
+    const uint8_t * hash = response->info_hash;
+
+    ++c->scrapeCount;
+    if( !response->didConnect
+        || ( response->errmsg != NULL )
+        || ( response->seeders != hash[0] )
+        || ( response->downloads != hash[1] )
+        || ( response->leechers != hash[2] ) )
+        ++c->scrapeMismatches;
+
+    if( !--c->pending )
+        event_base_loopbreak( c->base );
+}
+
+static void
+makeAnnounceRequest( tr_announce_udp_request * req, tr_announce_event event )
+{
+    memset( req, 0, sizeof( tr_announce_udp_request ) );
+    memset( req->info_hash, 'h', sizeof( req->info_hash ) );
+    memset( req->peer_id, 'p', sizeof( req->peer_id ) );
+    req->left = 1000;
+    req->event = event;
+    req->numwant = 80;
+    req->port = htons( 51413 );
+}
+
+/***
+****
+***/
+
+static int
+test_announce( void )
+{
+    struct client c;
+    struct tracker t;
+    tr_announce_udp_request req;
+    static const uint8_t expectedPeers[12] = { 1, 2, 3, 4, 0x16, 0x2e,
+                                               5, 6, 7, 8, 0x27, 0x0f };
+    struct event_base * base = event_base_new( );
+
+    check( trackerInit( &t, base ) );
+    check( clientInit( &c, base ) );
+
+    makeAnnounceRequest( &req, TR_ANNOUNCE_EVENT_STARTED );
+    c.pending = 1;
+    tr_announcerUdpAnnounce( c.udp, t.url, &req, onAnnounceDone, &c );
+    clientWait( &c );
+    check( !c.timedOut );
+    check( c.announce.didConnect );
+    check( !*c.errmsg );
+    check( c.announce.interval == 1800 );
+    check( c.announce.seeders == 7 );
+    check( c.announce.leechers == 3 );
+    check( c.announce.peersLen == sizeof( expectedPeers ) );
+    check( !memcmp( c.peers, expectedPeers, sizeof( expectedPeers ) ) );
+    check( !c.announce.isIPv6 );
+    check( t.lastEvent == TR_ANNOUNCE_EVENT_STARTED );
+    check( t.lastPort == 51413 );
+
+    /* the second announce reuses the connection id */
+    makeAnnounceRequest( &req, TR_ANNOUNCE_EVENT_NONE );
+    c.pending = 1;
+    tr_announcerUdpAnnounce( c.udp, t.url, &req, onAnnounceDone, &c );
+    clientWait( &c );
+    check( !c.timedOut );
+    check( c.announce.didConnect );
+    check( t.lastEvent == TR_ANNOUNCE_EVENT_NONE );
+    check( t.connects == 1 );
+    check( t.announces == 2 );
+    check( t.badConnectionIds == 0 );
+    check( tr_announcerUdpIsIdle( c.udp ) );
+
+    clientDestruct( &c );
+    trackerDestruct( &t );
+    event_base_free( base );
+    return 0;
+}
+
+static int
+test_scrape( void )
+{
+    int i;
+    struct client c;
+    struct tracker t;
+    struct event_base * base = event_base_new( );
+    enum { HASH_COUNT = 80 };
+
+    check( trackerInit( &t, base ) );
+    check( clientInit( &c, base ) );
+
+    /* scrapes queued together are batched, 74 to a packet */
+    c.pending = HASH_COUNT;
+    for( i=0; i<HASH_COUNT; ++i ) {
+        uint8_t hash[SHA_DIGEST_LENGTH];
+        memset( hash, 0, sizeof( hash ) );
+        hash[0] = i;
+        hash[1] = i + 1;
+        hash[2] = i + 2;
+        tr_announcerUdpScrape( c.udp, t.url, hash, onScrapeDone, &c );
+    }
+    clientWait( &c );
+    check( !c.timedOut );
+    check( c.scrapeCount == HASH_COUNT );
+    check( c.scrapeMismatches == 0 );
+    check( t.connects == 1 );
+    check( t.scrapes == 2 );
+    check( t.lastScrapeHashCount == HASH_COUNT - 74 );
+
+    clientDestruct( &c );
+    trackerDestruct( &t );
+    event_base_free( base );
+    return 0;
+}
+
+static int
+test_retransmit( void )
+{
+    struct client c;
+    struct tracker t;
+    tr_announce_udp_request req;
+    struct event_base * base = event_base_new( );
+
+    check( trackerInit( &t, base ) );
+    check( clientInit( &c, base ) );
+
+    /* lose the first connect... */
+    t.dropCount = 1;
+    makeAnnounceRequest( &req, TR_ANNOUNCE_EVENT_STARTED );
+    c.pending = 1;
+    tr_announcerUdpAnnounce( c.udp, t.url, &req, onAnnounceDone, &c );
+    clientWait( &c );
+    check( !c.timedOut );
+    check( c.announce.didConnect );
+    check( c.announce.seeders == 7 );
+    check( t.connects == 2 );
+    check( t.announces == 1 );
+
+    /* ...then the first announce */
+    t.dropCount = 1;
+    c.pending = 1;
+    tr_announcerUdpAnnounce( c.udp, t.url, &req, onAnnounceDone, &c );
+    clientWait( &c );
+    check( !c.timedOut );
+    check( c.announce.didConnect );
+    check( t.connects == 2 );
+    check( t.announces == 3 );
+
+    clientDestruct( &c );
+    trackerDestruct( &t );
+    event_base_free( base );
+    return 0;
+}
+
+static int
+test_error( void )
+{
+    struct client c;
+    struct tracker t;
+    tr_announce_udp_request req;
+    struct event_base * base = event_base_new( );
+
+    check( trackerInit( &t, base ) );
+    check( clientInit( &c, base ) );
+
+    t.sendError = TRUE;
+    makeAnnounceRequest( &req, TR_ANNOUNCE_EVENT_STARTED );
+    c.pending = 1;
+    tr_announcerUdpAnnounce( c.udp, t.url, &req, onAnnounceDone, &c );
+    clientWait( &c );
+    check( !c.timedOut );
+    check( c.announce.didConnect );
+    check( !strcmp( c.errmsg, "go away" ) );
+
+    clientDestruct( &c );
+    trackerDestruct( &t );
+    event_base_free( base );
+    return 0;
+}
+
+static int
+test_timeout( void )
+{
+    struct client c;
+    struct tracker t;
+    tr_announce_udp_request req;
+    struct event_base * base = event_base_new( );
+
+    check( trackerInit( &t, base ) );
+    check( clientInit( &c, base ) );
+
+    /* a tracker that never answers is retried with backoff, then given up on */
+    t.dropCount = 1000;
+    makeAnnounceRequest( &req, TR_ANNOUNCE_EVENT_STARTED );
+    c.pending = 1;
+    c.announce.didConnect = TRUE;
+    tr_announcerUdpAnnounce( c.udp, t.url, &req, onAnnounceDone, &c );
+    clientWait( &c );
+    check( !c.timedOut );
+    check( !c.announce.didConnect );
+    check( t.connects >= 3 );
+    check( t.connects <= 4 );
+    check( t.announces == 0 );
+    check( tr_announcerUdpIsIdle( c.udp ) );
+
+    clientDestruct( &c );
+    trackerDestruct( &t );
+    event_base_free( base );
+    return 0;
+}
+
+int
+main( void )
+{
+    int i;
+
+    if( ( i = test_announce( ) ) )
+        return i;
+    if( ( i = test_scrape( ) ) )
+        return i;
+    if( ( i = test_retransmit( ) ) )
+        return i;
+    if( ( i = test_error( ) ) )
+        return i;
+    if( ( i = test_timeout( ) ) )
+        return i;
+
+    return 0;
+}
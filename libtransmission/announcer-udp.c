@@ -0,0 +1,890 @@
+/*
+ * This file Copyright (C) 2011 Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2(b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#include <assert.h>
+#include <string.h> /* memcpy(), memset(), strcmp() */
+
+#include <event2/dns.h>
+#include <event2/event.h>
+#include <event2/util.h>
+
+#include "transmission.h"
+#include "announcer-udp.h"
+#include "crypto.h" /* tr_cryptoRandBuf() */
+#include "net.h"
+#include "ptrarray.h"
+#include "session.h"
+#include "tr-udp.h" /* tr_udpSendTo() */
+#include "utils.h"
+
+#define dbgmsg( ... ) \
+    do { \
+        if( tr_deepLoggingIsActive( ) ) \
+            tr_deepLog( __FILE__, __LINE__, "UDP Tracker", __VA_ARGS__ ); \
+    } while( 0 )
+
+/* the magic number that starts every connect request */
+#define TAU_PROTOCOL_ID 0x41727101980ULL
+
+enum
+{
+    TAU_ACTION_CONNECT = 0,
+    TAU_ACTION_ANNOUNCE = 1,
+    TAU_ACTION_SCRAPE = 2,
+    TAU_ACTION_ERROR = 3,
+
+    /* BEP 15: "A client can use a connection ID until one minute
+     * after it has received it." */
+    TAU_CONNECTION_TTL_MSEC = ( 60 * 1000 ),
+
+    /* BEP 15 waits 15 seconds for the first reply and doubles that
+     * after each retransmission */
+    TAU_RETRY_INTERVAL_MSEC = ( 15 * 1000 ),
+
+    /* give up on a request after this many retry intervals.
+     * That's two minutes at BEP 15's pace, which is as long as
+     * announcer.c waits for an HTTP tracker to answer */
+    TAU_REQUEST_TTL_INTERVALS = 8,
+
+    /* at shutdown, how long "stopped" announces get to go out */
+    TAU_SHUTDOWN_TTL_MSEC = ( 3 * 1000 ),
+
+    /* how long to trust a tracker hostname's address */
+    TAU_DNS_TTL_MSEC = ( 60 * 60 * 1000 ),
+
+    /* BEP 15: "Up to about 74 torrents can be scraped at once." */
+    TAU_MAX_SCRAPE_HASHES = 74,
+
+    /* how often to look for requests to retransmit or give up on.
+     * It's shortened if the retry interval is very short */
+    TAU_UPKEEP_INTERVAL_MSEC = 500,
+
+    /* connection id + action + transaction id */
+    TAU_REQUEST_HEADER_SIZE = 16,
+
+    /* info_hash, peer_id, downloaded, left, uploaded, event, ip, key,
+     * num_want, port */
+    TAU_ANNOUNCE_BODY_SIZE = 20 + 20 + 8 + 8 + 8 + 4 + 4 + 4 + 4 + 2,
+
+    TAU_MAX_PACKET_SIZE = TAU_REQUEST_HEADER_SIZE
+                        + TAU_MAX_SCRAPE_HASHES * SHA_DIGEST_LENGTH
+};
+
+/***
+****
+***/
+
+static void
+writeU16( uint8_t * buf, uint16_t val )
+{
+    buf[0] = val >> 8;
+    buf[1] = val;
+}
+
+static void
+writeU32( uint8_t * buf, uint32_t val )
+{
+    buf[0] = val >> 24;
+    buf[1] = val >> 16;
+    buf[2] = val >> 8;
+    buf[3] = val;
+}
+
+static void
+writeU64( uint8_t * buf, uint64_t val )
+{
+    writeU32( buf, val >> 32 );
+    writeU32( buf + 4, val );
+}
+
+static uint32_t
+readU32( const uint8_t * buf )
+{
+    return ( (uint32_t)buf[0] << 24 )
+         | ( (uint32_t)buf[1] << 16 )
+         | ( (uint32_t)buf[2] << 8 )
+         |   (uint32_t)buf[3];
+}
+
+static uint64_t
+readU64( const uint8_t * buf )
+{
+    return ( (uint64_t)readU32( buf ) << 32 ) | readU32( buf + 4 );
+}
+
+static uint32_t
+newTransactionId( void )
+{
+    uint32_t id;
+    tr_cryptoRandBuf( &id, sizeof( id ) );
+    return id;
+}
+
+/***
+****
+***/
+
+/* a torrent that's waiting on a request. Announces have one;
+ * scrapes have one for each info_hash in the packet */
+struct tau_torrent
+{
+    uint8_t info_hash[SHA_DIGEST_LENGTH];
+    tr_scrape_udp_func scrape_func;
+    void * callback_data;
+};
+
+struct tau_request
+{
+    int action;
+    uint32_t transactionId;
+
+    uint64_t deadline;
+    uint64_t sentAt;
+    int sendCount;
+
+    /* TAU_ACTION_ANNOUNCE */
+    tr_announce_udp_request announce;
+    tr_announce_udp_func announce_func;
+    void * announce_data;
+
+    /* TAU_ACTION_SCRAPE */
+    int torrentCount;
+    struct tau_torrent * torrents;
+};
+
+/* one per tracker host:port */
+struct tau_tracker
+{
+    struct tr_announcer_udp * udp;
+
+    char * key;     /* host:port */
+    char * host;
+    tr_port port;   /* network byte order */
+
+    tr_address addr;
+    uint64_t addrExpiresAt;
+    struct evdns_getaddrinfo_request * dnsRequest;
+    tr_bool isResolving;
+
+    uint64_t connectionId;
+    uint64_t connectionExpiresAt;
+    uint32_t connectTransactionId;
+    uint64_t connectSentAt;
+    int connectSendCount;
+
+    tr_ptrArray requests;       /* struct tau_request */
+    tr_ptrArray scrapeQueue;    /* struct tau_torrent, not batched yet */
+};
+
+struct tr_announcer_udp
+{
+    struct event_base * base;
+    struct evdns_base * dns;
+    tr_announcer_udp_sendto_func sendto;
+    void * user_data;
+
+    tr_ptrArray trackers; /* struct tau_tracker, sorted by key */
+
+    struct event * upkeepTimer;
+    int retryMsec;
+    tr_bool isShuttingDown;
+};
+
+static void
+requestFree( struct tau_request * req )
+{
+    tr_free( req->torrents );
+    tr_free( req );
+}
+
+/* tell the request's torrents that it's done.
+ * If buf is NULL, the tracker never answered */
+static void
+requestFinish( const struct tau_tracker * t, struct tau_request * req,
+               int action, const uint8_t * buf, size_t buflen )
+{
+    char * errmsg = NULL;
+
+    if( buf && ( action == TAU_ACTION_ERROR ) )
+        errmsg = tr_strndup( buf, buflen );
+    else if( buf && ( action != req->action ) )
+        errmsg = tr_strdup( "Unexpected reply from tracker" );
+
+    if( req->action == TAU_ACTION_ANNOUNCE )
+    {
+        tr_announce_udp_response response;
+
+        memset( &response, 0, sizeof( response ) );
+        response.didConnect = buf != NULL;
+        response.errmsg = errmsg;
+
+        if( buf && !errmsg )
+        {
+            if( buflen < 12 )
+                response.errmsg = "Unexpected reply from tracker";
+            else {
+                response.interval = readU32( buf );
+                response.leechers = readU32( buf + 4 );
+                response.seeders = readU32( buf + 8 );
+                response.peers = buf + 12;
+                response.peersLen = buflen - 12;
+                response.isIPv6 = t->addr.type == TR_AF_INET6;
+            }
+        }
+
+        if( req->announce_func != NULL )
+            req->announce_func( &response, req->announce_data );
+    }
+    else
+    {
+        int i;
+
+        for( i=0; i<req->torrentCount; ++i )
+        {
+            const struct tau_torrent * tor = req->torrents + i;
+            tr_scrape_udp_response response;
+
+            memset( &response, 0, sizeof( response ) );
+            response.info_hash = tor->info_hash;
+            response.didConnect = buf != NULL;
+            response.errmsg = errmsg;
+
+            /* seeders, completed, and leechers for each hash, in order */
+            if( buf && !errmsg )
+            {
+                if( buflen < ( i + 1 ) * 12u )
+                    response.errmsg = "Unexpected reply from tracker";
+                else {
+                    response.seeders = readU32( buf + i*12 );
+                    response.downloads = readU32( buf + i*12 + 4 );
+                    response.leechers = readU32( buf + i*12 + 8 );
+                }
+            }
+
+            if( tor->scrape_func != NULL )
+                tor->scrape_func( &response, tor->callback_data );
+        }
+    }
+
+    tr_free( errmsg );
+}
+
+/***
+****
+***/
+
+static int
+compareTrackers( const void * va, const void * vb )
+{
+    const struct tau_tracker * a = va;
+    const struct tau_tracker * b = vb;
+    return strcmp( a->key, b->key );
+}
+
+static int
+compareTrackerToKey( const void * va, const void * vb )
+{
+    const struct tau_tracker * a = va;
+    return strcmp( a->key, vb );
+}
+
+static struct tau_tracker *
+trackerNew( tr_announcer_udp * udp, const char * key, const char * host, int port )
+{
+    struct tau_tracker * t = tr_new0( struct tau_tracker, 1 );
+    t->udp = udp;
+    t->key = tr_strdup( key );
+    t->host = tr_strdup( host );
+    t->port = htons( port );
+    t->requests = TR_PTR_ARRAY_INIT;
+    t->scrapeQueue = TR_PTR_ARRAY_INIT;
+    return t;
+}
+
+static void
+trackerFree( void * vt )
+{
+    struct tau_tracker * t = vt;
+
+    if( t->dnsRequest != NULL )
+        evdns_getaddrinfo_cancel( t->dnsRequest );
+
+    tr_ptrArrayDestruct( &t->requests, (PtrArrayForeachFunc)requestFree );
+    tr_ptrArrayDestruct( &t->scrapeQueue, tr_free );
+    tr_free( t->host );
+    tr_free( t->key );
+    tr_free( t );
+}
+
+static struct tau_tracker *
+getTracker( tr_announcer_udp * udp, const char * url )
+{
+    int port = 0;
+    char * host = NULL;
+    char * key;
+    struct tau_tracker * t;
+
+    tr_urlParse( url, -1, NULL, &host, &port, NULL );
+    key = tr_strdup_printf( "%s:%d", ( host ? host : "invalid" ), port );
+
+    t = tr_ptrArrayFindSorted( &udp->trackers, key, compareTrackerToKey );
+    if( t == NULL ) {
+        t = trackerNew( udp, key, host ? host : "", port );
+        tr_ptrArrayInsertSorted( &udp->trackers, t, compareTrackers );
+    }
+
+    tr_free( key );
+    tr_free( host );
+    return t;
+}
+
+static void
+trackerFailRequests( struct tau_tracker * t, int action, const uint8_t * buf, size_t buflen )
+{
+    struct tau_request ** reqs;
+    int i, n;
+
+    /* move the requests out first, since the callbacks may queue more */
+    reqs = (struct tau_request**) tr_ptrArrayPeek( &t->requests, &n );
+    reqs = tr_memdup( reqs, n * sizeof( struct tau_request* ) );
+    tr_ptrArrayClear( &t->requests );
+
+    for( i=0; i<n; ++i ) {
+        requestFinish( t, reqs[i], action, buf, buflen );
+        requestFree( reqs[i] );
+    }
+
+    tr_free( reqs );
+
+    t->connectSentAt = 0;
+    t->connectSendCount = 0;
+}
+
+static void trackerUpkeep( struct tau_tracker * t, uint64_t now );
+
+static void
+onResolved( int result, struct evutil_addrinfo * res, void * vt )
+{
+    struct tau_tracker * t;
+    const struct evutil_addrinfo * ai;
+    const struct evutil_addrinfo * found = NULL;
+
+    /* the tracker is being freed */
+    if( result == EVUTIL_EAI_CANCEL )
+        return;
+
+    t = vt;
+    t->dnsRequest = NULL;
+    t->isResolving = FALSE;
+
+    /* prefer IPv4, since the IPv6 socket is only there on some hosts */
+    for( ai=res; ai!=NULL; ai=ai->ai_next )
+        if( !found || ( ( found->ai_family != AF_INET ) && ( ai->ai_family == AF_INET ) ) )
+            found = ai;
+
+    if( ( result == 0 ) && ( found != NULL ) )
+    {
+        tr_port unused;
+        tr_netAddressFromSockaddr( &t->addr, &unused, found->ai_addr, found->ai_addrlen );
+        t->addrExpiresAt = tr_time_msec( ) + TAU_DNS_TTL_MSEC;
+        dbgmsg( "%s is %s", t->key, tr_ntop_non_ts( &t->addr ) );
+        trackerUpkeep( t, tr_time_msec( ) );
+    }
+    else
+    {
+        static const char * errmsg = "Couldn't find tracker's address";
+        dbgmsg( "couldn't resolve %s: %s", t->key, evutil_gai_strerror( result ) );
+        trackerFailRequests( t, TAU_ACTION_ERROR, (const uint8_t*)errmsg, strlen( errmsg ) );
+    }
+
+    if( res != NULL )
+        evutil_freeaddrinfo( res );
+}
+
+static void
+trackerResolve( struct tau_tracker * t )
+{
+    tr_address addr;
+
+    if( !*t->host || !t->port )
+    {
+        static const char * errmsg = "Invalid tracker address";
+        trackerFailRequests( t, TAU_ACTION_ERROR, (const uint8_t*)errmsg, strlen( errmsg ) );
+    }
+    else if( tr_pton( t->host, &addr ) != NULL )
+    {
+        t->addr = addr;
+        t->addrExpiresAt = ~(uint64_t)0;
+        trackerUpkeep( t, tr_time_msec( ) );
+    }
+    else if( t->udp->dns != NULL )
+    {
+        struct evutil_addrinfo hints;
+        struct evdns_getaddrinfo_request * req;
+
+        memset( &hints, 0, sizeof( hints ) );
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        hints.ai_protocol = IPPROTO_UDP;
+
+        /* this may call onResolved() right away */
+        t->isResolving = TRUE;
+        req = evdns_getaddrinfo( t->udp->dns, t->host, NULL, &hints, onResolved, t );
+        if( t->isResolving )
+            t->dnsRequest = req;
+    }
+}
+
+static void
+trackerSend( struct tau_tracker * t, const uint8_t * buf, size_t buflen )
+{
+    t->udp->sendto( t->udp->user_data, buf, buflen, &t->addr, t->port );
+}
+
+static void
+trackerSendConnect( struct tau_tracker * t, uint64_t now )
+{
+    uint8_t buf[TAU_REQUEST_HEADER_SIZE];
+
+    if( !t->connectSendCount )
+        t->connectTransactionId = newTransactionId( );
+
+    writeU64( buf, TAU_PROTOCOL_ID );
+    writeU32( buf + 8, TAU_ACTION_CONNECT );
+    writeU32( buf + 12, t->connectTransactionId );
+    trackerSend( t, buf, sizeof( buf ) );
+
+    dbgmsg( "sending connect #%d to %s", t->connectSendCount + 1, t->key );
+    t->connectSentAt = now;
+    ++t->connectSendCount;
+}
+
+static void
+trackerSendRequest( struct tau_tracker * t, struct tau_request * req, uint64_t now )
+{
+    uint8_t buf[TAU_MAX_PACKET_SIZE];
+    uint8_t * walk = buf + TAU_REQUEST_HEADER_SIZE;
+
+    writeU64( buf, t->connectionId );
+    writeU32( buf + 8, req->action );
+    writeU32( buf + 12, req->transactionId );
+
+    if( req->action == TAU_ACTION_ANNOUNCE )
+    {
+        const tr_announce_udp_request * a = &req->announce;
+
+        memcpy( walk, a->info_hash, SHA_DIGEST_LENGTH ); walk += SHA_DIGEST_LENGTH;
+        memcpy( walk, a->peer_id, 20 ); walk += 20;
+        writeU64( walk, a->down ); walk += 8;
+        writeU64( walk, a->left ); walk += 8;
+        writeU64( walk, a->up ); walk += 8;
+        writeU32( walk, a->event ); walk += 4;
+        writeU32( walk, 0 ); walk += 4; /* ip: use the sender's address */
+        writeU32( walk, a->key ); walk += 4;
+        writeU32( walk, a->numwant ); walk += 4;
+        writeU16( walk, ntohs( a->port ) ); walk += 2;
+        assert( walk - buf == TAU_REQUEST_HEADER_SIZE + TAU_ANNOUNCE_BODY_SIZE );
+    }
+    else
+    {
+        int i;
+
+        for( i=0; i<req->torrentCount; ++i ) {
+            memcpy( walk, req->torrents[i].info_hash, SHA_DIGEST_LENGTH );
+            walk += SHA_DIGEST_LENGTH;
+        }
+    }
+
+    trackerSend( t, buf, walk - buf );
+
+    dbgmsg( "sending %s #%d to %s (%d torrents)",
+            req->action == TAU_ACTION_ANNOUNCE ? "announce" : "scrape",
+            req->sendCount + 1, t->key,
+            req->action == TAU_ACTION_ANNOUNCE ? 1 : req->torrentCount );
+    req->sentAt = now;
+    ++req->sendCount;
+}
+
+/* how long to wait for a reply after sending something sendCount times */
+static uint64_t
+getRetryDelay( const tr_announcer_udp * udp, int sendCount )
+{
+    return (uint64_t)udp->retryMsec << ( sendCount - 1 );
+}
+
+static uint64_t
+getRequestDeadline( const tr_announcer_udp * udp, uint64_t now )
+{
+    if( udp->isShuttingDown )
+        return now + TAU_SHUTDOWN_TTL_MSEC;
+
+    return now + (uint64_t)udp->retryMsec * TAU_REQUEST_TTL_INTERVALS;
+}
+
+static tr_bool
+trackerIsConnected( const struct tau_tracker * t, uint64_t now )
+{
+    return t->connectionExpiresAt > now;
+}
+
+static void
+trackerUpkeep( struct tau_tracker * t, uint64_t now )
+{
+    int i;
+    tr_announcer_udp * udp = t->udp;
+
+    /* batch up the scrapes that have been queued */
+    while( !tr_ptrArrayEmpty( &t->scrapeQueue ) )
+    {
+        const int n = MIN( tr_ptrArraySize( &t->scrapeQueue ), TAU_MAX_SCRAPE_HASHES );
+        struct tau_request * req = tr_new0( struct tau_request, 1 );
+
+        req->action = TAU_ACTION_SCRAPE;
+        req->transactionId = newTransactionId( );
+        req->deadline = getRequestDeadline( udp, now );
+        req->torrentCount = n;
+        req->torrents = tr_new( struct tau_torrent, n );
+        for( i=0; i<n; ++i ) {
+            struct tau_torrent * queued = tr_ptrArrayNth( &t->scrapeQueue, i );
+            req->torrents[i] = *queued;
+            tr_free( queued );
+        }
+        tr_ptrArrayErase( &t->scrapeQueue, 0, n );
+        tr_ptrArrayAppend( &t->requests, req );
+    }
+
+    /* give up on the requests that have waited too long */
+    for( i=tr_ptrArraySize( &t->requests )-1; i>=0; --i )
+    {
+        struct tau_request * req = tr_ptrArrayNth( &t->requests, i );
+
+        if( req->deadline <= now )
+        {
+            dbgmsg( "%s didn't answer transaction %u", t->key, req->transactionId );
+            tr_ptrArrayErase( &t->requests, i, i+1 );
+            requestFinish( t, req, req->action, NULL, 0 );
+            requestFree( req );
+        }
+    }
+
+    if( tr_ptrArrayEmpty( &t->requests ) )
+    {
+        t->connectSentAt = 0;
+        t->connectSendCount = 0;
+        return;
+    }
+
+    /* find out where the tracker is */
+    if( t->addrExpiresAt <= now )
+    {
+        if( !t->isResolving )
+            trackerResolve( t );
+        return;
+    }
+
+    /* get a connection id */
+    if( !trackerIsConnected( t, now ) )
+    {
+        if( !t->connectSendCount || ( t->connectSentAt + getRetryDelay( udp, t->connectSendCount ) <= now ) )
+            trackerSendConnect( t, now );
+        return;
+    }
+
+    /* send the requests that are new or that need to be retransmitted */
+    for( i=0; i<tr_ptrArraySize( &t->requests ); ++i )
+    {
+        struct tau_request * req = tr_ptrArrayNth( &t->requests, i );
+
+        if( !req->sendCount || ( req->sentAt + getRetryDelay( udp, req->sendCount ) <= now ) )
+            trackerSendRequest( t, req, now );
+    }
+}
+
+static void
+upkeep( tr_announcer_udp * udp )
+{
+    int i;
+    const uint64_t now = tr_time_msec( );
+
+    for( i=0; i<tr_ptrArraySize( &udp->trackers ); ++i )
+        trackerUpkeep( tr_ptrArrayNth( &udp->trackers, i ), now );
+}
+
+static void
+onUpkeepTimer( int foo UNUSED, short bar UNUSED, void * vudp )
+{
+    tr_announcer_udp * udp = vudp;
+
+    upkeep( udp );
+
+    tr_timerAddMsec( udp->upkeepTimer, MIN( TAU_UPKEEP_INTERVAL_MSEC, udp->retryMsec / 4 ) );
+}
+
+/* send new work the next time through the event loop,
+ * so that work queued in the meantime goes out together */
+static void
+scheduleUpkeep( tr_announcer_udp * udp )
+{
+    tr_timerAddMsec( udp->upkeepTimer, 0 );
+}
+
+/***
+****  Public API
+***/
+
+tr_announcer_udp *
+tr_announcerUdpNew( struct event_base            * base,
+                    tr_announcer_udp_sendto_func   sendto,
+                    void                         * user_data )
+{
+    tr_announcer_udp * udp = tr_new0( tr_announcer_udp, 1 );
+
+    udp->base = base;
+    udp->dns = evdns_base_new( base, TRUE );
+    udp->sendto = sendto;
+    udp->user_data = user_data;
+    udp->trackers = TR_PTR_ARRAY_INIT;
+    udp->retryMsec = TAU_RETRY_INTERVAL_MSEC;
+    udp->upkeepTimer = evtimer_new( base, onUpkeepTimer, udp );
+    tr_timerAddMsec( udp->upkeepTimer, TAU_UPKEEP_INTERVAL_MSEC );
+
+    return udp;
+}
+
+void
+tr_announcerUdpFree( tr_announcer_udp * udp )
+{
+    if( udp == NULL )
+        return;
+
+    event_free( udp->upkeepTimer );
+    tr_ptrArrayDestruct( &udp->trackers, trackerFree );
+
+    if( udp->dns != NULL )
+        evdns_base_free( udp->dns, FALSE );
+
+    tr_free( udp );
+}
+
+void
+tr_announcerUdpAnnounce( tr_announcer_udp              * udp,
+                         const char                    * url,
+                         const tr_announce_udp_request * request,
+                         tr_announce_udp_func            callback,
+                         void                          * callback_data )
+{
+    struct tau_tracker * t = getTracker( udp, url );
+    struct tau_request * req = tr_new0( struct tau_request, 1 );
+    const uint64_t now = tr_time_msec( );
+
+    req->action = TAU_ACTION_ANNOUNCE;
+    req->transactionId = newTransactionId( );
+    req->deadline = getRequestDeadline( udp, now );
+    req->announce = *request;
+    req->announce_func = callback;
+    req->announce_data = callback_data;
+    tr_ptrArrayAppend( &t->requests, req );
+
+    scheduleUpkeep( udp );
+}
+
+void
+tr_announcerUdpScrape( tr_announcer_udp   * udp,
+                       const char         * url,
+                       const uint8_t      * info_hash,
+                       tr_scrape_udp_func   callback,
+                       void               * callback_data )
+{
+    struct tau_tracker * t = getTracker( udp, url );
+    struct tau_torrent * torrent = tr_new0( struct tau_torrent, 1 );
+
+    memcpy( torrent->info_hash, info_hash, SHA_DIGEST_LENGTH );
+    torrent->scrape_func = callback;
+    torrent->callback_data = callback_data;
+    tr_ptrArrayAppend( &t->scrapeQueue, torrent );
+
+    scheduleUpkeep( udp );
+}
+
+static tr_bool
+trackerProcess( struct tau_tracker * t, int action, uint32_t transactionId,
+                const uint8_t * buf, size_t buflen )
+{
+    int i;
+    const uint64_t now = tr_time_msec( );
+
+    /* is it the answer to our connect request? */
+    if( t->connectSendCount && ( transactionId == t->connectTransactionId ) )
+    {
+        if( ( action == TAU_ACTION_CONNECT ) && ( buflen >= 8 ) )
+        {
+            t->connectionId = readU64( buf );
+            t->connectionExpiresAt = now + TAU_CONNECTION_TTL_MSEC;
+            t->connectSentAt = 0;
+            t->connectSendCount = 0;
+            dbgmsg( "connected to %s", t->key );
+            trackerUpkeep( t, now );
+        }
+        else
+        {
+            dbgmsg( "%s refused to connect", t->key );
+            trackerFailRequests( t, action, buf, buflen );
+        }
+
+        return TRUE;
+    }
+
+    for( i=0; i<tr_ptrArraySize( &t->requests ); ++i )
+    {
+        struct tau_request * req = tr_ptrArrayNth( &t->requests, i );
+
+        if( req->sendCount && ( req->transactionId == transactionId ) )
+        {
+            dbgmsg( "got an answer to transaction %u from %s", transactionId, t->key );
+            tr_ptrArrayErase( &t->requests, i, i+1 );
+
+            /* the tracker may have forgotten our connection id,
+             * so get a fresh one next time */
+            if( action == TAU_ACTION_ERROR )
+                t->connectionExpiresAt = 0;
+
+            requestFinish( t, req, action, buf, buflen );
+            requestFree( req );
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+tr_bool
+tr_announcerUdpProcess( tr_announcer_udp * udp,
+                        const void       * vbuf,
+                        size_t             buflen,
+                        const tr_address * from,
+                        tr_port            port )
+{
+    int i;
+    int action;
+    uint32_t transactionId;
+    const uint8_t * buf = vbuf;
+
+    /* every reply starts with an action and a transaction id */
+    if( buflen < 8 )
+        return FALSE;
+
+    action = readU32( buf );
+    transactionId = readU32( buf + 4 );
+    if( ( action < TAU_ACTION_CONNECT ) || ( action > TAU_ACTION_ERROR ) )
+        return FALSE;
+
+    for( i=0; i<tr_ptrArraySize( &udp->trackers ); ++i )
+    {
+        struct tau_tracker * t = tr_ptrArrayNth( &udp->trackers, i );
+
+        if( ( t->port == port )
+            && ( t->addrExpiresAt != 0 )
+            && !tr_compareAddresses( &t->addr, from )
+            && trackerProcess( t, action, transactionId, buf + 8, buflen - 8 ) )
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+tr_bool
+tr_announcerUdpIsIdle( const tr_announcer_udp * udp )
+{
+    int i;
+
+    for( i=0; i<tr_ptrArraySize( &udp->trackers ); ++i )
+    {
+        struct tau_tracker * t = tr_ptrArrayNth( (tr_ptrArray*)&udp->trackers, i );
+
+        if( !tr_ptrArrayEmpty( &t->requests ) || !tr_ptrArrayEmpty( &t->scrapeQueue ) )
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+void
+tr_announcerUdpShutdown( tr_announcer_udp * udp )
+{
+    int i, j;
+    const uint64_t deadline = tr_time_msec( ) + TAU_SHUTDOWN_TTL_MSEC;
+
+    udp->isShuttingDown = TRUE;
+
+    for( i=0; i<tr_ptrArraySize( &udp->trackers ); ++i )
+    {
+        struct tau_tracker * t = tr_ptrArrayNth( &udp->trackers, i );
+
+        for( j=0; j<tr_ptrArraySize( &t->requests ); ++j )
+        {
+            struct tau_request * req = tr_ptrArrayNth( &t->requests, j );
+            req->deadline = MIN( req->deadline, deadline );
+        }
+    }
+}
+
+void
+tr_announcerUdpSetRetryInterval( tr_announcer_udp * udp, int msec )
+{
+    assert( msec > 0 );
+
+    udp->retryMsec = msec;
+}
+
+/***
+****  The session's UDP tracker client
+***/
+
+static void
+udpSendTo( void * vsession, const void * buf, size_t buflen, const tr_address * addr, tr_port port )
+{
+    tr_udpSendTo( vsession, buf, buflen, addr, port );
+}
+
+void
+tr_announcerUdpInit( tr_session * session )
+{
+    assert( session->announcer_udp == NULL );
+
+    session->announcer_udp = tr_announcerUdpNew( session->event_base, udpSendTo, session );
+}
+
+void
+tr_announcerUdpUninit( tr_session * session )
+{
+    tr_announcerUdpFree( session->announcer_udp );
+    session->announcer_udp = NULL;
+}
+
+tr_bool
+tr_announcerUdpPacket( const unsigned char   * buf,
+                       size_t                  buflen,
+                       const struct sockaddr * from,
+                       socklen_t               fromlen,
+                       tr_session            * session )
+{
+    tr_address addr;
+    tr_port port;
+
+    if( session->announcer_udp == NULL )
+        return FALSE;
+
+    if( !tr_netAddressFromSockaddr( &addr, &port, from, fromlen ) )
+        return FALSE;
+
+    return tr_announcerUdpProcess( session->announcer_udp, buf, buflen, &addr, port );
+}
@@ -0,0 +1,170 @@
+/*
+ * This file Copyright (C) 2011 Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2(b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#ifndef __TRANSMISSION__
+#error only libtransmission should #include this header.
+#endif
+
+#ifndef TR_ANNOUNCER_UDP_H
+#define TR_ANNOUNCER_UDP_H
+
+#include "transmission.h"
+#include "net.h" /* tr_address */
+
+struct event_base;
+
+/**
+ * A client for the UDP tracker protocol (BEP 15).
+ *
+ * An announce or scrape over UDP is one small datagram each way instead
+ * of a TCP handshake and an HTTP request, so it's much cheaper for both
+ * us and the tracker. Like uTP, a tr_announcer_udp doesn't own a socket:
+ * replies are handed to it with tr_announcerUdpProcess(), and it sends
+ * through a tr_announcer_udp_sendto_func.
+ *
+ * The connection IDs that trackers hand out are cached per host:port
+ * and reused until they expire, scrapes of the same tracker that are
+ * queued together are sent as one multi-hash scrape, and unanswered
+ * requests are retransmitted with exponential backoff.
+ */
+typedef struct tr_announcer_udp tr_announcer_udp;
+
+typedef void ( *tr_announcer_udp_sendto_func )( void             * user_data,
+                                                const void       * buf,
+                                                size_t             buflen,
+                                                const tr_address * addr,
+                                                tr_port            port );
+
+typedef enum
+{
+    TR_ANNOUNCE_EVENT_NONE      = 0,
+    TR_ANNOUNCE_EVENT_COMPLETED = 1,
+    TR_ANNOUNCE_EVENT_STARTED   = 2,
+    TR_ANNOUNCE_EVENT_STOPPED   = 3
+}
+tr_announce_event;
+
+typedef struct
+{
+    uint8_t             info_hash[SHA_DIGEST_LENGTH];
+    uint8_t             peer_id[20];
+    uint64_t            up;
+    uint64_t            down;
+    uint64_t            left;
+    tr_announce_event   event;
+    uint32_t            key;
+    int                 numwant;
+    tr_port             port; /* network byte order */
+}
+tr_announce_udp_request;
+
+typedef struct
+{
+    /* false if the tracker never answered */
+    tr_bool             didConnect;
+
+    /* if the tracker answered with an error, this is its message */
+    const char        * errmsg;
+
+    int                 interval;
+    int                 seeders;
+    int                 leechers;
+
+    /* compact peers: 6 bytes apiece, or 18 if isIPv6 is true */
+    const uint8_t     * peers;
+    size_t              peersLen;
+    tr_bool             isIPv6;
+}
+tr_announce_udp_response;
+
+typedef struct
+{
+    const uint8_t     * info_hash;
+    tr_bool             didConnect;
+    const char        * errmsg;
+    int                 seeders;
+    int                 leechers;
+    int                 downloads;
+}
+tr_scrape_udp_response;
+
+typedef void ( *tr_announce_udp_func )( const tr_announce_udp_response * response,
+                                        void                           * user_data );
+
+typedef void ( *tr_scrape_udp_func )( const tr_scrape_udp_response * response,
+                                      void                         * user_data );
+
+tr_announcer_udp * tr_announcerUdpNew( struct event_base            * base,
+                                       tr_announcer_udp_sendto_func   sendto,
+                                       void                         * user_data );
+
+/** @brief free the context. Outstanding requests are dropped without
+ *         calling their callbacks */
+void    tr_announcerUdpFree( tr_announcer_udp * udp );
+
+/** @brief announce to the udp:// tracker at url. callback may be NULL */
+void    tr_announcerUdpAnnounce( tr_announcer_udp              * udp,
+                                 const char                    * url,
+                                 const tr_announce_udp_request * request,
+                                 tr_announce_udp_func            callback,
+                                 void                          * callback_data );
+
+/**
+ * @brief scrape a torrent from the udp:// tracker at url.
+ *
+ * Scrapes aren't sent until the event loop comes back around,
+ * so all the scrapes queued for a tracker in the meantime
+ * go out together.
+ */
+void    tr_announcerUdpScrape( tr_announcer_udp   * udp,
+                               const char         * url,
+                               const uint8_t      * info_hash,
+                               tr_scrape_udp_func   callback,
+                               void               * callback_data );
+
+/**
+ * @brief hand a datagram that arrived on the UDP socket to the tracker client
+ * @return true if it was the answer to one of our requests
+ */
+tr_bool tr_announcerUdpProcess( tr_announcer_udp * udp,
+                                const void       * buf,
+                                size_t             buflen,
+                                const tr_address * from,
+                                tr_port            port );
+
+/** @return true if there are no requests waiting for an answer */
+tr_bool tr_announcerUdpIsIdle( const tr_announcer_udp * udp );
+
+/** @brief give up on every outstanding request within a few seconds.
+ *         Used at shutdown so that "stopped" messages get a chance to go out */
+void    tr_announcerUdpShutdown( tr_announcer_udp * udp );
+
+/** @brief how long to wait for the first reply before retransmitting.
+ *         BEP 15 asks for 15 seconds, doubling on each retry */
+void    tr_announcerUdpSetRetryInterval( tr_announcer_udp * udp, int msec );
+
+/***
+****  The session's UDP tracker client
+***/
+
+void    tr_announcerUdpInit( tr_session * session );
+
+void    tr_announcerUdpUninit( tr_session * session );
+
+/** @brief called by tr-udp.c for datagrams that might be tracker replies */
+tr_bool tr_announcerUdpPacket( const unsigned char   * buf,
+                               size_t                  buflen,
+                               const struct sockaddr * from,
+                               socklen_t               fromlen,
+                               tr_session            * session );
+
+#endif
@@ -19,6 +19,7 @@
 
 #include "transmission.h"
 #include "announcer.h"
+#include "announcer-udp.h"
 #include "crypto.h"
 #include "net.h"
 #include "ptrarray.h"
@@ -56,6 +57,23 @@ enum
     /* how many web tasks we allow at one time */
     MAX_CONCURRENT_TASKS = 48,
 
+    /* each tracker host can take this many requests per second from us,
+     * with bursts of up to HOST_REQUEST_BURST */
+    HOST_REQUESTS_PER_SEC = 5,
+    HOST_REQUEST_BURST = 20,
+
+    /* the "started" announces when a session opens are spread out so
+     * that we send about this many per second */
+    STARTUP_ANNOUNCES_PER_SEC = 10,
+
+    /* don't scrape a tier that's going to announce this soon;
+     * the announce response has the same numbers */
+    SCRAPE_MERGE_SECS = 60,
+
+    /* the most info_hashes we'll put in one HTTP scrape request.
+     * Escaped, each one adds up to 71 bytes to the URL */
+    MULTISCRAPE_MAX = 64,
+
     /* if a tracker takes more than this long to respond,
      * we treat it as nonresponsive */
     MAX_TRACKER_RESPONSE_TIME_SECS = ( 60 * 2 ),
@@ -92,6 +110,12 @@ compareTransfer( uint64_t a_uploaded, uint64_t a_downloaded,
     return 0;
 }
 
+static tr_bool
+isUdpTracker( const char * url )
+{
+    return !strncmp( url, "udp://", 6 );
+}
+
 /***
 ****
 ***/
@@ -112,6 +136,23 @@ typedef struct
 
     /* the last successful announce/scrape time for this host */
     time_t lastSuccessfulRequest;
+
+    /* how many info_hashes to put in one scrape request to this host.
+     * This is halved when the tracker rejects a multiscrape, and creeps
+     * back up by one after each full batch that it answers */
+    int multiscrapeMax;
+
+    /* TRUE if the last single-info_hash scrape was rejected too, in which
+     * case rejected multiscrapes don't tell us anything about their size */
+    tr_bool singleScrapeRejected;
+
+    /* a token bucket that paces our requests to this host */
+    double tokens;
+    uint64_t tokensUpdatedAt;
+
+    /* due requests that are waiting on tokens or task slots */
+    int announcesQueued;
+    int scrapesQueued;
 }
 tr_host;
 
@@ -148,9 +189,31 @@ hostNew( const char * name )
 {
     tr_host * host = tr_new0( tr_host, 1 );
     host->name = tr_strdup( name );
+    host->multiscrapeMax = MULTISCRAPE_MAX;
     return host;
 }
 
+/* returns true if the host's request budget allows a request right now */
+static tr_bool
+hostTakeToken( tr_host * host, uint64_t now_msec )
+{
+    if( host == NULL )
+        return TRUE;
+
+    if( now_msec > host->tokensUpdatedAt )
+    {
+        const double refill = ( now_msec - host->tokensUpdatedAt ) * HOST_REQUESTS_PER_SEC / 1000.0;
+        host->tokens = MIN( HOST_REQUEST_BURST, host->tokens + refill );
+        host->tokensUpdatedAt = now_msec;
+    }
+
+    if( host->tokens < 1 )
+        return FALSE;
+
+    host->tokens -= 1;
+    return TRUE;
+}
+
 static void
 hostFree( void * vhost )
 {
@@ -207,6 +270,11 @@ typedef struct tr_announcer
     struct event * upkeepTimer;
     int slotsAvailable;
     time_t lpdHouseKeepingAt;
+
+    /* for spreading out the "started" announces at startup.
+     * startupQueueEnd is when the ones given out so far will all be sent */
+    time_t startedAt;
+    uint64_t startupQueueEnd; /* tr_time_msec() */
 }
 tr_announcer;
 
@@ -264,6 +332,7 @@ tr_announcerInit( tr_session * session )
     a->session = session;
     a->slotsAvailable = MAX_CONCURRENT_TASKS;
     a->lpdHouseKeepingAt = relaxUntil;
+    a->startedAt = tr_time( );
     a->upkeepTimer = evtimer_new( session->event_base, onUpkeepTimer, a );
     tr_timerAdd( a->upkeepTimer, UPKEEP_INTERVAL_SECS, 0 );
 
@@ -422,6 +491,10 @@ typedef struct
     tr_bool isScraping;
     tr_bool wasCopied;
 
+    /* set when a multiscrape's reply left this tier's torrent out,
+     * so that it gets one retry in a scrape request of its own */
+    tr_bool scrapeAlone;
+
     char lastAnnounceStr[128];
     char lastScrapeStr[128];
 }
@@ -785,6 +858,37 @@ createAnnounceURL( const tr_announcer     * announcer,
     return evbuffer_free_to_str( buf );
 }
 
+/* the udp:// counterpart of createAnnounceURL() */
+static void
+createAnnounceRequest( const tr_announcer       * announcer,
+                       const tr_torrent         * torrent,
+                       const tr_tier            * tier,
+                       const char               * eventName,
+                       tr_announce_udp_request  * setme )
+{
+    const tr_tracker_item * tracker = tier->currentTracker;
+
+    memset( setme, 0, sizeof( tr_announce_udp_request ) );
+    memcpy( setme->info_hash, torrent->info.hash, SHA_DIGEST_LENGTH );
+    memcpy( setme->peer_id, torrent->peer_id, sizeof( setme->peer_id ) );
+    setme->up = tier->byteCounts[TR_ANN_UP];
+    setme->down = tier->byteCounts[TR_ANN_DOWN];
+    setme->left = tr_cpLeftUntilComplete( &torrent->completion );
+    setme->numwant = !strcmp( eventName, "stopped" ) ? 0 : NUMWANT;
+    setme->port = htons( tr_sessionGetPublicPeerPort( announcer->session ) );
+    memcpy( &setme->key, tracker->key_param, sizeof( setme->key ) );
+
+    /* BEP 15 has no "paused" event, so partial seeds send none */
+    if( !strcmp( eventName, "started" ) )
+        setme->event = TR_ANNOUNCE_EVENT_STARTED;
+    else if( !strcmp( eventName, "completed" ) )
+        setme->event = TR_ANNOUNCE_EVENT_COMPLETED;
+    else if( !strcmp( eventName, "stopped" ) )
+        setme->event = TR_ANNOUNCE_EVENT_STOPPED;
+    else
+        setme->event = TR_ANNOUNCE_EVENT_NONE;
+}
+
 
 /***
 ****
@@ -995,10 +1099,56 @@ torrentAddAnnounce( tr_torrent * tor, const char * announceEvent, time_t announc
         tierAddAnnounce( tr_ptrArrayNth( &tiers->tiers, i ), announceEvent, announceAt );
 }
 
+/**
+ * When a session opens with thousands of torrents, they'd all announce
+ * in the first second. During the startup window, each "started" announce
+ * is put off by up to as many seconds as it takes to send the ones still
+ * queued ahead of it at STARTUP_ANNOUNCES_PER_SEC, but never past the end
+ * of the window. Within that, high priority torrents go first, and
+ * downloads go before seeds.
+ */
+static int
+getStartupAnnounceDelay( tr_torrent * tor )
+{
+    int spread;
+    int slice;
+    int rank;
+    uint64_t slot;
+    tr_announcer * announcer = tor->session->announcer;
+    const time_t now = tr_time( );
+    const uint64_t now_msec = tr_time_msec( );
+    const time_t windowEnd = announcer->startedAt + tor->session->announceStartupWindowSecs;
+
+    if( now >= windowEnd )
+        return 0;
+
+    /* once the startup burst has gone out, the queue is empty again */
+    slot = MAX( now_msec, announcer->startupQueueEnd );
+    announcer->startupQueueEnd = slot + 1000 / STARTUP_ANNOUNCES_PER_SEC;
+
+    spread = MIN( windowEnd - now, (int)( ( slot - now_msec ) / 1000 ) );
+    if( spread < 1 )
+        return 0;
+
+    slice = spread / 4;
+    if( slice < 1 )
+        return tr_cryptoWeakRandInt( spread + 1 );
+
+    switch( tr_torrentGetPriority( tor ) ) {
+        case TR_PRI_HIGH: rank = 0; break;
+        case TR_PRI_LOW:  rank = 2; break;
+        default:          rank = 1; break;
+    }
+    if( tor->completeness != TR_LEECH )
+        ++rank;
+
+    return rank * slice + tr_cryptoWeakRandInt( slice + 1 );
+}
+
 void
 tr_announcerTorrentStarted( tr_torrent * tor )
 {
-    torrentAddAnnounce( tor, STARTED, tr_time( ) );
+    torrentAddAnnounce( tor, STARTED, tr_time( ) + getStartupAnnounceDelay( tor ) );
 }
 void
 tr_announcerManualAnnounce( tr_torrent * tor )
@@ -1060,7 +1210,15 @@ tr_announcerRemoveTorrent( tr_announcer * announcer, tr_torrent * tor )
         {
             tr_tier * tier = tr_ptrArrayNth( &tor->tiers->tiers, i );
 
-            if( tier->isRunning )
+            if( tier->isRunning && isUdpTracker( tier->currentTracker->announce ) )
+            {
+                tr_announce_udp_request req;
+                createAnnounceRequest( announcer, tor, tier, "stopped", &req );
+                tr_announcerUdpAnnounce( announcer->session->announcer_udp,
+                                         tier->currentTracker->announce,
+                                         &req, NULL, NULL );
+            }
+            else if( tier->isRunning )
             {
                 struct stop_message * s = tr_new0( struct stop_message, 1 );
                 s->up = tier->byteCounts[TR_ANN_UP];
@@ -1132,6 +1290,14 @@ compareTiers( const void * va, const void * vb )
             ret = af ? 1 : -1;
     }
 
+    /* higher priority comes first */
+    if( !ret ) {
+        const tr_priority_t ap = tr_torrentGetPriority( a->tor );
+        const tr_priority_t bp = tr_torrentGetPriority( b->tor );
+        if( ap != bp )
+            ret = ap > bp ? -1 : 1;
+    }
+
     /* upload comes before download */
     if( !ret )
         ret = compareTransfer( a->byteCounts[TR_ANN_UP], a->byteCounts[TR_ANN_DOWN],
@@ -1327,6 +1493,7 @@ parseAnnounceResponse( tr_tier     * tier,
 
 struct announce_data
 {
+    tr_session * session;
     int torrentId;
     int tierId;
     time_t timeSent;
@@ -1507,6 +1674,41 @@ onAnnounceDone( tr_session   * session,
     tr_free( data );
 }
 
+static void
+onUdpAnnounceDone( const tr_announce_udp_response * response, void * vdata )
+{
+    struct announce_data * data = vdata;
+    long responseCode = 0;
+    char * str = NULL;
+    int len = 0;
+
+    /* turn the reply into what an HTTP tracker would have sent,
+     * so that both kinds of tracker go through onAnnounceDone() */
+    if( response->didConnect )
+    {
+        tr_benc benc;
+
+        tr_bencInitDict( &benc, 4 );
+        if( response->errmsg != NULL )
+            tr_bencDictAddStr( &benc, "failure reason", response->errmsg );
+        else {
+            tr_bencDictAddInt( &benc, "interval", response->interval );
+            tr_bencDictAddInt( &benc, "complete", response->seeders );
+            tr_bencDictAddInt( &benc, "incomplete", response->leechers );
+            tr_bencDictAddRaw( &benc, response->isIPv6 ? "peers6" : "peers",
+                               response->peers, response->peersLen );
+        }
+
+        str = tr_bencToStr( &benc, TR_FMT_BENC, &len );
+        tr_bencFree( &benc );
+        responseCode = HTTP_OK;
+    }
+
+    onAnnounceDone( data->session, responseCode, str, len, data );
+
+    tr_free( str );
+}
+
 static const char*
 getNextAnnounceEvent( tr_tier * tier )
 {
@@ -1590,39 +1792,53 @@ tierAnnounce( tr_announcer * announcer, tr_tier * tier )
 
     if( announceEvent != NULL )
     {
-        char * url;
         struct announce_data * data;
         const tr_torrent * tor = tier->tor;
+        const char * announce = tier->currentTracker->announce;
         const time_t now = tr_time( );
 
         data = tr_new0( struct announce_data, 1 );
+        data->session = announcer->session;
         data->torrentId = tr_torrentId( tor );
         data->tierId = tier->key;
         data->isRunningOnSuccess = tor->isRunning;
         data->timeSent = now;
         data->event = announceEvent;
-        url = createAnnounceURL( announcer, tor, tier, data->event );
 
         tier->isAnnouncing = TRUE;
         tier->lastAnnounceStartTime = now;
         --announcer->slotsAvailable;
-        tr_webRun( announcer->session, url, NULL, onAnnounceDone, data );
 
-        tr_free( url );
+        if( isUdpTracker( announce ) )
+        {
+            tr_announce_udp_request req;
+            createAnnounceRequest( announcer, tor, tier, data->event, &req );
+            tr_announcerUdpAnnounce( announcer->session->announcer_udp,
+                                     announce, &req, onUdpAnnounceDone, data );
+        }
+        else
+        {
+            char * url = createAnnounceURL( announcer, tor, tier, data->event );
+            tr_webRun( announcer->session, url, NULL, onAnnounceDone, data );
+            tr_free( url );
+        }
     }
 }
 
 static tr_bool
 parseScrapeResponse( tr_tier     * tier,
-                     const char  * response,
-                     size_t        responseLen,
+                     tr_benc     * benc,
                      char        * result,
                      size_t        resultlen )
 {
     tr_bool success = FALSE;
-    tr_benc benc, *files;
-    const int bencLoaded = !tr_bencLoad( response, responseLen, &benc, NULL );
-    if( bencLoaded && tr_bencDictFindDict( &benc, "files", &files ) )
+    tr_benc * files;
+    const char * failure = NULL;
+
+    if( benc && tr_bencDictFindStr( benc, "failure reason", &failure ) )
+        tr_strlcpy( result, failure, resultlen );
+
+    if( benc && tr_bencDictFindDict( benc, "files", &files ) )
     {
         const char * key;
         tr_benc * val;
@@ -1660,17 +1876,146 @@ parseScrapeResponse( tr_tier     * tier,
         }
     }
 
-    if( bencLoaded )
-        tr_bencFree( &benc );
-
     if( success )
         tr_strlcpy( result, _( "Success" ), resultlen );
-    else
+    else if( failure == NULL )
         tr_strlcpy( result, _( "Error parsing response" ), resultlen );
 
     return success;
 }
 
+/**
+ * One scrape request. HTTP scrapes can carry many info_hashes to
+ * the same scrape URL, so this lists every tier waiting on the reply.
+ */
+struct scrape_data
+{
+    tr_session * session;
+    tr_host * host;
+    time_t timeSent;
+
+    int tierCount;
+    int * torrentIds;
+    int * tierIds;
+};
+
+static void
+scrapeDataFree( struct scrape_data * data )
+{
+    tr_free( data->tierIds );
+    tr_free( data->torrentIds );
+    tr_free( data );
+}
+
+/* Trackers that can't handle a scrape this large tend to either
+ * refuse the request outright or answer with a failure reason.
+ * That's also how they turn down a scrape for any other reason,
+ * e.g. a bad passkey, so onScrapeDone() weighs it against how
+ * single-torrent scrapes fare */
+static tr_bool
+multiscrapeWasRejected( long responseCode, tr_benc * benc )
+{
+    const char * failure;
+
+    if( 400 <= responseCode && responseCode <= 499 )
+        return TRUE;
+
+    if( responseCode == HTTP_OK )
+        return !benc || tr_bencDictFindStr( benc, "failure reason", &failure );
+
+    return FALSE;
+}
+
+/* Others answer with a "files" dict that quietly leaves out the
+ * torrents past their limit, so check that each one made it in */
+static tr_bool
+scrapeResponseHasTorrent( tr_benc * benc, const tr_torrent * tor )
+{
+    tr_benc * files;
+
+    if( benc && tr_bencDictFindDict( benc, "files", &files ) )
+    {
+        int i = 0;
+        const char * key;
+        tr_benc * val;
+
+        while( tr_bencDictChild( files, i++, &key, &val ) )
+            if( !memcmp( tor->info.hash, key, SHA_DIGEST_LENGTH ) )
+                return TRUE;
+    }
+
+    return FALSE;
+}
+
+static void
+tierScrapeDone( tr_tier * tier, long responseCode, tr_benc * benc,
+                time_t timeSent, time_t now )
+{
+    tr_bool success = FALSE;
+
+    tier->isScraping = FALSE;
+    tier->scrapeAlone = FALSE;
+    tier->lastScrapeTime = now;
+
+    if( tier->currentTracker->host )
+    {
+        tr_host * host = tier->currentTracker->host;
+        host->lastRequestTime = timeSent;
+        host->lastResponseInterval = now - timeSent;
+    }
+
+    if( 200 <= responseCode && responseCode <= 299 )
+    {
+        const int interval = tier->scrapeIntervalSec;
+        tier->scrapeAt = now + interval;
+
+        if( responseCode == HTTP_OK )
+            success = parseScrapeResponse( tier, benc, tier->lastScrapeStr,
+                                           sizeof( tier->lastScrapeStr ) );
+        else
+            tr_snprintf( tier->lastScrapeStr, sizeof( tier->lastScrapeStr ),
+                         _( "tracker gave HTTP Response Code %1$ld (%2$s)" ),
+                         responseCode, tr_webGetResponseStr( responseCode ) );
+        tr_tordbg( tier->tor, "%s", tier->lastScrapeStr );
+    }
+    else if( 300 <= responseCode && responseCode <= 399 )
+    {
+        /* this shouldn't happen; libcurl should handle this */
+        const int interval = 5;
+        tier->scrapeAt = now + interval;
+        tr_snprintf( tier->lastScrapeStr, sizeof( tier->lastScrapeStr ),
+                     "Got a redirect. Retrying in %d seconds", interval );
+        tr_tordbg( tier->tor, "%s", tier->lastScrapeStr );
+    }
+    else
+    {
+        const int interval = getRetryInterval( tier->currentTracker->host );
+
+        /* Don't retry on a 4xx.
+         * Retry at growing intervals on a 5xx */
+        if( 400 <= responseCode && responseCode <= 499 )
+            tier->scrapeAt = 0;
+        else
+            tier->scrapeAt = now + interval;
+
+        /* %1$ld - http status code, such as 404
+         * %2$s - human-readable explanation of the http status code */
+        if( !responseCode )
+            tr_strlcpy( tier->lastScrapeStr, _( "tracker did not respond" ),
+                        sizeof( tier->lastScrapeStr ) );
+        else
+            tr_snprintf( tier->lastScrapeStr, sizeof( tier->lastScrapeStr ),
+                         _( "tracker gave HTTP Response Code %1$ld (%2$s)" ),
+                         responseCode, tr_webGetResponseStr( responseCode ) );
+    }
+
+    tier->lastScrapeSucceeded = success;
+    tier->lastScrapeTimedOut = responseCode == 0;
+
+    if( success && tier->currentTracker->host )
+        tier->currentTracker->host->lastSuccessfulRequest = now;
+}
+
 static void
 onScrapeDone( tr_session   * session,
               long           responseCode,
@@ -1678,113 +2023,208 @@ onScrapeDone( tr_session   * session,
               size_t         responseLen,
               void         * vdata )
 {
-    tr_bool success = FALSE;
     tr_announcer * announcer = session->announcer;
-    struct announce_data * data = vdata;
-    tr_tier * tier = getTier( announcer, data->torrentId, data->tierId );
+    struct scrape_data * data = vdata;
     const time_t now = tr_time( );
 
     if( announcer )
+    {
+        int i;
+        tr_benc benc;
+        tr_bool bencLoaded = FALSE;
+        tr_bool rejected;
+        tr_bool shrink = FALSE;
+        tr_bool * missing = tr_new0( tr_bool, data->tierCount );
+        int missingCount = 0;
+        tr_host * host = data->host;
+
         ++announcer->slotsAvailable;
 
-    if( announcer && tier )
-    {
-        tier->isScraping = FALSE;
-        tier->lastScrapeTime = now;
+        if( responseCode == HTTP_OK )
+            bencLoaded = !tr_bencLoad( response, responseLen, &benc, NULL );
 
-        if( tier->currentTracker->host )
-        {
-            tr_host * host = tier->currentTracker->host;
-            host->lastRequestTime = data->timeSent;
-            host->lastResponseInterval = now - data->timeSent;
-        }
+        rejected = multiscrapeWasRejected( responseCode, bencLoaded ? &benc : NULL );
 
-        if( 200 <= responseCode && responseCode <= 299 )
+        /* which of the torrents did an otherwise good reply leave out? */
+        if( !rejected && bencLoaded )
         {
-            const int interval = tier->scrapeIntervalSec;
-            tier->scrapeAt = now + interval;
+            for( i=0; i<data->tierCount; ++i )
+            {
+                tr_tier * tier = getTier( announcer, data->torrentIds[i], data->tierIds[i] );
 
-            if( responseCode == HTTP_OK )
-                success = parseScrapeResponse( tier, response, responseLen,
-                                               tier->lastScrapeStr, sizeof( tier->lastScrapeStr ) );
-            else
-                tr_snprintf( tier->lastScrapeStr, sizeof( tier->lastScrapeStr ),
-                             _( "tracker gave HTTP Response Code %1$ld (%2$s)" ),
-                             responseCode, tr_webGetResponseStr( responseCode ) );
-            tr_tordbg( tier->tor, "%s", tier->lastScrapeStr );
+                if( ( tier != NULL ) && !scrapeResponseHasTorrent( &benc, tier->tor ) )
+                {
+                    missing[i] = TRUE;
+                    ++missingCount;
+                }
+            }
         }
-        else if( 300 <= responseCode && responseCode <= 399 )
+
+        if( host != NULL )
         {
-            /* this shouldn't happen; libcurl should handle this */
-            const int interval = 5;
-            tier->scrapeAt = now + interval;
-            tr_snprintf( tier->lastScrapeStr, sizeof( tier->lastScrapeStr ),
-                         "Got a redirect. Retrying in %d seconds", interval );
-            tr_tordbg( tier->tor, "%s", tier->lastScrapeStr );
+            if( data->tierCount == 1 )
+            {
+                host->singleScrapeRejected = rejected;
+            }
+            else if( rejected )
+            {
+                /* the tracker refused the whole batch.  That's only a hint
+                 * that it was too large if a lone info_hash gets through */
+                shrink = !host->singleScrapeRejected;
+            }
+            else if( missingCount > data->tierCount / 2 )
+            {
+                /* it answered for only a few of them; probably a size cap */
+                shrink = TRUE;
+            }
+
+            if( shrink && ( host->multiscrapeMax > data->tierCount / 2 ) )
+            {
+                host->multiscrapeMax = MAX( 1, data->tierCount / 2 );
+                tr_ndbg( host->name,
+                         "Tracker rejected a scrape of %d torrents (%d unanswered); now sending %d at a time",
+                         data->tierCount, rejected ? data->tierCount : missingCount,
+                         host->multiscrapeMax );
+            }
+
+            /* a full batch that was answered in full means we can try more */
+            if( bencLoaded && !rejected && !missingCount )
+            {
+                host->singleScrapeRejected = FALSE;
+
+                if( ( data->tierCount >= host->multiscrapeMax )
+                    && ( host->multiscrapeMax < MULTISCRAPE_MAX ) )
+                    ++host->multiscrapeMax;
+            }
         }
-        else
+
+        for( i=0; i<data->tierCount; ++i )
         {
-            const int interval = getRetryInterval( tier->currentTracker->host );
+            tr_tier * tier = getTier( announcer, data->torrentIds[i], data->tierIds[i] );
 
-            /* Don't retry on a 4xx.
-             * Retry at growing intervals on a 5xx */
-            if( 400 <= responseCode && responseCode <= 499 )
-                tier->scrapeAt = 0;
-            else
-                tier->scrapeAt = now + interval;
+            if( tier == NULL )
+                continue;
 
-            /* %1$ld - http status code, such as 404
-             * %2$s - human-readable explanation of the http status code */
-            if( !responseCode )
-                tr_strlcpy( tier->lastScrapeStr, _( "tracker did not respond" ),
-                            sizeof( tier->lastScrapeStr ) );
-            else
-                tr_snprintf( tier->lastScrapeStr, sizeof( tier->lastScrapeStr ),
-                             _( "tracker gave HTTP Response Code %1$ld (%2$s)" ),
-                             responseCode, tr_webGetResponseStr( responseCode ) );
+            if( shrink && ( rejected || missing[i] ) ) {
+                /* retry right away in a smaller batch */
+                tier->isScraping = FALSE;
+                tier->scrapeAt = now;
+            } else if( missing[i] && ( data->tierCount > 1 ) ) {
+                /* the tracker may just not know it, but give it one
+                 * more try by itself before calling it a failure */
+                tier->isScraping = FALSE;
+                tier->scrapeAlone = TRUE;
+                tier->scrapeAt = now;
+            } else {
+                tierScrapeDone( tier, responseCode, bencLoaded ? &benc : NULL,
+                                data->timeSent, now );
+            }
         }
 
-        tier->lastScrapeSucceeded = success;
-        tier->lastScrapeTimedOut = responseCode == 0;
+        if( bencLoaded )
+            tr_bencFree( &benc );
+        tr_free( missing );
+    }
+
+    scrapeDataFree( data );
+}
+
+static void
+onUdpScrapeDone( const tr_scrape_udp_response * response, void * vdata )
+{
+    struct scrape_data * data = vdata;
+    struct evbuffer * buf = evbuffer_new( );
+    long responseCode = 0;
+
+    /* as with onUdpAnnounceDone(), turn the reply into an HTTP tracker's.
+     * It's built by hand because info_hash isn't a NUL-terminated key */
+    if( response->didConnect )
+    {
+        if( response->errmsg != NULL )
+            evbuffer_add_printf( buf, "d14:failure reason%d:%se",
+                                 (int)strlen( response->errmsg ), response->errmsg );
+        else {
+            evbuffer_add_printf( buf, "d5:filesd%d:", SHA_DIGEST_LENGTH );
+            evbuffer_add( buf, response->info_hash, SHA_DIGEST_LENGTH );
+            evbuffer_add_printf( buf, "d8:completei%de10:downloadedi%de10:incompletei%deeee",
+                                 response->seeders, response->downloads, response->leechers );
+        }
 
-        if( success && tier->currentTracker->host )
-            tier->currentTracker->host->lastSuccessfulRequest = now;
+        responseCode = HTTP_OK;
     }
 
-    tr_free( data );
+    onScrapeDone( data->session, responseCode,
+                  evbuffer_pullup( buf, -1 ), evbuffer_get_length( buf ), data );
+
+    evbuffer_free( buf );
 }
 
+/**
+ * Scrape tiers that share a scrape URL with a single request.
+ * UDP scrapes are batched by announcer-udp.c, so they come one at a time
+ */
 static void
-tierScrape( tr_announcer * announcer, tr_tier * tier )
+scrapeTiers( tr_announcer * announcer, tr_tier ** tiers, int tierCount )
 {
-    char * url;
+    int i;
     const char * scrape;
-    struct announce_data * data;
+    struct scrape_data * data;
     const time_t now = tr_time( );
 
-    assert( tier );
-    assert( !tier->isScraping );
-    assert( tier->currentTracker != NULL );
-    assert( tr_isTorrent( tier->tor ) );
+    assert( tierCount > 0 );
+    assert( tiers[0]->currentTracker != NULL );
 
-    data = tr_new0( struct announce_data, 1 );
-    data->torrentId = tr_torrentId( tier->tor );
-    data->tierId = tier->key;
+    scrape = tiers[0]->currentTracker->scrape;
 
-    scrape = tier->currentTracker->scrape;
+    data = tr_new0( struct scrape_data, 1 );
+    data->session = announcer->session;
+    data->host = tiers[0]->currentTracker->host;
+    data->timeSent = now;
+    data->tierCount = tierCount;
+    data->torrentIds = tr_new( int, tierCount );
+    data->tierIds = tr_new( int, tierCount );
+
+    for( i=0; i<tierCount; ++i )
+    {
+        tr_tier * tier = tiers[i];
 
-    url = tr_strdup_printf( "%s%cinfo_hash=%s",
-                            scrape,
-                            strchr( scrape, '?' ) ? '&' : '?',
-                            tier->tor->info.hashEscaped );
+        assert( !tier->isScraping );
+        assert( tr_isTorrent( tier->tor ) );
+        assert( !strcmp( tier->currentTracker->scrape, scrape ) );
+
+        data->torrentIds[i] = tr_torrentId( tier->tor );
+        data->tierIds[i] = tier->key;
+
+        tier->isScraping = TRUE;
+        tier->lastScrapeStartTime = now;
+    }
 
-    tier->isScraping = TRUE;
-    tier->lastScrapeStartTime = now;
     --announcer->slotsAvailable;
-    dbgmsg( tier, "scraping \"%s\"", url );
-    tr_webRun( announcer->session, url, NULL, onScrapeDone, data );
 
-    tr_free( url );
+    if( isUdpTracker( scrape ) )
+    {
+        assert( tierCount == 1 );
+        dbgmsg( tiers[0], "scraping \"%s\"", scrape );
+        tr_announcerUdpScrape( announcer->session->announcer_udp, scrape,
+                               tiers[0]->tor->info.hash, onUdpScrapeDone, data );
+    }
+    else
+    {
+        char * url;
+        struct evbuffer * buf = evbuffer_new( );
+
+        evbuffer_add_printf( buf, "%s", scrape );
+        for( i=0; i<tierCount; ++i )
+            evbuffer_add_printf( buf, "%cinfo_hash=%s",
+                                 ( i || strchr( scrape, '?' ) ) ? '&' : '?',
+                                 tiers[i]->tor->info.hashEscaped );
+        url = evbuffer_free_to_str( buf );
+
+        dbgmsg( tiers[0], "scraping %d torrents with \"%s\"", tierCount, url );
+        tr_webRun( announcer->session, url, NULL, onScrapeDone, data );
+
+        tr_free( url );
+    }
 }
 
 static void
@@ -1813,29 +2253,56 @@ tierNeedsToAnnounce( const tr_tier * tier, const time_t now )
         && ( tr_ptrArraySize( &tier->announceEvents ) != 0 );
 }
 
+static tr_bool
+tierAnnouncesSoon( const tr_tier * tier, const time_t now )
+{
+    return ( tier->announceAt != 0 )
+        && ( tier->announceAt <= now + SCRAPE_MERGE_SECS )
+        && ( tr_ptrArraySize( &tier->announceEvents ) != 0 );
+}
+
 static tr_bool
 tierNeedsToScrape( const tr_tier * tier, const time_t now )
 {
     return ( !tier->isScraping )
+        && ( !tierAnnouncesSoon( tier, now ) )
         && ( tier->scrapeAt != 0 )
         && ( tier->scrapeAt <= now )
         && ( tier->currentTracker != NULL )
         && ( tier->currentTracker->scrape != NULL );
 }
 
+static int
+compareTiersByScrapeURL( const void * va, const void * vb )
+{
+    const tr_tier * a = *(const tr_tier**)va;
+    const tr_tier * b = *(const tr_tier**)vb;
+
+    return strcmp( a->currentTracker->scrape, b->currentTracker->scrape );
+}
+
 static void
 announceMore( tr_announcer * announcer )
 {
     tr_torrent * tor = NULL;
     const time_t now = tr_time( );
 
-    if( announcer->slotsAvailable > 0 )
+    /* this runs even when every task slot is busy,
+     * so that the per-host queue depths stay current */
     {
         int i;
         int n;
+        const uint64_t now_msec = tr_time_msec( );
         tr_ptrArray announceMe = TR_PTR_ARRAY_INIT;
         tr_ptrArray scrapeMe = TR_PTR_ARRAY_INIT;
 
+        n = tr_ptrArraySize( &announcer->hosts );
+        for( i=0; i<n; ++i ) {
+            tr_host * host = tr_ptrArrayNth( &announcer->hosts, i );
+            host->announcesQueued = 0;
+            host->scrapesQueued = 0;
+        }
+
         /* build a list of tiers that need to be announced */
         while(( tor = tr_torrentNext( announcer->session, tor ))) {
             if( tor->tiers ) {
@@ -1850,25 +2317,42 @@ announceMore( tr_announcer * announcer )
             }
         }
 
-        /* if there are more tiers than slots available, prioritize */
+        /* prioritize, since the slots and the hosts' request
+         * budgets may not stretch to all of them */
         n = tr_ptrArraySize( &announceMe );
-        if( n > announcer->slotsAvailable )
-            qsort( tr_ptrArrayBase( &announceMe ), n, sizeof( tr_tier * ), compareTiers );
+        qsort( tr_ptrArrayBase( &announceMe ), n, sizeof( tr_tier * ), compareTiers );
 
         /* announce some */
-        n = MIN( tr_ptrArraySize( &announceMe ), announcer->slotsAvailable );
         for( i=0; i<n; ++i ) {
             tr_tier * tier = tr_ptrArrayNth( &announceMe, i );
-            dbgmsg( tier, "announcing tier %d of %d", i, n );
-            tierAnnounce( announcer, tier );
+            tr_host * host = tier->currentTracker ? tier->currentTracker->host : NULL;
+            if( ( announcer->slotsAvailable > 0 ) && hostTakeToken( host, now_msec ) ) {
+                dbgmsg( tier, "announcing tier %d of %d", i, n );
+                tierAnnounce( announcer, tier );
+            } else if( host != NULL ) {
+                ++host->announcesQueued;
+            }
         }
 
-        /* scrape some */
-        n = MIN( tr_ptrArraySize( &scrapeMe ), announcer->slotsAvailable );
-        for( i=0; i<n; ++i ) {
-            tr_tier * tier = tr_ptrArrayNth( &scrapeMe, i );
-            dbgmsg( tier, "scraping tier %d of %d", (i+1), n );
-            tierScrape( announcer, tier );
+        /* scrape some. Tiers with the same HTTP scrape URL are
+         * sorted together so they can share a request */
+        n = tr_ptrArraySize( &scrapeMe );
+        qsort( tr_ptrArrayBase( &scrapeMe ), n, sizeof( tr_tier * ), compareTiersByScrapeURL );
+        for( i=0; i<n; ) {
+            tr_tier ** tiers = (tr_tier**) tr_ptrArrayBase( &scrapeMe ) + i;
+            const tr_tracker_item * tracker = tiers[0]->currentTracker;
+            int count = 1;
+            if( !isUdpTracker( tracker->scrape ) && ( tracker->host != NULL ) && !tiers[0]->scrapeAlone ) {
+                const int max = MIN( n - i, tracker->host->multiscrapeMax );
+                while( count < max && !tiers[count]->scrapeAlone
+                                   && !strcmp( tiers[count]->currentTracker->scrape, tracker->scrape ) )
+                    ++count;
+            }
+            if( ( announcer->slotsAvailable > 0 ) && hostTakeToken( tracker->host, now_msec ) )
+                scrapeTiers( announcer, tiers, count );
+            else if( tracker->host != NULL )
+                tracker->host->scrapesQueued += count;
+            i += count;
         }
 
 #if 0
@@ -1882,34 +2366,8 @@ fprintf( stderr, "[%s] announce.c has %d requests ready to send (announce: %d, s
         tr_ptrArrayDestruct( &announceMe, NULL );
     }
 
-    tor = NULL;
-    while(( tor = tr_torrentNext( announcer->session, tor ))) {
-        if( tor->dhtAnnounceAt <= now ) {
-            if( tor->isRunning && tr_torrentAllowsDHT(tor) ) {
-                int rc;
-                rc = tr_dhtAnnounce(tor, AF_INET, 1);
-                if(rc == 0)
-                    /* The DHT is not ready yet. Try again soon. */
-                    tor->dhtAnnounceAt = now + 5 + tr_cryptoWeakRandInt( 5 );
-                else
-                    /* We should announce at least once every 30 minutes. */
-                    tor->dhtAnnounceAt =
-                        now + 25 * 60 + tr_cryptoWeakRandInt( 3 * 60 );
-            }
-        }
-
-        if( tor->dhtAnnounce6At <= now ) {
-            if( tor->isRunning && tr_torrentAllowsDHT(tor) ) {
-                int rc;
-                rc = tr_dhtAnnounce(tor, AF_INET6, 1);
-                if(rc == 0)
-                    tor->dhtAnnounce6At = now + 5 + tr_cryptoWeakRandInt( 5 );
-                else
-                    tor->dhtAnnounce6At =
-                        now + 25 * 60 + tr_cryptoWeakRandInt( 3 * 60 );
-            }
-        }
-    }
+    /* DHT */
+    tr_dhtAnnounceMore( announcer->session, now );
 
     /* Local Peer Discovery */
     if( announcer->lpdHouseKeepingAt <= now )
@@ -2055,3 +2513,37 @@ tr_announcerStatsFree( tr_tracker_stat * trackers,
 {
     tr_free( trackers );
 }
+
+tr_tracker_host_stat *
+tr_announcerHostStats( const tr_session * session, int * setmeHostCount )
+{
+    int i;
+    int n;
+    tr_tracker_host_stat * ret;
+    const tr_announcer * announcer = session->announcer;
+
+    assert( tr_isSession( session ) );
+
+    n = announcer ? tr_ptrArraySize( &announcer->hosts ) : 0;
+    ret = tr_new0( tr_tracker_host_stat, n );
+
+    for( i=0; i<n; ++i )
+    {
+        const tr_host * host = tr_ptrArrayNth( (tr_ptrArray*)&announcer->hosts, i );
+        tr_tracker_host_stat * st = ret + i;
+
+        tr_strlcpy( st->host, host->name, sizeof( st->host ) );
+        st->announcesQueued = host->announcesQueued;
+        st->scrapesQueued = host->scrapesQueued;
+        st->multiscrapeMax = host->multiscrapeMax;
+    }
+
+    *setmeHostCount = n;
+    return ret;
+}
+
+void
+tr_announcerHostStatsFree( tr_tracker_host_stat * hosts )
+{
+    tr_free( hosts );
+}
@@ -103,5 +103,26 @@ tr_tracker_stat * tr_announcerStats( const tr_torrent * torrent,
 void tr_announcerStatsFree( tr_tracker_stat * trackers,
                             int               trackerCount );
 
+/** @brief how much announce and scrape work is waiting on each tracker host */
+typedef struct
+{
+    char host[128];
+
+    /* due announces and scrapes that haven't been sent yet, either
+     * because the host's request budget is spent or because we're
+     * already running as many web tasks as we allow */
+    int announcesQueued;
+    int scrapesQueued;
+
+    /* the most info_hashes we'll put in a single scrape to this host */
+    int multiscrapeMax;
+}
+tr_tracker_host_stat;
+
+tr_tracker_host_stat * tr_announcerHostStats( const tr_session * session,
+                                              int              * setmeHostCount );
+
+void tr_announcerHostStatsFree( tr_tracker_host_stat * hosts );
+
 
 #endif /* _TR_ANNOUNCER_H_ */
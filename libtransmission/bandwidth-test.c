@@ -0,0 +1,353 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h> /* strcmp */
+
+#include "transmission.h"
+#include "bandwidth.h"
+#include "utils.h"
+
+#undef VERBOSE
+
+static int test = 0;
+
+#ifdef VERBOSE
+  #define check( A ) \
+    { \
+        ++test; \
+        if( A ){ \
+            fprintf( stderr, "PASS test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+        } else { \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#else
+  #define check( A ) \
+    { \
+        ++test; \
+        if( !( A ) ){ \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#endif
+
+enum
+{
+    PEER_COUNT = 500,
+
+    /* how far from its fair share a peer may be, per unit of weight */
+    SLACK = 1024
+};
+
+/* a pretend peer that wants `want' bytes and takes them
+ * out of a bandwidth pool shared by all the peers */
+struct fake_peer
+{
+    size_t want;
+    size_t got;
+    int flushCount;
+};
+
+static struct fake_peer peers[PEER_COUNT];
+static size_t pool;
+
+static int
+fakeFlush( void * vpeer, tr_direction dir UNUSED, size_t byteCount )
+{
+    struct fake_peer * peer = vpeer;
+    size_t n = MIN( byteCount, peer->want - peer->got );
+    n = MIN( n, pool );
+    pool -= n;
+    peer->got += n;
+    ++peer->flushCount;
+    return (int)n;
+}
+
+static void
+resetPeers( int n, size_t want )
+{
+    int i;
+
+    for( i=0; i<n; ++i ) {
+        peers[i].want = want;
+        peers[i].got = 0;
+        peers[i].flushCount = 0;
+    }
+}
+
+static tr_bandwidth_share*
+makeShare( int n, unsigned int weight )
+{
+    int i;
+    tr_bandwidth_share * share = tr_new( tr_bandwidth_share, n );
+
+    for( i=0; i<n; ++i ) {
+        share[i].peer = &peers[i];
+        share[i].weight = weight;
+    }
+
+    return share;
+}
+
+static tr_bool
+isNear( size_t a, size_t b, size_t slack )
+{
+    return ( a > b ? a - b : b - a ) <= slack;
+}
+
+/* Jain's fairness index: 1.0 is perfectly fair, 1/n is as bad as it gets */
+static double
+getFairness( int n )
+{
+    int i;
+    double sum = 0, sumSquares = 0;
+
+    for( i=0; i<n; ++i ) {
+        sum += peers[i].got;
+        sumSquares += (double)peers[i].got * peers[i].got;
+    }
+
+    return sumSquares > 0 ? ( sum * sum ) / ( n * sumSquares ) : 1.0;
+}
+
+static int
+test_equal_share( void )
+{
+    int i;
+    int flushCount;
+    const int n = 50;
+    const size_t limit = 1024 * 1024;
+    tr_bandwidth_share * share = makeShare( n, 1 );
+
+    /* everyone wants more than there is, so they each get 1/n of it */
+    resetPeers( n, limit );
+    pool = limit;
+    flushCount = tr_bandwidthShare( share, n, TR_UP, pool, fakeFlush );
+    check( pool == 0 );
+    for( i=0; i<n; ++i )
+        check( isNear( peers[i].got, limit / n, SLACK ) );
+
+    /* and most of it is handed out in one large chunk per peer */
+    check( flushCount <= 3 * n );
+
+    tr_free( share );
+    return 0;
+}
+
+static int
+test_weighted_share( void )
+{
+    int i;
+    const int n = 40;
+    const size_t limit = 500 * 1024;
+    tr_bandwidth_share * share = makeShare( n, 1 );
+    size_t lowGot = 0, highGot = 0;
+
+    /* half the peers have four times the weight of the other half */
+    for( i=0; i<n; i+=2 )
+        share[i].weight = 4;
+    resetPeers( n, limit );
+    pool = limit;
+    tr_bandwidthShare( share, n, TR_UP, pool, fakeFlush );
+    check( pool == 0 );
+
+    for( i=0; i<n; ++i ) {
+        if( i % 2 ) lowGot += peers[i].got;
+        else highGot += peers[i].got;
+    }
+    check( isNear( highGot, limit * 4 / 5, SLACK * 5 * n ) );
+    check( isNear( lowGot, limit / 5, SLACK * 5 * n ) );
+    for( i=0; i<n; ++i )
+        check( isNear( peers[i].got, i % 2 ? limit / ( 5 * n / 2 ) : limit * 4 / ( 5 * n / 2 ), SLACK * 4 ) );
+
+    tr_free( share );
+    return 0;
+}
+
+static int
+test_max_min_share( void )
+{
+    int i;
+    const int n = 20;
+    const size_t limit = 100 * 1024;
+    tr_bandwidth_share * share = makeShare( n, 1 );
+
+    /* half the peers only want a little, so they should get all of it
+     * and the other half should split what's left */
+    resetPeers( n, limit );
+    for( i=0; i<n/2; ++i )
+        peers[i].want = 1000;
+    pool = limit;
+    tr_bandwidthShare( share, n, TR_DOWN, pool, fakeFlush );
+    check( pool == 0 );
+    for( i=0; i<n/2; ++i )
+        check( peers[i].got == 1000 );
+    for( ; i<n; ++i )
+        check( isNear( peers[i].got, ( limit - 1000 * ( n / 2 ) ) / ( n / 2 ), SLACK ) );
+
+    /* a peer that wants nothing is only asked once */
+    resetPeers( n, 0 );
+    pool = limit;
+    tr_bandwidthShare( share, n, TR_DOWN, pool, fakeFlush );
+    check( pool == limit );
+    for( i=0; i<n; ++i )
+        check( peers[i].flushCount == 1 );
+
+    /* no peers is fine too */
+    check( tr_bandwidthShare( share, 0, TR_DOWN, pool, fakeFlush ) == 0 );
+
+    tr_free( share );
+    return 0;
+}
+
+static int
+test_group_priority( void )
+{
+    tr_bandwidth * session = tr_bandwidthNew( NULL, NULL );
+    tr_bandwidth * group = tr_bandwidthNew( NULL, session );
+    tr_bandwidth * tor = tr_bandwidthNew( NULL, group );
+    tr_bandwidth * peer = tr_bandwidthNew( NULL, tor );
+
+    /* outside of a group, the highest priority on the way up wins */
+    tor->priority = TR_PRI_HIGH;
+    check( tr_bandwidthGetPeerPriority( peer ) == TR_PRI_HIGH );
+    tor->priority = TR_PRI_LOW;
+    check( tr_bandwidthGetPeerPriority( peer ) == TR_PRI_NORMAL );
+
+    /* a group's priority replaces its torrents', whether higher or lower */
+    group->isGroup = TRUE;
+    group->priority = TR_PRI_HIGH;
+    check( tr_bandwidthGetPeerPriority( peer ) == TR_PRI_HIGH );
+    group->priority = TR_PRI_LOW;
+    tor->priority = TR_PRI_HIGH;
+    check( tr_bandwidthGetPeerPriority( peer ) == TR_PRI_LOW );
+
+    tr_bandwidthFree( peer );
+    tr_bandwidthFree( tor );
+    tr_bandwidthFree( group );
+    tr_bandwidthFree( session );
+    return 0;
+}
+
+static int
+test_group_limits( void )
+{
+    tr_bandwidth * session = tr_bandwidthNew( NULL, NULL );
+    tr_bandwidth * group = tr_bandwidthNew( NULL, session );
+    tr_bandwidth * tor = tr_bandwidthNew( NULL, group );
+    group->isGroup = TRUE;
+
+    /* the session allows 5 KiB this second, and the group 10 KiB */
+    tr_bandwidthSetLimited( session, TR_DOWN, TRUE );
+    tr_bandwidthSetDesiredSpeed_Bps( session, TR_DOWN, 5 * 1024 );
+    tr_bandwidthSetLimited( group, TR_DOWN, TRUE );
+    tr_bandwidthSetDesiredSpeed_Bps( group, TR_DOWN, 10 * 1024 );
+    tr_bandwidthAllocate( session, TR_DOWN, 1000 );
+
+    check( tr_bandwidthClamp( tor, TR_DOWN, 1024 * 1024 ) == 5 * 1024 );
+
+    /* a torrent that ignores the session's limits still gets the group's */
+    tr_bandwidthHonorParentLimits( tor, TR_DOWN, FALSE );
+    check( tr_bandwidthClamp( tor, TR_DOWN, 1024 * 1024 ) == 10 * 1024 );
+
+    /* ...and one that isn't in a group is unlimited */
+    group->isGroup = FALSE;
+    check( tr_bandwidthClamp( tor, TR_DOWN, 1024 * 1024 ) == 1024 * 1024 );
+
+    tr_bandwidthFree( tor );
+    tr_bandwidthFree( group );
+    tr_bandwidthFree( session );
+    return 0;
+}
+
+/* the old way: go round-robin in fixed 1 KiB increments */
+static int
+referenceShare( int n )
+{
+    int i = 0;
+    int flushCount = 0;
+    struct fake_peer * active[PEER_COUNT];
+
+    for( i=0; i<n; ++i )
+        active[i] = &peers[i];
+
+    i = 0;
+    while( n > 0 )
+    {
+        const size_t increment = 1024;
+        const int bytesUsed = fakeFlush( active[i], TR_UP, increment );
+        ++flushCount;
+
+        if( bytesUsed == (int)increment )
+            ++i;
+        else
+            active[i] = active[--n];
+
+        if( i == n )
+            i = 0;
+    }
+
+    return flushCount;
+}
+
+/* compare the two for a 500-peer session with a 10 MiB/s limit
+ * and 1 MiB/s of demand from each peer */
+static void
+benchmark( void )
+{
+    int i;
+    int flushCount;
+    const int loops = 100;
+    const size_t limit = 10 * 1024 * 1024 / 2; /* per half-second pulse */
+    const size_t want = 1024 * 1024 / 2;
+    uint64_t begin, oldUsec, newUsec;
+    double oldFairness, newFairness;
+    tr_bandwidth_share * share = makeShare( PEER_COUNT, 1 );
+
+    begin = tr_time_usec( );
+    for( i=0; i<loops; ++i ) {
+        resetPeers( PEER_COUNT, want );
+        pool = limit;
+        flushCount = referenceShare( PEER_COUNT );
+    }
+    oldUsec = tr_time_usec( ) - begin;
+    oldFairness = getFairness( PEER_COUNT );
+    printf( "1 KiB round-robin: %d flushes/pulse, %.1f usec/pulse, fairness %.4f\n",
+            flushCount, oldUsec / (double)loops, oldFairness );
+
+    begin = tr_time_usec( );
+    for( i=0; i<loops; ++i ) {
+        resetPeers( PEER_COUNT, want );
+        pool = limit;
+        flushCount = tr_bandwidthShare( share, PEER_COUNT, TR_UP, limit, fakeFlush );
+    }
+    newUsec = tr_time_usec( ) - begin;
+    newFairness = getFairness( PEER_COUNT );
+    printf( "adaptive quanta:   %d flushes/pulse, %.1f usec/pulse, fairness %.4f\n",
+            flushCount, newUsec / (double)loops, newFairness );
+
+    tr_free( share );
+}
+
+int
+main( int argc, char ** argv )
+{
+    int i;
+
+    if( ( i = test_equal_share( ) ) )
+        return i;
+    if( ( i = test_weighted_share( ) ) )
+        return i;
+    if( ( i = test_max_min_share( ) ) )
+        return i;
+    if( ( i = test_group_priority( ) ) )
+        return i;
+    if( ( i = test_group_limits( ) ) )
+        return i;
+
+    if( ( argc > 1 ) && !strcmp( argv[1], "--benchmark" ) )
+        benchmark( );
+
+    return 0;
+}
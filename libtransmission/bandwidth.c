@@ -12,6 +12,7 @@
 
 #include <assert.h>
 #include <limits.h>
+#include <string.h> /* memcpy() */
 
 #include "transmission.h"
 #include "bandwidth.h"
@@ -33,27 +34,41 @@
 static unsigned int
 getSpeed_Bps( const struct bratecontrol * r, unsigned int interval_msec, uint64_t now )
 {
-    uint64_t       bytes = 0;
-    const uint64_t cutoff = (now?now:tr_time_msec()) - interval_msec;
-    int            i = r->newest;
+    if( !now )
+        now = tr_time_msec( );
 
-    for( ;; )
+    /* the speed is asked for many times per msec -- by the rechoke
+     * and bandwidth code, and once per peer for the stats -- so cache it */
+    if( now != r->cache_time )
     {
-        if( r->transfers[i].date <= cutoff )
-            break;
+        uint64_t       bytes = 0;
+        const uint64_t cutoff = now - interval_msec;
+        struct bratecontrol * mutable_r = (struct bratecontrol*) r;
+        int            i = r->newest;
 
-        bytes += r->transfers[i].size;
+        for( ;; )
+        {
+            if( r->transfers[i].date <= cutoff )
+                break;
 
-        if( --i == -1 ) i = HISTORY_SIZE - 1; /* circular history */
-        if( i == r->newest ) break; /* we've come all the way around */
+            bytes += r->transfers[i].size;
+
+            if( --i == -1 ) i = HISTORY_SIZE - 1; /* circular history */
+            if( i == r->newest ) break; /* we've come all the way around */
+        }
+
+        mutable_r->cache_val = (unsigned int)(( bytes * 1000u ) / interval_msec);
+        mutable_r->cache_time = now;
     }
 
-    return (unsigned int)(( bytes * 1000u ) / interval_msec);
+    return r->cache_val;
 }
 
 static void
 bytesUsed( const uint64_t now, struct bratecontrol * r, size_t size )
 {
+    r->cache_time = 0;
+
     if( r->transfers[r->newest].date + GRANULARITY_MSEC >= now )
         r->transfers[r->newest].size += size;
     else
@@ -149,15 +164,31 @@ tr_bandwidthSetParent( tr_bandwidth  * b,
 #define DEBUG_DIRECTION TR_UP
 #endif
 
+tr_priority_t
+tr_bandwidthGetPeerPriority( const tr_bandwidth * b )
+{
+    tr_priority_t priority = TR_PRI_LOW;
+
+    assert( tr_isBandwidth( b ) );
+
+    for( ; b != NULL; b = b->parent )
+    {
+        /* a group's priority overrides its members', even a lower one */
+        if( b->isGroup )
+            return b->priority;
+
+        priority = MAX( priority, b->priority );
+    }
+
+    return priority;
+}
+
 static void
 allocateBandwidth( tr_bandwidth  * b,
-                   tr_priority_t   parent_priority,
                    tr_direction    dir,
                    unsigned int    period_msec,
                    tr_ptrArray   * peer_pool )
 {
-    tr_priority_t priority;
-
     assert( tr_isBandwidth( b ) );
     assert( tr_isDirection( dir ) );
 
@@ -175,11 +206,9 @@ allocateBandwidth( tr_bandwidth  * b,
 #endif
     }
 
-    priority = MAX( parent_priority, b->priority );
-
     /* add this bandwidth's peer, if any, to the peer pool */
     if( b->peer != NULL ) {
-        b->peer->priority = priority;
+        b->peer->priority = tr_bandwidthGetPeerPriority( b );
         tr_ptrArrayAppend( peer_pool, b->peer );
     }
 
@@ -194,44 +223,124 @@ fprintf( stderr, "bandwidth %p has %d peers\n", b, n );
         struct tr_bandwidth ** children = (struct tr_bandwidth**) tr_ptrArrayBase( &b->children );
         const int n = tr_ptrArraySize( &b->children );
         for( i=0; i<n; ++i )
-            allocateBandwidth( children[i], priority, dir, period_msec, peer_pool );
+            allocateBandwidth( children[i], dir, period_msec, peer_pool );
     }
 }
 
-static void
-phaseOne( tr_ptrArray * peerArray, tr_direction dir )
+enum
+{
+    /* the smallest & largest chunks that tr_bandwidthShare() hands out
+     * per unit of weight in one turn */
+    MIN_QUANTUM = 1024,
+    MAX_QUANTUM = 64 * 1024
+};
+
+/* how much a peer's turn is worth, relative to other peers */
+static unsigned int
+getPriorityWeight( tr_priority_t priority )
 {
-    int i, n;
-    int peerCount = tr_ptrArraySize( peerArray );
-    struct tr_peerIo ** peers = (struct tr_peerIo**) tr_ptrArrayBase( peerArray );
-
-    /* First phase of IO. Tries to distribute bandwidth fairly to keep faster
-     * peers from starving the others. Loop through the peers, giving each a
-     * small chunk of bandwidth. Keep looping until we run out of bandwidth
-     * and/or peers that can use it */
-    n = peerCount;
+    switch( priority ) {
+        case TR_PRI_HIGH:   return 4;
+        case TR_PRI_NORMAL: return 2;
+        default:            return 1;
+    }
+}
+
+int
+tr_bandwidthShare( tr_bandwidth_share       * peers,
+                   int                        n,
+                   tr_direction               dir,
+                   size_t                     bytesLeft,
+                   tr_bandwidth_flush_func    flush )
+{
+    int i;
+    int flushCount = 0;
+    unsigned int weightSum = 0;
+    tr_bandwidth_share * keep = tr_new( tr_bandwidth_share, n );
+
+    for( i=0; i<n; ++i )
+        weightSum += peers[i].weight;
+
     dbgmsg( "%d peers to go round-robin for %s", n, (dir==TR_UP?"upload":"download") );
-    i = n ? tr_cryptoWeakRandInt( n ) : 0; /* pick a random starting point */
-    while( n > 1 )
+
+    while( n > 0 )
     {
-        const size_t increment = 1024;
-        const int bytesUsed = tr_peerIoFlush( peers[i], dir, increment );
-
-        dbgmsg( "peer #%d of %d used %d bytes in this pass", i, n, bytesUsed );
-
-        if( bytesUsed == (int)increment )
-            ++i;
-        else {
-            /* peer is done writing for now; move it to the end of the list */
-            tr_peerIo * pio = peers[i];
-            peers[i] = peers[n-1];
-            peers[n-1] = pio;
-            --n;
+        int keepCount = 0;
+        int doneCount = 0;
+        const int start = tr_cryptoWeakRandInt( n ); /* pick a random starting point */
+
+        /* split what's left between the peers that still want it */
+        size_t quantum = bytesLeft / ( weightSum ? weightSum : 1 );
+        quantum = MAX( quantum, MIN_QUANTUM );
+        quantum = MIN( quantum, MAX_QUANTUM );
+
+        for( i=0; i<n; ++i )
+        {
+            const tr_bandwidth_share * p = &peers[( start + i ) % n];
+            const size_t offer = quantum * p->weight;
+            int bytesUsed = flush( p->peer, dir, offer );
+
+            ++flushCount;
+            if( bytesUsed < 0 )
+                bytesUsed = 0;
+            bytesLeft -= MIN( bytesLeft, (size_t)bytesUsed );
+
+            dbgmsg( "peer #%d of %d used %d of %zu bytes in this pass", i, n, bytesUsed, offer );
+
+            /* if the peer didn't use all it was offered, it's done for now.
+             * move it to the end of the list */
+            if( (size_t)bytesUsed == offer )
+                keep[keepCount++] = *p;
+            else {
+                keep[n - ++doneCount] = *p;
+                weightSum -= p->weight;
+            }
         }
 
-        if( i == n )
-            i = 0;
+        memcpy( peers, keep, sizeof( tr_bandwidth_share ) * n );
+        n = keepCount;
     }
+
+    tr_free( keep );
+    return flushCount;
+}
+
+static int
+flushPeer( void * vio, tr_direction dir, size_t byteCount )
+{
+    return tr_peerIoFlush( vio, dir, byteCount );
+}
+
+/* First phase of IO. Tries to distribute bandwidth fairly to keep faster
+ * peers from starving the others. Peers that aren't limited by anything
+ * are left to the second phase, since there's nothing to be fair about */
+static void
+phaseOne( struct tr_peerIo ** peers, int peerCount, tr_direction dir )
+{
+    int i;
+    int n = 0;
+    size_t bytesLeft = 0;
+    tr_bandwidth_share * share = tr_new( tr_bandwidth_share, peerCount );
+
+    for( i=0; i<peerCount; ++i )
+    {
+        tr_peerIo * io = peers[i];
+        const unsigned int available = tr_bandwidthClamp( &io->bandwidth, dir, UINT_MAX );
+
+        if( available == UINT_MAX )
+            continue;
+
+        /* peers may be under different limits, so this is only a hint */
+        bytesLeft = MAX( bytesLeft, available );
+
+        share[n].peer = io;
+        share[n].weight = getPriorityWeight( io->priority );
+        ++n;
+    }
+
+    tr_bandwidthShare( share, n, dir, bytesLeft, flushPeer );
+
+    tr_free( share );
 }
 
 void
@@ -241,15 +350,12 @@ tr_bandwidthAllocate( tr_bandwidth  * b,
 {
     int i, peerCount;
     tr_ptrArray tmp = TR_PTR_ARRAY_INIT;
-    tr_ptrArray low = TR_PTR_ARRAY_INIT;
-    tr_ptrArray high = TR_PTR_ARRAY_INIT;
-    tr_ptrArray normal = TR_PTR_ARRAY_INIT;
     struct tr_peerIo ** peers;
 
     /* allocateBandwidth() is a helper function with two purposes:
      * 1. allocate bandwidth to b and its subtree
      * 2. accumulate an array of all the peerIos from b and its subtree. */
-    allocateBandwidth( b, TR_PRI_LOW, dir, period_msec, &tmp );
+    allocateBandwidth( b, dir, period_msec, &tmp );
     peers = (struct tr_peerIo**) tr_ptrArrayBase( &tmp );
     peerCount = tr_ptrArraySize( &tmp );
 
@@ -259,21 +365,11 @@ tr_bandwidthAllocate( tr_bandwidth  * b,
         tr_peerIoRef( io );
 
         tr_peerIoFlushOutgoingProtocolMsgs( io );
-
-        switch( io->priority ) {
-            case TR_PRI_HIGH:   tr_ptrArrayAppend( &high,   io ); /* fall through */
-            case TR_PRI_NORMAL: tr_ptrArrayAppend( &normal, io ); /* fall through */
-            default:            tr_ptrArrayAppend( &low,    io );
-        }
     }
 
-    /* First phase of IO. Tries to distribute bandwidth fairly to keep faster
-     * peers from starving the others. Loop through the peers, giving each a
-     * small chunk of bandwidth. Keep looping until we run out of bandwidth
-     * and/or peers that can use it */
-    phaseOne( &high, dir );
-    phaseOne( &normal, dir );
-    phaseOne( &low, dir );
+    /* First phase of IO. Give each peer its fair share of the bandwidth,
+     * weighted by priority, in chunks as large as the limits allow */
+    phaseOne( peers, peerCount, dir );
 
     /* Second phase of IO. To help us scale in high bandwidth situations,
      * enable on-demand IO for peers with bandwidth left to burn.
@@ -286,9 +382,6 @@ tr_bandwidthAllocate( tr_bandwidth  * b,
         tr_peerIoUnref( peers[i] );
 
     /* cleanup */
-    tr_ptrArrayDestruct( &normal, NULL );
-    tr_ptrArrayDestruct( &high, NULL );
-    tr_ptrArrayDestruct( &low, NULL );
     tr_ptrArrayDestruct( &tmp, NULL );
 }
 
@@ -320,6 +413,8 @@ tr_bandwidthClamp( const tr_bandwidth  * b,
 
         if( b->parent && b->band[dir].honorParentLimits )
             byteCount = tr_bandwidthClamp( b->parent, dir, byteCount );
+        else if( b->parent && b->parent->isGroup && b->parent->band[dir].isLimited )
+            byteCount = MIN( byteCount, b->parent->band[dir].bytesLeft );
     }
 
     return byteCount;
@@ -343,12 +438,13 @@ tr_bandwidthGetPieceSpeed_Bps( const tr_bandwidth * b, const uint64_t now, const
     return getSpeed_Bps( &b->band[dir].piece, HISTORY_MSEC, now );
 }
 
-void
-tr_bandwidthUsed( tr_bandwidth  * b,
-                  tr_direction    dir,
-                  size_t          byteCount,
-                  tr_bool         isPieceData,
-                  uint64_t        now )
+static void
+bandwidthUsed( tr_bandwidth  * b,
+               tr_direction    dir,
+               size_t          byteCount,
+               tr_bool         isPieceData,
+               tr_bool         consume,
+               uint64_t        now )
 {
     struct tr_band * band;
 
@@ -357,7 +453,7 @@ tr_bandwidthUsed( tr_bandwidth  * b,
 
     band = &b->band[dir];
 
-    if( band->isLimited && isPieceData )
+    if( consume && band->isLimited && isPieceData )
         band->bytesLeft -= MIN( band->bytesLeft, byteCount );
 
 #ifdef DEBUG_DIRECTION
@@ -372,5 +468,44 @@ fprintf( stderr, "%p consumed %5zu bytes of %5s data... was %6zu, now %6zu left\
         bytesUsed( now, &band->piece, byteCount );
 
     if( b->parent != NULL )
-        tr_bandwidthUsed( b->parent, dir, byteCount, isPieceData, now );
+        bandwidthUsed( b->parent, dir, byteCount, isPieceData, consume, now );
+}
+
+void
+tr_bandwidthUsed( tr_bandwidth  * b,
+                  tr_direction    dir,
+                  size_t          byteCount,
+                  tr_bool         isPieceData,
+                  uint64_t        now )
+{
+    bandwidthUsed( b, dir, byteCount, isPieceData, TRUE, now );
+}
+
+void
+tr_bandwidthRecordUsed( tr_bandwidth  * b,
+                        tr_direction    dir,
+                        size_t          byteCount,
+                        tr_bool         isPieceData,
+                        uint64_t        now )
+{
+    bandwidthUsed( b, dir, byteCount, isPieceData, FALSE, now );
+}
+
+void
+tr_bandwidthConsume( tr_bandwidth  * b,
+                     tr_direction    dir,
+                     size_t          byteCount )
+{
+    for( ; b != NULL; b = b->parent )
+    {
+        struct tr_band * band;
+
+        assert( tr_isBandwidth( b ) );
+        assert( tr_isDirection( dir ) );
+
+        band = &b->band[dir];
+
+        if( band->isLimited )
+            band->bytesLeft -= MIN( band->bytesLeft, byteCount );
+    }
 }
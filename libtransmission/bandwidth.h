@@ -45,6 +45,8 @@ struct bratecontrol
 {
     int newest;
     struct { uint64_t date, size; } transfers[HISTORY_SIZE];
+    uint64_t cache_time;
+    unsigned int cache_val;
 };
 
 /* these are PRIVATE IMPLEMENTATION details that should not be touched.
@@ -70,7 +72,9 @@ struct tr_band
  *
  *   Transmission's bandwidth hierarchy is a tree.
  *   At the top is the global bandwidth object owned by tr_session.
- *   Its children are per-torrent bandwidth objects owned by tr_torrent.
+ *   Its children are per-torrent bandwidth objects owned by tr_torrent,
+ *   or the bandwidth objects of the session's bandwidth groups, which in
+ *   turn are the parents of their torrents' bandwidth objects.
  *   Underneath those are per-peer bandwidth objects owned by tr_peer.
  *
  *   tr_session also owns a tr_handshake's bandwidths, so that the handshake
@@ -106,6 +110,12 @@ typedef struct tr_bandwidth
     struct tr_band band[2];
     struct tr_bandwidth * parent;
     tr_priority_t priority;
+
+    /* set on a bandwidth group's object.  Its priority is given to its
+     * whole subtree as-is, and its children are held to its own limits
+     * even when they don't honor their parents' */
+    tr_bool isGroup;
+
     int magicNumber;
     tr_session * session;
     tr_ptrArray children; /* struct tr_bandwidth */
@@ -200,6 +210,44 @@ void    tr_bandwidthAllocate          ( tr_bandwidth        * bandwidth,
                                         tr_direction          direction,
                                         unsigned int          period_msec );
 
+/**
+ * @brief lets a peer use up to byteCount bytes.
+ * @return the number of bytes it used
+ */
+typedef int ( *tr_bandwidth_flush_func )( void * peer, tr_direction dir, size_t byteCount );
+
+/* a peer waiting for its share of the bandwidth in tr_bandwidthShare() */
+typedef struct tr_bandwidth_share
+{
+    void * peer;
+    unsigned int weight;
+}
+tr_bandwidth_share;
+
+/**
+ * @brief Deal out up to bytesLeft bytes to peers in weighted round-robin order.
+ *
+ * Each turn, a peer is offered a quantum that's proportional to its weight
+ * and sized to split the remaining bandwidth between the peers still
+ * waiting, so that peers can move large chunks at once when there's plenty
+ * to go around. A peer that doesn't use all it was offered is done.
+ * The order of the peers array is changed.
+ *
+ * This is used by tr_bandwidthAllocate() and exposed for testing.
+ *
+ * @return the number of times flush was called
+ */
+int     tr_bandwidthShare             ( tr_bandwidth_share  * peers,
+                                        int                   peerCount,
+                                        tr_direction          direction,
+                                        size_t                bytesLeft,
+                                        tr_bandwidth_flush_func flush );
+
+/**
+ * @brief returns the priority that the peer under this bandwidth is given
+ */
+tr_priority_t tr_bandwidthGetPeerPriority( const tr_bandwidth * bandwidth );
+
 /**
  * @brief clamps byteCount down to a number that this bandwidth will allow to be consumed
  */
@@ -231,6 +279,25 @@ void    tr_bandwidthUsed              ( tr_bandwidth        * bandwidth,
                                         tr_bool               isPieceData,
                                         uint64_t              now );
 
+/**
+ * @brief Like tr_bandwidthUsed(), but only records the transfer for the speed
+ * history. This is for bytes whose bandwidth was already taken by
+ * tr_bandwidthConsume() when they were granted to a sharded peer.
+ */
+void    tr_bandwidthRecordUsed        ( tr_bandwidth        * bandwidth,
+                                        tr_direction          direction,
+                                        size_t                byteCount,
+                                        tr_bool               isPieceData,
+                                        uint64_t              now );
+
+/**
+ * @brief Take bandwidth from this object and its parents ahead of time,
+ * so that peers in other threads can use it without asking again.
+ */
+void    tr_bandwidthConsume           ( tr_bandwidth        * bandwidth,
+                                        tr_direction          direction,
+                                        size_t                byteCount );
+
 /******
 *******
 ******/
@@ -378,6 +378,8 @@ static int
 testMerge( void )
 {
     tr_benc dest, src;
+    tr_benc * l;
+    tr_benc * d;
     int64_t i;
     const char * s;
 
@@ -389,6 +391,8 @@ testMerge( void )
     tr_bencDictAddStr( &dest, "s5", "abc" );
     tr_bencDictAddStr( &dest, "s6", "def" );
     tr_bencDictAddStr( &dest, "s7", "127.0.0.1" ); /* remains untouched */
+    tr_bencListAddInt( tr_bencDictAddList( &dest, "l9", 2 ), 9 );
+    tr_bencDictAddInt( &dest, "d11", 11 );
 
     /* new dictionary, will overwrite items in dest  */
     tr_bencInitDict( &src, 10 );
@@ -398,6 +402,13 @@ testMerge( void )
     tr_bencDictAddStr( &src, "s5", "abc" ); /* same value */
     tr_bencDictAddStr( &src, "s6", "xyz" ); /* new value */
     tr_bencDictAddStr( &src, "s8", "ghi" ); /* new key:value */
+    l = tr_bencDictAddList( &src, "l9", 2 ); /* list replaces old list */
+    tr_bencListAddInt( l, 1 );
+    tr_bencListAddInt( l, 2 );
+    d = tr_bencDictAddDict( &src, "d10", 1 ); /* new dict */
+    tr_bencDictAddInt( d, "i", 10 );
+    d = tr_bencDictAddDict( &src, "d11", 1 ); /* dict replaces int */
+    tr_bencDictAddInt( d, "i", 11 );
 
     tr_bencMergeDicts( &dest, /*const*/ &src );
 
@@ -417,6 +428,16 @@ testMerge( void )
     check( strcmp( "127.0.0.1", s ) == 0 );
     check( tr_bencDictFindStr( &dest, "s8", &s ));
     check( strcmp( "ghi", s ) == 0 );
+    check( tr_bencDictFindList( &dest, "l9", &l ));
+    check( tr_bencListSize( l ) == 2 );
+    check( tr_bencGetInt( tr_bencListChild( l, 0 ), &i ));
+    check( i == 1 );
+    check( tr_bencDictFindDict( &dest, "d10", &d ));
+    check( tr_bencDictFindInt( d, "i", &i ));
+    check( i == 10 );
+    check( tr_bencDictFindDict( &dest, "d11", &d ));
+    check( tr_bencDictFindInt( d, "i", &i ));
+    check( i == 11 );
 
     tr_bencFree( &dest );
     tr_bencFree( &src );
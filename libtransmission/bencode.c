@@ -1573,16 +1573,19 @@ tr_bencMergeDicts( tr_benc * target, const tr_benc * source )
             {
                 tr_bencDictAddRaw( target, key, getStr( val ), val->val.s.len );
             }
-            else if( tr_bencIsDict( val ) && tr_bencDictFindDict( target, key, &t ) )
+            else if( tr_bencIsDict( val ) )
             {
+                if( !tr_bencDictFindDict( target, key, &t ) )
+                {
+                    tr_bencDictRemove( target, key );
+                    t = tr_bencDictAddDict( target, key, tr_bencDictSize( val ) );
+                }
                 tr_bencMergeDicts( t, val );
             }
             else if( tr_bencIsList( val ) )
             {
-                if( tr_bencDictFind( target, key ) == NULL )
-                {
-                    tr_bencListCopy( tr_bencDictAddList( target, key, tr_bencListSize( val ) ), val );
-                }
+                tr_bencDictRemove( target, key );
+                tr_bencListCopy( tr_bencDictAddList( target, key, tr_bencListSize( val ) ), val );
             }
             else
             {
@@ -32,6 +32,7 @@ tr_bitset;
 static inline void
 tr_bitsetConstructor( tr_bitset * b, size_t size )
 {
+    b->haveAll = b->haveNone = 0;
     tr_bitfieldConstruct( &b->bitfield, size );
 }
 
@@ -0,0 +1,203 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h> /* memcmp, memset */
+#include <sys/time.h> /* gettimeofday */
+
+#include "transmission.h"
+#include "crypto.h"
+#include "utils.h"
+
+#undef VERBOSE
+
+static int test = 0;
+
+#ifdef VERBOSE
+  #define check( A ) \
+    { \
+        ++test; \
+        if( A ){ \
+            fprintf( stderr, "PASS test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+        } else { \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#else
+  #define check( A ) \
+    { \
+        ++test; \
+        if( !( A ) ){ \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#endif
+
+enum
+{
+    KEY_LEN = 96,
+
+    /* how many handshakes to time in the benchmark */
+    BENCH_HANDSHAKES = 64,
+
+    /* give up waiting for the pool to fill after this long */
+    POOL_FILL_MSEC = 10000
+};
+
+static uint64_t
+now_usec( void )
+{
+    struct timeval tv;
+    gettimeofday( &tv, NULL );
+    return (uint64_t)tv.tv_sec * 1000000u + tv.tv_usec;
+}
+
+/* do both halves of an MSE key exchange and make sure they agree */
+static int
+test_key_exchange( void )
+{
+    int len;
+    uint8_t hash[SHA_DIGEST_LENGTH];
+    uint8_t secretA[KEY_LEN];
+    uint8_t secretB[KEY_LEN];
+    uint8_t keyA[KEY_LEN];
+    uint8_t plain[100], wire[100], out[100];
+    const uint8_t * key;
+    tr_crypto * a;
+    tr_crypto * b;
+
+    memset( hash, 0x42, sizeof( hash ) );
+    a = tr_cryptoNew( hash, FALSE );
+    b = tr_cryptoNew( hash, TRUE );
+
+    key = tr_cryptoGetMyPublicKey( a, &len );
+    check( len == KEY_LEN );
+    memcpy( keyA, key, KEY_LEN );
+    memcpy( secretB, tr_cryptoComputeSecret( b, key ), KEY_LEN );
+    key = tr_cryptoGetMyPublicKey( b, &len );
+    check( memcmp( keyA, key, KEY_LEN ) );
+    memcpy( secretA, tr_cryptoComputeSecret( a, key ), KEY_LEN );
+    check( !memcmp( secretA, secretB, KEY_LEN ) );
+
+    /* and the RC4 streams derived from the secret line up */
+    memset( plain, 'x', sizeof( plain ) );
+    tr_cryptoEncryptInit( a );
+    tr_cryptoDecryptInit( b );
+    tr_cryptoEncrypt( a, sizeof( plain ), plain, wire );
+    tr_cryptoDecrypt( b, sizeof( wire ), wire, out );
+    check( memcmp( plain, wire, sizeof( plain ) ) );
+    check( !memcmp( plain, out, sizeof( plain ) ) );
+
+    tr_cryptoFree( b );
+    tr_cryptoFree( a );
+    return 0;
+}
+
+static tr_bool
+waitForFullPool( int depth )
+{
+    tr_key_pool_stats stats;
+    const uint64_t deadline = tr_time_msec( ) + POOL_FILL_MSEC;
+
+    do {
+        tr_cryptoKeyPoolGetStats( &stats );
+        if( stats.depth >= depth )
+            return TRUE;
+        tr_wait_msec( 10 );
+    } while( tr_time_msec( ) < deadline );
+
+    return FALSE;
+}
+
+/* our half of the key work in an MSE handshake:
+ * make a keypair, then combine it with the peer's public key */
+static uint64_t
+timeHandshakes( const uint8_t * peerKey, int n )
+{
+    int i, len;
+    uint8_t hash[SHA_DIGEST_LENGTH];
+    const uint64_t begin = now_usec( );
+
+    memset( hash, 0x42, sizeof( hash ) );
+    for( i=0; i<n; ++i ) {
+        tr_crypto * c = tr_cryptoNew( hash, FALSE );
+        tr_cryptoGetMyPublicKey( c, &len );
+        tr_cryptoComputeSecret( c, peerKey );
+        tr_cryptoFree( c );
+    }
+
+    return now_usec( ) - begin;
+}
+
+static int
+test_key_pool( void )
+{
+    int i, len;
+    uint8_t hash[SHA_DIGEST_LENGTH];
+    uint8_t peerKey[KEY_LEN];
+    uint8_t keys[BENCH_HANDSHAKES][KEY_LEN];
+    uint64_t withoutPool, withPool;
+    tr_key_pool_stats stats;
+    tr_crypto * peer;
+
+    memset( hash, 0x42, sizeof( hash ) );
+    peer = tr_cryptoNew( hash, TRUE );
+    memcpy( peerKey, tr_cryptoGetMyPublicKey( peer, &len ), KEY_LEN );
+
+    withoutPool = timeHandshakes( peerKey, BENCH_HANDSHAKES );
+
+    tr_cryptoKeyPoolInit( );
+    check( waitForFullPool( BENCH_HANDSHAKES ) );
+
+    /* every keypair comes from the pool, and they're all different */
+    tr_cryptoKeyPoolGetStats( &stats );
+    check( stats.hits == 0 );
+    check( stats.misses == 0 );
+    for( i=0; i<BENCH_HANDSHAKES; ++i ) {
+        tr_crypto * c = tr_cryptoNew( hash, FALSE );
+        memcpy( keys[i], tr_cryptoGetMyPublicKey( c, &len ), KEY_LEN );
+        tr_cryptoFree( c );
+    }
+    tr_cryptoKeyPoolGetStats( &stats );
+    check( stats.hits == BENCH_HANDSHAKES );
+    check( stats.misses == 0 );
+    for( i=1; i<BENCH_HANDSHAKES; ++i )
+        check( memcmp( keys[i-1], keys[i], KEY_LEN ) );
+
+    /* pooled keypairs make working keys too */
+    check( waitForFullPool( BENCH_HANDSHAKES ) );
+    check( !test_key_exchange( ) );
+    tr_cryptoKeyPoolGetStats( &stats );
+    check( stats.hits == BENCH_HANDSHAKES + 2 );
+    check( stats.misses == 0 );
+
+    check( waitForFullPool( BENCH_HANDSHAKES ) );
+    withPool = timeHandshakes( peerKey, BENCH_HANDSHAKES );
+    tr_cryptoKeyPoolGetStats( &stats );
+    check( stats.misses == 0 );
+
+    printf( "MSE key work on the event thread: %.0f handshakes/sec without "
+            "the keypair pool, %.0f with it\n",
+            BENCH_HANDSHAKES * 1000000.0 / MAX( withoutPool, 1 ),
+            BENCH_HANDSHAKES * 1000000.0 / MAX( withPool, 1 ) );
+
+    /* an empty pool falls back to making keys inline */
+    tr_cryptoKeyPoolUninit( );
+    check( !test_key_exchange( ) );
+
+    tr_cryptoFree( peer );
+    return 0;
+}
+
+int
+main( void )
+{
+    int i;
+
+    if( ( i = test_key_exchange( ) ) )
+        return i;
+    if( ( i = test_key_pool( ) ) )
+        return i;
+
+    return 0;
+}
@@ -16,7 +16,10 @@
 #include <stdlib.h> /* for abs() */
 #include <string.h> /* memcpy */
 
+#include <pthread.h> /* pthread_self */
+
 #include <openssl/bn.h>
+#include <openssl/crypto.h> /* CRYPTO_set_locking_callback */
 #include <openssl/dh.h>
 #include <openssl/err.h>
 #include <openssl/rc4.h>
@@ -25,6 +28,7 @@
 
 #include "transmission.h"
 #include "crypto.h"
+#include "platform.h" /* tr_lock, tr_threadNew */
 #include "utils.h"
 
 #define MY_NAME "tr_crypto"
@@ -110,45 +114,247 @@ struct tr_crypto
         } \
     } while( 0 )
 
+/* make a new keypair. This is the expensive part of an MSE handshake */
+static DH*
+generateKeypair( uint8_t * setme_public_key )
+{
+    int len, offset;
+    DH * dh = DH_new( );
+
+    dh->p = BN_bin2bn( dh_P, sizeof( dh_P ), NULL );
+    if( dh->p == NULL )
+        logErrorFromSSL( );
+
+    dh->g = BN_bin2bn( dh_G, sizeof( dh_G ), NULL );
+    if( dh->g == NULL )
+        logErrorFromSSL( );
+
+    /* private DH value: strong random BN of DH_PRIVKEY_LEN*8 bits */
+    dh->priv_key = BN_new( );
+    do {
+        if( BN_rand( dh->priv_key, DH_PRIVKEY_LEN * 8, -1, 0 ) != 1 )
+            logErrorFromSSL( );
+    } while ( BN_num_bits( dh->priv_key ) < DH_PRIVKEY_LEN_MIN * 8 );
+
+    if( !DH_generate_key( dh ) )
+        logErrorFromSSL( );
+
+    /* DH can generate key sizes that are smaller than the size of
+       P with exponentially decreasing probability, in which case
+       the msb's of myPublicKey need to be zeroed appropriately. */
+    len = BN_num_bytes( dh->pub_key );
+    offset = KEY_LEN - len;
+    assert( len <= KEY_LEN );
+    memset( setme_public_key, 0, offset );
+    BN_bn2bin( dh->pub_key, setme_public_key + offset );
+
+    return dh;
+}
+
+/***
+****  Keypairs made ahead of time
+****
+****  When a session starts with lots of torrents, or a flood of incoming
+****  connections arrives, generating a keypair for each handshake on the
+****  event thread holds up everything else. So a worker thread keeps a
+****  pool of them ready, and handshakes only make their own when it's dry.
+***/
+
+enum
+{
+    /* how many keypairs to keep ready */
+    KEY_POOL_SIZE = 64,
+
+    /* how often an idle worker checks to see if the pool needs refilling */
+    KEY_POOL_POLL_MSEC = 50
+};
+
+struct tr_keypair
+{
+    DH * dh;
+    uint8_t publicKey[KEY_LEN];
+};
+
+static struct
+{
+    tr_lock * lock;
+    int refCount;
+    tr_bool isRunning;
+    tr_bool isWorkerDone;
+    int depth;
+    struct tr_keypair keys[KEY_POOL_SIZE];
+    tr_key_pool_stats stats;
+}
+keyPool;
+
+static tr_bool
+takePooledKeypair( tr_crypto * crypto )
+{
+    tr_bool found = FALSE;
+
+    if( keyPool.lock != NULL )
+    {
+        tr_lockLock( keyPool.lock );
+        if( keyPool.depth > 0 )
+        {
+            const struct tr_keypair * key = &keyPool.keys[--keyPool.depth];
+            crypto->dh = key->dh;
+            memcpy( crypto->myPublicKey, key->publicKey, KEY_LEN );
+            ++keyPool.stats.hits;
+            found = TRUE;
+        }
+        else
+        {
+            ++keyPool.stats.misses;
+        }
+        tr_lockUnlock( keyPool.lock );
+    }
+
+    return found;
+}
+
 static void
-ensureKeyExists( tr_crypto * crypto)
+keyPoolWorker( void * unused UNUSED )
 {
-    if( crypto->dh == NULL )
+    tr_lockLock( keyPool.lock );
+
+    while( keyPool.isRunning )
     {
-        int len, offset;
-        DH * dh = DH_new( );
+        if( keyPool.depth < KEY_POOL_SIZE )
+        {
+            struct tr_keypair key;
+
+            tr_lockUnlock( keyPool.lock );
+            key.dh = generateKeypair( key.publicKey );
+            tr_lockLock( keyPool.lock );
+
+            if( keyPool.isRunning && ( keyPool.depth < KEY_POOL_SIZE ) ) {
+                keyPool.keys[keyPool.depth++] = key;
+                ++keyPool.stats.generated;
+            } else {
+                DH_free( key.dh );
+            }
+        }
+        else
+        {
+            tr_lockUnlock( keyPool.lock );
+            tr_wait_msec( KEY_POOL_POLL_MSEC );
+            tr_lockLock( keyPool.lock );
+        }
+    }
 
-        dh->p = BN_bin2bn( dh_P, sizeof( dh_P ), NULL );
-        if( dh->p == NULL )
-            logErrorFromSSL( );
+    keyPool.isWorkerDone = TRUE;
+    tr_lockUnlock( keyPool.lock );
+}
 
-        dh->g = BN_bin2bn( dh_G, sizeof( dh_G ), NULL );
-        if( dh->g == NULL )
-            logErrorFromSSL( );
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+/* OpenSSL before 1.1 can't be used from more than one thread at a time
+ * unless it's given locks, and the pool worker uses it alongside the
+ * event thread */
+static tr_lock ** sslLocks = NULL;
 
-        /* private DH value: strong random BN of DH_PRIVKEY_LEN*8 bits */
-        dh->priv_key = BN_new( );
-        do {
-            if( BN_rand( dh->priv_key, DH_PRIVKEY_LEN * 8, -1, 0 ) != 1 )
-                logErrorFromSSL( );
-        } while ( BN_num_bits( dh->priv_key ) < DH_PRIVKEY_LEN_MIN * 8 );
+static void
+sslLockingCallback( int mode, int n, const char * file UNUSED, int line UNUSED )
+{
+    if( mode & CRYPTO_LOCK )
+        tr_lockLock( sslLocks[n] );
+    else
+        tr_lockUnlock( sslLocks[n] );
+}
 
-        if( !DH_generate_key( dh ) )
-            logErrorFromSSL( );
+static unsigned long
+sslThreadIdCallback( void )
+{
+    return (unsigned long) pthread_self( );
+}
 
-        /* DH can generate key sizes that are smaller than the size of
-           P with exponentially decreasing probability, in which case
-           the msb's of myPublicKey need to be zeroed appropriately. */
-        len = BN_num_bytes( dh->pub_key );
-        offset = KEY_LEN - len;
-        assert( len <= KEY_LEN );
-        memset( crypto->myPublicKey, 0, offset );
-        BN_bn2bin( dh->pub_key, crypto->myPublicKey + offset );
+static void
+initSSLLocks( void )
+{
+    if( sslLocks == NULL && CRYPTO_get_locking_callback( ) == NULL )
+    {
+        int i;
+        const int n = CRYPTO_num_locks( );
+        sslLocks = tr_new( tr_lock*, n );
+        for( i=0; i<n; ++i )
+            sslLocks[i] = tr_lockNew( );
+        CRYPTO_set_id_callback( sslThreadIdCallback );
+        CRYPTO_set_locking_callback( sslLockingCallback );
+    }
+}
+#else
+static void
+initSSLLocks( void )
+{
+}
+#endif
 
-        crypto->dh = dh;
+void
+tr_cryptoKeyPoolInit( void )
+{
+    if( ++keyPool.refCount == 1 )
+    {
+        initSSLLocks( );
+        keyPool.lock = tr_lockNew( );
+        keyPool.isRunning = TRUE;
+        keyPool.isWorkerDone = FALSE;
+        tr_threadNew( keyPoolWorker, NULL );
     }
 }
 
+void
+tr_cryptoKeyPoolUninit( void )
+{
+    if( --keyPool.refCount == 0 )
+    {
+        int i;
+        tr_lock * lock = keyPool.lock;
+
+        /* the worker exits as soon as it's done with the key it's making */
+        tr_lockLock( lock );
+        keyPool.isRunning = FALSE;
+        while( !keyPool.isWorkerDone ) {
+            tr_lockUnlock( lock );
+            tr_wait_msec( 10 );
+            tr_lockLock( lock );
+        }
+
+        tr_dbg( "DH keypair pool: %"PRIu64" generated, %"PRIu64" used, %"PRIu64" misses",
+                keyPool.stats.generated, keyPool.stats.hits, keyPool.stats.misses );
+        for( i=0; i<keyPool.depth; ++i )
+            DH_free( keyPool.keys[i].dh );
+        keyPool.depth = 0;
+        keyPool.lock = NULL;
+        tr_lockUnlock( lock );
+        tr_lockFree( lock );
+    }
+}
+
+void
+tr_cryptoKeyPoolGetStats( tr_key_pool_stats * setme )
+{
+    memset( setme, 0, sizeof( tr_key_pool_stats ) );
+
+    if( keyPool.lock != NULL )
+    {
+        tr_lockLock( keyPool.lock );
+        *setme = keyPool.stats;
+        setme->depth = keyPool.depth;
+        tr_lockUnlock( keyPool.lock );
+    }
+}
+
+/**
+***
+**/
+
+static void
+ensureKeyExists( tr_crypto * crypto)
+{
+    if( ( crypto->dh == NULL ) && !takePooledKeypair( crypto ) )
+        crypto->dh = generateKeypair( crypto->myPublicKey );
+}
+
 tr_crypto *
 tr_cryptoNew( const uint8_t * torrentHash,
               int             isIncoming )
@@ -67,6 +67,28 @@ void           tr_cryptoEncrypt( tr_crypto *  crypto,
                                  const void * buf_in,
                                  void *       buf_out );
 
+/**
+ * @brief start keeping a pool of DH keypairs ready in a worker thread.
+ *
+ * Without it, each encrypted handshake generates its own keypair on the
+ * event thread when it first needs one. Calls nest; the pool lives until
+ * the last tr_cryptoKeyPoolUninit().
+ */
+void           tr_cryptoKeyPoolInit( void );
+
+void           tr_cryptoKeyPoolUninit( void );
+
+typedef struct tr_key_pool_stats
+{
+    int         depth;      /* keypairs ready right now */
+    uint64_t    generated;  /* keypairs made by the worker */
+    uint64_t    hits;       /* handshakes that got a keypair from the pool */
+    uint64_t    misses;     /* handshakes that found the pool empty */
+}
+tr_key_pool_stats;
+
+void           tr_cryptoKeyPoolGetStats( tr_key_pool_stats * setme );
+
 /* @} */
 
 /**
@@ -21,6 +21,10 @@
  #define _XOPEN_SOURCE 600
 #endif
 
+#ifdef HAVE_ACCEPT4
+ #define _GNU_SOURCE /* accept4 */
+#endif
+
 #include <assert.h>
 #include <errno.h>
 #include <inttypes.h>
@@ -31,8 +35,9 @@
  #include <fcntl.h>
 #endif
 
-#ifdef HAVE_FALLOCATE64
-  /* FIXME can't find the right #include voodoo to pick up the declaration.. */
+#if defined( HAVE_FALLOCATE64 ) && !defined( _GNU_SOURCE )
+  /* FIXME can't find the right #include voodoo to pick up the declaration..
+   * with _GNU_SOURCE, <fcntl.h> declares it */
   extern int fallocate64( int fd, int mode, uint64_t offset, uint64_t len );
 #endif
 
@@ -639,7 +644,12 @@ tr_fdSocketAccept( tr_session * s, int sockfd, tr_address * addr, tr_port * port
     gFd = s->fdInfo;
 
     len = sizeof( struct sockaddr_storage );
+#ifdef HAVE_ACCEPT4
+    /* saves the caller an fcntl() or two per connection */
+    fd = accept4( sockfd, (struct sockaddr *) &sock, &len, SOCK_NONBLOCK | SOCK_CLOEXEC );
+#else
     fd = accept( sockfd, (struct sockaddr *) &sock, &len );
+#endif
 
     if( ( fd >= 0 ) && gFd->socket_count > gFd->socket_limit )
     {
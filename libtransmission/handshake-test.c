@@ -0,0 +1,506 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h> /* atoi, mkdtemp */
+#include <string.h> /* strcmp, strlen */
+#include <unistd.h> /* fork, pipe, read, write */
+
+#include <dirent.h>
+#include <ifaddrs.h> /* getifaddrs */
+#include <sys/resource.h> /* getrusage */
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+
+#include <event2/event.h>
+#include <event2/util.h> /* evutil_make_socket_nonblocking */
+
+#include "transmission.h"
+#include "bencode.h"
+#include "handshake.h"
+#include "net.h"
+#include "peer-io.h"
+#include "session.h"
+#include "trevent.h"
+#include "utils.h"
+
+#undef VERBOSE
+
+static int test = 0;
+
+#ifdef VERBOSE
+  #define check( A ) \
+    { \
+        ++test; \
+        if( A ){ \
+            fprintf( stderr, "PASS test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+        } else { \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#else
+  #define check( A ) \
+    { \
+        ++test; \
+        if( !( A ) ){ \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#endif
+
+/**
+ * A benchmark of whole handshakes over loopback.
+ *
+ * A session can't handshake with itself -- it would notice its own
+ * peer_id -- so a forked child runs a second session that accepts
+ * the connections, and this one makes them one after another.
+ *
+ * Run with a handshake count to benchmark, e.g. "handshake-test 5000".
+ * Without one, it does a few of each kind as a test.
+ */
+
+enum
+{
+    DEFAULT_HANDSHAKES = 100,
+
+    /* give up on a round of handshakes after this long */
+    ROUND_TIMEOUT_SECS = 120
+};
+
+/* a single-piece torrent that both sessions have, paused */
+static const char * metainfo =
+    "d4:infod6:lengthi16384e4:name5:bench12:piece lengthi16384e"
+    "6:pieces20:aaaaaaaaaaaaaaaaaaaaee";
+
+/***
+****
+***/
+
+static uint64_t
+cpuUsec( void )
+{
+    struct rusage ru;
+    getrusage( RUSAGE_SELF, &ru );
+    return (uint64_t)( ru.ru_utime.tv_sec + ru.ru_stime.tv_sec ) * 1000000u
+                   + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static uint64_t
+wallUsec( void )
+{
+    struct timeval tv;
+    gettimeofday( &tv, NULL );
+    return (uint64_t)tv.tv_sec * 1000000u + tv.tv_usec;
+}
+
+static void
+removeTree( const char * path )
+{
+    struct stat sb;
+
+    if( !stat( path, &sb ) && S_ISDIR( sb.st_mode ) )
+    {
+        DIR * odir = opendir( path );
+        struct dirent * d;
+        while( odir && ( d = readdir( odir ) ) )
+            if( strcmp( d->d_name, "." ) && strcmp( d->d_name, ".." ) ) {
+                char * child = tr_buildPath( path, d->d_name, NULL );
+                removeTree( child );
+                tr_free( child );
+            }
+        if( odir )
+            closedir( odir );
+        rmdir( path );
+    }
+    else
+    {
+        unlink( path );
+    }
+}
+
+/* listen on whatever port the system picks. Binding to port 0 rather than
+ * probing for a free one and binding to it later can't lose a race with
+ * the ephemeral ports that thousands of outgoing connections churn through */
+static int
+listenOnFreePort( tr_port * setme_port )
+{
+    struct sockaddr_in sin;
+    socklen_t len = sizeof( sin );
+    const int fd = socket( AF_INET, SOCK_STREAM, 0 );
+
+    memset( &sin, 0, sizeof( sin ) );
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl( INADDR_ANY );
+    if( ( fd < 0 )
+        || bind( fd, (struct sockaddr*)&sin, sizeof( sin ) )
+        || getsockname( fd, (struct sockaddr*)&sin, &len )
+        || listen( fd, 128 )
+        || evutil_make_socket_nonblocking( fd ) ) {
+        if( fd >= 0 )
+            close( fd );
+        return -1;
+    }
+
+    *setme_port = sin.sin_port;
+    return fd;
+}
+
+/* Transmission won't connect to 127.0.0.1, so talk to ourselves
+ * through one of this machine's other addresses */
+static tr_bool
+findLocalAddress( tr_address * setme )
+{
+    tr_bool found = FALSE;
+    struct ifaddrs * ifs;
+    struct ifaddrs * walk;
+
+    if( getifaddrs( &ifs ) )
+        return FALSE;
+
+    for( walk=ifs; walk && !found; walk=walk->ifa_next ) {
+        tr_port unused;
+        if( ( walk->ifa_addr != NULL )
+            && ( walk->ifa_addr->sa_family == AF_INET )
+            && tr_netAddressFromSockaddr( setme, &unused, walk->ifa_addr, sizeof( struct sockaddr_in ) )
+            && tr_isValidPeerAddress( setme, htons( 1 ) ) )
+            found = TRUE;
+    }
+
+    freeifaddrs( ifs );
+    return found;
+}
+
+static tr_session*
+sessionNew( const char * dir, tr_encryption_mode encryption, uint8_t * setme_hash )
+{
+    tr_benc settings;
+    tr_session * session;
+    tr_torrent * tor;
+    tr_ctor * ctor;
+
+    tr_bencInitDict( &settings, 0 );
+    tr_sessionGetDefaultSettings( dir, &settings );
+    tr_bencDictAddStr( &settings, TR_PREFS_KEY_DOWNLOAD_DIR, dir );
+    tr_bencDictAddBool( &settings, TR_PREFS_KEY_DHT_ENABLED, FALSE );
+    tr_bencDictAddBool( &settings, TR_PREFS_KEY_LPD_ENABLED, FALSE );
+    tr_bencDictAddBool( &settings, TR_PREFS_KEY_PEX_ENABLED, FALSE );
+    tr_bencDictAddBool( &settings, TR_PREFS_KEY_UTP_ENABLED, FALSE );
+    tr_bencDictAddBool( &settings, TR_PREFS_KEY_PORT_FORWARDING, FALSE );
+    tr_bencDictAddBool( &settings, TR_PREFS_KEY_RPC_ENABLED, FALSE );
+    tr_bencDictAddBool( &settings, TR_PREFS_KEY_PEER_PORT_RANDOM_ON_START, FALSE );
+    tr_bencDictAddInt ( &settings, TR_PREFS_KEY_PEER_PORT, 0 ); /* let the system pick */
+    tr_bencDictAddInt ( &settings, TR_PREFS_KEY_ENCRYPTION, encryption );
+    tr_bencDictAddInt ( &settings, TR_PREFS_KEY_MSGLEVEL, TR_MSG_ERR );
+    session = tr_sessionInit( "handshake-test", dir, FALSE, &settings );
+    tr_bencFree( &settings );
+
+    ctor = tr_ctorNew( session );
+    tr_ctorSetMetainfo( ctor, (const uint8_t*)metainfo, strlen( metainfo ) );
+    tr_ctorSetPaused( ctor, TR_FORCE, TRUE );
+    tor = tr_torrentNew( ctor, NULL );
+    memcpy( setme_hash, tr_torrentInfo( tor )->hash, SHA_DIGEST_LENGTH );
+    tr_ctorFree( ctor );
+
+    return session;
+}
+
+/***
+****  The child: accept handshakes until the parent hangs up,
+****  and report how much CPU they took whenever it asks.
+****
+****  It listens for itself rather than going through the peer manager,
+****  which would only take one connection at a time from the parent's
+****  address and would hang onto each one as a peer.
+***/
+
+static ReadState
+childCanRead( tr_peerIo * io, void * unused UNUSED, size_t * piece )
+{
+    struct evbuffer * inbuf = tr_peerIoGetReadBuffer( io );
+
+    *piece = 0;
+    evbuffer_drain( inbuf, evbuffer_get_length( inbuf ) );
+    return READ_LATER;
+}
+
+static void
+childUnref( int fd UNUSED, short what UNUSED, void * vio )
+{
+    tr_peerIoUnref( vio );
+}
+
+static void
+childGotError( tr_peerIo * io, short what UNUSED, void * unused UNUSED )
+{
+    const struct timeval now = { 0, 0 };
+
+    /* the parent hung up. Let go of the io once peer-io is done with it */
+    tr_peerIoSetIOFuncs( io, NULL, NULL, NULL, NULL );
+    event_base_once( tr_peerIoGetSession( io )->event_base, -1, EV_TIMEOUT,
+                     childUnref, io, &now );
+}
+
+static tr_bool
+childHandshakeDone( tr_handshake  * handshake,
+                    tr_peerIo     * io,
+                    tr_bool         readAnythingFromPeer UNUSED,
+                    tr_bool         isConnected,
+                    const uint8_t * peerId UNUSED,
+                    void          * unused UNUSED )
+{
+    /* keep the connection until the parent's read our side of the handshake */
+    if( isConnected ) {
+        tr_handshakeStealIO( handshake );
+        tr_peerIoSetIOFuncs( io, childCanRead, NULL, childGotError, NULL );
+    }
+
+    return isConnected;
+}
+
+static void
+childAccept( int fd, short what UNUSED, void * vsession )
+{
+    tr_port port;
+    tr_address addr;
+    tr_session * session = vsession;
+    const int s = tr_netAccept( session, fd, &addr, &port );
+
+    if( s >= 0 ) {
+        tr_peerIo * io = tr_peerIoNewIncoming( session, session->bandwidth, &addr, port, s, NULL );
+        tr_handshakeNew( io, TR_ENCRYPTION_PREFERRED, childHandshakeDone, NULL );
+        tr_peerIoUnref( io ); /* balanced by the ref in tr_peerIoNewIncoming() */
+    }
+}
+
+struct child_listener
+{
+    tr_session * session;
+    int fd;
+    struct event * event;
+};
+
+static void
+childListen( void * vlistener )
+{
+    struct child_listener * l = vlistener;
+
+    l->event = event_new( l->session->event_base, l->fd, EV_READ | EV_PERSIST,
+                          childAccept, l->session );
+    event_add( l->event, NULL );
+}
+
+static void
+childUnlisten( void * vlistener )
+{
+    struct child_listener * l = vlistener;
+
+    event_free( l->event );
+    l->event = NULL;
+}
+
+static void
+runChild( const char * dir, int listenFd, int cmdFd, int replyFd )
+{
+    char cmd;
+    uint64_t cpu;
+    uint8_t hash[SHA_DIGEST_LENGTH];
+    struct child_listener l;
+
+    l.session = sessionNew( dir, TR_ENCRYPTION_PREFERRED, hash );
+    l.fd = listenFd;
+    l.event = NULL;
+    tr_runInEventThread( l.session, childListen, &l );
+
+    cpu = cpuUsec( );
+    while( read( cmdFd, &cmd, 1 ) == 1 ) {
+        const uint64_t now = cpuUsec( );
+        const uint64_t used = now - cpu;
+        cpu = now;
+        if( write( replyFd, &used, sizeof( used ) ) != sizeof( used ) )
+            break;
+    }
+
+    tr_runInEventThread( l.session, childUnlisten, &l );
+    while( l.event != NULL )
+        tr_wait_msec( 10 );
+    tr_netCloseSocket( l.fd );
+    tr_sessionClose( l.session );
+    _exit( 0 );
+}
+
+/***
+****  The parent: handshake with the child over and over
+***/
+
+struct bench
+{
+    tr_session * session;
+    tr_address addr;
+    tr_port port; /* network byte order */
+    uint8_t hash[SHA_DIGEST_LENGTH];
+    tr_encryption_mode mode;
+    int remaining;
+    int succeeded;
+    int failed;
+    tr_bool isDone;
+};
+
+static void startHandshake( int fd UNUSED, short what UNUSED, void * vbench );
+
+static tr_bool
+onHandshakeDone( tr_handshake  * handshake UNUSED,
+                 tr_peerIo     * io UNUSED,
+                 tr_bool         readAnythingFromPeer UNUSED,
+                 tr_bool         isConnected,
+                 const uint8_t * peerId UNUSED,
+                 void          * vbench )
+{
+    struct bench * b = vbench;
+    const struct timeval now = { 0, 0 };
+
+    if( isConnected )
+        ++b->succeeded;
+    else
+        ++b->failed;
+
+    /* start the next one once this one's been cleaned up */
+    if( --b->remaining > 0 )
+        event_base_once( b->session->event_base, -1, EV_TIMEOUT,
+                         startHandshake, b, &now );
+    else
+        b->isDone = TRUE;
+
+    return isConnected;
+}
+
+static void
+startHandshake( int fd UNUSED, short what UNUSED, void * vbench )
+{
+    struct bench * b = vbench;
+    tr_peerIo * io = tr_peerIoNewOutgoing( b->session, b->session->bandwidth,
+                                           &b->addr, b->port, b->hash,
+                                           FALSE, FALSE );
+
+    if( io == NULL ) {
+        ++b->failed;
+        b->isDone = TRUE;
+        return;
+    }
+
+    tr_handshakeNew( io, b->mode, onHandshakeDone, b );
+    tr_peerIoUnref( io ); /* balanced by the ref in tr_peerIoNewOutgoing() */
+}
+
+static void
+startRound( void * vbench )
+{
+    startHandshake( -1, 0, vbench );
+}
+
+static int
+benchmark( struct bench * b, tr_encryption_mode mode, const char * name,
+           int count, int cmdFd, int replyFd )
+{
+    char cmd = 'm';
+    uint64_t childCpu;
+    uint64_t wall, cpu;
+    const time_t deadline = time( NULL ) + ROUND_TIMEOUT_SECS;
+
+    /* reset the child's CPU counter */
+    check( write( cmdFd, &cmd, 1 ) == 1 );
+    check( read( replyFd, &childCpu, sizeof( childCpu ) ) == sizeof( childCpu ) );
+
+    b->mode = mode;
+    b->remaining = count;
+    b->succeeded = 0;
+    b->failed = 0;
+    b->isDone = FALSE;
+
+    wall = wallUsec( );
+    cpu = cpuUsec( );
+    tr_runInEventThread( b->session, startRound, b );
+    while( !b->isDone && ( time( NULL ) < deadline ) )
+        tr_wait_msec( 10 );
+    wall = wallUsec( ) - wall;
+    cpu = cpuUsec( ) - cpu;
+
+    check( write( cmdFd, &cmd, 1 ) == 1 );
+    check( read( replyFd, &childCpu, sizeof( childCpu ) ) == sizeof( childCpu ) );
+
+    printf( "%-14s %6d handshakes, %5d failed: %7.0f handshakes/sec, "
+            "CPU per handshake %4.0f usec outgoing, %4.0f usec incoming\n",
+            name, count, b->failed,
+            count * 1000000.0 / MAX( wall, 1 ),
+            (double)cpu / count, (double)childCpu / count );
+
+    check( b->isDone );
+    check( b->succeeded == count );
+    return 0;
+}
+
+int
+main( int argc, char ** argv )
+{
+    int i;
+    pid_t pid;
+    int cmdPipe[2];
+    int replyPipe[2];
+    struct bench b;
+    char parentDir[] = "/tmp/handshake-test-XXXXXX";
+    char childDir[] = "/tmp/handshake-test-XXXXXX";
+    const int count = argc > 1 ? atoi( argv[1] ) : DEFAULT_HANDSHAKES;
+    int listenFd;
+    uint64_t childCpu;
+    const char ready = 'm';
+
+    memset( &b, 0, sizeof( b ) );
+    if( !findLocalAddress( &b.addr ) ) {
+        fprintf( stderr, "no usable network address; skipping\n" );
+        return 77;
+    }
+    listenFd = listenOnFreePort( &b.port );
+    if( !mkdtemp( parentDir ) || !mkdtemp( childDir ) || ( listenFd < 0 ) || ( count < 1 ) )
+        return 1;
+    if( pipe( cmdPipe ) || pipe( replyPipe ) )
+        return 1;
+
+    /* fork before there's a session, so that the child doesn't inherit
+     * our peer_id or any of the session's threads */
+    if( !( pid = fork( ) ) ) {
+        close( cmdPipe[1] );
+        close( replyPipe[0] );
+        runChild( childDir, listenFd, cmdPipe[0], replyPipe[1] );
+    }
+    tr_netCloseSocket( listenFd );
+    close( cmdPipe[0] );
+    close( replyPipe[1] );
+
+    b.session = sessionNew( parentDir, TR_ENCRYPTION_PREFERRED, b.hash );
+
+    /* wait for the child's session to be up */
+    i = ( write( cmdPipe[1], &ready, 1 ) == 1 )
+     && ( read( replyPipe[0], &childCpu, sizeof( childCpu ) ) == sizeof( childCpu ) ) ? 0 : 1;
+
+    if( !i )
+        i = benchmark( &b, TR_CLEAR_PREFERRED, "plaintext", count, cmdPipe[1], replyPipe[0] );
+    if( !i )
+        i = benchmark( &b, TR_ENCRYPTION_PREFERRED, "RC4-preferred", count, cmdPipe[1], replyPipe[0] );
+    if( !i )
+        i = benchmark( &b, TR_ENCRYPTION_REQUIRED, "RC4-required", count, cmdPipe[1], replyPipe[0] );
+
+    close( cmdPipe[1] );
+    close( replyPipe[0] );
+    waitpid( pid, NULL, 0 );
+
+    /* if a round timed out, a handshake may still be in flight,
+     * and closing the session out from under it would crash */
+    if( b.isDone )
+        tr_sessionClose( b.session );
+    removeTree( parentDir );
+    removeTree( childDir );
+    return i;
+}
@@ -598,6 +598,85 @@ readPadD( tr_handshake *    handshake,
 ****
 ***/
 
+/* Most plaintext handshakes arrive in one piece, so when the whole
+ * thing's here, parse it in place instead of walking it through
+ * readHandshake() and readPeerId() a field at a time.
+ * Returns FALSE to fall back to the general path */
+static tr_bool
+readPlaintextHandshake( tr_handshake *    handshake,
+                        struct evbuffer * inbuf,
+                        ReadState *       setme_ret )
+{
+    tr_torrent * tor;
+    const uint8_t * msg;
+    const uint8_t * reserved;
+    const uint8_t * hash;
+    const uint8_t * peer_id;
+    const uint8_t * tor_peer_id;
+    tr_bool peerIsGood;
+
+    if( tr_peerIoIsEncrypted( handshake->io )
+        || ( handshake->encryptionMode == TR_ENCRYPTION_REQUIRED )
+        || ( evbuffer_get_length( inbuf ) < HANDSHAKE_SIZE ) )
+        return FALSE;
+
+    /* this only copies if the handshake straddles two chunks */
+    msg = evbuffer_pullup( inbuf, HANDSHAKE_SIZE );
+    if( memcmp( msg, HANDSHAKE_NAME, HANDSHAKE_NAME_LEN ) )
+        return FALSE;
+
+    reserved = msg + HANDSHAKE_NAME_LEN;
+    hash = reserved + HANDSHAKE_FLAGS_LEN;
+    peer_id = hash + SHA_DIGEST_LENGTH;
+
+    handshake->haveReadAnythingFromPeer = TRUE;
+
+    if( tr_peerIoIsIncoming( handshake->io ) )
+    {
+        if( !tr_torrentExists( handshake->session, hash ) )
+        {
+            dbgmsg( handshake, "peer is trying to connect to us for a torrent we don't have." );
+            *setme_ret = tr_handshakeDone( handshake, FALSE );
+            return TRUE;
+        }
+
+        assert( !tr_peerIoHasTorrentHash( handshake->io ) );
+        tr_peerIoSetTorrentHash( handshake->io, hash );
+    }
+    else if( memcmp( hash, tr_peerIoGetTorrentHash( handshake->io ), SHA_DIGEST_LENGTH ) )
+    {
+        dbgmsg( handshake, "peer returned the wrong hash. wtf?" );
+        *setme_ret = tr_handshakeDone( handshake, FALSE );
+        return TRUE;
+    }
+
+    tr_peerIoEnableLTEP( handshake->io, HANDSHAKE_HAS_LTEP( reserved ) );
+    tr_peerIoEnableFEXT( handshake->io, HANDSHAKE_HAS_FASTEXT( reserved ) );
+    tr_peerIoEnableDHT( handshake->io, HANDSHAKE_HAS_DHT( reserved ) );
+
+    tr_peerIoSetPeersId( handshake->io, peer_id );
+    handshake->havePeerID = TRUE;
+    dbgmsg( handshake, "peer-id is [%*.*s]", PEER_ID_LEN, PEER_ID_LEN, peer_id );
+
+    /* if we've somehow connected to ourselves, don't keep the connection */
+    tor = tr_torrentFindFromHash( handshake->session, hash );
+    tor_peer_id = tor && tor->peer_id ? tor->peer_id : tr_getPeerId( );
+    peerIsGood = memcmp( peer_id, tor_peer_id, PEER_ID_LEN ) != 0;
+
+    evbuffer_drain( inbuf, HANDSHAKE_SIZE );
+
+    if( peerIsGood && !handshake->haveSentBitTorrentHandshake )
+    {
+        uint8_t reply[HANDSHAKE_SIZE];
+        buildHandshakeMessage( handshake, reply );
+        tr_peerIoWriteBytes( handshake->io, reply, sizeof( reply ), FALSE );
+        handshake->haveSentBitTorrentHandshake = 1;
+    }
+
+    *setme_ret = tr_handshakeDone( handshake, peerIsGood );
+    return TRUE;
+}
+
 static int
 readHandshake( tr_handshake *    handshake,
                struct evbuffer * inbuf )
@@ -618,7 +697,9 @@ readHandshake( tr_handshake *    handshake,
     pstrlen = evbuffer_pullup( inbuf, 1 )[0]; /* peek, don't read. We may be
                                                  handing inbuf to AWAITING_YA */
 
-    if( pstrlen == 19 ) /* unencrypted */
+    /* match the whole name, as readYb() does: one MSE public key
+     * in 256 starts with a 19, and isn't a plaintext handshake */
+    if( !memcmp( evbuffer_pullup( inbuf, HANDSHAKE_NAME_LEN ), HANDSHAKE_NAME, HANDSHAKE_NAME_LEN ) )
     {
         tr_peerIoSetEncryption( handshake->io, PEER_ENCRYPTION_NONE );
 
@@ -1022,7 +1103,9 @@ canRead( struct tr_peerIo * io, void * arg, size_t * piece )
         switch( handshake->state )
         {
             case AWAITING_HANDSHAKE:
-                ret = readHandshake    ( handshake, inbuf ); break;
+                if( !readPlaintextHandshake( handshake, inbuf, &ret ) )
+                    ret = readHandshake( handshake, inbuf );
+                break;
 
             case AWAITING_PEER_ID:
                 ret = readPeerId       ( handshake, inbuf ); break;
@@ -1071,6 +1154,13 @@ canRead( struct tr_peerIo * io, void * arg, size_t * piece )
             readyForMore = evbuffer_get_length( inbuf ) >= handshake->ia_len;
     }
 
+    /* the write event turns itself off when there's nothing to send,
+     * so turn it back on for whatever we just queued instead of leaving
+     * it for the next bandwidth pulse. io's still ours: canReadWrapper()
+     * holds a ref for the duration of this call */
+    if( ret != READ_ERR )
+        tr_peerIoSetEnabled( io, TR_UP, tr_peerIoHasBandwidthLeft( io, TR_UP ) );
+
     return ret;
 }
 
@@ -1124,12 +1214,29 @@ tr_handshakeAbort( tr_handshake * handshake )
 }
 
 static void
-gotError( tr_peerIo  * io UNUSED,
+gotError( tr_peerIo  * io,
           short        what,
           void       * vhandshake )
 {
     tr_handshake * handshake = vhandshake;
 
+    /* if we couldn't reach the peer over uTP, maybe it doesn't speak uTP...
+     * remember that for next time, and try this one again over TCP.
+     * Nothing's gone out yet, so the handshake can pick up where it was */
+    if( tr_peerIoIsUTP( io ) && !tr_peerIoIsIncoming( io ) && !io->hasFinishedConnecting )
+    {
+        tr_torrent * tor = tr_torrentFindFromHash( handshake->session, tr_peerIoGetTorrentHash( io ) );
+
+        if( tor != NULL )
+            tr_peerMgrSetUtpFailed( tor, tr_peerIoGetAddress( io, NULL ), TRUE );
+
+        if( !tr_peerIoReconnect( io ) )
+        {
+            dbgmsg( handshake, "uTP connection failed, trying TCP..." );
+            return;
+        }
+    }
+
     /* if the error happened while we were sending a public key, we might
      * have encountered a peer that doesn't do encryption... reconnect and
      * try a plaintext handshake */
@@ -1187,6 +1294,11 @@ tr_handshakeNew( tr_peerIo           * io,
     tr_peerIoSetIOFuncs( handshake->io, canRead, NULL, gotError, handshake );
     tr_peerIoSetEncryption( io, PEER_ENCRYPTION_NONE );
 
+    /* a new io is quiet until the next bandwidth pulse turns it on,
+     * which would add up to half a second to each leg of the handshake */
+    tr_peerIoSetEnabled( io, TR_UP, tr_peerIoHasBandwidthLeft( io, TR_UP ) );
+    tr_peerIoSetEnabled( io, TR_DOWN, tr_peerIoHasBandwidthLeft( io, TR_DOWN ) );
+
     if( tr_peerIoIsIncoming( handshake->io ) )
         setReadState( handshake, AWAITING_HANDSHAKE );
     else if( encryptionMode != TR_CLEAR_PREFERRED )
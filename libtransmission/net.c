@@ -247,10 +247,85 @@ tr_netSetCongestionControl( int s UNUSED, const char *algorithm UNUSED )
 #endif
 }
 
-static socklen_t
-setup_sockaddr( const tr_address        * addr,
-                tr_port                   port,
-                struct sockaddr_storage * sockaddr)
+int
+tr_netSetNoDelay( int s UNUSED, tr_bool noDelay UNUSED )
+{
+#ifdef TCP_NODELAY
+    const int val = noDelay ? 1 : 0;
+    return setsockopt( s, IPPROTO_TCP, TCP_NODELAY, (char*)&val, sizeof( val ) );
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int
+tr_netSetCork( int s UNUSED, tr_bool corked UNUSED )
+{
+#if defined( TCP_CORK )
+    const int val = corked ? 1 : 0;
+    return setsockopt( s, IPPROTO_TCP, TCP_CORK, (char*)&val, sizeof( val ) );
+#elif defined( TCP_NOPUSH )
+    const int val = corked ? 1 : 0;
+    return setsockopt( s, IPPROTO_TCP, TCP_NOPUSH, (char*)&val, sizeof( val ) );
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int
+tr_netGetMSS( int s UNUSED )
+{
+#ifdef TCP_MAXSEG
+    int mss = 0;
+    socklen_t len = sizeof( mss );
+    if( !getsockopt( s, IPPROTO_TCP, TCP_MAXSEG, (char*)&mss, &len ) && ( mss > 0 ) )
+        return mss;
+#endif
+    return 0;
+}
+
+int
+tr_netSetNotSentLowat( int s UNUSED, int bytes UNUSED )
+{
+#ifdef TCP_NOTSENT_LOWAT
+    return setsockopt( s, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (char*)&bytes, sizeof( bytes ) );
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int
+tr_netGetTCPInfo( int s UNUSED, tr_tcp_info * setme )
+{
+#if defined( __linux__ ) && defined( TCP_INFO )
+    struct tcp_info info;
+    socklen_t len = sizeof( info );
+
+    memset( setme, 0, sizeof( tr_tcp_info ) );
+
+    if( getsockopt( s, IPPROTO_TCP, TCP_INFO, (char*)&info, &len ) )
+        return -1;
+
+    setme->rtt_usec = info.tcpi_rtt;
+    setme->rttvar_usec = info.tcpi_rttvar;
+    setme->cwnd = info.tcpi_snd_cwnd;
+    setme->mss = info.tcpi_snd_mss;
+
+    return 0;
+#else
+    memset( setme, 0, sizeof( tr_tcp_info ) );
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+socklen_t
+tr_netSetupSockaddr( const tr_address        * addr,
+                     tr_port                   port,
+                     struct sockaddr_storage * sockaddr)
 {
     assert( tr_isAddress( addr ) );
 
@@ -277,6 +352,35 @@ setup_sockaddr( const tr_address        * addr,
     }
 }
 
+tr_bool
+tr_netAddressFromSockaddr( tr_address            * setme_addr,
+                           tr_port               * setme_port,
+                           const struct sockaddr * from,
+                           socklen_t               fromlen )
+{
+    if( ( from->sa_family == AF_INET ) && ( fromlen >= sizeof( struct sockaddr_in ) ) )
+    {
+        struct sockaddr_in sin;
+        memcpy( &sin, from, sizeof( sin ) );
+        setme_addr->type = TR_AF_INET;
+        setme_addr->addr.addr4 = sin.sin_addr;
+        *setme_port = sin.sin_port;
+        return TRUE;
+    }
+
+    if( ( from->sa_family == AF_INET6 ) && ( fromlen >= sizeof( struct sockaddr_in6 ) ) )
+    {
+        struct sockaddr_in6 sin6;
+        memcpy( &sin6, from, sizeof( sin6 ) );
+        setme_addr->type = TR_AF_INET6;
+        setme_addr->addr.addr6 = sin6.sin6_addr;
+        *setme_port = sin6.sin6_port;
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
 int
 tr_netOpenPeerSocket( tr_session        * session,
                       const tr_address  * addr,
@@ -312,12 +416,12 @@ tr_netOpenPeerSocket( tr_session        * session,
         return -1;
     }
 
-    addrlen = setup_sockaddr( addr, port, &sock );
+    addrlen = tr_netSetupSockaddr( addr, port, &sock );
 
     /* set source address */
     source_addr = tr_sessionGetPublicAddress( session, addr->type, NULL );
     assert( source_addr );
-    sourcelen = setup_sockaddr( source_addr, 0, &source_sock );
+    sourcelen = tr_netSetupSockaddr( source_addr, 0, &source_sock );
     if( bind( s, ( struct sockaddr * ) &source_sock, sourcelen ) )
     {
         tr_err( _( "Couldn't set source address %s on %d: %s" ),
@@ -350,7 +454,8 @@ tr_netOpenPeerSocket( tr_session        * session,
 }
 
 static int
-tr_netBindTCPImpl( const tr_address * addr, tr_port port, tr_bool suppressMsgs, int * errOut )
+tr_netBindTCPImpl( const tr_address * addr, tr_port port, tr_bool suppressMsgs,
+                   tr_bool reusePort, int * errOut )
 {
     static const int domains[NUM_TR_AF_INET_TYPES] = { AF_INET, AF_INET6 };
     struct sockaddr_storage sock;
@@ -376,6 +481,17 @@ tr_netBindTCPImpl( const tr_address * addr, tr_port port, tr_bool suppressMsgs,
     setsockopt( fd, SOL_SOCKET, SO_KEEPALIVE, &optval, sizeof(optval) );
     setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval) );
 
+    if( reusePort ) {
+#ifdef SO_REUSEPORT
+        if( setsockopt( fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof( optval ) ) == -1 )
+#endif
+        {
+            *errOut = ENOPROTOOPT;
+            tr_netCloseSocket( fd );
+            return -1;
+        }
+    }
+
 #ifdef IPV6_V6ONLY
     if( addr->type == TR_AF_INET6 )
         if( setsockopt( fd, IPPROTO_IPV6, IPV6_V6ONLY, &optval, sizeof( optval ) ) == -1 )
@@ -385,7 +501,7 @@ tr_netBindTCPImpl( const tr_address * addr, tr_port port, tr_bool suppressMsgs,
             }
 #endif
 
-    addrlen = setup_sockaddr( addr, htons( port ), &sock );
+    addrlen = tr_netSetupSockaddr( addr, htons( port ), &sock );
     if( bind( fd, (struct sockaddr *) &sock, addrlen ) ) {
         const int err = sockerrno;
         if( !suppressMsgs )
@@ -426,7 +542,14 @@ int
 tr_netBindTCP( const tr_address * addr, tr_port port, tr_bool suppressMsgs )
 {
     int unused;
-    return tr_netBindTCPImpl( addr, port, suppressMsgs, &unused );
+    return tr_netBindTCPImpl( addr, port, suppressMsgs, FALSE, &unused );
+}
+
+int
+tr_netBindTCPReusePort( const tr_address * addr, tr_port port, tr_bool suppressMsgs )
+{
+    int unused;
+    return tr_netBindTCPImpl( addr, port, suppressMsgs, TRUE, &unused );
 }
 
 tr_bool
@@ -438,7 +561,7 @@ tr_net_hasIPv6( tr_port port )
     if( !alreadyDone )
     {
         int err;
-        int fd = tr_netBindTCPImpl( &tr_in6addr_any, port, TRUE, &err );
+        int fd = tr_netBindTCPImpl( &tr_in6addr_any, port, TRUE, FALSE, &err );
         if( fd >= 0 || err != EAFNOSUPPORT ) /* we support ipv6 */
             result = TRUE;
         if( fd >= 0 )
@@ -457,10 +580,12 @@ tr_netAccept( tr_session  * session,
 {
     int fd = tr_fdSocketAccept( session, b, addr, port );
 
+#ifndef HAVE_ACCEPT4 /* accept4() already made it nonblocking */
     if( fd>=0 && evutil_make_socket_nonblocking(fd)<0 ) {
         tr_netClose( session, fd );
         fd = -1;
     }
+#endif
 
     return fd;
 }
@@ -477,6 +602,42 @@ tr_netClose( tr_session * session, int s )
     tr_fdSocketClose( session, s );
 }
 
+int64_t
+tr_netGetListenOverflows( void )
+{
+    int64_t ret = -1;
+#ifdef __linux__
+    /* /proc/net/netstat has pairs of lines: "TcpExt: name name ..."
+     * followed by "TcpExt: value value ..." */
+    char names[4096];
+    char values[4096];
+    FILE * fp = fopen( "/proc/net/netstat", "r" );
+
+    while( fp && ( ret < 0 ) && fgets( names, sizeof( names ), fp )
+                             && fgets( values, sizeof( values ), fp ) )
+    {
+        char * nwalk = names;
+        char * vwalk = values;
+        const char * name = tr_strsep( &nwalk, " \n" );
+        const char * value = tr_strsep( &vwalk, " \n" );
+
+        if( tr_strcmp0( name, "TcpExt:" ) || tr_strcmp0( value, "TcpExt:" ) )
+            continue;
+
+        while( ( name = tr_strsep( &nwalk, " \n" ) )
+            && ( value = tr_strsep( &vwalk, " \n" ) ) )
+            if( !strcmp( name, "ListenOverflows" ) ) {
+                ret = strtoll( value, NULL, 10 );
+                break;
+            }
+    }
+
+    if( fp != NULL )
+        fclose( fp );
+#endif
+    return ret;
+}
+
 /*
    get_source_address() and global_unicast_address() were written by
    Juliusz Chroboczek, and are covered under the same license as dht.c.
@@ -106,6 +106,13 @@ int  tr_netBindTCP( const tr_address * addr,
                     tr_port            port,
                     tr_bool            suppressMsgs );
 
+/** @brief like tr_netBindTCP(), but with SO_REUSEPORT set so that several
+ *         sockets can listen on the same port, each with its own backlog.
+ *         Fails if the platform doesn't have SO_REUSEPORT */
+int  tr_netBindTCPReusePort( const tr_address * addr,
+                             tr_port            port,
+                             tr_bool            suppressMsgs );
+
 int  tr_netAccept( tr_session * session,
                    int          bound,
                    tr_address * setme_addr,
@@ -116,10 +123,55 @@ int  tr_netSetTOS( int s,
 
 int tr_netSetCongestionControl( int s, const char *algorithm );
 
+/** @brief turn Nagle's algorithm off (or back on) for a TCP socket */
+int tr_netSetNoDelay( int s, tr_bool noDelay );
+
+/** @brief hold back partial segments on a TCP socket until it's uncorked.
+    Uses TCP_CORK where available, or TCP_NOPUSH on BSDs. */
+int tr_netSetCork( int s, tr_bool corked );
+
+/** @return the socket's maximum segment size, or 0 if it's not known */
+int tr_netGetMSS( int s );
+
+/** @brief only report the socket as writable when fewer than this many
+    bytes are waiting in the kernel to be sent */
+int tr_netSetNotSentLowat( int s, int bytes );
+
+/** @brief what the kernel knows about a TCP connection's send side */
+typedef struct tr_tcp_info
+{
+    uint32_t rtt_usec;    /* smoothed round-trip time */
+    uint32_t rttvar_usec; /* round-trip time variance */
+    uint32_t cwnd;        /* congestion window, in segments */
+    uint32_t mss;         /* send MSS, in bytes */
+}
+tr_tcp_info;
+
+/** @brief get the kernel's view of a TCP connection. Only Linux is
+    supported for now; elsewhere this fails with ENOSYS */
+int tr_netGetTCPInfo( int s, tr_tcp_info * setme );
+
+/** @brief fill in a sockaddr for an address and a port in network byte order
+    @return the sockaddr's length */
+socklen_t tr_netSetupSockaddr( const tr_address        * addr,
+                               tr_port                   port,
+                               struct sockaddr_storage * setme );
+
+/** @brief the reverse of tr_netSetupSockaddr()
+    @return false if it's not an IPv4 or IPv6 address */
+tr_bool tr_netAddressFromSockaddr( tr_address            * setme_addr,
+                                   tr_port               * setme_port,
+                                   const struct sockaddr * from,
+                                   socklen_t               fromlen );
+
 void tr_netClose( tr_session * session, int s );
 
 void tr_netCloseSocket( int fd );
 
+/** @return how many connections the kernel has dropped, system-wide,
+ *          because a listen queue was full, or -1 if it doesn't say */
+int64_t tr_netGetListenOverflows( void );
+
 void tr_netInit( void );
 
 /**
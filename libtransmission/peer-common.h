@@ -35,6 +35,22 @@ enum
         meet our bandwidth goals for the next N seconds */
     REQUEST_BUF_SECS = 10,
 
+    /** with kernel sizing, we only need enough requests to cover
+        the connection's round-trip time plus this much slack */
+    REQUEST_KERNEL_SLACK_MSEC = 2000,
+
+    /** how many round trips' worth of requests to keep outstanding
+        once we know how long a peer takes to answer them */
+    REQUEST_BDP_GAIN = 2,
+
+    /** new requests only go out on peer-mgr's bandwidth pulse, so a
+        round trip lasts at least this much longer than the peer takes */
+    REQUEST_REFILL_MSEC = 500,
+
+    /** after this many round trips without the download rate growing,
+        a peer's request pipeline is considered full */
+    REQUEST_FULL_PIPE_ROUNDS = 3,
+
     /** this is the maximum size of a block request.
         most bittorrent clients will reject requests
         larger than this size. */
@@ -64,22 +80,27 @@ typedef enum
     TR_PEER_CLIENT_GOT_SUGGEST,
     TR_PEER_CLIENT_GOT_PORT,
     TR_PEER_CLIENT_GOT_REJ,
+    TR_PEER_CLIENT_GOT_HAVE,
+    TR_PEER_CLIENT_GOT_BITFIELD,
     TR_PEER_PEER_GOT_DATA,
     TR_PEER_PEER_PROGRESS,
     TR_PEER_ERROR
 }
 PeerEventType;
 
+struct tr_bitset;
+
 typedef struct
 {
     PeerEventType    eventType;
-    uint32_t         pieceIndex;   /* for GOT_BLOCK, CANCEL, ALLOWED, SUGGEST */
+    uint32_t         pieceIndex;   /* for GOT_BLOCK, GOT_HAVE, CANCEL, ALLOWED, SUGGEST */
     uint32_t         offset;       /* for GOT_BLOCK */
     uint32_t         length;       /* for GOT_BLOCK + GOT_DATA */
     float            progress;     /* for PEER_PROGRESS */
     int              err;          /* errno for GOT_ERROR */
     tr_bool          wasPieceData; /* for GOT_DATA */
     tr_port          port;         /* for GOT_PORT */
+    const struct tr_bitset * bitset; /* for GOT_BITFIELD: the peer's new set of pieces */
 }
 tr_peer_event;
 
@@ -0,0 +1,372 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h> /* memcmp, strcmp */
+
+#include "transmission.h"
+#include "crypto.h"
+#include "peer-io.h"
+#include "utils.h"
+
+#undef VERBOSE
+
+static int test = 0;
+
+#ifdef VERBOSE
+  #define check( A ) \
+    { \
+        ++test; \
+        if( A ){ \
+            fprintf( stderr, "PASS test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+        } else { \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#else
+  #define check( A ) \
+    { \
+        ++test; \
+        if( !( A ) ){ \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#endif
+
+enum
+{
+    BLOCK_SIZE = 16 * 1024,
+
+    /* a BT_PIECE message's header: length, id, index, and offset */
+    PIECE_HEADER_SIZE = 4 + 1 + 4 + 4
+};
+
+static tr_crypto * encrypter;
+static tr_crypto * decrypter;
+
+/* set up both ends of an encrypted connection */
+static void
+makeCryptoPair( void )
+{
+    int len;
+    uint8_t hash[SHA_DIGEST_LENGTH];
+    const uint8_t * key;
+
+    memset( hash, 0x5a, sizeof( hash ) );
+    encrypter = tr_cryptoNew( hash, FALSE );
+    decrypter = tr_cryptoNew( hash, TRUE );
+
+    key = tr_cryptoGetMyPublicKey( decrypter, &len );
+    tr_cryptoComputeSecret( encrypter, key );
+    key = tr_cryptoGetMyPublicKey( encrypter, &len );
+    tr_cryptoComputeSecret( decrypter, key );
+
+    tr_cryptoEncryptInit( encrypter );
+    tr_cryptoDecryptInit( decrypter );
+}
+
+static void
+freeCryptoPair( void )
+{
+    tr_cryptoFree( encrypter );
+    tr_cryptoFree( decrypter );
+}
+
+static void
+fillPattern( uint8_t * buf, size_t len, int seed )
+{
+    size_t i;
+
+    for( i=0; i<len; ++i )
+        buf[i] = (uint8_t)( i * 31 + seed );
+}
+
+/* build a buffer out of many small chunks, so that walking it
+ * takes more than one evbuffer_peek() */
+static struct evbuffer*
+makeChunkyBuffer( const uint8_t * bytes, size_t len )
+{
+    size_t i;
+    struct evbuffer * buf = evbuffer_new( );
+
+    for( i=0; i<len; )
+    {
+        const size_t n = MIN( len - i, 100 + ( i % 7 ) );
+        struct evbuffer * chunk = evbuffer_new( );
+        evbuffer_add( chunk, bytes + i, n );
+        evbuffer_add_buffer( buf, chunk );
+        evbuffer_free( chunk );
+        i += n;
+    }
+
+    return buf;
+}
+
+static int
+test_crypt_range( void )
+{
+    const size_t len = 5000;
+    const size_t skip = 10;
+    uint8_t plain[5000];
+    uint8_t wire[5000];
+    struct evbuffer * buf;
+
+    makeCryptoPair( );
+    fillPattern( plain, len, 1 );
+    buf = makeChunkyBuffer( plain, len );
+
+    /* encrypt all but the first and last few bytes, in two passes
+     * that start and end in the middle of chunks */
+    evbuffer_crypt( buf, skip, 1234, encrypter, TR_UP );
+    evbuffer_crypt( buf, skip + 1234, len - 1234 - 2 * skip, encrypter, TR_UP );
+    check( evbuffer_get_length( buf ) == len );
+    evbuffer_remove( buf, wire, len );
+
+    /* the bytes outside of the range were left alone */
+    check( !memcmp( wire, plain, skip ) );
+    check( !memcmp( wire + len - skip, plain + len - skip, skip ) );
+    check( memcmp( wire + skip, plain + skip, len - 2 * skip ) );
+
+    /* and the ones inside it decrypt back to what we started with */
+    tr_cryptoDecrypt( decrypter, len - 2 * skip, wire + skip, wire + skip );
+    check( !memcmp( wire, plain, len ) );
+
+    /* decrypting in place in the buffer works too */
+    evbuffer_free( buf );
+    tr_cryptoEncrypt( encrypter, len, plain, wire );
+    buf = makeChunkyBuffer( wire, len );
+    evbuffer_crypt( buf, 0, len, decrypter, TR_DOWN );
+    evbuffer_remove( buf, wire, len );
+    check( !memcmp( wire, plain, len ) );
+
+    evbuffer_free( buf );
+    freeCryptoPair( );
+    return 0;
+}
+
+static int
+test_add_encrypted( void )
+{
+    uint8_t plain[BLOCK_SIZE];
+    uint8_t wire[BLOCK_SIZE + PIECE_HEADER_SIZE];
+    struct evbuffer * buf = evbuffer_new( );
+
+    makeCryptoPair( );
+    fillPattern( plain, sizeof( plain ), 2 );
+
+    /* a header encrypted in place, then a block encrypted on copy,
+     * has to look like one continuous stream to the other end */
+    evbuffer_add( buf, plain, PIECE_HEADER_SIZE );
+    evbuffer_crypt( buf, 0, PIECE_HEADER_SIZE, encrypter, TR_UP );
+    evbuffer_add_encrypted( buf, plain, sizeof( plain ), encrypter );
+    evbuffer_add_encrypted( buf, plain, 0, encrypter );
+    check( evbuffer_get_length( buf ) == sizeof( wire ) );
+
+    evbuffer_remove( buf, wire, sizeof( wire ) );
+    tr_cryptoDecrypt( decrypter, sizeof( wire ), wire, wire );
+    check( !memcmp( wire, plain, PIECE_HEADER_SIZE ) );
+    check( !memcmp( wire + PIECE_HEADER_SIZE, plain, sizeof( plain ) ) );
+
+    evbuffer_free( buf );
+    freeCryptoPair( );
+    return 0;
+}
+
+static int
+test_segments( void )
+{
+    const unsigned int mss = 1448;
+
+    /* a write that empties the queue is left alone */
+    check( tr_peerIoTrimToSegments( 5000, 5000, mss ) == 5000 );
+    check( tr_peerIoTrimToSegments( 9000, 5000, mss ) == 9000 );
+
+    /* one that doesn't is cut back to whole segments... */
+    check( tr_peerIoTrimToSegments( 5000, 100000, mss ) == 3 * mss );
+    check( tr_peerIoTrimToSegments( 2 * mss, 100000, mss ) == 2 * mss );
+
+    /* ...unless it's a segment or less to begin with */
+    check( tr_peerIoTrimToSegments( 1000, 100000, mss ) == 1000 );
+    check( tr_peerIoTrimToSegments( 5000, 100000, 0 ) == 5000 );
+
+    /* protocol messages are padded out to a segment with what's behind them */
+    check( tr_peerIoFillSegment( 17, 100000, mss ) == mss );
+    check( tr_peerIoFillSegment( mss + 1, 100000, mss ) == 2 * mss );
+    check( tr_peerIoFillSegment( mss, 100000, mss ) == mss );
+    check( tr_peerIoFillSegment( 17, 500, mss ) == 500 );
+    check( tr_peerIoFillSegment( 17, 100000, 0 ) == 17 );
+    check( tr_peerIoFillSegment( 0, 100000, mss ) == 0 );
+
+    return 0;
+}
+
+/***
+****  Benchmark
+***/
+
+/* the old way of encrypting a buffer: allocate an iovec for every chunk */
+static void
+referenceEncrypt( struct evbuffer * buf, tr_crypto * crypto )
+{
+    size_t i;
+    const size_t len = evbuffer_get_length( buf );
+    const int n = evbuffer_peek( buf, len, NULL, NULL, 0 );
+    struct evbuffer_iovec * iovec = tr_new0( struct evbuffer_iovec, n );
+
+    evbuffer_peek( buf, len, NULL, iovec, n );
+    for( i=0; i<(size_t)n; ++i )
+        tr_cryptoEncrypt( crypto, iovec[i].iov_len, iovec[i].iov_base, iovec[i].iov_base );
+
+    tr_free( iovec );
+}
+
+typedef enum
+{
+    SEND_PLAINTEXT,
+    SEND_ENCRYPT_IN_PLACE,
+    SEND_ENCRYPT_ON_COPY
+}
+send_mode;
+
+/* queue up `blockCount' piece messages the way peer-msgs does,
+ * reading each block from `source' as if it were in the cache */
+static void
+sendBlocks( struct evbuffer * outbuf, const uint8_t * source, int blockCount, send_mode mode )
+{
+    int i;
+    static uint8_t sessionBuffer[BLOCK_SIZE];
+
+    for( i=0; i<blockCount; ++i )
+    {
+        struct evbuffer_iovec iovec[1];
+        struct evbuffer * out = evbuffer_new( );
+
+        evbuffer_add_uint32( out, 1 + 4 + 4 + BLOCK_SIZE );
+        evbuffer_add_uint8 ( out, 7 );
+        evbuffer_add_uint32( out, i );
+        evbuffer_add_uint32( out, 0 );
+
+        if( mode == SEND_ENCRYPT_ON_COPY )
+        {
+            memcpy( sessionBuffer, source, BLOCK_SIZE );
+            evbuffer_crypt( out, 0, PIECE_HEADER_SIZE, encrypter, TR_UP );
+            evbuffer_add_buffer( outbuf, out );
+            evbuffer_add_encrypted( outbuf, sessionBuffer, BLOCK_SIZE, encrypter );
+        }
+        else
+        {
+            evbuffer_reserve_space( out, BLOCK_SIZE, iovec, 1 );
+            memcpy( iovec[0].iov_base, source, BLOCK_SIZE );
+            iovec[0].iov_len = BLOCK_SIZE;
+            evbuffer_commit_space( out, iovec, 1 );
+
+            if( mode == SEND_ENCRYPT_IN_PLACE )
+                referenceEncrypt( out, encrypter );
+
+            evbuffer_add_buffer( outbuf, out );
+        }
+
+        evbuffer_free( out );
+    }
+}
+
+/* read piece messages back out of `inbuf' the way peer-msgs does:
+ * either decrypting each field as it's read, or all at once up front */
+static void
+receiveBlocks( struct evbuffer * inbuf, tr_bool decrypt, tr_bool bulk )
+{
+    uint8_t header[PIECE_HEADER_SIZE];
+    static uint8_t block[BLOCK_SIZE];
+
+    if( decrypt && bulk )
+        evbuffer_crypt( inbuf, 0, evbuffer_get_length( inbuf ), decrypter, TR_DOWN );
+
+    while( evbuffer_get_length( inbuf ) > 0 )
+    {
+        int field;
+        const int fieldSizes[] = { 4, 1, 4, 4 };
+        uint8_t * walk = header;
+
+        for( field=0; field<4; ++field ) {
+            evbuffer_remove( inbuf, walk, fieldSizes[field] );
+            if( decrypt && !bulk )
+                tr_cryptoDecrypt( decrypter, fieldSizes[field], walk, walk );
+            walk += fieldSizes[field];
+        }
+
+        evbuffer_remove( inbuf, block, BLOCK_SIZE );
+        if( decrypt && !bulk )
+            tr_cryptoDecrypt( decrypter, BLOCK_SIZE, block, block );
+    }
+}
+
+static double
+toMBps( int blockCount, uint64_t usec )
+{
+    const double bytes = (double)blockCount * ( BLOCK_SIZE + PIECE_HEADER_SIZE );
+    return usec ? ( bytes / ( 1024.0 * 1024.0 ) ) / ( usec / 1000000.0 ) : 0;
+}
+
+/* compare the throughput of plaintext and encrypted peers */
+static void
+benchmark( void )
+{
+    int i;
+    uint64_t begin;
+    const int loops = 20;
+    const int blockCount = 256; /* 4 MiB per loop */
+    static uint8_t source[BLOCK_SIZE];
+    const char * sendNames[] = { "plaintext", "RC4 in place, iovec alloc", "RC4 on copy" };
+    const send_mode sendModes[] = { SEND_PLAINTEXT, SEND_ENCRYPT_IN_PLACE, SEND_ENCRYPT_ON_COPY };
+    struct evbuffer * buf = evbuffer_new( );
+
+    makeCryptoPair( );
+    fillPattern( source, sizeof( source ), 3 );
+
+    for( i=0; i<3; ++i )
+    {
+        int loop;
+        uint64_t sendUsec = 0, recvUsec = 0;
+        const tr_bool decrypt = sendModes[i] != SEND_PLAINTEXT;
+        const tr_bool bulk = sendModes[i] == SEND_ENCRYPT_ON_COPY;
+
+        for( loop=0; loop<loops; ++loop )
+        {
+            begin = tr_time_usec( );
+            sendBlocks( buf, source, blockCount, sendModes[i] );
+            sendUsec += tr_time_usec( ) - begin;
+
+            /* the other end decrypts it with its own RC4 stream */
+            begin = tr_time_usec( );
+            receiveBlocks( buf, decrypt, bulk );
+            recvUsec += tr_time_usec( ) - begin;
+        }
+
+        printf( "%-26s send %7.1f MiB/s, receive %7.1f MiB/s (%s decryption)\n",
+                sendNames[i],
+                toMBps( blockCount * loops, sendUsec ),
+                toMBps( blockCount * loops, recvUsec ),
+                !decrypt ? "no" : bulk ? "bulk" : "per-field" );
+    }
+
+    evbuffer_free( buf );
+    freeCryptoPair( );
+}
+
+int
+main( int argc, char ** argv )
+{
+    int i;
+
+    if( ( i = test_crypt_range( ) ) )
+        return i;
+    if( ( i = test_add_encrypted( ) ) )
+        return i;
+    if( ( i = test_segments( ) ) )
+        return i;
+
+    if( ( argc > 1 ) && !strcmp( argv[1], "--benchmark" ) )
+        benchmark( );
+
+    return 0;
+}
@@ -34,7 +34,9 @@
 #include "net.h"
 #include "peer-common.h" /* MAX_BLOCK_SIZE */
 #include "peer-io.h"
+#include "platform.h" /* tr_lock */
 #include "trevent.h" /* tr_runInEventThread() */
+#include "tr-utp.h"
 #include "utils.h"
 
 #define MAGIC_NUMBER 206745
@@ -90,6 +92,17 @@ struct tr_datatype
 ****
 ***/
 
+static void
+ioBandwidthUsed( tr_peerIo * io, tr_direction dir, size_t byteCount,
+                 tr_bool isPieceData, uint64_t now )
+{
+    /* a sharded peer's bandwidth was taken when its budget was granted */
+    if( io->shard != NULL )
+        tr_bandwidthRecordUsed( &io->bandwidth, dir, byteCount, isPieceData, now );
+    else
+        tr_bandwidthUsed( &io->bandwidth, dir, byteCount, isPieceData, now );
+}
+
 static void
 didWriteWrapper( tr_peerIo * io, unsigned int bytes_transferred )
 {
@@ -101,10 +114,10 @@ didWriteWrapper( tr_peerIo * io, unsigned int bytes_transferred )
         const unsigned int overhead = guessPacketOverhead( payload );
         const uint64_t now = tr_time_msec( );
 
-        tr_bandwidthUsed( &io->bandwidth, TR_UP, payload, next->isPieceData, now );
+        ioBandwidthUsed( io, TR_UP, payload, next->isPieceData, now );
 
         if( overhead > 0 )
-            tr_bandwidthUsed( &io->bandwidth, TR_UP, overhead, FALSE, now );
+            ioBandwidthUsed( io, TR_UP, overhead, FALSE, now );
 
         if( io->didWrite )
             io->didWrite( io, payload, next->isPieceData, io->userData );
@@ -156,10 +169,10 @@ canReadWrapper( tr_peerIo * io )
                 const uint64_t now = tr_time_msec( );
 
                 if( piece )
-                    tr_bandwidthUsed( &io->bandwidth, TR_DOWN, piece, TRUE, now );
+                    ioBandwidthUsed( io, TR_DOWN, piece, TRUE, now );
 
                 if( used != piece )
-                    tr_bandwidthUsed( &io->bandwidth, TR_DOWN, used - piece, FALSE, now );
+                    ioBandwidthUsed( io, TR_DOWN, used - piece, FALSE, now );
             }
 
             switch( ret )
@@ -199,6 +212,119 @@ tr_isPeerIo( const tr_peerIo * io )
         && ( tr_isAddress( &io->addr ) );
 }
 
+/***
+****  Transmit scheduling
+***/
+
+enum
+{
+    /* used until the kernel tells us the socket's real MSS */
+    DEFAULT_MSS = 1460,
+
+    /* how often to ask the kernel for a connection's TCP_INFO */
+    TCP_INFO_INTERVAL_MSEC = 500,
+
+    /* with kernel sizing, only wake up to write when the kernel's
+     * got less than this much left to send */
+    KERNEL_NOTSENT_LOWAT = 4 * MAX_BLOCK_SIZE,
+
+    /* with kernel sizing, how much output to queue, in milliseconds'
+     * worth of what the congestion window can carry */
+    KERNEL_QUEUE_MSEC = 1000
+};
+
+size_t
+tr_peerIoTrimToSegments( size_t howmuch, size_t queued, unsigned int mss )
+{
+    if( ( mss > 0 ) && ( howmuch < queued ) && ( howmuch > mss ) )
+        howmuch -= howmuch % mss;
+
+    return howmuch;
+}
+
+size_t
+tr_peerIoFillSegment( size_t byteCount, size_t queued, unsigned int mss )
+{
+    if( ( mss > 0 ) && ( byteCount % mss ) )
+        byteCount += mss - ( byteCount % mss );
+
+    return MIN( byteCount, queued );
+}
+
+static inline void
+countSyscall( struct tr_syscall_count * count, int res )
+{
+    ++count->calls;
+
+    if( res > 0 )
+        count->bytes += res;
+}
+
+static unsigned int
+ioGetMSS( tr_peerIo * io, int fd, struct tr_syscall_count * count )
+{
+    if( !io->mss )
+    {
+        const int mss = tr_netGetMSS( fd );
+        countSyscall( count, 0 );
+        io->mss = mss > 0 ? (unsigned int)mss : DEFAULT_MSS;
+    }
+
+    return io->mss;
+}
+
+static void
+ioSetCorked( tr_peerIo * io, int fd, tr_bool corked, struct tr_syscall_count * count )
+{
+    if( ( io->isCorked != corked ) && !io->corkFailed )
+    {
+        countSyscall( count, 0 );
+
+        if( tr_netSetCork( fd, corked ) )
+            io->corkFailed = TRUE;
+        else
+            io->isCorked = corked;
+    }
+}
+
+/**
+ * Write up to howmuch bytes of buf to the socket in one writev().
+ *
+ * Peer sockets have TCP_NODELAY set so that protocol messages go out at
+ * once, but that also means every bandwidth-limited write would end with
+ * a runt segment. So writes are trimmed to whole segments, and the socket
+ * is corked while there's more output queued behind the write. When the
+ * queue drains, the socket is uncorked to push out the tail.
+ */
+static int
+ioTransmit( tr_peerIo * io, int fd, struct evbuffer * buf, size_t howmuch,
+            struct tr_syscall_count * count )
+{
+    int n;
+    const size_t queued = evbuffer_get_length( buf );
+    const unsigned int mss = ioGetMSS( io, fd, count );
+
+    howmuch = tr_peerIoTrimToSegments( howmuch, queued, mss );
+
+    if( howmuch < queued )
+        ioSetCorked( io, fd, TRUE, count );
+
+    EVUTIL_SET_SOCKET_ERROR( 0 );
+    n = evbuffer_write_atmost( buf, fd, howmuch );
+    countSyscall( count, n );
+
+    if( ( n > 0 ) && io->isCorked && !evbuffer_get_length( buf ) )
+        ioSetCorked( io, fd, FALSE, count );
+
+    return n;
+}
+
+/***
+****
+***/
+
+static void maybeDecryptInput( tr_peerIo * io, size_t offset, size_t len );
+
 static void
 event_read_cb( int fd, short event UNUSED, void * vio )
 {
@@ -232,9 +358,12 @@ event_read_cb( int fd, short event UNUSED, void * vio )
     EVUTIL_SET_SOCKET_ERROR( 0 );
     res = evbuffer_read( io->inbuf, fd, (int)howmuch );
     e = EVUTIL_SOCKET_ERROR( );
+    countSyscall( &io->syscalls, res );
 
     if( res > 0 )
     {
+        maybeDecryptInput( io, curlen, res );
+
         tr_peerIoSetEnabled( io, dir, TRUE );
 
         /* Invoke the user callback - must always be called last */
@@ -270,8 +399,20 @@ tr_evbuffer_write( tr_peerIo * io, int fd, size_t howmuch )
     int n;
     char errstr[256];
 
-    EVUTIL_SET_SOCKET_ERROR( 0 );
-    n = evbuffer_write_atmost( io->outbuf, fd, howmuch );
+    if( io->utp != NULL )
+    {
+        /* uTP takes what fits in its send window */
+        if(( n = (int) tr_utpWrite( io->utp, io->outbuf, howmuch )) == 0 )
+        {
+            EVUTIL_SET_SOCKET_ERROR( EAGAIN );
+            n = -1;
+        }
+    }
+    else
+    {
+        n = ioTransmit( io, fd, io->outbuf, howmuch, &io->syscalls );
+    }
+
     e = EVUTIL_SOCKET_ERROR( );
     dbgmsg( io, "wrote %d to peer (%s)", n, (n==-1?tr_net_strerror(errstr,sizeof(errstr),e):"") );
 
@@ -340,6 +481,377 @@ event_write_cb( int fd, short event UNUSED, void * vio )
         io->gotError( io, what, io->userData );
 }
 
+/***
+****  Sharded I/O
+****
+****  When peer I/O sharding is enabled, a peer's socket is handed to one
+****  of the shard threads once its handshake is done. The shard reads
+****  into shardIn, decrypting as it goes, and writes what the main thread
+****  queues in shardPending, encrypting as it goes. It never reads or
+****  writes more than the budgets that the main thread grants from the
+****  bandwidth tree in tr_peerIoFlush() and tr_peerIoSetEnabled().
+****  The main thread picks up the results in ioShardDeliver().
+***/
+
+#define SHARD_UNLIMITED ( (size_t)-1 )
+
+enum
+{
+    /* a peer's read budget is topped up to what it reads in this long... */
+    SHARD_READ_BUDGET_MSEC = 1000,
+
+    /* ...or to this, whichever is larger */
+    SHARD_MIN_READ_BUDGET = 16 * 1024,
+
+    /* limit the unparsed input, as event_read_cb() does */
+    SHARD_MAX_INBUF = 256 * 1024
+};
+
+static void maybeEncryptBuffer( tr_peerIo * io, struct evbuffer * buf );
+static void maybeDecryptBuffer( tr_peerIo * io, struct evbuffer * buf );
+static void event_disable( struct tr_peerIo * io, short event );
+static void io_dtor_finish( void * vio );
+
+static inline void
+shardLock( const tr_peerIo * io )
+{
+    tr_lockLock( tr_eventShardGetLock( io->shard ) );
+}
+
+static inline void
+shardUnlock( const tr_peerIo * io )
+{
+    tr_lockUnlock( tr_eventShardGetLock( io->shard ) );
+}
+
+static inline void
+shardUseBudget( tr_peerIo * io, tr_direction dir, size_t byteCount )
+{
+    if( io->shardBudget[dir] != SHARD_UNLIMITED )
+        io->shardBudget[dir] -= MIN( io->shardBudget[dir], byteCount );
+}
+
+/* shard thread: poll the socket if there's budget & a reason to */
+static void
+shardUpdateEvents( tr_peerIo * io )
+{
+    short want = 0;
+
+    shardLock( io );
+    io->shardSyscalls.calls += io->shardSyscallsUnreported.calls;
+    io->shardSyscalls.bytes += io->shardSyscallsUnreported.bytes;
+    memset( &io->shardSyscallsUnreported, 0, sizeof( struct tr_syscall_count ) );
+    if( !io->shardDetached && !io->shardError )
+    {
+        if( io->shardEnabled[TR_DOWN]
+            && io->shardBudget[TR_DOWN]
+            && ( evbuffer_get_length( io->shardIn ) < SHARD_MAX_INBUF ) )
+            want |= EV_READ;
+
+        if( io->shardEnabled[TR_UP]
+            && io->shardBudget[TR_UP]
+            && ( evbuffer_get_length( io->shardOut )
+                 || evbuffer_get_length( io->shardPending ) ) )
+            want |= EV_WRITE;
+    }
+    shardUnlock( io );
+
+    if( ( want & EV_READ ) != ( io->shardArmed & EV_READ ) ) {
+        if( want & EV_READ )
+            event_add( io->event_read, NULL );
+        else
+            event_del( io->event_read );
+    }
+
+    if( ( want & EV_WRITE ) != ( io->shardArmed & EV_WRITE ) ) {
+        if( want & EV_WRITE )
+            event_add( io->event_write, NULL );
+        else
+            event_del( io->event_write );
+    }
+
+    io->shardArmed = want;
+}
+
+static void ioShardDeliver( void * vio );
+
+/* shard thread: tell the main thread that there's something to pick up */
+static void
+shardPostDelivery( tr_peerIo * io )
+{
+    tr_bool post;
+
+    shardLock( io );
+    post = !io->shardDeliverPending;
+    io->shardDeliverPending = TRUE;
+    shardUnlock( io );
+
+    if( post )
+        tr_runInEventThread( io->session, ioShardDeliver, io );
+}
+
+static void
+shard_read_cb( int fd, short event UNUSED, void * vio )
+{
+    int res = 0;
+    int e = 0;
+    size_t howmuch;
+    tr_peerIo * io = vio;
+
+    io->shardArmed &= ~EV_READ;
+
+    shardLock( io );
+    howmuch = SHARD_MAX_INBUF - MIN( SHARD_MAX_INBUF, evbuffer_get_length( io->shardIn ) );
+    howmuch = MIN( howmuch, io->shardBudget[TR_DOWN] );
+    shardUnlock( io );
+
+    if( howmuch > 0 )
+    {
+        EVUTIL_SET_SOCKET_ERROR( 0 );
+        res = evbuffer_read( io->shardScratch, fd, (int)howmuch );
+        e = EVUTIL_SOCKET_ERROR( );
+        countSyscall( &io->shardSyscallsUnreported, res );
+
+        if( res > 0 )
+        {
+            /* decrypt outside of the lock */
+            maybeDecryptBuffer( io, io->shardScratch );
+
+            shardLock( io );
+            evbuffer_add_buffer( io->shardIn, io->shardScratch );
+            shardUseBudget( io, TR_DOWN, res );
+            shardUnlock( io );
+            shardPostDelivery( io );
+        }
+        else if( ( res == 0 ) || ( ( e != EAGAIN ) && ( e != EINTR ) ) )
+        {
+            shardLock( io );
+            io->shardError = BEV_EVENT_READING | ( res ? BEV_EVENT_ERROR : BEV_EVENT_EOF );
+            io->shardErrno = e;
+            shardUnlock( io );
+            shardPostDelivery( io );
+        }
+    }
+
+    shardUpdateEvents( io );
+}
+
+static void
+shard_write_cb( int fd, short event UNUSED, void * vio )
+{
+    int n;
+    int e;
+    size_t howmuch;
+    tr_peerIo * io = vio;
+
+    io->shardArmed &= ~EV_WRITE;
+
+    /* take the newly-queued output and encrypt it outside of the lock */
+    shardLock( io );
+    evbuffer_add_buffer( io->shardScratch, io->shardPending );
+    howmuch = io->shardBudget[TR_UP];
+    shardUnlock( io );
+    maybeEncryptBuffer( io, io->shardScratch );
+    evbuffer_add_buffer( io->shardOut, io->shardScratch );
+
+    howmuch = MIN( howmuch, evbuffer_get_length( io->shardOut ) );
+
+    if( howmuch > 0 )
+    {
+        n = ioTransmit( io, fd, io->shardOut, howmuch, &io->shardSyscallsUnreported );
+        e = EVUTIL_SOCKET_ERROR( );
+
+        if( n > 0 )
+        {
+            shardLock( io );
+            shardUseBudget( io, TR_UP, n );
+            io->shardBytesWritten += n;
+            shardUnlock( io );
+            shardPostDelivery( io );
+        }
+        else if( ( n == 0 ) || ( e && ( e != EAGAIN ) && ( e != EINTR ) && ( e != EINPROGRESS ) ) )
+        {
+            shardLock( io );
+            io->shardError = BEV_EVENT_WRITING | ( n ? BEV_EVENT_ERROR : BEV_EVENT_EOF );
+            io->shardErrno = e;
+            shardUnlock( io );
+            shardPostDelivery( io );
+        }
+    }
+
+    shardUpdateEvents( io );
+}
+
+/* shard thread */
+static void
+ioShardRearm( void * vio )
+{
+    tr_peerIo * io = vio;
+
+    shardLock( io );
+    io->shardRearmPending = FALSE;
+    shardUnlock( io );
+
+    shardUpdateEvents( io );
+}
+
+/* main thread: ask the shard to recheck whether it should be polling */
+static void
+shardRequestRearm( tr_peerIo * io )
+{
+    tr_bool post;
+
+    shardLock( io );
+    post = !io->shardRearmPending && !io->shardDetached;
+    io->shardRearmPending = TRUE;
+    shardUnlock( io );
+
+    if( post )
+        tr_runInShardThread( io->shard, ioShardRearm, io );
+}
+
+/* main thread: pick up what the shard has read and written */
+static void
+ioShardDeliver( void * vio )
+{
+    short what;
+    int err;
+    size_t bytesWritten;
+    tr_peerIo * io = vio;
+
+    shardLock( io );
+    io->shardDeliverPending = FALSE;
+    if( io->shardDetached ) {
+        shardUnlock( io );
+        return;
+    }
+    evbuffer_add_buffer( io->inbuf, io->shardIn );
+    bytesWritten = io->shardBytesWritten;
+    io->shardBytesWritten = 0;
+    what = io->shardError;
+    err = io->shardErrno;
+    shardUnlock( io );
+
+    assert( tr_isPeerIo( io ) );
+    tr_peerIoRef( io );
+
+    if( bytesWritten > 0 ) {
+        io->shardQueued -= MIN( io->shardQueued, bytesWritten );
+        didWriteWrapper( io, bytesWritten );
+    }
+
+    if( evbuffer_get_length( io->inbuf ) )
+        canReadWrapper( io );
+
+    if( what && !io->shardErrorReported )
+    {
+        char errstr[512];
+
+        io->shardErrorReported = TRUE;
+        tr_net_strerror( errstr, sizeof( errstr ), err );
+        dbgmsg( io, "shard got an error. what is %hd, errno is %d (%s)", what, err, errstr );
+
+        if( io->gotError != NULL )
+            io->gotError( io, what, io->userData );
+    }
+
+    /* the input buffer may have room again */
+    shardRequestRearm( io );
+
+    tr_peerIoUnref( io );
+}
+
+/* main thread: give a sharded peer some bandwidth to use in its thread */
+static size_t
+shardGrant( tr_peerIo * io, tr_direction dir, size_t limit )
+{
+    size_t want;
+    size_t grant;
+
+    if( tr_bandwidthClamp( &io->bandwidth, dir, UINT_MAX ) == UINT_MAX )
+    {
+        /* nothing is limiting this peer */
+        shardLock( io );
+        io->shardBudget[dir] = SHARD_UNLIMITED;
+        shardUnlock( io );
+        return 0;
+    }
+
+    if( dir == TR_UP )
+        want = io->shardQueued;
+    else
+        want = MAX( SHARD_MIN_READ_BUDGET, ( tr_bandwidthGetRawSpeed_Bps( &io->bandwidth, 0, dir )
+                                             * SHARD_READ_BUDGET_MSEC ) / 1000u );
+
+    shardLock( io );
+    if( io->shardBudget[dir] == SHARD_UNLIMITED )
+        io->shardBudget[dir] = 0;
+    want = want > io->shardBudget[dir] ? want - io->shardBudget[dir] : 0;
+    grant = tr_bandwidthClamp( &io->bandwidth, dir, MIN( MIN( want, limit ), UINT_MAX ) );
+    io->shardBudget[dir] += grant;
+    shardUnlock( io );
+
+    if( grant > 0 )
+        tr_bandwidthConsume( &io->bandwidth, dir, grant );
+
+    return grant;
+}
+
+/* shard thread */
+static void
+ioShardDetach( void * vio )
+{
+    tr_peerIo * io = vio;
+
+    event_free( io->event_read );
+    event_free( io->event_write );
+    io->event_read = NULL;
+    io->event_write = NULL;
+    tr_eventReleaseShard( io->shard );
+
+    tr_runInEventThread( io->session, io_dtor_finish, io );
+}
+
+void
+tr_peerIoAttachShard( tr_peerIo * io )
+{
+    struct tr_event_handle * shard;
+
+    assert( tr_isPeerIo( io ) );
+    assert( tr_amInEventThread( io->session ) );
+
+    if( ( io->shard != NULL ) || ( io->socket < 0 ) )
+        return;
+
+    if(( shard = tr_eventAcquireShard( io->session )) == NULL )
+        return;
+
+    dbgmsg( io, "moving to a peer I/O shard" );
+
+    /* stop polling in the main thread */
+    event_disable( io, EV_READ | EV_WRITE );
+    event_free( io->event_read );
+    event_free( io->event_write );
+
+    /* from now on, input is decrypted by the shard as it arrives */
+    tr_peerIoDecryptOnRead( io );
+
+    io->shardIn = evbuffer_new( );
+    io->shardPending = evbuffer_new( );
+    io->shardOut = evbuffer_new( );
+    io->shardScratch = evbuffer_new( );
+
+    /* the output that's already queued was encrypted when it was queued */
+    io->shardQueued = evbuffer_get_length( io->outbuf );
+    evbuffer_add_buffer( io->shardOut, io->outbuf );
+
+    io->shardEnabled[TR_UP] = TRUE;
+    io->shardEnabled[TR_DOWN] = TRUE;
+    io->event_read = event_new( tr_eventShardGetBase( shard ), io->socket, EV_READ, shard_read_cb, io );
+    io->event_write = event_new( tr_eventShardGetBase( shard ), io->socket, EV_WRITE, shard_write_cb, io );
+    io->shard = shard;
+}
+
 /**
 ***
 **/
@@ -357,6 +869,105 @@ maybeSetCongestionAlgorithm( int socket, const char * algorithm )
     }
 }
 
+/***
+****  uTP
+****
+****  A uTP connection pushes its input to us as it arrives rather than
+****  waiting to be read, and it tells us when its send window opens up.
+****  So a uTP peer's events are never polled: event_enable() remembers
+****  what's wanted, and the write event is activated by hand when uTP
+****  can take more output.
+***/
+
+enum
+{
+    /* the receive window we advertise is what's left of this. It's larger
+     * than event_read_cb()'s limit because it has to cover the data that's
+     * in flight, not just the data that's waiting to be parsed */
+    UTP_MAX_INBUF = 1024 * 1024
+};
+
+static void
+utpWriteReady( tr_peerIo * io )
+{
+    if( ( io->pendingEvents & EV_WRITE ) && evbuffer_get_length( io->outbuf ) )
+        event_active( io->event_write, EV_WRITE, 0 );
+}
+
+static void
+utpOnRead( void * vio, const void * data, size_t len )
+{
+    tr_peerIo * io = vio;
+    const size_t curlen = evbuffer_get_length( io->inbuf );
+
+    assert( tr_isPeerIo( io ) );
+
+    dbgmsg( io, "uTP delivered %zu bytes", len );
+    evbuffer_add( io->inbuf, data, len );
+    maybeDecryptInput( io, curlen, len );
+
+    canReadWrapper( io );
+}
+
+static size_t
+utpGetReceiveWindow( void * vio )
+{
+    tr_peerIo * io = vio;
+    const size_t curlen = evbuffer_get_length( io->inbuf );
+    const size_t space = curlen >= UTP_MAX_INBUF ? 0 : UTP_MAX_INBUF - curlen;
+
+    assert( tr_isPeerIo( io ) );
+
+    return tr_bandwidthClamp( &io->bandwidth, TR_DOWN, space );
+}
+
+static void
+utpOnState( void * vio, tr_utp_state state )
+{
+    tr_peerIo * io = vio;
+
+    assert( tr_isPeerIo( io ) );
+
+    switch( state )
+    {
+        case TR_UTP_CONNECT:
+            dbgmsg( io, "uTP connection is up" );
+            io->hasFinishedConnecting = TRUE;
+            utpWriteReady( io );
+            break;
+
+        case TR_UTP_WRITABLE:
+            utpWriteReady( io );
+            break;
+
+        case TR_UTP_EOF:
+            dbgmsg( io, "uTP peer closed the connection" );
+            if( io->gotError != NULL )
+                io->gotError( io, BEV_EVENT_READING | BEV_EVENT_EOF, io->userData );
+            break;
+    }
+}
+
+static void
+utpOnError( void * vio, int err )
+{
+    tr_peerIo * io = vio;
+
+    assert( tr_isPeerIo( io ) );
+
+    dbgmsg( io, "uTP got an error: %d (%s)", err, tr_strerror( err ) );
+
+    errno = err;
+    if( io->gotError != NULL )
+        io->gotError( io, BEV_EVENT_READING | BEV_EVENT_ERROR, io->userData );
+}
+
+static const tr_utp_funcs utp_funcs = { utpOnRead, utpGetReceiveWindow, utpOnState, utpOnError };
+
+/***
+****
+***/
+
 static tr_peerIo*
 tr_peerIoNew( tr_session       * session,
               tr_bandwidth     * parent,
@@ -365,7 +976,8 @@ tr_peerIoNew( tr_session       * session,
               const uint8_t    * torrentHash,
               tr_bool            isIncoming,
               tr_bool            isSeed,
-              int                socket )
+              int                socket,
+              tr_utp_socket    * utp )
 {
     tr_peerIo * io;
 
@@ -377,6 +989,9 @@ tr_peerIoNew( tr_session       * session,
 
     if( socket >= 0 ) {
         tr_netSetTOS( socket, session->peerSocketTOS );
+        tr_netSetNoDelay( socket, TRUE );
+        if( session->peerSocketKernelSizing )
+            tr_netSetNotSentLowat( socket, KERNEL_NOTSENT_LOWAT );
         maybeSetCongestionAlgorithm( socket, session->peer_congestion_algorithm );
     }
 
@@ -389,6 +1004,7 @@ tr_peerIoNew( tr_session       * session,
     io->isSeed = isSeed;
     io->port = port;
     io->socket = socket;
+    io->utp = utp;
     io->isIncoming = isIncoming != 0;
     io->hasFinishedConnecting = FALSE;
     io->timeCreated = tr_time( );
@@ -400,6 +1016,9 @@ tr_peerIoNew( tr_session       * session,
     tr_bandwidthSetPeer( &io->bandwidth, io );
     dbgmsg( io, "bandwidth is %p; its parent is %p", &io->bandwidth, parent );
 
+    if( utp != NULL )
+        tr_utpSetFuncs( utp, &utp_funcs, io );
+
     return io;
 }
 
@@ -408,13 +1027,22 @@ tr_peerIoNewIncoming( tr_session        * session,
                       tr_bandwidth      * parent,
                       const tr_address  * addr,
                       tr_port             port,
-                      int                 fd )
+                      int                 fd,
+                      tr_utp_socket     * utp )
 {
+    tr_peerIo * io;
+
     assert( session );
     assert( tr_isAddress( addr ) );
-    assert( fd >= 0 );
+    assert( ( fd >= 0 ) != ( utp != NULL ) );
+
+    io = tr_peerIoNew( session, parent, addr, port, NULL, TRUE, FALSE, fd, utp );
+
+    /* uTP doesn't tell us about a connection until it's up */
+    if( utp != NULL )
+        io->hasFinishedConnecting = TRUE;
 
-    return tr_peerIoNew( session, parent, addr, port, NULL, TRUE, FALSE, fd );
+    return io;
 }
 
 tr_peerIo*
@@ -423,19 +1051,30 @@ tr_peerIoNewOutgoing( tr_session        * session,
                       const tr_address  * addr,
                       tr_port             port,
                       const uint8_t     * torrentHash,
-                      tr_bool             isSeed )
+                      tr_bool             isSeed,
+                      tr_bool             utp )
 {
-    int fd;
+    int fd = -1;
+    tr_utp_socket * utpSocket = NULL;
 
     assert( session );
     assert( tr_isAddress( addr ) );
     assert( torrentHash );
+    assert( tr_isBool( utp ) );
+
+    if( utp && tr_sessionAllowsUTP( session ) && tr_isValidPeerAddress( addr, port ) )
+        utpSocket = tr_utpConnect( session->utp, addr, port );
+
+    if( utpSocket == NULL )
+    {
+        fd = tr_netOpenPeerSocket( session, addr, port, isSeed );
+        dbgmsg( NULL, "tr_netOpenPeerSocket returned fd %d", fd );
 
-    fd = tr_netOpenPeerSocket( session, addr, port, isSeed );
-    dbgmsg( NULL, "tr_netOpenPeerSocket returned fd %d", fd );
+        if( fd < 0 )
+            return NULL;
+    }
 
-    return fd < 0 ? NULL
-                  : tr_peerIoNew( session, parent, addr, port, torrentHash, FALSE, isSeed, fd );
+    return tr_peerIoNew( session, parent, addr, port, torrentHash, FALSE, isSeed, fd, utpSocket );
 }
 
 /***
@@ -451,6 +1090,16 @@ event_enable( tr_peerIo * io, short event )
     assert( event_initialized( io->event_read ) );
     assert( event_initialized( io->event_write ) );
 
+    if( io->utp != NULL )
+    {
+        /* input is pushed to us, so only output needs a nudge */
+        if( ( event & EV_WRITE ) && !( io->pendingEvents & EV_WRITE ) && tr_utpIsWritable( io->utp ) )
+            event_active( io->event_write, EV_WRITE, 0 );
+
+        io->pendingEvents |= event;
+        return;
+    }
+
     if( io->socket < 0 )
         return;
 
@@ -505,7 +1154,18 @@ tr_peerIoSetEnabled( tr_peerIo    * io,
     assert( tr_amInEventThread( io->session ) );
     assert( io->session->events != NULL );
 
-    if( isEnabled )
+    if( io->shard != NULL )
+    {
+        /* let the shard do on-demand I/O with whatever bandwidth is left */
+        if( isEnabled )
+            shardGrant( io, dir, SHARD_UNLIMITED );
+
+        shardLock( io );
+        io->shardEnabled[dir] = isEnabled;
+        shardUnlock( io );
+        shardRequestRearm( io );
+    }
+    else if( isEnabled )
         event_enable( io, event );
     else
         event_disable( io, event );
@@ -516,22 +1176,29 @@ tr_peerIoSetEnabled( tr_peerIo    * io,
 ***/
 
 static void
-io_dtor( void * vio )
+io_dtor_finish( void * vio )
 {
     tr_peerIo * io = vio;
 
     assert( tr_isPeerIo( io ) );
     assert( tr_amInEventThread( io->session ) );
-    assert( io->session->events != NULL );
 
-    dbgmsg( io, "in tr_peerIo destructor" );
-    event_disable( io, EV_READ | EV_WRITE );
-    event_free( io->event_read );
-    event_free( io->event_write );
+    if( io->shard != NULL ) {
+        /* the shard thread has already freed the events */
+        evbuffer_free( io->shardScratch );
+        evbuffer_free( io->shardOut );
+        evbuffer_free( io->shardPending );
+        evbuffer_free( io->shardIn );
+    } else {
+        event_disable( io, EV_READ | EV_WRITE );
+        event_free( io->event_read );
+        event_free( io->event_write );
+    }
     tr_bandwidthDestruct( &io->bandwidth );
     evbuffer_free( io->outbuf );
     evbuffer_free( io->inbuf );
     tr_netClose( io->session, io->socket );
+    tr_utpClose( io->utp );
     tr_cryptoFree( io->crypto );
     tr_list_free( &io->outbuf_datatypes, tr_free );
 
@@ -539,6 +1206,32 @@ io_dtor( void * vio )
     tr_free( io );
 }
 
+static void
+io_dtor( void * vio )
+{
+    tr_peerIo * io = vio;
+
+    assert( tr_isPeerIo( io ) );
+    assert( tr_amInEventThread( io->session ) );
+    assert( io->session->events != NULL );
+
+    dbgmsg( io, "in tr_peerIo destructor" );
+
+    if( io->shard == NULL )
+        io_dtor_finish( io );
+    else {
+        /* the torrent's or session's bandwidth may be freed before we get
+         * back from the shard thread, so let go of it while it's still here */
+        tr_bandwidthSetParent( &io->bandwidth, NULL );
+
+        /* the shard's events have to be freed in its own thread */
+        shardLock( io );
+        io->shardDetached = TRUE;
+        shardUnlock( io );
+        tr_runInShardThread( io->shard, ioShardDetach, io );
+    }
+}
+
 static void
 tr_peerIoFree( tr_peerIo * io )
 {
@@ -632,6 +1325,7 @@ tr_peerIoReconnect( tr_peerIo * io )
 
     assert( tr_isPeerIo( io ) );
     assert( !tr_peerIoIsIncoming( io ) );
+    assert( io->shard == NULL );
 
     session = tr_peerIoGetSession( io );
 
@@ -641,8 +1335,20 @@ tr_peerIoReconnect( tr_peerIo * io )
     if( io->socket >= 0 )
         tr_netClose( session, io->socket );
 
-    event_del( io->event_read );
-    event_del( io->event_write );
+    /* if we couldn't get through over uTP, try again over TCP */
+    if( io->utp != NULL ) {
+        tr_utpClose( io->utp );
+        io->utp = NULL;
+    }
+
+    event_free( io->event_read );
+    event_free( io->event_write );
+    io->inbufIsDecrypted = FALSE;
+    io->mss = 0;
+    io->isCorked = FALSE;
+    io->corkFailed = FALSE;
+    io->tcpInfoTime = 0;
+    memset( &io->tcpInfo, 0, sizeof( tr_tcp_info ) );
     io->socket = tr_netOpenPeerSocket( session, &io->addr, io->port, io->isSeed );
     io->event_read = event_new( session->event_base, io->socket, EV_READ, event_read_cb, io );
     io->event_write = event_new( session->event_base, io->socket, EV_WRITE, event_write_cb, io );
@@ -651,6 +1357,9 @@ tr_peerIoReconnect( tr_peerIo * io )
     {
         event_enable( io, pendingEvents );
         tr_netSetTOS( io->socket, session->peerSocketTOS );
+        tr_netSetNoDelay( io->socket, TRUE );
+        if( session->peerSocketKernelSizing )
+            tr_netSetNotSentLowat( io->socket, KERNEL_NOTSENT_LOWAT );
         maybeSetCongestionAlgorithm( io->socket, session->peer_congestion_algorithm );
         return 0;
     }
@@ -709,8 +1418,29 @@ tr_peerIoSetPeersId( tr_peerIo *     io,
 ***
 **/
 
+const tr_tcp_info*
+tr_peerIoGetTCPInfo( tr_peerIo * io, uint64_t now )
+{
+    assert( tr_isPeerIo( io ) );
+
+    if( io->hasFinishedConnecting
+        && ( io->tcpInfoTime + TCP_INFO_INTERVAL_MSEC <= now ) )
+    {
+        io->tcpInfoTime = now;
+
+        if( io->utp != NULL )
+            tr_utpGetInfo( io->utp, &io->tcpInfo );
+        else if( io->socket >= 0 ) {
+            countSyscall( &io->syscalls, 0 );
+            tr_netGetTCPInfo( io->socket, &io->tcpInfo );
+        }
+    }
+
+    return ( io->tcpInfo.rtt_usec > 0 ) && ( io->tcpInfo.cwnd > 0 ) ? &io->tcpInfo : NULL;
+}
+
 static unsigned int
-getDesiredOutputBufferSize( const tr_peerIo * io, uint64_t now )
+getDesiredOutputBufferSize( tr_peerIo * io, uint64_t now )
 {
     /* this is all kind of arbitrary, but what seems to work well is
      * being large enough to hold the next 20 seconds' worth of input,
@@ -720,14 +1450,35 @@ getDesiredOutputBufferSize( const tr_peerIo * io, uint64_t now )
     const unsigned int period = 15u; /* arbitrary */
     /* the 3 is arbitrary; the .5 is to leave room for messages */
     static const unsigned int ceiling =  (unsigned int)( MAX_BLOCK_SIZE * 3.5 );
-    return MAX( ceiling, currentSpeed_Bps*period );
+    unsigned int desired = MAX( ceiling, currentSpeed_Bps*period );
+
+    /* The kernel already holds the bytes in flight, and its autotuned
+     * send buffer grows to fit the link. So if we know how much the
+     * congestion window carries per round trip, we only need to queue
+     * enough to keep it topped off until the next few writes */
+    if( io->session->peerSocketKernelSizing )
+    {
+        const tr_tcp_info * info = tr_peerIoGetTCPInfo( io, now );
+
+        if( info != NULL )
+        {
+            const uint64_t window = (uint64_t)info->cwnd * info->mss;
+            const uint64_t queue = ( window * KERNEL_QUEUE_MSEC * 1000u ) / info->rtt_usec;
+
+            if( queue < desired )
+                desired = MAX( ceiling, (unsigned int)queue );
+        }
+    }
+
+    return desired;
 }
 
 size_t
-tr_peerIoGetWriteBufferSpace( const tr_peerIo * io, uint64_t now )
+tr_peerIoGetWriteBufferSpace( tr_peerIo * io, uint64_t now )
 {
     const size_t desiredLen = getDesiredOutputBufferSize( io, now );
-    const size_t currentLen = evbuffer_get_length( io->outbuf );
+    const size_t currentLen = io->shard ? io->shardQueued
+                                        : evbuffer_get_length( io->outbuf );
     size_t freeSpace = 0;
 
     if( desiredLen > currentLen )
@@ -765,30 +1516,101 @@ addDatatype( tr_peerIo * io, size_t byteCount, tr_bool isPieceData )
     tr_list_append( &io->outbuf_datatypes, d );
 }
 
-static struct evbuffer_iovec *
-evbuffer_peek_all( struct evbuffer * buf, size_t * setme_vecCount )
+void
+evbuffer_crypt( struct evbuffer   * buf,
+                size_t              offset,
+                size_t              len,
+                struct tr_crypto  * crypto,
+                tr_direction        dir )
 {
-    const size_t byteCount = evbuffer_get_length( buf );
-    const int vecCount = evbuffer_peek( buf, byteCount, NULL, NULL, 0 );
-    struct evbuffer_iovec * iovec = tr_new0( struct evbuffer_iovec, vecCount );
-    const int n = evbuffer_peek( buf, byteCount, NULL, iovec, vecCount );
-    assert( vecCount == n );
-    *setme_vecCount = vecCount;
-    return iovec;
+    struct evbuffer_ptr ptr;
+    struct evbuffer_iovec iovec[8];
+    const int maxVecs = sizeof( iovec ) / sizeof( iovec[0] );
+
+    assert( offset + len <= evbuffer_get_length( buf ) );
+
+    while( len > 0 )
+    {
+        int i, n;
+
+        evbuffer_ptr_set( buf, &ptr, offset, EVBUFFER_PTR_SET );
+        n = MIN( maxVecs, evbuffer_peek( buf, len, &ptr, iovec, maxVecs ) );
+
+        for( i=0; i<n && len>0; ++i )
+        {
+            const size_t thisPass = MIN( iovec[i].iov_len, len );
+
+            if( dir == TR_UP )
+                tr_cryptoEncrypt( crypto, thisPass, iovec[i].iov_base, iovec[i].iov_base );
+            else
+                tr_cryptoDecrypt( crypto, thisPass, iovec[i].iov_base, iovec[i].iov_base );
+
+            offset += thisPass;
+            len -= thisPass;
+        }
+    }
+}
+
+void
+evbuffer_add_encrypted( struct evbuffer   * buf,
+                        const void        * bytes,
+                        size_t              len,
+                        struct tr_crypto  * crypto )
+{
+    struct evbuffer_iovec iovec[1];
+
+    if( len > 0 )
+    {
+        if( evbuffer_reserve_space( buf, len, iovec, 1 ) >= 1 )
+        {
+            tr_cryptoEncrypt( crypto, len, bytes, iovec[0].iov_base );
+            iovec[0].iov_len = len;
+            evbuffer_commit_space( buf, iovec, 1 );
+        }
+        else
+        {
+            /* couldn't get one contiguous chunk, so copy the bytes
+             * in and encrypt them wherever they landed */
+            const size_t offset = evbuffer_get_length( buf );
+
+            if( !evbuffer_add( buf, bytes, len ) )
+                evbuffer_crypt( buf, offset, len, crypto, TR_UP );
+        }
+    }
 }
 
 static void
 maybeEncryptBuffer( tr_peerIo * io, struct evbuffer * buf )
 {
     if( io->encryptionMode == PEER_ENCRYPTION_RC4 )
-    {
-        size_t i, n;
-        struct evbuffer_iovec * iovec = evbuffer_peek_all( buf, &n );
+        evbuffer_crypt( buf, 0, evbuffer_get_length( buf ), io->crypto, TR_UP );
+}
 
-        for( i=0; i<n; ++i )
-            tr_cryptoEncrypt( io->crypto, iovec[i].iov_len, iovec[i].iov_base, iovec[i].iov_base );
+static void
+maybeDecryptBuffer( tr_peerIo * io, struct evbuffer * buf )
+{
+    if( io->encryptionMode == PEER_ENCRYPTION_RC4 )
+        evbuffer_crypt( buf, 0, evbuffer_get_length( buf ), io->crypto, TR_DOWN );
+}
 
-        tr_free( iovec );
+/* decrypt newly-read input in one pass, if we're past the handshake */
+static void
+maybeDecryptInput( tr_peerIo * io, size_t offset, size_t len )
+{
+    if( io->inbufIsDecrypted && ( io->encryptionMode == PEER_ENCRYPTION_RC4 ) )
+        evbuffer_crypt( io->inbuf, offset, len, io->crypto, TR_DOWN );
+}
+
+void
+tr_peerIoDecryptOnRead( tr_peerIo * io )
+{
+    assert( tr_isPeerIo( io ) );
+
+    /* anything we've already got was left encrypted, so decrypt it now */
+    if( !io->inbufIsDecrypted )
+    {
+        maybeDecryptBuffer( io, io->inbuf );
+        io->inbufIsDecrypted = TRUE;
     }
 }
 
@@ -796,6 +1618,19 @@ void
 tr_peerIoWriteBuf( tr_peerIo * io, struct evbuffer * buf, tr_bool isPieceData )
 {
     const size_t byteCount = evbuffer_get_length( buf );
+
+    if( io->shard != NULL )
+    {
+        /* the shard encrypts it when it's ready to write it */
+        shardLock( io );
+        evbuffer_add_buffer( io->shardPending, buf );
+        shardUnlock( io );
+        io->shardQueued += byteCount;
+        addDatatype( io, byteCount, isPieceData );
+        shardRequestRearm( io );
+        return;
+    }
+
     maybeEncryptBuffer( io, buf );
     evbuffer_add_buffer( io->outbuf, buf );
     addDatatype( io, byteCount, isPieceData );
@@ -804,10 +1639,25 @@ tr_peerIoWriteBuf( tr_peerIo * io, struct evbuffer * buf, tr_bool isPieceData )
 void
 tr_peerIoWriteBytes( tr_peerIo * io, const void * bytes, size_t byteCount, tr_bool isPieceData )
 {
-    struct evbuffer * buf = evbuffer_new( );
-    evbuffer_add( buf, bytes, byteCount );
-    tr_peerIoWriteBuf( io, buf, isPieceData );
-    evbuffer_free( buf );
+    if( io->shard != NULL )
+    {
+        /* the shard encrypts it when it's ready to write it */
+        shardLock( io );
+        evbuffer_add( io->shardPending, bytes, byteCount );
+        shardUnlock( io );
+        io->shardQueued += byteCount;
+        addDatatype( io, byteCount, isPieceData );
+        shardRequestRearm( io );
+        return;
+    }
+
+    /* encrypt it on the way into the output buffer */
+    if( io->encryptionMode == PEER_ENCRYPTION_RC4 )
+        evbuffer_add_encrypted( io->outbuf, bytes, byteCount, io->crypto );
+    else
+        evbuffer_add( io->outbuf, bytes, byteCount );
+
+    addDatatype( io, byteCount, isPieceData );
 }
 
 /***
@@ -846,7 +1696,8 @@ tr_peerIoReadBytes( tr_peerIo * io, struct evbuffer * inbuf, void * bytes, size_
 
         case PEER_ENCRYPTION_RC4:
             evbuffer_remove( inbuf, bytes, byteCount );
-            tr_cryptoDecrypt( io->crypto, byteCount, bytes, bytes );
+            if( !io->inbufIsDecrypted )
+                tr_cryptoDecrypt( io->crypto, byteCount, bytes, bytes );
             break;
 
         default:
@@ -900,16 +1751,31 @@ tr_peerIoTryRead( tr_peerIo * io, size_t howmuch )
 {
     int res = 0;
 
-    if(( howmuch = tr_bandwidthClamp( &io->bandwidth, TR_DOWN, howmuch )))
+    if( io->utp != NULL )
+    {
+        /* uTP has already pushed its input to us, so just give the peer
+         * another look at it, then let uTP reopen the receive window */
+        if( evbuffer_get_length( io->inbuf ) )
+            canReadWrapper( io );
+
+        tr_utpReadDrained( io->utp );
+    }
+    else if(( howmuch = tr_bandwidthClamp( &io->bandwidth, TR_DOWN, howmuch )))
     {
         int e;
 
+        const size_t curlen = evbuffer_get_length( io->inbuf );
+
         EVUTIL_SET_SOCKET_ERROR( 0 );
         res = evbuffer_read( io->inbuf, io->socket, (int)howmuch );
         e = EVUTIL_SOCKET_ERROR( );
+        countSyscall( &io->syscalls, res );
 
         dbgmsg( io, "read %d from peer (%s)", res, (res==-1?strerror(e):"") );
 
+        if( res > 0 )
+            maybeDecryptInput( io, curlen, res );
+
         if( evbuffer_get_length( io->inbuf ) )
             canReadWrapper( io );
 
@@ -967,7 +1833,12 @@ tr_peerIoFlush( tr_peerIo  * io, tr_direction dir, size_t limit )
     assert( tr_isPeerIo( io ) );
     assert( tr_isDirection( dir ) );
 
-    if( io->hasFinishedConnecting )
+    if( io->shard != NULL )
+    {
+        if(( bytesUsed = (int) shardGrant( io, dir, limit )))
+            shardRequestRearm( io );
+    }
+    else if( io->hasFinishedConnecting )
     {
         if( dir == TR_DOWN )
             bytesUsed = tr_peerIoTryRead( io, limit );
@@ -997,5 +1868,25 @@ tr_peerIoFlushOutgoingProtocolMsgs( tr_peerIo * io )
         byteCount += d->length;
     }
 
+    /* top off their last segment with the piece data queued behind them */
+    if( byteCount && ( it != NULL ) && ( io->shard == NULL ) )
+        byteCount = tr_peerIoFillSegment( byteCount, evbuffer_get_length( io->outbuf ), io->mss );
+
     return tr_peerIoFlush( io, TR_UP, byteCount );
 }
+
+double
+tr_peerIoGetSyscallsPerMB( const tr_peerIo * io )
+{
+    struct tr_syscall_count count = io->syscalls;
+
+    if( io->shard != NULL )
+    {
+        shardLock( io );
+        count.calls += io->shardSyscalls.calls;
+        count.bytes += io->shardSyscalls.bytes;
+        shardUnlock( io );
+    }
+
+    return count.bytes ? count.calls / ( count.bytes / ( 1024.0 * 1024.0 ) ) : 0.0;
+}
@@ -35,7 +35,9 @@
 struct evbuffer;
 struct tr_bandwidth;
 struct tr_crypto;
+struct tr_event_handle;
 struct tr_peerIo;
+struct tr_utp_socket;
 
 /**
  * @addtogroup networked_io Networked IO
@@ -63,6 +65,14 @@ typedef void      ( *tr_net_error_cb )( struct tr_peerIo * io,
                                         short              what,
                                         void             * userData );
 
+/* how many system calls were made on a peer's socket, and how many
+ * bytes they moved. see tr_peerIoGetSyscallsPerMB() */
+struct tr_syscall_count
+{
+    uint64_t calls;
+    uint64_t bytes;
+};
+
 typedef struct tr_peerIo
 {
     tr_bool               isEncrypted;
@@ -89,6 +99,9 @@ typedef struct tr_peerIo
     tr_port               port;
     int                   socket;
 
+    /* if not NULL, the peer is connected over uTP and socket is -1 */
+    struct tr_utp_socket * utp;
+
     int                   refCount;
 
     uint8_t               peerId[SHA_DIGEST_LENGTH];
@@ -112,6 +125,45 @@ typedef struct tr_peerIo
 
     struct event        * event_read;
     struct event        * event_write;
+
+    /* the transmit scheduler's state. These are only used by the thread
+     * that does the socket I/O: the shard thread if there is one, or the
+     * main thread if there isn't */
+    unsigned int          mss;
+    tr_bool               isCorked;
+    tr_bool               corkFailed;
+
+    /* only used by the main thread */
+    struct tr_syscall_count syscalls;
+    tr_tcp_info           tcpInfo;
+    uint64_t              tcpInfoTime;
+
+    /* If peer I/O sharding is enabled, the socket is handed to a shard
+     * thread when the handshake is done. These fields are shared with
+     * that thread and are protected by tr_eventShardGetLock( shard ) */
+    struct tr_event_handle * shard;
+    struct evbuffer     * shardIn;      /* decrypted input for the main thread */
+    struct evbuffer     * shardPending; /* plaintext output for the shard */
+    size_t                shardBudget[2];
+    size_t                shardBytesWritten;
+    struct tr_syscall_count shardSyscalls;
+    short                 shardError;
+    int                   shardErrno;
+    tr_bool               shardEnabled[2];
+    tr_bool               shardDeliverPending;
+    tr_bool               shardRearmPending;
+    tr_bool               shardDetached;
+
+    /* only used by the shard thread */
+    struct evbuffer     * shardOut;     /* encrypted output for the socket */
+    struct evbuffer     * shardScratch;
+    short                 shardArmed;
+    struct tr_syscall_count shardSyscallsUnreported;
+
+    /* only used by the main thread */
+    size_t                shardQueued;
+    tr_bool               shardErrorReported;
+    tr_bool               inbufIsDecrypted;
 }
 tr_peerIo;
 
@@ -124,13 +176,15 @@ tr_peerIo*  tr_peerIoNewOutgoing( tr_session              * session,
                                   const struct tr_address * addr,
                                   tr_port                   port,
                                   const  uint8_t          * torrentHash,
-                                  tr_bool                   isSeed );
+                                  tr_bool                   isSeed,
+                                  tr_bool                   utp );
 
 tr_peerIo*  tr_peerIoNewIncoming( tr_session              * session,
                                   struct tr_bandwidth     * parent,
                                   const struct tr_address * addr,
                                   tr_port                   port,
-                                  int                       socket );
+                                  int                       socket,
+                                  struct tr_utp_socket    * utp );
 
 void tr_peerIoRefImpl           ( const char              * file,
                                   int                       line,
@@ -207,11 +261,29 @@ void                 tr_peerIoSetTorrentHash( tr_peerIo *     io,
 
 int                  tr_peerIoReconnect( tr_peerIo * io );
 
+/** @brief hand the peer's socket to a peer I/O shard thread, if sharding
+ *         is enabled. This is done once the peer's handshake is finished. */
+void                 tr_peerIoAttachShard( tr_peerIo * io );
+
+/**
+ * @brief decrypt input in bulk as it's read from the socket, instead of
+ *        a few bytes at a time as it's consumed.
+ *
+ * The handshake changes the encryption partway through the stream,
+ * so this can't be done until the handshake is finished.
+ */
+void                 tr_peerIoDecryptOnRead( tr_peerIo * io );
+
 static inline tr_bool tr_peerIoIsIncoming( const tr_peerIo * io )
 {
     return io->isIncoming;
 }
 
+static inline tr_bool tr_peerIoIsUTP( const tr_peerIo * io )
+{
+    return io->utp != NULL;
+}
+
 static inline int    tr_peerIoGetAge( const tr_peerIo * io )
 {
     return tr_time() - io->timeCreated;
@@ -283,6 +355,17 @@ tr_peerIoIsEncrypted( const tr_peerIo * io )
     return ( io != NULL ) && ( io->encryptionMode == PEER_ENCRYPTION_RC4 );
 }
 
+/**
+ * @return true if tr_peerIoWriteBytes() encrypts the bytes while copying
+ *         them into the output buffer. When it does, that's cheaper than
+ *         building an evbuffer for tr_peerIoWriteBuf() to encrypt in place.
+ */
+static inline tr_bool
+tr_peerIoEncryptsOnCopy( const tr_peerIo * io )
+{
+    return tr_peerIoIsEncrypted( io ) && ( io->shard == NULL );
+}
+
 static inline void
 evbuffer_add_uint8( struct evbuffer * outbuf, uint8_t byte )
 {
@@ -292,6 +375,24 @@ evbuffer_add_uint8( struct evbuffer * outbuf, uint8_t byte )
 void evbuffer_add_uint16( struct evbuffer * outbuf, uint16_t hs );
 void evbuffer_add_uint32( struct evbuffer * outbuf, uint32_t hl );
 
+/**
+ * @brief RC4 the `len' bytes of `buf' that start at `offset', in place.
+ *        TR_UP encrypts and TR_DOWN decrypts.
+ *
+ * The buffer's chunks are walked a few at a time, so nothing is allocated.
+ */
+void evbuffer_crypt( struct evbuffer   * buf,
+                     size_t              offset,
+                     size_t              len,
+                     struct tr_crypto  * crypto,
+                     tr_direction        dir );
+
+/** @brief append `len' bytes to `buf', encrypting them as they're copied */
+void evbuffer_add_encrypted( struct evbuffer   * buf,
+                             const void        * bytes,
+                             size_t              len,
+                             struct tr_crypto  * crypto );
+
 void tr_peerIoReadBytes( tr_peerIo        * io,
                          struct evbuffer  * inbuf,
                          void             * bytes,
@@ -320,7 +421,14 @@ void      tr_peerIoDrain( tr_peerIo        * io,
 ***
 **/
 
-size_t    tr_peerIoGetWriteBufferSpace( const tr_peerIo * io, uint64_t now );
+size_t    tr_peerIoGetWriteBufferSpace( tr_peerIo * io, uint64_t now );
+
+/**
+ * @brief Get the kernel's view of the peer's TCP connection.
+ * This is cached and only refreshed every so often.
+ * @return NULL if the round-trip time and congestion window aren't known
+ */
+const tr_tcp_info * tr_peerIoGetTCPInfo( tr_peerIo * io, uint64_t now );
 
 static inline void tr_peerIoSetParent( tr_peerIo            * io,
                                           struct tr_bandwidth  * parent )
@@ -367,6 +475,27 @@ int       tr_peerIoFlush( tr_peerIo     * io,
 
 int       tr_peerIoFlushOutgoingProtocolMsgs( tr_peerIo * io );
 
+/** @return how many system calls the peer's socket needed per MiB it moved */
+double    tr_peerIoGetSyscallsPerMB( const tr_peerIo * io );
+
+/**
+ * @brief Trim a write of howmuch bytes to end on a segment boundary.
+ *
+ * If more than howmuch bytes are queued, a write that spans more than one
+ * segment is cut back to a whole number of segments. The rest stays queued
+ * to go out at the front of the next write instead of as a runt segment.
+ *
+ * This is used by the transmit scheduler and exposed for testing.
+ */
+size_t    tr_peerIoTrimToSegments( size_t howmuch, size_t queued, unsigned int mss );
+
+/**
+ * @brief Stretch a write of byteCount bytes to fill out its last segment
+ * with whatever's queued behind it, so that a small protocol message
+ * doesn't go out in a segment of its own.
+ */
+size_t    tr_peerIoFillSegment( size_t byteCount, size_t queued, unsigned int mss );
+
 /**
 ***
 **/
@@ -0,0 +1,337 @@
+#include <limits.h> /* INT_MAX */
+#include <stdio.h>
+#include <stdlib.h> /* qsort */
+#include <string.h> /* strcmp */
+
+#include "transmission.h"
+#include "crypto.h"
+#include "peer-mgr.h"
+#include "utils.h"
+
+#undef VERBOSE
+
+static int test = 0;
+
+#ifdef VERBOSE
+  #define check( A ) \
+    { \
+        ++test; \
+        if( A ){ \
+            fprintf( stderr, "PASS test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+        } else { \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#else
+  #define check( A ) \
+    { \
+        ++test; \
+        if( !( A ) ){ \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#endif
+
+enum
+{
+    PEER_COUNT = 1000,
+    UPLOAD_SLOTS = 14
+};
+
+static tr_peer peers[PEER_COUNT];
+
+/* the same ordering that rechokeUploads() uses */
+static int
+compareChoke( const void * va, const void * vb )
+{
+    const tr_choke_data * a = va;
+    const tr_choke_data * b = vb;
+
+    if( a->rate != b->rate )
+        return a->rate > b->rate ? -1 : 1;
+    if( a->wasChoked != b->wasChoked )
+        return a->wasChoked ? 1 : -1;
+    if( a->salt != b->salt )
+        return a->salt - b->salt;
+    return 0;
+}
+
+static void
+makeChokeData( tr_choke_data * choke, int size )
+{
+    int i;
+
+    for( i=0; i<size; ++i )
+    {
+        tr_choke_data * c = &choke[i];
+        c->peer = &peers[i];
+        c->isInterested = tr_cryptoWeakRandInt( 3 ) != 0;
+        c->wasChoked = tr_cryptoWeakRandInt( 2 );
+        c->isChoked = TRUE;
+        c->rate = tr_cryptoWeakRandInt( 16 ) * 1024; /* lots of ties */
+        c->salt = tr_cryptoWeakRandInt( INT_MAX );
+    }
+}
+
+/* the old way: sort them all, then walk until the slots are full */
+static int
+referenceSelectUnchoked( tr_choke_data * choke, int size, int slots )
+{
+    int i, unchokedInterested = 0;
+
+    qsort( choke, size, sizeof( tr_choke_data ), compareChoke );
+
+    for( i=0; i<size && unchokedInterested<slots; ++i ) {
+        choke[i].isChoked = FALSE;
+        if( choke[i].isInterested )
+            ++unchokedInterested;
+    }
+
+    return i;
+}
+
+static tr_bool
+isUnchoked( const tr_choke_data * choke, int size, const tr_peer * peer )
+{
+    int i;
+
+    for( i=0; i<size; ++i )
+        if( choke[i].peer == peer )
+            return !choke[i].isChoked;
+
+    return FALSE;
+}
+
+static int
+test_select_unchoked( int size, int slots )
+{
+    int i, n, refn;
+    tr_choke_data * choke = tr_new( tr_choke_data, size );
+    tr_choke_data * ref = tr_new( tr_choke_data, size );
+
+    makeChokeData( choke, size );
+    memcpy( ref, choke, sizeof( tr_choke_data ) * size );
+
+    n = tr_peerMgrSelectUnchoked( choke, size, slots, FALSE );
+    refn = referenceSelectUnchoked( ref, size, slots );
+    check( n == refn );
+
+    /* the unchoked peers are at the front... */
+    for( i=0; i<size; ++i )
+        check( choke[i].isChoked == ( i >= n ) );
+
+    /* ...and they're the same ones as if we'd sorted everything */
+    for( i=0; i<n; ++i )
+        check( isUnchoked( ref, size, choke[i].peer ) );
+
+    tr_free( ref );
+    tr_free( choke );
+    return 0;
+}
+
+static int
+test_maxed_out( void )
+{
+    int i, n;
+    tr_choke_data choke[100];
+
+    /* if we're maxed out, the selected peers keep their old state */
+    makeChokeData( choke, 100 );
+    n = tr_peerMgrSelectUnchoked( choke, 100, 4, TRUE );
+    for( i=0; i<n; ++i )
+        check( choke[i].isChoked == choke[i].wasChoked );
+    for( ; i<100; ++i )
+        check( choke[i].isChoked );
+
+    /* no slots means no unchoking */
+    makeChokeData( choke, 100 );
+    n = tr_peerMgrSelectUnchoked( choke, 100, 0, FALSE );
+    check( n == 0 );
+
+    return 0;
+}
+
+static int
+test_request_rtt( void )
+{
+    tr_peer * peer = &peers[0];
+    const uint64_t now = 1000000;
+
+    peer->requestRTT_msec = 0;
+
+    /* the first sample is taken as-is, however it came back */
+    tr_peerUpdateRequestRTT( peer, now - 400, FALSE, now );
+    check( peer->requestRTT_msec == 400 );
+
+    /* a request that was first in line is averaged in */
+    tr_peerUpdateRequestRTT( peer, now - 80, TRUE, now );
+    check( peer->requestRTT_msec == ( 7 * 400 + 80 ) / 8 );
+
+    /* one that waited behind others can only lower it */
+    tr_peerUpdateRequestRTT( peer, now - 2000, FALSE, now );
+    check( peer->requestRTT_msec == ( 7 * 400 + 80 ) / 8 );
+    tr_peerUpdateRequestRTT( peer, now - 100, FALSE, now );
+    check( peer->requestRTT_msec == 100 );
+
+    /* clocks that go backwards are ignored, and it never drops to 0 */
+    tr_peerUpdateRequestRTT( peer, now + 10, TRUE, now );
+    check( peer->requestRTT_msec == 100 );
+    tr_peerUpdateRequestRTT( peer, now, FALSE, now );
+    check( peer->requestRTT_msec == 1 );
+
+    return 0;
+}
+
+static int
+test_half_open( void )
+{
+    int i, n;
+    tr_half_open h;
+    uint64_t now = 1000000;
+
+    tr_halfOpenInit( &h );
+    n = tr_halfOpenAvailable( &h );
+    check( n > 0 );
+
+    /* slow start: answers to a full window double it */
+    for( i=0; i<n; ++i )
+        tr_halfOpenStarted( &h );
+    check( tr_halfOpenAvailable( &h ) == 0 );
+    for( i=0; i<n; ++i )
+        tr_halfOpenAnswered( &h, i % 2 );
+    check( h.inFlight == 0 );
+    check( h.window == n * 2 );
+    check( h.answered == (uint64_t)n );
+    check( h.refused == (uint64_t)n / 2 );
+
+    /* a window that isn't being used doesn't grow */
+    n = h.window;
+    tr_halfOpenStarted( &h );
+    tr_halfOpenAnswered( &h, FALSE );
+    check( h.window == n );
+
+    /* a few timeouts among the answers don't shrink it */
+    for( i=0; i<n; ++i )
+        tr_halfOpenStarted( &h );
+    for( i=0; i<n; ++i ) {
+        if( i % 4 )
+            tr_halfOpenAnswered( &h, FALSE );
+        else
+            tr_halfOpenTimedOut( &h, now );
+    }
+    check( h.window > n );
+    check( h.timedOut == (uint64_t)( n + 3 ) / 4 );
+
+    /* but when most of them time out, it's halved once... */
+    n = h.window;
+    for( i=0; i<n; ++i )
+        tr_halfOpenStarted( &h );
+    for( i=0; i<n; ++i )
+        tr_halfOpenTimedOut( &h, now );
+    check( h.window == n / 2 );
+    check( h.threshold == n / 2 );
+
+    /* ...and not again until the connects that were already out have had
+     * time to time out too. After that, it can be halved again */
+    n = h.window;
+    tr_halfOpenStarted( &h );
+    tr_halfOpenTimedOut( &h, now + 1000 );
+    check( h.window == n );
+    tr_halfOpenStarted( &h );
+    tr_halfOpenTimedOut( &h, now + 60000 );
+    check( h.window == n / 2 );
+
+    /* past the threshold, it grows by one per window of answers */
+    tr_halfOpenInit( &h );
+    h.threshold = h.window;
+    n = h.window;
+    for( i=0; i<n; ++i )
+        tr_halfOpenStarted( &h );
+    for( i=0; i<n; ++i )
+        tr_halfOpenAnswered( &h, FALSE );
+    check( h.window == n + 1 );
+
+    /* it never shrinks below the minimum, however bad things get */
+    for( i=0; i<20; ++i ) {
+        now += 60000;
+        tr_halfOpenStarted( &h );
+        tr_halfOpenTimedOut( &h, now );
+    }
+    check( h.window > 0 );
+    check( tr_halfOpenAvailable( &h ) == h.window );
+
+    /* connects that we cancel just give back their slots */
+    n = h.window;
+    tr_halfOpenStarted( &h );
+    check( tr_halfOpenAvailable( &h ) == n - 1 );
+    tr_halfOpenCancelled( &h );
+    check( tr_halfOpenAvailable( &h ) == n );
+    check( h.window == n );
+
+    return 0;
+}
+
+/* time the old full sort against partial selection for a 1,000-peer torrent */
+static void
+benchmark( void )
+{
+    int i;
+    const int loops = 2000;
+    uint64_t begin, sortUsec, selectUsec;
+    tr_choke_data * orig = tr_new( tr_choke_data, PEER_COUNT );
+    tr_choke_data * choke = tr_new( tr_choke_data, PEER_COUNT );
+
+    makeChokeData( orig, PEER_COUNT );
+
+    begin = tr_time_usec( );
+    for( i=0; i<loops; ++i ) {
+        memcpy( choke, orig, sizeof( tr_choke_data ) * PEER_COUNT );
+        referenceSelectUnchoked( choke, PEER_COUNT, UPLOAD_SLOTS );
+    }
+    sortUsec = tr_time_usec( ) - begin;
+
+    begin = tr_time_usec( );
+    for( i=0; i<loops; ++i ) {
+        memcpy( choke, orig, sizeof( tr_choke_data ) * PEER_COUNT );
+        tr_peerMgrSelectUnchoked( choke, PEER_COUNT, UPLOAD_SLOTS, FALSE );
+    }
+    selectUsec = tr_time_usec( ) - begin;
+
+    printf( "%d rechokes of %d peers: qsort %.1f usec/rechoke, "
+            "partial selection %.1f usec/rechoke\n",
+            loops, PEER_COUNT,
+            sortUsec / (double)loops,
+            selectUsec / (double)loops );
+
+    tr_free( choke );
+    tr_free( orig );
+}
+
+int
+main( int argc, char ** argv )
+{
+    int i;
+    int l;
+
+    for( l=0; l<20; ++l ) {
+        if( ( i = test_select_unchoked( PEER_COUNT, UPLOAD_SLOTS ) ) )
+            return i;
+        if( ( i = test_select_unchoked( 10, UPLOAD_SLOTS ) ) )
+            return i;
+        if( ( i = test_select_unchoked( 50, 1 ) ) )
+            return i;
+    }
+    if( ( i = test_maxed_out( ) ) )
+        return i;
+    if( ( i = test_request_rtt( ) ) )
+        return i;
+    if( ( i = test_half_open( ) ) )
+        return i;
+
+    if( ( argc > 1 ) && !strcmp( argv[1], "--benchmark" ) )
+        benchmark( );
+
+    return 0;
+}
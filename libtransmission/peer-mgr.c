@@ -36,6 +36,7 @@
 #include "session.h"
 #include "stats.h" /* tr_statsAddUploaded, tr_statsAddDownloaded */
 #include "torrent.h"
+#include "tr-utp.h"
 #include "utils.h"
 #include "webseed.h"
 
@@ -66,11 +67,19 @@ enum
     /* when few peers are available, keep idle ones this long */
     MAX_UPLOAD_IDLE_SECS = ( 60 * 5 ),
 
-    /* max number of peers to ask for per second overall.
+    /* the half-open connection window; see tr_half_open.
      * this throttle is to avoid overloading the router */
-    MAX_CONNECTIONS_PER_SECOND = 12,
+    HALF_OPEN_INITIAL_WINDOW = 8,
+    HALF_OPEN_MIN_WINDOW = 4,
+    HALF_OPEN_MAX_WINDOW = 128,
 
-    MAX_CONNECTIONS_PER_PULSE = (int)(MAX_CONNECTIONS_PER_SECOND * (RECONNECT_PERIOD_MSEC/1000.0)),
+    /* halve the window when this many percent of connects are timing out */
+    HALF_OPEN_CONGESTED_PERCENT = 50,
+
+    /* give up on a connect that hasn't been answered in this long.
+     * that's time for three SYN retransmits, and a live peer will
+     * almost always have answered by then */
+    CONNECT_TIMEOUT_SECS = 8,
 
     /* number of bad pieces a peer is allowed to send before we ban them */
     MAX_BAD_PIECES_PER_PEER = 5,
@@ -87,6 +96,10 @@ enum
      * if they try to connect to us it's okay */
     MYFLAG_UNREACHABLE = 2,
 
+    /* use for bitwise operations w/peer_atom.flags2 */
+    /* the peer didn't answer over uTP, so use TCP next time */
+    MYFLAG_UTP_FAILED = 4,
+
     /* the minimum we'll wait before attempting to reconnect to a peer */
     MINIMUM_RECONNECT_INTERVAL_SECS = 5,
 
@@ -167,7 +180,17 @@ struct block_request
 {
     tr_block_index_t block;
     tr_peer * peer;
-    time_t sentAt;
+    uint64_t sentAt; /* tr_time_msec() */
+
+    /* true if nothing else was pending from the peer when it was sent */
+    tr_bool wasFirstInLine;
+
+    /* the next request in the same hash bucket */
+    struct block_request * next;
+
+    /* neighbors in the peer's list of requests */
+    struct block_request * peerPrev;
+    struct block_request * peerNext;
 };
 
 struct weighted_piece
@@ -182,6 +205,8 @@ typedef struct tr_torrent_peers
 {
     tr_ptrArray                outgoingHandshakes; /* tr_handshake */
     tr_ptrArray                pool; /* struct peer_atom */
+    struct peer_atom        ** atomTable; /* open-addressing index of pool, keyed by address */
+    int                        atomTableSize; /* zero or a power of two */
     tr_ptrArray                peers; /* tr_peer */
     tr_ptrArray                webseeds; /* tr_webseed */
 
@@ -194,16 +219,29 @@ typedef struct tr_torrent_peers
     tr_bool                    isRunning;
     tr_bool                    needsCompletenessCheck;
 
-    struct block_request     * requests;
+    struct block_request    ** requests; /* hash buckets, keyed by block */
     int                        requestCount;
-    int                        requestAlloc;
+    int                        requestBucketCount;
 
     struct weighted_piece    * pieces;
     int                        pieceCount;
+    int                        pieceSortState;
+
+    /* how many connected peers have each piece, or NULL if not built yet */
+    uint16_t                 * pieceReplication;
+    size_t                     pieceReplicationSize;
 
     int                        interestedCount;
     int                        maxPeers;
     time_t                     lastCancel;
+
+    /* atoms from the pool that we may want to connect to.
+     * This is rebuilt when candidatesDirty is set, or when an atom
+     * that we were waiting on to retry becomes eligible again. */
+    tr_ptrArray                candidates; /* struct peer_atom */
+    tr_bool                    candidatesDirty;
+    tr_bool                    candidatesBuiltAsSeed;
+    time_t                     candidatesExpireAt;
 }
 Torrent;
 
@@ -211,10 +249,14 @@ struct tr_peerMgr
 {
     tr_session    * session;
     tr_ptrArray     incomingHandshakes; /* tr_handshake */
+    tr_ptrArray     halfOpenHandshakes; /* tr_handshake, sorted by pointer */
+    tr_half_open    halfOpen;
     struct event  * bandwidthTimer;
     struct event  * rechokeTimer;
     struct event  * refillUpkeepTimer;
     struct event  * atomTimer;
+
+    tr_peer_connection_stats connectionStats;
 };
 
 #define tordbg( t, ... ) \
@@ -290,24 +332,6 @@ getExistingHandshake( tr_ptrArray * handshakes, const tr_address * addr )
     return tr_ptrArrayFindSorted( handshakes, addr, handshakeCompareToAddr );
 }
 
-static int
-comparePeerAtomToAddress( const void * va, const void * vb )
-{
-    const struct peer_atom * a = va;
-
-    return tr_compareAddresses( &a->addr, vb );
-}
-
-static int
-compareAtomsByAddress( const void * va, const void * vb )
-{
-    const struct peer_atom * b = vb;
-
-    assert( tr_isAtom( b ) );
-
-    return comparePeerAtomToAddress( va, &b->addr );
-}
-
 /**
 ***
 **/
@@ -333,13 +357,102 @@ peerCompare( const void * a, const void * b )
     return tr_compareAddresses( tr_peerAddress( a ), tr_peerAddress( b ) );
 }
 
+/**
+*** The atom table is an open-addressing hash table with linear probing
+*** that indexes Torrent::pool by address. Atoms are only ever removed
+*** from the pool in bulk, so the table is rebuilt rather than having
+*** to support deletion.
+**/
+
+enum
+{
+    ATOM_TABLE_SIZE_MIN = 64
+};
+
+/* seeded per-session so that peers can't choose colliding addresses */
+static unsigned int atomHashSalt = 0;
+
+static unsigned int
+atomHash( const tr_address * addr )
+{
+    size_t i;
+    unsigned int h = 2166136261u ^ atomHashSalt; /* FNV-1a */
+    const uint8_t * bytes = (const uint8_t*) &addr->addr;
+    const size_t n = addr->type == TR_AF_INET ? sizeof( struct in_addr )
+                                              : sizeof( struct in6_addr );
+
+    for( i=0; i<n; ++i ) {
+        h ^= bytes[i];
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+static void
+atomTableInsert( Torrent * t, struct peer_atom * atom )
+{
+    const int mask = t->atomTableSize - 1;
+    int i = atomHash( &atom->addr ) & mask;
+
+    while( t->atomTable[i] != NULL )
+        i = ( i + 1 ) & mask;
+
+    t->atomTable[i] = atom;
+}
+
+static void
+atomTableRebuild( Torrent * t )
+{
+    int i;
+    const int n = tr_ptrArraySize( &t->pool );
+    struct peer_atom ** atoms = (struct peer_atom**) tr_ptrArrayBase( &t->pool );
+
+    /* keep the load factor at or below 50% */
+    t->atomTableSize = ATOM_TABLE_SIZE_MIN;
+    while( t->atomTableSize < n * 2 )
+        t->atomTableSize *= 2;
+
+    tr_free( t->atomTable );
+    t->atomTable = tr_new0( struct peer_atom*, t->atomTableSize );
+
+    for( i=0; i<n; ++i )
+        atomTableInsert( t, atoms[i] );
+}
+
+static void
+addAtomToPool( Torrent * t, struct peer_atom * atom )
+{
+    tr_ptrArrayAppend( &t->pool, atom );
+
+    if( tr_ptrArraySize( &t->pool ) * 2 > t->atomTableSize )
+        atomTableRebuild( t );
+    else
+        atomTableInsert( t, atom );
+}
+
 static struct peer_atom*
 getExistingAtom( const Torrent    * t,
                  const tr_address * addr )
 {
-    Torrent * tt = (Torrent*)t;
     assert( torrentIsLocked( t ) );
-    return tr_ptrArrayFindSorted( &tt->pool, addr, comparePeerAtomToAddress );
+
+    if( t->atomTableSize > 0 )
+    {
+        struct peer_atom * atom;
+        const int mask = t->atomTableSize - 1;
+        int i = atomHash( addr ) & mask;
+
+        while(( atom = t->atomTable[i] ))
+        {
+            if( !tr_compareAddresses( &atom->addr, addr ) )
+                return atom;
+
+            i = ( i + 1 ) & mask;
+        }
+    }
+
+    return NULL;
 }
 
 static tr_bool
@@ -354,6 +467,14 @@ peerIsInUse( const Torrent * ct, const struct peer_atom * atom )
         || getExistingHandshake( &t->manager->incomingHandshakes, &atom->addr );
 }
 
+/* an atom's state changed in a way that may change whether
+ * it's a connection candidate, so rebuild the candidate list */
+static inline void
+candidatesSetDirty( Torrent * t )
+{
+    t->candidatesDirty = TRUE;
+}
+
 static tr_peer*
 peerConstructor( struct peer_atom * atom )
 {
@@ -391,6 +512,9 @@ getPeer( Torrent * torrent, struct peer_atom * atom )
 }
 
 static void peerDeclinedAllRequests( Torrent *, const tr_peer * );
+static void requestListFree( Torrent * );
+static void replicationFree( Torrent * );
+static void tr_decrReplicationFromBitset( Torrent *, const tr_bitset * );
 
 static void
 peerDestructor( Torrent * t, tr_peer * peer )
@@ -399,6 +523,8 @@ peerDestructor( Torrent * t, tr_peer * peer )
 
     peerDeclinedAllRequests( t, peer );
 
+    tr_decrReplicationFromBitset( t, &peer->have );
+
     if( peer->msgs != NULL )
         tr_peerMsgsFree( peer->msgs );
 
@@ -428,6 +554,7 @@ removePeer( Torrent * t, tr_peer * peer )
     assert( atom );
 
     atom->time = tr_time( );
+    candidatesSetDirty( t );
 
     removed = tr_ptrArrayRemoveSorted( &t->peers, peer, peerCompare );
     assert( removed == peer );
@@ -453,11 +580,14 @@ torrentDestructor( void * vt )
     assert( tr_ptrArrayEmpty( &t->peers ) );
 
     tr_ptrArrayDestruct( &t->webseeds, (PtrArrayForeachFunc)tr_webseedFree );
+    tr_ptrArrayDestruct( &t->candidates, NULL );
     tr_ptrArrayDestruct( &t->pool, (PtrArrayForeachFunc)tr_free );
+    tr_free( t->atomTable );
     tr_ptrArrayDestruct( &t->outgoingHandshakes, NULL );
     tr_ptrArrayDestruct( &t->peers, NULL );
 
-    tr_free( t->requests );
+    requestListFree( t );
+    replicationFree( t );
     tr_free( t->pieces );
     tr_free( t );
 }
@@ -475,6 +605,8 @@ torrentConstructor( tr_peerMgr * manager,
     t->manager = manager;
     t->tor = tor;
     t->pool = TR_PTR_ARRAY_INIT;
+    t->candidates = TR_PTR_ARRAY_INIT;
+    t->candidatesDirty = TRUE;
     t->peers = TR_PTR_ARRAY_INIT;
     t->webseeds = TR_PTR_ARRAY_INIT;
     t->outgoingHandshakes = TR_PTR_ARRAY_INIT;
@@ -494,7 +626,11 @@ tr_peerMgrNew( tr_session * session )
 {
     tr_peerMgr * m = tr_new0( tr_peerMgr, 1 );
     m->session = session;
+    if( !atomHashSalt )
+        atomHashSalt = tr_cryptoWeakRandInt( INT_MAX );
     m->incomingHandshakes = TR_PTR_ARRAY_INIT;
+    m->halfOpenHandshakes = TR_PTR_ARRAY_INIT;
+    tr_halfOpenInit( &m->halfOpen );
     return m;
 }
 
@@ -530,6 +666,7 @@ tr_peerMgrFree( tr_peerMgr * manager )
         tr_handshakeAbort( tr_ptrArrayNth( &manager->incomingHandshakes, 0 ) );
 
     tr_ptrArrayDestruct( &manager->incomingHandshakes, NULL );
+    tr_ptrArrayDestruct( &manager->halfOpenHandshakes, NULL );
 
     managerUnlock( manager );
     tr_free( manager );
@@ -571,6 +708,7 @@ tr_peerMgrOnBlocklistChanged( tr_peerMgr * mgr )
             struct peer_atom * atom = tr_ptrArrayNth( &t->pool, i );
             atom->blocklisted = -1;
         }
+        candidatesSetDirty( t );
     }
 }
 
@@ -634,10 +772,12 @@ tr_peerMgrPeerIsSeed( const tr_torrent  * tor,
 ***
 *** There are two data structures associated with managing block requests:
 ***
-*** 1. Torrent::requests, an array of "struct block_request" which keeps
+*** 1. Torrent::requests, a hash table of "struct block_request" which keeps
 ***    track of which blocks have been requested, and when, and by which peers.
 ***    This is list is used for (a) cancelling requests that have been pending
 ***    for too long and (b) avoiding duplicate requests before endgame.
+***    Each request is also linked into its peer's list, tr_peer::requests,
+***    so that a peer's requests can be dropped without walking the table.
 ***
 *** 2. Torrent::pieces, an array of "struct weighted_piece" which lists the
 ***    pieces that we want to request. It's used to decide which blocks to
@@ -648,57 +788,101 @@ tr_peerMgrPeerIsSeed( const tr_torrent  * tor,
 *** struct block_request
 **/
 
-static int
-compareReqByBlock( const void * va, const void * vb )
+enum
 {
-    const struct block_request * a = va;
-    const struct block_request * b = vb;
-
-    /* primary key: block */
-    if( a->block < b->block ) return -1;
-    if( a->block > b->block ) return 1;
-
-    /* secondary key: peer */
-    if( a->peer < b->peer ) return -1;
-    if( a->peer > b->peer ) return 1;
+    /* initial number of hash buckets in Torrent::requests. must be a power of 2 */
+    REQUEST_BUCKETS_MIN = 256
+};
 
-    return 0;
+/* The blocks we have in flight are usually runs of neighbors from a few
+ * pieces, so the low bits of the block index spread them evenly */
+static inline int
+requestListBucket( const Torrent * t, tr_block_index_t block )
+{
+    return block & ( t->requestBucketCount - 1 );
 }
 
 static void
-requestListAdd( Torrent * t, tr_block_index_t block, tr_peer * peer )
+requestListRehash( Torrent * t, int bucketCount )
 {
-    struct block_request key;
+    int i;
+    struct block_request ** old = t->requests;
+    const int oldCount = t->requestBucketCount;
 
-    /* ensure enough room is available... */
-    if( t->requestCount + 1 >= t->requestAlloc )
+    t->requests = tr_new0( struct block_request*, bucketCount );
+    t->requestBucketCount = bucketCount;
+
+    for( i=0; i<oldCount; ++i )
     {
-        const int CHUNK_SIZE = 128;
-        t->requestAlloc += CHUNK_SIZE;
-        t->requests = tr_renew( struct block_request,
-                                t->requests, t->requestAlloc );
+        struct block_request * b = old[i];
+
+        while( b != NULL )
+        {
+            struct block_request * next = b->next;
+            const int pos = requestListBucket( t, b->block );
+            b->next = t->requests[pos];
+            t->requests[pos] = b;
+            b = next;
+        }
     }
 
-    /* populate the record we're inserting */
-    key.block = block;
-    key.peer = peer;
-    key.sentAt = tr_time( );
+    tr_free( old );
+}
 
-    /* insert the request to our array... */
+static void
+requestListFree( Torrent * t )
+{
+    int i;
+
+    for( i=0; i<t->requestBucketCount; ++i )
     {
-        tr_bool exact;
-        const int pos = tr_lowerBound( &key, t->requests, t->requestCount,
-                                       sizeof( struct block_request ),
-                                       compareReqByBlock, &exact );
-        assert( !exact );
-        memmove( t->requests + pos + 1,
-                 t->requests + pos,
-                 sizeof( struct block_request ) * ( t->requestCount++ - pos ) );
-        t->requests[pos] = key;
+        struct block_request * b = t->requests[i];
+
+        while( b != NULL )
+        {
+            struct block_request * next = b->next;
+            tr_free( b );
+            b = next;
+        }
     }
 
+    tr_free( t->requests );
+    t->requests = NULL;
+    t->requestBucketCount = 0;
+    t->requestCount = 0;
+}
+
+static void
+requestListAdd( Torrent * t, tr_block_index_t block, tr_peer * peer )
+{
+    int pos;
+    struct block_request * b;
+
+    /* keep the load factor at or below 1 */
+    if( t->requestCount >= t->requestBucketCount )
+        requestListRehash( t, MAX( REQUEST_BUCKETS_MIN, t->requestBucketCount * 2 ) );
+
+    /* populate the record we're inserting */
+    b = tr_new0( struct block_request, 1 );
+    b->block = block;
+    b->peer = peer;
+    b->sentAt = tr_time_msec( );
+    b->wasFirstInLine = ( peer != NULL ) && ( peer->pendingReqsToPeer == 0 );
+
+    /* insert the request to our table... */
+    pos = requestListBucket( t, block );
+    b->next = t->requests[pos];
+    t->requests[pos] = b;
+    ++t->requestCount;
+
+    /* ...and to the peer's list */
     if( peer != NULL )
     {
+        b->peerNext = peer->requests;
+        if( b->peerNext != NULL )
+            b->peerNext->peerPrev = b;
+        peer->requests = b;
+
         ++peer->pendingReqsToPeer;
         assert( peer->pendingReqsToPeer >= 0 );
     }
@@ -711,38 +895,31 @@ requestListAdd( Torrent * t, tr_block_index_t block, tr_peer * peer )
 static struct block_request *
 requestListLookup( Torrent * t, tr_block_index_t block, const tr_peer * peer )
 {
-    struct block_request key;
-    key.block = block;
-    key.peer = (tr_peer*) peer;
+    struct block_request * b;
 
-    return bsearch( &key, t->requests, t->requestCount,
-                    sizeof( struct block_request ),
-                    compareReqByBlock );
+    if( t->requestCount == 0 )
+        return NULL;
+
+    for( b=t->requests[requestListBucket( t, block )]; b!=NULL; b=b->next )
+        if( ( b->block == block ) && ( b->peer == peer ) )
+            return b;
+
+    return NULL;
 }
 
 /* how many peers are we currently requesting this block from... */
 static int
 countBlockRequests( Torrent * t, tr_block_index_t block )
 {
-    tr_bool exact;
-    int i, n, pos;
-    struct block_request key;
-
-    key.block = block;
-    key.peer = NULL;
-    pos = tr_lowerBound( &key, t->requests, t->requestCount,
-                         sizeof( struct block_request ),
-                         compareReqByBlock, &exact );
+    int n = 0;
+    const struct block_request * b;
 
-    assert( !exact ); /* shouldn't have a request with .peer == NULL */
+    if( t->requestCount == 0 )
+        return 0;
 
-    n = 0;
-    for( i=pos; i<t->requestCount; ++i ) {
-        if( t->requests[i].block == block )
+    for( b=t->requests[requestListBucket( t, block )]; b!=NULL; b=b->next )
+        if( b->block == block )
             ++n;
-        else
-            break;
-    }
 
     return n;
 }
@@ -755,25 +932,62 @@ decrementPendingReqCount( const struct block_request * b )
             --b->peer->pendingReqsToPeer;
 }
 
+void
+tr_peerUpdateRequestRTT( tr_peer  * peer,
+                         uint64_t   sentAt,
+                         tr_bool    wasFirstInLine,
+                         uint64_t   now )
+{
+    uint32_t sample;
+
+    if( now < sentAt )
+        return;
+
+    sample = MAX( 1, (uint32_t)( now - sentAt ) );
+
+    if( !peer->requestRTT_msec )
+        peer->requestRTT_msec = sample;
+    else if( wasFirstInLine ) /* smooth it the way TCP smooths its RTT */
+        peer->requestRTT_msec = ( 7 * peer->requestRTT_msec + sample ) / 8;
+    else if( sample < peer->requestRTT_msec )
+        peer->requestRTT_msec = sample;
+}
+
 static void
 requestListRemove( Torrent * t, tr_block_index_t block, const tr_peer * peer )
 {
-    const struct block_request * b = requestListLookup( t, block, peer );
-    if( b != NULL )
+    struct block_request ** walk;
+
+    if( t->requestCount == 0 )
+        return;
+
+    for( walk=&t->requests[requestListBucket( t, block )]; *walk!=NULL; walk=&(*walk)->next )
     {
-        const int pos = b - t->requests;
-        assert( pos < t->requestCount );
+        struct block_request * b = *walk;
 
-        decrementPendingReqCount( b );
+        if( ( b->block == block ) && ( b->peer == peer ) )
+        {
+            *walk = b->next;
+            --t->requestCount;
 
-        tr_removeElementFromArray( t->requests,
-                                   pos,
-                                   sizeof( struct block_request ),
-                                   t->requestCount-- );
+            if( b->peer != NULL )
+            {
+                if( b->peerPrev != NULL )
+                    b->peerPrev->peerNext = b->peerNext;
+                else
+                    b->peer->requests = b->peerNext;
+                if( b->peerNext != NULL )
+                    b->peerNext->peerPrev = b->peerPrev;
+            }
 
-        /*fprintf( stderr, "removing request of block %lu from peer %s... "
-                           "there are now %d block requests left\n",
-                           (unsigned long)block, tr_atomAddrStr( peer->atom ), t->requestCount );*/
+            decrementPendingReqCount( b );
+            tr_free( b );
+
+            /*fprintf( stderr, "removing request of block %lu from peer %s... "
+                               "there are now %d block requests left\n",
+                               (unsigned long)block, tr_atomAddrStr( peer->atom ), t->requestCount );*/
+            break;
+        }
     }
 }
 
@@ -790,6 +1004,15 @@ enum
 
 const tr_torrent * weightTorrent;
 
+const uint16_t * weightReplication;
+
+static void
+setComparePieceByWeightTorrent( Torrent * t )
+{
+    weightTorrent = t->tor;
+    weightReplication = t->pieceReplication;
+}
+
 /* we try to create a "weight" s.t. high-priority pieces come before others,
  * and that partially-complete pieces come before empty ones. */
 static int
@@ -816,7 +1039,16 @@ comparePieceByWeight( const void * va, const void * vb )
     if( ia > ib ) return -1;
     if( ia < ib ) return 1;
 
-    /* tertiary key: random */
+    /* tertiary key: rarest first */
+    if( weightReplication != NULL )
+    {
+        ia = weightReplication[a->index];
+        ib = weightReplication[b->index];
+        if( ia < ib ) return -1;
+        if( ia > ib ) return 1;
+    }
+
+    /* quaternary key: random */
     if( a->salt < b->salt ) return -1;
     if( a->salt > b->salt ) return 1;
 
@@ -840,12 +1072,14 @@ pieceListSort( Torrent * t, int mode )
     assert( mode==PIECES_SORTED_BY_INDEX
          || mode==PIECES_SORTED_BY_WEIGHT );
 
-    weightTorrent = t->tor;
+    setComparePieceByWeightTorrent( t );
 
     if( mode == PIECES_SORTED_BY_WEIGHT )
         qsort( t->pieces, t->pieceCount, sizeof( struct weighted_piece ), comparePieceByWeight );
     else
         qsort( t->pieces, t->pieceCount, sizeof( struct weighted_piece ), comparePieceByIndex );
+
+    t->pieceSortState = mode;
 }
 
 static tr_bool
@@ -877,7 +1111,7 @@ assertWeightedPiecesAreSorted( Torrent * t )
     if( !isInEndgame( t ) )
     {
         int i;
-        weightTorrent = t->tor;
+        setComparePieceByWeightTorrent( t );
         for( i=0; i<t->pieceCount-1; ++i )
             assert( comparePieceByWeight( &t->pieces[i], &t->pieces[i+1] ) <= 0 );
     }
@@ -996,9 +1230,13 @@ pieceListResortPiece( Torrent * t, struct weighted_piece * p )
     if( p == NULL )
         return;
 
+    /* if the list isn't sorted, this piece will be sorted with the rest of it */
+    if( t->pieceSortState != PIECES_SORTED_BY_WEIGHT )
+        return;
+
     /* is the torrent already sorted? */
     pos = p - t->pieces;
-    weightTorrent = t->tor;
+    setComparePieceByWeightTorrent( t );
     if( isSorted && ( pos > 0 ) && ( comparePieceByWeight( p-1, p ) > 0 ) )
         isSorted = FALSE;
     if( isSorted && ( pos < t->pieceCount - 1 ) && ( comparePieceByWeight( p, p+1 ) > 0 ) )
@@ -1046,6 +1284,133 @@ pieceListRemoveRequest( Torrent * t, tr_block_index_t block )
     assertWeightedPiecesAreSorted( t );
 }
 
+/**
+*** Replication count (for rarest first policy)
+**/
+
+static tr_bool
+replicationExists( const Torrent * t )
+{
+    return t->pieceReplication != NULL;
+}
+
+static void
+replicationFree( Torrent * t )
+{
+    tr_free( t->pieceReplication );
+    t->pieceReplication = NULL;
+    t->pieceReplicationSize = 0;
+}
+
+/* Add `delta' to the replication count of each piece in the bitfield.
+ * The inner loop is branch-free so that the compiler can vectorize it */
+static void
+replicationAddBitfield( Torrent * t, const tr_bitfield * b, int delta )
+{
+    size_t i;
+    uint16_t * rep = t->pieceReplication;
+    const size_t n = MIN( t->pieceReplicationSize, b->bitCount );
+    const size_t fullBytes = n / 8u;
+
+    for( i=0; i<fullBytes; ++i )
+    {
+        const unsigned int bits = b->bits[i];
+
+        if( bits != 0 )
+        {
+            int j;
+            uint16_t * r = rep + ( i * 8u );
+            for( j=0; j<8; ++j )
+                r[j] += delta * (int)( ( bits >> ( 7 - j ) ) & 1u );
+        }
+    }
+
+    for( i=fullBytes*8u; i<n; ++i )
+        if( tr_bitfieldHasFast( b, i ) )
+            rep[i] += delta;
+}
+
+static void
+replicationAddAll( Torrent * t, int delta )
+{
+    size_t i;
+    uint16_t * rep = t->pieceReplication;
+    const size_t n = t->pieceReplicationSize;
+
+    for( i=0; i<n; ++i )
+        rep[i] += delta;
+}
+
+static void
+replicationAddBitset( Torrent * t, const tr_bitset * b, int delta )
+{
+    if( b->haveAll )
+        replicationAddAll( t, delta );
+    else if( !b->haveNone )
+        replicationAddBitfield( t, &b->bitfield, delta );
+}
+
+static void
+replicationNew( Torrent * t )
+{
+    int i;
+    const int peerCount = tr_ptrArraySize( &t->peers );
+    tr_peer ** peers = (tr_peer**) tr_ptrArrayBase( &t->peers );
+
+    assert( !replicationExists( t ) );
+
+    /* we can't count pieces until we know how many there are */
+    if( !tr_torrentHasMetadata( t->tor ) )
+        return;
+
+    t->pieceReplicationSize = t->tor->info.pieceCount;
+    t->pieceReplication = tr_new0( uint16_t, t->pieceReplicationSize );
+
+    for( i=0; i<peerCount; ++i )
+        replicationAddBitset( t, &peers[i]->have, 1 );
+
+    if( t->pieceSortState == PIECES_SORTED_BY_WEIGHT )
+        t->pieceSortState = PIECES_UNSORTED;
+}
+
+static void
+tr_incrReplicationOfPiece( Torrent * t, const size_t index )
+{
+    assert( replicationExists( t ) );
+
+    if( index < t->pieceReplicationSize )
+    {
+        ++t->pieceReplication[index];
+
+        /* if the piece list is sorted by weight, resort this piece */
+        if( t->pieceSortState == PIECES_SORTED_BY_WEIGHT )
+            pieceListResortPiece( t, pieceListLookup( t, index ) );
+    }
+}
+
+static void
+tr_incrReplicationFromBitset( Torrent * t, const tr_bitset * b )
+{
+    assert( replicationExists( t ) );
+
+    replicationAddBitset( t, b, 1 );
+
+    if( t->pieceSortState == PIECES_SORTED_BY_WEIGHT )
+        t->pieceSortState = PIECES_UNSORTED;
+}
+
+static void
+tr_decrReplicationFromBitset( Torrent * t, const tr_bitset * b )
+{
+    if( replicationExists( t ) )
+    {
+        replicationAddBitset( t, b, -1 );
+
+        if( t->pieceSortState == PIECES_SORTED_BY_WEIGHT )
+            t->pieceSortState = PIECES_UNSORTED;
+    }
+}
+
 /**
 ***
 **/
@@ -1084,8 +1449,12 @@ tr_peerMgrGetNextRequests( tr_torrent           * tor,
     assertWeightedPiecesAreSorted( t );
 
     /* prep the pieces list */
+    if( !replicationExists( t ) )
+        replicationNew( t );
     if( t->pieces == NULL )
         pieceListRebuild( t );
+    if( t->pieceSortState != PIECES_SORTED_BY_WEIGHT )
+        pieceListSort( t, PIECES_SORTED_BY_WEIGHT );
 
     endgame = isInEndgame( t );
 
@@ -1137,7 +1506,7 @@ tr_peerMgrGetNextRequests( tr_torrent           * tor,
         /* not enough requests || last piece modified */
         if ( i == t->pieceCount ) --i;
 
-        weightTorrent = t->tor;
+        setComparePieceByWeightTorrent( t );
         while( --i >= 0 )
         {
             tr_bool exact;
@@ -1176,13 +1545,13 @@ static void
 refillUpkeep( int foo UNUSED, short bar UNUSED, void * vmgr )
 {
     time_t now;
-    time_t too_old;
+    uint64_t too_old;
     tr_torrent * tor;
     tr_peerMgr * mgr = vmgr;
     managerLock( mgr );
 
     now = tr_time( );
-    too_old = now - REQUEST_TTL_SECS;
+    too_old = tr_time_msec( ) - REQUEST_TTL_SECS * 1000u;
 
     tor = NULL;
     while(( tor = tr_torrentNext( mgr->session, tor )))
@@ -1191,34 +1560,26 @@ refillUpkeep( int foo UNUSED, short bar UNUSED, void * vmgr )
         const int n = t->requestCount;
         if( n > 0 )
         {
-            int keepCount = 0;
+            int i;
             int cancelCount = 0;
             struct block_request * cancel = tr_new( struct block_request, n );
             const struct block_request * it;
             const struct block_request * end;
 
-            for( it=t->requests, end=it+n; it!=end; ++it )
-            {
-                if( ( it->sentAt <= too_old ) && it->peer->msgs && !tr_peerMsgsIsReadingBlock( it->peer->msgs, it->block ) )
-                    cancel[cancelCount++] = *it;
-                else
-                {
-                    if( it != &t->requests[keepCount] )
-                        t->requests[keepCount] = *it;
-                    keepCount++;
-                }
-            }
-
-            /* prune out the ones we aren't keeping */
-            t->requestCount = keepCount;
+            /* find the requests that have been pending too long */
+            for( i=0; i<t->requestBucketCount; ++i )
+                for( it=t->requests[i]; it!=NULL; it=it->next )
+                    if( ( it->sentAt <= too_old ) && it->peer->msgs && !tr_peerMsgsIsReadingBlock( it->peer->msgs, it->block ) )
+                        cancel[cancelCount++] = *it;
 
-            /* send cancel messages for all the "cancel" ones */
+            /* send cancel messages for all the "cancel" ones, and
+             * prune them out of the request table */
             for( it=cancel, end=it+cancelCount; it!=end; ++it ) {
                 if( ( it->peer != NULL ) && ( it->peer->msgs != NULL ) ) {
                     tr_historyAdd( it->peer->cancelsSentToPeer, now, 1 );
                     tr_peerMsgsCancel( it->peer->msgs, it->block );
-                    decrementPendingReqCount( it );
                 }
+                requestListRemove( t, it->block, it->peer );
             }
 
             /* decrement the pending request counts for the timed-out blocks */
@@ -1321,17 +1682,8 @@ removeRequestFromTables( Torrent * t, tr_block_index_t block, const tr_peer * pe
 static void
 peerDeclinedAllRequests( Torrent * t, const tr_peer * peer )
 {
-    int i, n;
-    tr_block_index_t * blocks = tr_new( tr_block_index_t, t->requestCount );
-
-    for( i=n=0; i<t->requestCount; ++i )
-        if( peer == t->requests[i].peer )
-            blocks[n++] = t->requests[i].block;
-
-    for( i=0; i<n; ++i )
-        removeRequestFromTables( t, blocks[i], peer );
-
-    tr_free( blocks );
+    while( peer->requests != NULL )
+        removeRequestFromTables( t, peer->requests->block, peer );
 }
 
 static void
@@ -1375,6 +1727,19 @@ peerCallbackFunc( tr_peer * peer, const tr_peer_event * e, void * vt )
             peerDeclinedAllRequests( t, peer );
             break;
 
+        case TR_PEER_CLIENT_GOT_HAVE:
+            if( replicationExists( t ) )
+                tr_incrReplicationOfPiece( t, e->pieceIndex );
+            break;
+
+        case TR_PEER_CLIENT_GOT_BITFIELD:
+            /* peer->have still holds the peer's old set of pieces */
+            if( replicationExists( t ) ) {
+                tr_decrReplicationFromBitset( t, &peer->have );
+                tr_incrReplicationFromBitset( t, e->bitset );
+            }
+            break;
+
         case TR_PEER_CLIENT_GOT_PORT:
             if( peer )
                 peer->atom->port = e->port;
@@ -1431,6 +1796,12 @@ peerCallbackFunc( tr_peer * peer, const tr_peer_event * e, void * vt )
             tr_torrent * tor = t->tor;
             tr_block_index_t block = _tr_block( tor, e->pieceIndex, e->offset );
 
+            if( peer != NULL ) {
+                const struct block_request * b = requestListLookup( t, block, peer );
+                if( b != NULL )
+                    tr_peerUpdateRequestRTT( peer, b->sentAt, b->wasFirstInLine, tr_time_msec( ) );
+            }
+
             requestListRemove( t, block, peer );
             pieceListRemoveRequest( t, block );
 
@@ -1550,6 +1921,8 @@ getDefaultShelfLife( uint8_t from )
     }
 }
 
+static void candidatesAddAtom( Torrent *, struct peer_atom * );
+
 static void
 ensureAtomExists( Torrent           * t,
                   const tr_address  * addr,
@@ -1577,7 +1950,8 @@ ensureAtomExists( Torrent           * t,
         a->shelf_date = tr_time( ) + getDefaultShelfLife( from ) + jitter;
         a->blocklisted = -1;
         atomSetSeedProbability( a, seedProbability );
-        tr_ptrArrayInsertSorted( &t->pool, a, compareAtomsByAddress );
+        addAtomToPool( t, a );
+        candidatesAddAtom( t, a );
 
         tordbg( t, "got a new atom: %s", tr_atomAddrStr( a ) );
     }
@@ -1603,6 +1977,154 @@ getPeerCount( const Torrent * t )
     return tr_ptrArraySize( &t->peers );/* + tr_ptrArraySize( &t->outgoingHandshakes ); */
 }
 
+/**
+***  Half-open connections
+**/
+
+void
+tr_halfOpenInit( tr_half_open * h )
+{
+    memset( h, 0, sizeof( tr_half_open ) );
+    h->window = HALF_OPEN_INITIAL_WINDOW;
+    h->threshold = HALF_OPEN_MAX_WINDOW;
+}
+
+int
+tr_halfOpenAvailable( const tr_half_open * h )
+{
+    return MAX( 0, h->window - h->inFlight );
+}
+
+void
+tr_halfOpenStarted( tr_half_open * h )
+{
+    ++h->inFlight;
+    ++h->started;
+    h->peakInFlight = MAX( h->peakInFlight, h->inFlight );
+}
+
+static void
+halfOpenRemove( tr_half_open * h )
+{
+    assert( h->inFlight > 0 );
+
+    /* when everything's been answered, start watching for a new peak */
+    if( !--h->inFlight )
+        h->peakInFlight = 0;
+}
+
+static void
+halfOpenResolved( tr_half_open * h, tr_bool timedOut )
+{
+    halfOpenRemove( h );
+    h->timeoutRatio = ( h->timeoutRatio * 7 + ( timedOut ? 1 : 0 ) ) / 8;
+}
+
+void
+tr_halfOpenAnswered( tr_half_open * h, tr_bool refused )
+{
+    /* only grow the window if we're using it, as Linux's TCP does.
+     * Otherwise a quiet spell would let it grow without bound,
+     * and the next busy one would send a flood of SYNs */
+    const tr_bool inUse = h->window < h->peakInFlight * 2;
+
+    halfOpenResolved( h, FALSE );
+    ++h->answered;
+    if( refused )
+        ++h->refused;
+
+    if( inUse && ( h->window < HALF_OPEN_MAX_WINDOW ) )
+    {
+        if( h->window < h->threshold )
+            ++h->window;
+        else if( ++h->answeredSinceGrowth >= h->window ) {
+            ++h->window;
+            h->answeredSinceGrowth = 0;
+        }
+    }
+}
+
+void
+tr_halfOpenTimedOut( tr_half_open * h, uint64_t now_msec )
+{
+    halfOpenResolved( h, TRUE );
+    ++h->timedOut;
+
+    /* some peers in any swarm are gone for good, so a timeout or two is
+     * normal. It's when most of them are timing out that we back off */
+    if( ( h->timeoutRatio * 100 >= HALF_OPEN_CONGESTED_PERCENT )
+        && ( now_msec >= h->holdUntil_msec ) )
+    {
+        h->threshold = MAX( h->window / 2, HALF_OPEN_MIN_WINDOW );
+        h->window = h->threshold;
+        h->answeredSinceGrowth = 0;
+        h->holdUntil_msec = now_msec + CONNECT_TIMEOUT_SECS * 1000;
+    }
+}
+
+void
+tr_halfOpenCancelled( tr_half_open * h )
+{
+    halfOpenRemove( h );
+}
+
+static int
+comparePointers( const void * a, const void * b )
+{
+    if( a != b )
+        return a < b ? -1 : 1;
+
+    return 0;
+}
+
+/* called when an outgoing handshake finishes, for better or worse */
+static void
+halfOpenHandshakeDone( tr_peerMgr      * mgr,
+                       tr_handshake    * handshake,
+                       const tr_peerIo * io,
+                       tr_bool           readAnythingFromPeer )
+{
+    /* if it's not in the list, it was answered or given up on already */
+    if( !tr_ptrArrayRemoveSorted( &mgr->halfOpenHandshakes, handshake, comparePointers ) )
+        return;
+
+    if( readAnythingFromPeer )
+        tr_halfOpenAnswered( &mgr->halfOpen, FALSE );
+    else if( io->hasFinishedConnecting )
+        tr_halfOpenAnswered( &mgr->halfOpen, TRUE );
+    else
+        tr_halfOpenCancelled( &mgr->halfOpen );
+}
+
+/* see which of the half-open connects have been answered,
+ * and give up on the ones that have waited too long */
+static void
+halfOpenPulse( tr_peerMgr * mgr, const time_t now, const uint64_t now_msec )
+{
+    int i;
+    tr_ptrArray * handshakes = &mgr->halfOpenHandshakes;
+
+    for( i=tr_ptrArraySize( handshakes )-1; i>=0; --i )
+    {
+        tr_handshake * handshake = tr_ptrArrayNth( handshakes, i );
+        const tr_peerIo * io = tr_handshakeGetIO( handshake );
+
+        if( io->hasFinishedConnecting )
+        {
+            tr_ptrArrayErase( handshakes, i, i+1 );
+            tr_halfOpenAnswered( &mgr->halfOpen, FALSE );
+        }
+        else if( now - io->timeCreated >= CONNECT_TIMEOUT_SECS )
+        {
+            /* take it out of the list first, so that the
+             * handshakeDone callback doesn't count it again */
+            tr_ptrArrayErase( handshakes, i, i+1 );
+            tr_halfOpenTimedOut( &mgr->halfOpen, now_msec );
+            tr_handshakeAbort( handshake );
+        }
+    }
+}
+
 /* FIXME: this is kind of a mess. */
 static tr_bool
 myHandshakeDoneCB( tr_handshake  * handshake,
@@ -1639,6 +2161,9 @@ myHandshakeDoneCB( tr_handshake  * handshake,
     assert( ours );
     assert( ours == handshake );
 
+    if( !tr_peerIoIsIncoming( io ) )
+        halfOpenHandshakeDone( manager, handshake, io, readAnythingFromPeer );
+
     if( t )
         torrentLock( t );
 
@@ -1677,6 +2202,10 @@ myHandshakeDoneCB( tr_handshake  * handshake,
             atom->flags2 &= ~MYFLAG_UNREACHABLE;
         }
 
+        /* let the peers we PEX this one to know that it speaks uTP */
+        if( tr_peerIoIsUTP( io ) )
+            atom->flags |= ADDED_F_UTP_FLAGS;
+
         if( atom->flags2 & MYFLAG_BANNED )
         {
             tordbg( t, "banned peer %s tried to reconnect",
@@ -1710,6 +2239,8 @@ myHandshakeDoneCB( tr_handshake  * handshake,
                 peer->io = tr_handshakeStealIO( handshake ); /* this steals its refcount too, which is
                                                                 balanced by our unref in peerDestructor()  */
                 tr_peerIoSetParent( peer->io, t->tor->bandwidth );
+                tr_peerIoDecryptOnRead( peer->io );
+                tr_peerIoAttachShard( peer->io );
                 tr_peerMsgsNew( t->tor, peer, peerCallbackFunc, t );
 
                 success = TRUE;
@@ -1717,17 +2248,20 @@ myHandshakeDoneCB( tr_handshake  * handshake,
         }
     }
 
-    if( t )
+    if( t ) {
+        candidatesSetDirty( t );
         torrentUnlock( t );
+    }
 
     return success;
 }
 
 void
-tr_peerMgrAddIncoming( tr_peerMgr * manager,
-                       tr_address * addr,
-                       tr_port      port,
-                       int          socket )
+tr_peerMgrAddIncoming( tr_peerMgr           * manager,
+                       tr_address           * addr,
+                       tr_port                port,
+                       int                    socket,
+                       struct tr_utp_socket * utp )
 {
     tr_session * session;
 
@@ -1740,17 +2274,19 @@ tr_peerMgrAddIncoming( tr_peerMgr * manager,
     {
         tr_dbg( "Banned IP address \"%s\" tried to connect to us", tr_ntop_non_ts( addr ) );
         tr_netClose( session, socket );
+        tr_utpClose( utp );
     }
     else if( getExistingHandshake( &manager->incomingHandshakes, addr ) )
     {
         tr_netClose( session, socket );
+        tr_utpClose( utp );
     }
     else /* we don't have a connection to them yet... */
     {
         tr_peerIo *    io;
         tr_handshake * handshake;
 
-        io = tr_peerIoNewIncoming( session, session->bandwidth, addr, port, socket );
+        io = tr_peerIoNewIncoming( session, session->bandwidth, addr, port, socket, utp );
 
         handshake = tr_handshakeNew( io,
                                      session->encryptionMode,
@@ -1789,6 +2325,29 @@ tr_peerMgrAddPex( tr_torrent * tor, uint8_t from,
     }
 }
 
+void
+tr_peerMgrSetUtpFailed( tr_torrent * tor, const tr_address * addr, tr_bool failed )
+{
+    Torrent * t;
+    struct peer_atom * atom;
+
+    assert( tr_isTorrent( tor ) );
+    assert( tr_isBool( failed ) );
+
+    t = tor->torrentPeers;
+    managerLock( t->manager );
+
+    if(( atom = getExistingAtom( t, addr )))
+    {
+        if( failed )
+            atom->flags2 |= MYFLAG_UTP_FAILED;
+        else
+            atom->flags2 &= ~MYFLAG_UTP_FAILED;
+    }
+
+    managerUnlock( t->manager );
+}
+
 void
 tr_peerMgrMarkAllAsSeeds( tr_torrent * tor )
 {
@@ -2075,6 +2634,7 @@ tr_peerMgrStartTorrent( tr_torrent * tor )
 
     t->isRunning = TRUE;
     t->maxPeers = t->tor->maxConnectedPeers;
+    candidatesSetDirty( t );
 
     rechokePulse( 0, 0, t->manager );
     managerUnlock( t->manager );
@@ -2088,6 +2648,7 @@ stopTorrent( Torrent * t )
     assert( torrentIsLocked( t ) );
 
     t->isRunning = FALSE;
+    candidatesSetDirty( t );
 
     /* disconnect the peers. */
     for( i=0, n=tr_ptrArraySize( &t->peers ); i<n; ++i )
@@ -2143,34 +2704,29 @@ tr_peerMgrTorrentAvailability( const tr_torrent * tor,
                                unsigned int       tabCount )
 {
     tr_piece_index_t   i;
-    const Torrent *    t;
+    Torrent *          t;
     float              interval;
     tr_bool            isSeed;
-    int                peerCount;
-    const tr_peer **   peers;
     tr_torrentLock( tor );
 
     t = tor->torrentPeers;
     tor = t->tor;
     interval = tor->info.pieceCount / (float)tabCount;
     isSeed = tor && ( tr_cpGetStatus ( &tor->completion ) == TR_SEED );
-    peers = (const tr_peer **) tr_ptrArrayBase( &t->peers );
-    peerCount = tr_ptrArraySize( &t->peers );
 
     memset( tab, 0, tabCount );
 
+    if( !replicationExists( t ) )
+        replicationNew( t );
+
     for( i = 0; tor && i < tabCount; ++i )
     {
         const int piece = i * interval;
 
         if( isSeed || tr_cpPieceIsComplete( &tor->completion, piece ) )
             tab[i] = -1;
-        else if( peerCount ) {
-            int j;
-            for( j = 0; j < peerCount; ++j )
-                if( tr_bitsetHas( &peers[j]->have, i ) )
-                    ++tab[i];
-        }
+        else if( replicationExists( t ) )
+            tab[i] = MIN( t->pieceReplication[piece], INT8_MAX );
     }
 
     tr_torrentUnlock( tor );
@@ -2180,23 +2736,37 @@ tr_peerMgrTorrentAvailability( const tr_torrent * tor,
 tr_bitfield*
 tr_peerMgrGetAvailable( const tr_torrent * tor )
 {
-    int i;
-    int peerCount;
+    size_t i;
     Torrent * t = tor->torrentPeers;
-    const tr_peer ** peers;
     tr_bitfield * pieces;
     managerLock( t->manager );
 
     pieces = tr_bitfieldNew( t->tor->info.pieceCount );
-    peerCount = tr_ptrArraySize( &t->peers );
-    peers = (const tr_peer**) tr_ptrArrayBase( &t->peers );
-    for( i=0; i<peerCount; ++i )
-        tr_bitsetOr( pieces, &peers[i]->have );
+
+    if( !replicationExists( t ) )
+        replicationNew( t );
+
+    for( i=0; i<t->pieceReplicationSize; ++i )
+        if( t->pieceReplication[i] > 0 )
+            tr_bitfieldAdd( pieces, i );
 
     managerUnlock( t->manager );
     return pieces;
 }
 
+int
+tr_peerMgrKnownPeerCount( const tr_torrent * tor )
+{
+    int n;
+    const Torrent * t = tor->torrentPeers;
+
+    managerLock( t->manager );
+    n = tr_ptrArraySize( &t->pool );
+    managerUnlock( t->manager );
+
+    return n;
+}
+
 void
 tr_peerMgrTorrentStats( tr_torrent       * tor,
                         int              * setmePeersKnown,
@@ -2341,6 +2911,7 @@ tr_peerMgrPeerStats( const tr_torrent    * tor,
         const tr_peer *          peer = peers[i];
         const struct peer_atom * atom = peer->atom;
         tr_peer_stat *           stat = ret + i;
+        const tr_tcp_info *      tcpInfo;
 
         tr_ntop( &atom->addr, stat->addr, sizeof( stat->addr ) );
         tr_strlcpy( stat->client, ( peer->client ? peer->client : "" ),
@@ -2356,6 +2927,7 @@ tr_peerMgrPeerStats( const tr_torrent    * tor,
         stat->clientIsChoked      = peer->clientIsChoked;
         stat->clientIsInterested  = peer->clientIsInterested;
         stat->isIncoming          = tr_peerIoIsIncoming( peer->io );
+        stat->isUTP               = tr_peerIoIsUTP( peer->io );
         stat->isDownloadingFrom   = clientIsDownloadingFrom( tor, peer );
         stat->isUploadingTo       = clientIsUploadingTo( peer );
         stat->isSeed              = ( atom->uploadOnly == UPLOAD_ONLY_YES ) || ( peer->progress >= 1.0 );
@@ -2367,6 +2939,14 @@ tr_peerMgrPeerStats( const tr_torrent    * tor,
 
         stat->pendingReqsToPeer   = peer->pendingReqsToPeer;
         stat->pendingReqsToClient = peer->pendingReqsToClient;
+        stat->syscallsPerMB       = tr_peerIoGetSyscallsPerMB( peer->io );
+        stat->requestRtt_msec     = peer->requestRTT_msec;
+        stat->desiredReqsToPeer   = peer->msgs ? tr_peerMsgsGetDesiredRequestCount( peer->msgs ) : 0;
+
+        if(( tcpInfo = tr_peerIoGetTCPInfo( peer->io, now_msec ))) {
+            stat->rtt_msec         = tcpInfo->rtt_usec / 1000.0;
+            stat->congestionWindow = tcpInfo->cwnd * tcpInfo->mss;
+        }
 
         pch = stat->flagStr;
         if( t->optimistic == peer ) *pch++ = 'O';
@@ -2380,6 +2960,7 @@ tr_peerMgrPeerStats( const tr_torrent    * tor,
         if( stat->from == TR_PEER_FROM_DHT ) *pch++ = 'H';
         else if( stat->from == TR_PEER_FROM_PEX ) *pch++ = 'X';
         if( stat->isIncoming ) *pch++ = 'I';
+        if( stat->isUTP ) *pch++ = 'T';
         *pch = '\0';
     }
 
@@ -2458,6 +3039,8 @@ rechokeDownloads( Torrent * t )
     int badCount         = 0;
     int goodCount        = 0;
     int untestedCount    = 0;
+    int * blockCounts    = tr_new( int, peerCount );
+    int * cancelCounts   = tr_new( int, peerCount );
     tr_peer ** bad       = tr_new( tr_peer*, peerCount );
     tr_peer ** good      = tr_new( tr_peer*, peerCount );
     tr_peer ** untested  = tr_new( tr_peer*, peerCount );
@@ -2488,6 +3071,10 @@ rechokeDownloads( Torrent * t )
             const int b = tr_historyGet( peer->blocksSentToClient, now, CANCEL_HISTORY_SEC );
             const int c = tr_historyGet( peer->cancelsSentToPeer, now, CANCEL_HISTORY_SEC );
 
+            /* remember these for the next section */
+            blockCounts[i] = b;
+            cancelCounts[i] = c;
+
             if( b == 0 ) /* ignore unresponsive peers, as described above */
                 continue;
 
@@ -2534,14 +3121,21 @@ rechokeDownloads( Torrent * t )
      * untested peers, and "bad" (ones with a high cancel-to-block ratio).
      * That's the order in which we'll choose who to show interest in */
     {
-        /* Randomize the peer array so the peers in the three groups will be unsorted... */
-        int n = peerCount;
-        tr_peer ** peers = tr_memdup( tr_ptrArrayBase( &t->peers ), n * sizeof( tr_peer * ) );
+        /* Visit the peers in random order so the peers in the three groups
+         * will be unsorted. This is a Fisher-Yates shuffle of their indices */
+        int n;
+        int * order = tr_new( int, peerCount );
+
+        for( i=0; i<peerCount; ++i )
+            order[i] = i;
 
-        while( n > 0 )
+        for( n=peerCount; n>0; --n )
         {
-            const int i = tr_cryptoWeakRandInt( n );
-            tr_peer * peer = tr_ptrArrayNth( &t->peers, i );
+            const int j = tr_cryptoWeakRandInt( n );
+            const int index = order[j];
+            tr_peer * peer = tr_ptrArrayNth( &t->peers, index );
+
+            order[j] = order[n-1];
 
             if( !isPeerInteresting( t->tor, peer ) )
             {
@@ -2549,8 +3143,8 @@ rechokeDownloads( Torrent * t )
             }
             else
             {
-                const int blocks = tr_historyGet( peer->blocksSentToClient, now, CANCEL_HISTORY_SEC );
-                const int cancels = tr_historyGet( peer->cancelsSentToPeer, now, CANCEL_HISTORY_SEC );
+                const int blocks = blockCounts[index];
+                const int cancels = cancelCounts[index];
 
                 if( !blocks && !cancels )
                     untested[untestedCount++] = peer;
@@ -2563,11 +3157,9 @@ rechokeDownloads( Torrent * t )
                 else
                     bad[badCount++] = peer;
             }
-
-            tr_removeElementFromArray( peers, i, sizeof(tr_peer*), n-- );
         }
 
-        tr_free( peers );
+        tr_free( order );
     }
 
     t->interestedCount = 0;
@@ -2600,28 +3192,20 @@ rechokeDownloads( Torrent * t )
     tr_free( untested );
     tr_free( good );
     tr_free( bad );
+    tr_free( cancelCounts );
+    tr_free( blockCounts );
 }
 
 /**
 ***
 **/
 
-struct ChokeData
-{
-    tr_bool         isInterested;
-    tr_bool         wasChoked;
-    tr_bool         isChoked;
-    int             rate;
-    int             salt;
-    tr_peer *       peer;
-};
-
 static int
 compareChoke( const void * va,
               const void * vb )
 {
-    const struct ChokeData * a = va;
-    const struct ChokeData * b = vb;
+    const tr_choke_data * a = va;
+    const tr_choke_data * b = vb;
 
     if( a->rate != b->rate ) /* prefer higher overall speeds */
         return a->rate > b->rate ? -1 : 1;
@@ -2665,6 +3249,63 @@ getRate( const tr_torrent * tor, struct peer_atom * atom, uint64_t now )
     return Bps;
 }
 
+static inline void
+swapChoke( tr_choke_data * a, tr_choke_data * b )
+{
+    const tr_choke_data tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+int
+tr_peerMgrSelectUnchoked( tr_choke_data * choke,
+                          int             size,
+                          int             slots,
+                          tr_bool         isMaxedOut )
+{
+    int i;
+    int interestedCount;
+    int unchokeCount;
+
+    /* move the interested peers to the front */
+    for( i=interestedCount=0; i<size; ++i )
+        if( choke[i].isInterested )
+            swapChoke( &choke[interestedCount++], &choke[i] );
+
+    if( slots <= 0 )
+    {
+        unchokeCount = 0;
+    }
+    else if( interestedCount < slots )
+    {
+        /* not enough interested peers to fill the slots, so
+         * every peer ranks ahead of the last unchoked one */
+        unchokeCount = size;
+    }
+    else
+    {
+        const tr_choke_data * worst;
+
+        /* find the best `slots' interested peers and the worst of them */
+        tr_quickfindFirstK( choke, interestedCount, sizeof( tr_choke_data ), compareChoke, slots );
+        worst = &choke[0];
+        for( i=1; i<slots; ++i )
+            if( compareChoke( &choke[i], worst ) > 0 )
+                worst = &choke[i];
+
+        /* uninterested peers that are better than that get unchoked too */
+        unchokeCount = slots;
+        for( i=interestedCount; i<size; ++i )
+            if( compareChoke( &choke[i], worst ) < 0 )
+                swapChoke( &choke[unchokeCount++], &choke[i] );
+    }
+
+    for( i=0; i<unchokeCount; ++i )
+        choke[i].isChoked = isMaxedOut ? choke[i].wasChoked : FALSE;
+
+    return unchokeCount;
+}
+
 static inline tr_bool
 isBandwidthMaxedOut( const tr_bandwidth * b,
                      const uint64_t now_msec, tr_direction dir )
@@ -2681,10 +3322,10 @@ isBandwidthMaxedOut( const tr_bandwidth * b,
 static void
 rechokeUploads( Torrent * t, const uint64_t now )
 {
-    int i, size, unchokedInterested;
+    int i, size, unchokeCount;
     const int peerCount = tr_ptrArraySize( &t->peers );
     tr_peer ** peers = (tr_peer**) tr_ptrArrayBase( &t->peers );
-    struct ChokeData * choke = tr_new0( struct ChokeData, peerCount );
+    tr_choke_data * choke = tr_new0( tr_choke_data, peerCount );
     const tr_session * session = t->manager->session;
     const int chokeAll = !tr_torrentIsPieceTransferAllowed( t->tor, TR_CLIENT_TO_PEER );
     const tr_bool isMaxedOut = isBandwidthMaxedOut( t->tor->bandwidth, now, TR_UP );
@@ -2698,7 +3339,7 @@ rechokeUploads( Torrent * t, const uint64_t now )
     else
         t->optimistic = NULL;
 
-    /* sort the peers by preference and rate */
+    /* get the peers' rates */
     for( i = 0, size = 0; i < peerCount; ++i )
     {
         tr_peer * peer = peers[i];
@@ -2718,7 +3359,7 @@ rechokeUploads( Torrent * t, const uint64_t now )
         }
         else if( peer != t->optimistic )
         {
-            struct ChokeData * n = &choke[size++];
+            tr_choke_data * n = &choke[size++];
             n->peer         = peer;
             n->isInterested = peer->peerIsInterested;
             n->wasChoked    = peer->peerIsChoked;
@@ -2728,8 +3369,6 @@ rechokeUploads( Torrent * t, const uint64_t now )
         }
     }
 
-    qsort( choke, size, sizeof( struct ChokeData ), compareChoke );
-
     /**
      * Reciprocation and number of uploads capping is managed by unchoking
      * the N peers which have the best upload rate and are interested.
@@ -2744,22 +3383,20 @@ rechokeUploads( Torrent * t, const uint64_t now )
      * rate to decide which peers to unchoke.
      *
      * If our bandwidth is maxed out, don't unchoke any more peers.
+     *
+     * Only a few of the peers get unchoked, so we don't need to
+     * sort them all to find out which ones.
      */
-    unchokedInterested = 0;
-    for( i=0; i<size && unchokedInterested<session->uploadSlotsPerTorrent; ++i ) {
-        choke[i].isChoked = isMaxedOut ? choke[i].wasChoked : FALSE;
-        if( choke[i].isInterested )
-            ++unchokedInterested;
-    }
+    unchokeCount = tr_peerMgrSelectUnchoked( choke, size, session->uploadSlotsPerTorrent, isMaxedOut );
 
     /* optimistic unchoke */
-    if( !t->optimistic && !isMaxedOut && (i<size) )
+    if( !t->optimistic && !isMaxedOut && ( unchokeCount < size ) )
     {
         int n;
-        struct ChokeData * c;
+        tr_choke_data * c;
         tr_ptrArray randPool = TR_PTR_ARRAY_INIT;
 
-        for( ; i<size; ++i )
+        for( i=unchokeCount; i<size; ++i )
         {
             if( choke[i].isInterested )
             {
@@ -3175,8 +3812,10 @@ reconnectPulse( int foo UNUSED, short bar UNUSED, void * vmgr )
     while(( tor = tr_torrentNext( mgr->session, tor )))
         closeBadPeers( tor->torrentPeers, now_msec, now_sec );
 
-    /* try to make new peer connections */
-    makeNewPeerConnections( mgr, MAX_CONNECTIONS_PER_PULSE );
+    /* try to make new peer connections, as many as the
+     * half-open window has room for */
+    halfOpenPulse( mgr, now_sec, now_msec );
+    makeNewPeerConnections( mgr, tr_halfOpenAvailable( &mgr->halfOpen ) );
 }
 
 /****
@@ -3248,18 +3887,6 @@ bandwidthPulse( int foo UNUSED, short bar UNUSED, void * vmgr )
 ****
 ***/
 
-static int
-compareAtomPtrsByAddress( const void * va, const void *vb )
-{
-    const struct peer_atom * a = * (const struct peer_atom**) va;
-    const struct peer_atom * b = * (const struct peer_atom**) vb;
-
-    assert( tr_isAtom( a ) );
-    assert( tr_isAtom( b ) );
-
-    return tr_compareAddresses( &a->addr, &b->addr );
-}
-
 /* best come first, worst go last */
 static int
 compareAtomPtrsByShelfDate( const void * va, const void *vb )
@@ -3328,10 +3955,12 @@ atomPulse( int foo UNUSED, short bar UNUSED, void * vmgr )
                     test[testCount++] = atom;
             }
 
-            /* if there's room, keep the best of what's left */
+            /* if there's room, keep the best of what's left.
+             * we don't care about their order, so don't sort them all */
             i = 0;
             if( keepCount < maxAtomCount ) {
-                qsort( test, testCount, sizeof( struct peer_atom * ), compareAtomPtrsByShelfDate );
+                const int room = maxAtomCount - keepCount;
+                tr_quickfindFirstK( test, testCount, sizeof( struct peer_atom * ), compareAtomPtrsByShelfDate, room );
                 while( i<testCount && keepCount<maxAtomCount )
                     keep[keepCount++] = test[i++];
             }
@@ -3340,12 +3969,16 @@ atomPulse( int foo UNUSED, short bar UNUSED, void * vmgr )
             while( i<testCount )
                 tr_free( test[i++] );
 
-            /* rebuild Torrent.pool with what's left */
+            /* rebuild Torrent.pool and its index with what's left */
             tr_ptrArrayDestruct( &t->pool, NULL );
             t->pool = TR_PTR_ARRAY_INIT;
-            qsort( keep, keepCount, sizeof( struct peer_atom * ), compareAtomPtrsByAddress );
             for( i=0; i<keepCount; ++i )
                 tr_ptrArrayAppend( &t->pool, keep[i] );
+            atomTableRebuild( t );
+
+            /* the candidate list may point to culled atoms */
+            tr_ptrArrayClear( &t->candidates );
+            candidatesSetDirty( t );
 
             tordbg( t, "max atom count is %d... pruned from %d to %d\n", maxAtomCount, atomCount, keepCount );
 
@@ -3365,32 +3998,105 @@ atomPulse( int foo UNUSED, short bar UNUSED, void * vmgr )
 ****
 ***/
 
+enum
+{
+    CANDIDATE_NO,    /* not a candidate until its state changes */
+    CANDIDATE_LATER, /* not a candidate until its reconnect interval passes */
+    CANDIDATE_YES
+};
+
 /* is this atom someone that we'd want to initiate a connection to? */
-static tr_bool
-isPeerCandidate( const tr_torrent * tor, struct peer_atom * atom, const time_t now )
+static int
+getCandidateState( const tr_torrent * tor, struct peer_atom * atom,
+                   const time_t now, time_t * setme_eligibleAt )
 {
+    int interval;
+
     /* not if we're both seeds */
     if( tr_torrentIsSeed( tor ) )
         if( atomIsSeed( atom ) || ( atom->uploadOnly == UPLOAD_ONLY_YES ) )
-            return FALSE;
+            return CANDIDATE_NO;
 
     /* not if we've already got a connection to them... */
     if( peerIsInUse( tor->torrentPeers, atom ) )
-        return FALSE;
-
-    /* not if we just tried them already */
-    if( ( now - atom->time ) < getReconnectIntervalSecs( atom, now ) )
-        return FALSE;
+        return CANDIDATE_NO;
 
     /* not if they're blocklisted */
     if( isAtomBlocklisted( tor->session, atom ) )
-        return FALSE;
+        return CANDIDATE_NO;
 
     /* not if they're banned... */
     if( atom->flags2 & MYFLAG_BANNED )
-        return FALSE;
+        return CANDIDATE_NO;
+
+    /* not if we just tried them already */
+    interval = getReconnectIntervalSecs( atom, now );
+    if( ( now - atom->time ) < interval ) {
+        *setme_eligibleAt = atom->time + interval;
+        return CANDIDATE_LATER;
+    }
+
+    return CANDIDATE_YES;
+}
+
+static void
+candidatesRebuild( Torrent * t, const time_t now )
+{
+    int i, n;
+    const tr_torrent * tor = t->tor;
+    struct peer_atom ** atoms = (struct peer_atom**) tr_ptrArrayPeek( &t->pool, &n );
+
+    tr_ptrArrayClear( &t->candidates );
+    t->candidatesDirty = FALSE;
+    t->candidatesBuiltAsSeed = tr_torrentIsSeed( tor );
+    t->candidatesExpireAt = 0;
+
+    for( i=0; i<n; ++i )
+    {
+        time_t eligibleAt;
 
-    return TRUE;
+        switch( getCandidateState( tor, atoms[i], now, &eligibleAt ) )
+        {
+            case CANDIDATE_YES:
+                tr_ptrArrayAppend( &t->candidates, atoms[i] );
+                break;
+
+            case CANDIDATE_LATER:
+                if( !t->candidatesExpireAt || ( eligibleAt < t->candidatesExpireAt ) )
+                    t->candidatesExpireAt = eligibleAt;
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    t->manager->connectionStats.candidateAtomsScanned += n;
+}
+
+/* a new atom was added to the pool */
+static void
+candidatesAddAtom( Torrent * t, struct peer_atom * atom )
+{
+    time_t eligibleAt;
+
+    if( t->candidatesDirty )
+        return;
+
+    switch( getCandidateState( t->tor, atom, tr_time( ), &eligibleAt ) )
+    {
+        case CANDIDATE_YES:
+            tr_ptrArrayAppend( &t->candidates, atom );
+            break;
+
+        case CANDIDATE_LATER:
+            if( !t->candidatesExpireAt || ( eligibleAt < t->candidatesExpireAt ) )
+                t->candidatesExpireAt = eligibleAt;
+            break;
+
+        default:
+            break;
+    }
 }
 
 struct peer_candidate
@@ -3480,9 +4186,9 @@ comparePeerCandidates( const void * va, const void * vb )
     return 0;
 }
 
-/** @return an array of all the atoms we might want to connect to */
+/** @return an array of the best `max' atoms we might want to connect to */
 static struct peer_candidate*
-getPeerCandidates( tr_session * session, int * candidateCount )
+getPeerCandidates( tr_session * session, int max, int * candidateCount )
 {
     int n;
     tr_torrent * tor;
@@ -3503,48 +4209,84 @@ getPeerCandidates( tr_session * session, int * candidateCount )
         return NULL;
     }
 
-    /* allocate an array of candidates */
+    /* refresh the torrents' cached candidate lists */
     n = 0;
     tor= NULL;
     while(( tor = tr_torrentNext( session, tor )))
-        n += tr_ptrArraySize( &tor->torrentPeers->pool );
+    {
+        Torrent * t = tor->torrentPeers;
+
+        if( !t->isRunning )
+            continue;
+
+        if( t->candidatesDirty
+            || ( t->candidatesExpireAt && ( t->candidatesExpireAt <= now ) )
+            || ( t->candidatesBuiltAsSeed != tr_torrentIsSeed( tor ) ) )
+            candidatesRebuild( t, now );
+
+        n += tr_ptrArraySize( &t->candidates );
+    }
     walk = candidates = tr_new( struct peer_candidate, n );
 
     /* populate the candidate array */
     tor = NULL;
     while(( tor = tr_torrentNext( session, tor )))
     {
-        int i, nAtoms;
+        int i, nAtoms, keepCount;
         struct peer_atom ** atoms;
+        Torrent * t = tor->torrentPeers;
 
-        if( !tor->torrentPeers->isRunning )
+        if( !t->isRunning )
             continue;
 
         /* if we've already got enough peers in this torrent... */
-        if( tr_torrentGetPeerLimit( tor ) <= tr_ptrArraySize( &tor->torrentPeers->peers ) )
+        if( tr_torrentGetPeerLimit( tor ) <= tr_ptrArraySize( &t->peers ) )
             continue;
 
         /* if we've already got enough speed in this torrent... */
         if( tr_torrentIsSeed( tor ) && isBandwidthMaxedOut( tor->bandwidth, now_msec, TR_UP ) )
             continue;
 
-        atoms = (struct peer_atom**) tr_ptrArrayPeek( &tor->torrentPeers->pool, &nAtoms );
-        for( i=0; i<nAtoms; ++i )
+        /* recheck the cached candidates, dropping the ones whose state
+         * has changed since the list was built */
+        atoms = (struct peer_atom**) tr_ptrArrayPeek( &t->candidates, &nAtoms );
+        for( i=keepCount=0; i<nAtoms; ++i )
         {
+            time_t eligibleAt;
             struct peer_atom * atom = atoms[i];
 
-            if( isPeerCandidate( tor, atom, now ) )
+            switch( getCandidateState( tor, atom, now, &eligibleAt ) )
             {
-                const uint8_t salt = tr_cryptoWeakRandInt( 1024 );
-                walk->tor = tor;
-                walk->atom = atom;
-                walk->score = getPeerCandidateScore( tor, atom, salt );
-                ++walk;
+                case CANDIDATE_YES: {
+                    const uint8_t salt = tr_cryptoWeakRandInt( 1024 );
+                    walk->tor = tor;
+                    walk->atom = atom;
+                    walk->score = getPeerCandidateScore( tor, atom, salt );
+                    ++walk;
+                    atoms[keepCount++] = atom;
+                    break;
+                }
+
+                case CANDIDATE_LATER:
+                    if( !t->candidatesExpireAt || ( eligibleAt < t->candidatesExpireAt ) )
+                        t->candidatesExpireAt = eligibleAt;
+                    break;
+
+                default:
+                    break;
             }
         }
+        if( keepCount < nAtoms )
+            tr_ptrArrayErase( &t->candidates, keepCount, nAtoms );
+        session->peerMgr->connectionStats.candidatesConsidered += nAtoms;
     }
 
+    /* we only need the best `max' of them, so don't sort them all */
     *candidateCount = walk - candidates;
+    if( *candidateCount > max ) {
+        tr_quickfindFirstK( candidates, *candidateCount, sizeof( struct peer_candidate ), comparePeerCandidates, max );
+        *candidateCount = max;
+    }
     if( *candidateCount > 1 )
         qsort( candidates, *candidateCount, sizeof( struct peer_candidate ), comparePeerCandidates );
     return candidates;
@@ -3555,15 +4297,24 @@ initiateConnection( tr_peerMgr * mgr, Torrent * t, struct peer_atom * atom )
 {
     tr_peerIo * io;
     const time_t now = tr_time( );
+    tr_bool utp = tr_sessionIsUTPEnabled( mgr->session )
+               && !( atom->flags2 & MYFLAG_UTP_FAILED );
+
+    /* PEX tells us whether a peer speaks uTP, so don't bother trying
+     * if it came from PEX without the flag */
+    if( atom->fromFirst == TR_PEER_FROM_PEX )
+        utp = utp && ( atom->flags & ADDED_F_UTP_FLAGS );
 
-    tordbg( t, "Starting an OUTGOING connection with %s", tr_atomAddrStr( atom ) );
+    tordbg( t, "Starting an OUTGOING %s connection with %s",
+            utp ? "uTP" : "TCP", tr_atomAddrStr( atom ) );
 
     io = tr_peerIoNewOutgoing( mgr->session,
                                mgr->session->bandwidth,
                                &atom->addr,
                                atom->port,
                                t->tor->info.hash,
-                               t->tor->completeness == TR_SEED );
+                               t->tor->completeness == TR_SEED,
+                               utp );
 
     if( io == NULL )
     {
@@ -3586,6 +4337,10 @@ initiateConnection( tr_peerMgr * mgr, Torrent * t, struct peer_atom * atom )
 
         tr_ptrArrayInsertSorted( &t->outgoingHandshakes, handshake,
                                  handshakeCompare );
+
+        tr_ptrArrayInsertSorted( &mgr->halfOpenHandshakes, handshake,
+                                 comparePointers );
+        tr_halfOpenStarted( &mgr->halfOpen );
     }
 
     atom->lastConnectionAttemptAt = now;
@@ -3611,12 +4366,37 @@ static void
 makeNewPeerConnections( struct tr_peerMgr * mgr, const int max )
 {
     int i, n;
+    uint64_t usec;
     struct peer_candidate * candidates;
+    const uint64_t begin = tr_time_usec( );
+
+    if( max < 1 )
+        return;
 
-    candidates = getPeerCandidates( mgr->session, &n );
+    candidates = getPeerCandidates( mgr->session, max, &n );
 
     for( i=0; i<n && i<max; ++i )
         initiateCandidateConnection( mgr, &candidates[i] );
 
     tr_free( candidates );
+
+    usec = tr_time_usec( ) - begin;
+    mgr->connectionStats.candidatePulses++;
+    mgr->connectionStats.candidatePulseUsec += usec;
+    mgr->connectionStats.lastCandidatePulseUsec = usec;
+}
+
+void
+tr_peerMgrGetConnectionStats( const tr_peerMgr         * mgr,
+                              tr_peer_connection_stats * setme )
+{
+    managerLock( mgr );
+    *setme = mgr->connectionStats;
+    setme->halfOpen = mgr->halfOpen.inFlight;
+    setme->halfOpenWindow = mgr->halfOpen.window;
+    setme->connectsStarted = mgr->halfOpen.started;
+    setme->connectsAnswered = mgr->halfOpen.answered;
+    setme->connectsRefused = mgr->halfOpen.refused;
+    setme->connectsTimedOut = mgr->halfOpen.timedOut;
+    managerUnlock( mgr );
 }
@@ -70,6 +70,7 @@ tr_pex;
 struct tr_bandwidth;
 struct tr_peerIo;
 struct tr_peermsgs;
+struct tr_utp_socket;
 
 enum
 {
@@ -78,8 +79,9 @@ enum
     ENCRYPTION_PREFERENCE_NO
 };
 
-/* opaque forward declaration */
+/* opaque forward declarations */
 struct peer_atom;
+struct block_request;
 
 /**
  * State information about a connected peer.
@@ -107,9 +109,16 @@ typedef struct tr_peer
     /* how many requests we've made and are currently awaiting a response for */
     int                      pendingReqsToPeer;
 
+    /* how long it takes the peer to answer a block request, or 0 if
+     * we don't know yet. see tr_peerUpdateRequestRTT() */
+    uint32_t                 requestRTT_msec;
+
     struct tr_peerIo       * io;
     struct peer_atom       * atom;
 
+    /* the requests we're awaiting a response for, linked through block_request */
+    struct block_request   * requests;
+
     struct tr_bitfield     * blame;
     struct tr_bitset         have;
 
@@ -154,10 +163,13 @@ tr_bool tr_peerMgrDidPeerRequest( const tr_torrent  * torrent,
 
 void tr_peerMgrRebuildRequests( tr_torrent * torrent );
 
-void tr_peerMgrAddIncoming( tr_peerMgr  * manager,
-                            tr_address  * addr,
-                            tr_port       port,
-                            int           socket );
+/** @param socket the peer's TCP socket, or -1 if it connected over uTP
+ *  @param utp the peer's uTP socket, or NULL if it connected over TCP */
+void tr_peerMgrAddIncoming( tr_peerMgr           * manager,
+                            tr_address           * addr,
+                            tr_port                port,
+                            int                    socket,
+                            struct tr_utp_socket * utp );
 
 tr_pex * tr_peerMgrCompactToPex( const void    * compact,
                                  size_t          compactLen,
@@ -185,6 +197,12 @@ void tr_peerMgrAddPex( tr_torrent     * tor,
 
 void tr_peerMgrMarkAllAsSeeds( tr_torrent * tor );
 
+/** @brief remember whether a peer couldn't be reached over uTP,
+ *         so that we use TCP the next time we connect to it */
+void tr_peerMgrSetUtpFailed( tr_torrent        * tor,
+                             const tr_address  * addr,
+                             tr_bool             failed );
+
 void tr_peerMgrSetBlame( tr_torrent        * tor,
                          tr_piece_index_t    pieceIndex,
                          int                 success );
@@ -218,6 +236,43 @@ struct tr_bitfield* tr_peerMgrGetAvailable( const tr_torrent * tor );
 
 void tr_peerMgrOnBlocklistChanged( tr_peerMgr * manager );
 
+/** @brief Statistics about how the peer manager finds new peers to connect to */
+typedef struct tr_peer_connection_stats
+{
+    /* number of times we've looked for peers to connect to */
+    uint64_t candidatePulses;
+
+    /* total time spent looking, in microseconds */
+    uint64_t candidatePulseUsec;
+
+    /* how long the most recent look took, in microseconds */
+    uint64_t lastCandidatePulseUsec;
+
+    /* how many atoms were scanned while rebuilding torrents' candidate lists */
+    uint64_t candidateAtomsScanned;
+
+    /* how many cached candidates were scored and compared */
+    uint64_t candidatesConsidered;
+
+    /* outgoing connects that haven't been answered yet,
+     * and how many of them are allowed at once. see tr_half_open */
+    int      halfOpen;
+    int      halfOpenWindow;
+
+    /* what became of the outgoing connects */
+    uint64_t connectsStarted;
+    uint64_t connectsAnswered;
+    uint64_t connectsRefused;
+    uint64_t connectsTimedOut;
+}
+tr_peer_connection_stats;
+
+void tr_peerMgrGetConnectionStats( const tr_peerMgr        * manager,
+                                   tr_peer_connection_stats * setme );
+
+/** @brief the number of peers we know of for this torrent, connected or not */
+int tr_peerMgrKnownPeerCount( const tr_torrent * tor );
+
 void tr_peerMgrTorrentStats( tr_torrent * tor,
                              int * setmePeersKnown,
                              int * setmePeersConnected,
@@ -241,6 +296,94 @@ int tr_peerGetPieceSpeed_Bps( const tr_peer    * peer,
 
 void tr_peerMgrClearInterest( tr_torrent * tor );
 
+/* used by the rechoke code. This is only exposed for unit testing */
+typedef struct tr_choke_data
+{
+    tr_bool    isInterested;
+    tr_bool    wasChoked;
+    tr_bool    isChoked;
+    int        rate;
+    int        salt;
+    tr_peer  * peer;
+}
+tr_choke_data;
+
+/**
+ * @brief decide which peers to unchoke.
+ *
+ * Picks the `slots' best interested peers, plus any uninterested peers
+ * that rank ahead of the worst of those, and moves them to the front of
+ * the array. The array is not otherwise sorted.
+ *
+ * @return the number of peers at the front of the array that were picked
+ */
+int tr_peerMgrSelectUnchoked( tr_choke_data * choke,
+                              int             size,
+                              int             slots,
+                              tr_bool         isMaxedOut );
+
+/**
+ * @brief update the peer's request round trip time when a block arrives.
+ *
+ * A request that was sent while others were pending from the same peer
+ * also spent time waiting behind them. Averaging that in would make the
+ * pipeline look deeper than it needs to be, and it would keep growing.
+ * So only requests that were first in line are averaged in. A request
+ * that comes back faster than the average still lowers it, though.
+ */
+void tr_peerUpdateRequestRTT( tr_peer  * peer,
+                              uint64_t   sentAt,
+                              tr_bool    wasFirstInLine,
+                              uint64_t   now );
+
+/**
+ * @brief how many outgoing connects may be in flight at once.
+ *
+ * A connect is half-open until the peer answers, with a SYN-ACK or a
+ * refusal, or until we give up on it. The window works like TCP's
+ * congestion window: it starts small and grows by one for each answer
+ * that comes back while it's in use, which doubles it every round trip,
+ * until it reaches the slow start threshold. After that it grows by one
+ * per window's worth of answers. When most connects are going
+ * unanswered, which is what it looks like when a NAT is dropping our
+ * SYNs, the window and the threshold are halved. The connects that were
+ * already out when that happened are allowed to time out too before
+ * it's halved again.
+ *
+ * This is only exposed for unit testing.
+ */
+typedef struct tr_half_open
+{
+    int      inFlight;
+    int      peakInFlight;      /* since inFlight was last 0 */
+    int      window;
+    int      threshold;
+    int      answeredSinceGrowth;
+    double   timeoutRatio;      /* a moving average, 0..1 */
+    uint64_t holdUntil_msec;    /* don't halve the window again until then */
+
+    uint64_t started;
+    uint64_t answered;
+    uint64_t refused;
+    uint64_t timedOut;
+}
+tr_half_open;
+
+void tr_halfOpenInit( tr_half_open * h );
+
+/** @return how many more connects can be started now */
+int  tr_halfOpenAvailable( const tr_half_open * h );
+
+void tr_halfOpenStarted( tr_half_open * h );
+
+/** @brief the peer answered the connect. `refused' if it was with a RST */
+void tr_halfOpenAnswered( tr_half_open * h, tr_bool refused );
+
+void tr_halfOpenTimedOut( tr_half_open * h, uint64_t now_msec );
+
+/** @brief we stopped waiting for our own reasons, e.g. the torrent stopped */
+void tr_halfOpenCancelled( tr_half_open * h );
+
 /* @} */
 
 #endif
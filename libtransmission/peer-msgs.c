@@ -180,6 +180,14 @@ struct tr_peermsgs
 
     int             desiredRequestCount;
 
+    /* the request pipeline starts out buffering REQUEST_BUF_SECS' worth.
+     * once the rate stops growing, the pipe is full and we only keep
+     * the bandwidth-delay product outstanding. see checkPipeIsFull() */
+    tr_bool         pipeIsFull;
+    int             pipeFullRounds;
+    int             pipeBestRate_Bps;
+    uint64_t        pipeCheckedAt;
+
     int             prefetchCount;
 
     /* how long the outMessages batch should be allowed to grow before
@@ -451,7 +459,7 @@ protocolSendHaveNone( tr_peermsgs * msgs )
 ***  EVENTS
 **/
 
-static const tr_peer_event blankEvent = { 0, 0, 0, 0, 0.0f, 0, 0, 0 };
+static const tr_peer_event blankEvent = { 0, 0, 0, 0, 0.0f, 0, 0, 0, NULL };
 
 static void
 publish( tr_peermsgs * msgs, tr_peer_event * e )
@@ -524,6 +532,34 @@ fireClientGotData( tr_peermsgs * msgs,
     publish( msgs, &e );
 }
 
+static void
+fireClientGotHave( tr_peermsgs * msgs, uint32_t pieceIndex )
+{
+    tr_peer_event e = blankEvent;
+    e.eventType = TR_PEER_CLIENT_GOT_HAVE;
+    e.pieceIndex = pieceIndex;
+    publish( msgs, &e );
+}
+
+/* Tell the peer-mgr about the peer's new set of pieces before
+ * it replaces the old one, so that both are visible to it */
+static void
+fireClientGotBitset( tr_peermsgs * msgs, const tr_bitset * bitset )
+{
+    tr_peer_event e = blankEvent;
+    e.eventType = TR_PEER_CLIENT_GOT_BITFIELD;
+    e.bitset = bitset;
+    publish( msgs, &e );
+}
+
+static void
+setPeerHave( tr_peermsgs * msgs, tr_bitset * have )
+{
+    fireClientGotBitset( msgs, have );
+    tr_bitsetDestructor( &msgs->peer->have );
+    msgs->peer->have = *have;
+}
+
 static void
 fireClientGotSuggest( tr_peermsgs * msgs, uint32_t pieceIndex )
 {
@@ -1184,6 +1220,11 @@ readBtId( tr_peermsgs * msgs, struct evbuffer  * inbuf, size_t inlen )
 static void
 updatePeerProgress( tr_peermsgs * msgs )
 {
+    /* a peer that sent HAVE_NONE and then a HAVE has a bitfield only as
+     * long as that piece's index, which would look like a seed's */
+    if( tr_torrentHasMetadata( msgs->torrent ) )
+        tr_bitsetReserve( &msgs->peer->have, msgs->torrent->info.pieceCount );
+
     msgs->peer->progress = tr_bitsetPercent( &msgs->peer->have );
     dbgmsg( msgs, "peer progress is %f", msgs->peer->progress );
     updateFastSet( msgs );
@@ -1398,7 +1439,8 @@ readBtMessage( tr_peermsgs * msgs, struct evbuffer * inbuf, size_t inlen )
             msgs->peer->peerIsInterested = 0;
             break;
 
-        case BT_HAVE:
+        case BT_HAVE: {
+            tr_bool hadPiece;
             tr_peerIoReadUint32( msgs->peer->io, inbuf, &ui32 );
             dbgmsg( msgs, "got Have: %u", ui32 );
             if( tr_torrentHasMetadata( msgs->torrent )
@@ -1407,22 +1449,28 @@ readBtMessage( tr_peermsgs * msgs, struct evbuffer * inbuf, size_t inlen )
                 fireError( msgs, ERANGE );
                 return READ_ERR;
             }
+            hadPiece = tr_bitsetHas( &msgs->peer->have, ui32 );
             if( tr_bitsetAdd( &msgs->peer->have, ui32 ) )
             {
                 fireError( msgs, ERANGE );
                 return READ_ERR;
             }
+            if( !hadPiece )
+                fireClientGotHave( msgs, ui32 );
             updatePeerProgress( msgs );
             break;
+        }
 
         case BT_BITFIELD: {
+            tr_bitset have;
             const size_t bitCount = tr_torrentHasMetadata( msgs->torrent )
                                   ? msgs->torrent->info.pieceCount
                                   : msglen * 8;
             dbgmsg( msgs, "got a bitfield" );
-            tr_bitsetReserve( &msgs->peer->have, bitCount );
+            tr_bitsetConstructor( &have, bitCount );
             tr_peerIoReadBytes( msgs->peer->io, inbuf,
-                                msgs->peer->have.bitfield.bits, msglen );
+                                have.bitfield.bits, msglen );
+            setPeerHave( msgs, &have );
             updatePeerProgress( msgs );
             break;
         }
@@ -1498,7 +1546,10 @@ readBtMessage( tr_peermsgs * msgs, struct evbuffer * inbuf, size_t inlen )
         case BT_FEXT_HAVE_ALL:
             dbgmsg( msgs, "Got a BT_FEXT_HAVE_ALL" );
             if( fext ) {
-                tr_bitsetSetHaveAll( &msgs->peer->have );
+                tr_bitset have;
+                tr_bitsetConstructor( &have, 0 );
+                tr_bitsetSetHaveAll( &have );
+                setPeerHave( msgs, &have );
                 updatePeerProgress( msgs );
             } else {
                 fireError( msgs, EMSGSIZE );
@@ -1509,7 +1560,10 @@ readBtMessage( tr_peermsgs * msgs, struct evbuffer * inbuf, size_t inlen )
         case BT_FEXT_HAVE_NONE:
             dbgmsg( msgs, "Got a BT_FEXT_HAVE_NONE" );
             if( fext ) {
-                tr_bitsetSetHaveNone( &msgs->peer->have );
+                tr_bitset have;
+                tr_bitsetConstructor( &have, 0 );
+                tr_bitsetSetHaveNone( &have );
+                setPeerHave( msgs, &have );
                 updatePeerProgress( msgs );
             } else {
                 fireError( msgs, EMSGSIZE );
@@ -1667,10 +1721,46 @@ tr_peerMsgsIsReadingBlock( const tr_peermsgs * msgs, tr_block_index_t block )
                                msgs->incoming.blockReq.offset );
 }
 
+int
+tr_peerMsgsGetDesiredRequestCount( const tr_peermsgs * msgs )
+{
+    return msgs->desiredRequestCount;
+}
+
 /**
 ***
 **/
 
+/* Like TCP BBR's startup phase: each round trip, see if the rate grew
+ * by at least a quarter. After a few rounds where it didn't, whatever's
+ * limiting it isn't the number of requests we have outstanding */
+static void
+checkPipeIsFull( tr_peermsgs * msgs, int rate_Bps, uint64_t now )
+{
+    const uint64_t roundTrip = msgs->peer->requestRTT_msec + REQUEST_REFILL_MSEC;
+
+    if( msgs->pipeCheckedAt + roundTrip > now )
+        return;
+
+    msgs->pipeCheckedAt = now;
+
+    if( rate_Bps >= msgs->pipeBestRate_Bps + msgs->pipeBestRate_Bps / 4 ) {
+        msgs->pipeBestRate_Bps = rate_Bps;
+        msgs->pipeFullRounds = 0;
+    } else if( ++msgs->pipeFullRounds >= REQUEST_FULL_PIPE_ROUNDS ) {
+        msgs->pipeIsFull = TRUE;
+    }
+}
+
+static void
+resetPipe( tr_peermsgs * msgs )
+{
+    msgs->pipeIsFull = FALSE;
+    msgs->pipeFullRounds = 0;
+    msgs->pipeBestRate_Bps = 0;
+    msgs->pipeCheckedAt = 0;
+}
+
 static void
 updateDesiredRequestCount( tr_peermsgs * msgs )
 {
@@ -1683,18 +1773,21 @@ updateDesiredRequestCount( tr_peermsgs * msgs )
     else if( msgs->peer->clientIsChoked )
     {
         msgs->desiredRequestCount = 0;
+        resetPipe( msgs );
     }
     else if( !msgs->peer->clientIsInterested )
     {
         msgs->desiredRequestCount = 0;
+        resetPipe( msgs );
     }
     else
     {
         int estimatedBlocksInPeriod;
+        uint64_t blocksLeft;
         int rate_Bps;
         int irate_Bps;
         const int floor = 4;
-        const int seconds = REQUEST_BUF_SECS;
+        int msec = REQUEST_BUF_SECS * 1000;
         const uint64_t now = tr_time_msec( );
 
         /* Get the rate limit we should use.
@@ -1703,20 +1796,58 @@ updateDesiredRequestCount( tr_peermsgs * msgs )
         if( tr_torrentUsesSpeedLimit( torrent, TR_PEER_TO_CLIENT ) )
             rate_Bps = MIN( rate_Bps, tr_torrentGetSpeedLimit_Bps( torrent, TR_PEER_TO_CLIENT ) );
 
+        /* honor the bandwidth group's limits, if any */
+        if( torrent->bandwidthGroup != NULL )
+        {
+            const tr_bandwidth_group * group = tr_sessionFindBandwidthGroup( torrent->session, torrent->bandwidthGroup, FALSE );
+
+            if( ( group != NULL ) && tr_bandwidthGroupGetActiveSpeedLimit_Bps( torrent->session, group, TR_PEER_TO_CLIENT, &irate_Bps ) )
+                rate_Bps = MIN( rate_Bps, irate_Bps );
+        }
+
         /* honor the session limits, if enabled */
         if( tr_torrentUsesSessionLimits( torrent ) )
             if( tr_sessionGetActiveSpeedLimit_Bps( torrent->session, TR_PEER_TO_CLIENT, &irate_Bps ) )
                 rate_Bps = MIN( rate_Bps, irate_Bps );
 
+        if( !msgs->pipeIsFull && ( msgs->peer->requestRTT_msec > 0 ) )
+            checkPipeIsFull( msgs, rate_Bps, now );
+
+        /* Once the pipe is full, keep the bandwidth-delay product
+         * outstanding: the rate times the time the peer takes to answer
+         * a request, plus the wait for our next chance to send more.
+         * It's doubled so the rate still has room to grow.
+         * Until then, buffer a few seconds' worth */
+        if( msgs->pipeIsFull )
+        {
+            const int roundTrip = (int)msgs->peer->requestRTT_msec + REQUEST_REFILL_MSEC;
+            msec = MIN( msec, REQUEST_BDP_GAIN * roundTrip );
+        }
+        else if( torrent->session->peerSocketKernelSizing )
+        {
+            /* if the kernel knows the round-trip time, there's no need
+             * to keep ten seconds' worth of requests outstanding */
+            const tr_tcp_info * info = tr_peerIoGetTCPInfo( msgs->peer->io, now );
+
+            if( info != NULL )
+                msec = MIN( msec, (int)( info->rtt_usec / 1000 ) + REQUEST_KERNEL_SLACK_MSEC );
+        }
+
         /* use this desired rate to figure out how
          * many requests we should send to this peer */
-        estimatedBlocksInPeriod = ( rate_Bps * seconds ) / torrent->blockSize;
+        estimatedBlocksInPeriod = (int)( ( (uint64_t)rate_Bps * msec / 1000 ) / torrent->blockSize );
         msgs->desiredRequestCount = MAX( floor, estimatedBlocksInPeriod );
 
         /* honor the peer's maximum request count, if specified */
         if( msgs->reqq > 0 )
             if( msgs->desiredRequestCount > msgs->reqq )
                 msgs->desiredRequestCount = msgs->reqq;
+
+        /* there's no point in asking one peer for more blocks
+         * than the torrent has left to download */
+        blocksLeft = tr_cpLeftUntilDone( &torrent->completion ) / torrent->blockSize + 1;
+        if( (uint64_t)msgs->desiredRequestCount > blocksLeft )
+            msgs->desiredRequestCount = (int)blocksLeft;
     }
 }
 
@@ -1891,21 +2022,36 @@ fillOutputBuffer( tr_peermsgs * msgs, time_t now )
         {
             int err;
             const uint32_t msglen = 4 + 1 + 4 + 4 + req.length;
+            const tr_bool encryptOnCopy = tr_peerIoEncryptsOnCopy( msgs->peer->io );
             struct evbuffer * out;
             struct evbuffer_iovec iovec[1];
+            uint8_t * block;
 
             out = evbuffer_new( );
-            evbuffer_expand( out, msglen );
+            evbuffer_expand( out, encryptOnCopy ? msglen - req.length : msglen );
 
             evbuffer_add_uint32( out, sizeof( uint8_t ) + 2 * sizeof( uint32_t ) + req.length );
             evbuffer_add_uint8 ( out, BT_PIECE );
             evbuffer_add_uint32( out, req.index );
             evbuffer_add_uint32( out, req.offset );
 
-            evbuffer_reserve_space( out, req.length, iovec, 1 );
-            err = tr_cacheReadBlock( getSession(msgs)->cache, msgs->torrent, req.index, req.offset, req.length, iovec[0].iov_base );
-            iovec[0].iov_len = req.length;
-            evbuffer_commit_space( out, iovec, 1 );
+            /* if the block's going to be encrypted, read it into the session
+             * buffer so that it can be encrypted while it's copied to the peer.
+             * Otherwise, read it straight into the message. */
+            if( encryptOnCopy ) {
+                assert( req.length <= SESSION_BUFFER_SIZE );
+                block = tr_sessionGetBuffer( getSession( msgs ) );
+            } else {
+                evbuffer_reserve_space( out, req.length, iovec, 1 );
+                block = iovec[0].iov_base;
+            }
+
+            err = tr_cacheReadBlock( getSession(msgs)->cache, msgs->torrent, req.index, req.offset, req.length, block );
+
+            if( !encryptOnCopy ) {
+                iovec[0].iov_len = req.length;
+                evbuffer_commit_space( out, iovec, 1 );
+            }
 
             /* check the piece if it needs checking... */
             if( !err && tr_torrentPieceNeedsCheck( msgs->torrent, req.index ) )
@@ -1919,15 +2065,18 @@ fillOutputBuffer( tr_peermsgs * msgs, time_t now )
             }
             else
             {
-                const size_t n = evbuffer_get_length( out );
                 dbgmsg( msgs, "sending block %u:%u->%u", req.index, req.offset, req.length );
-                assert( n == msglen );
                 tr_peerIoWriteBuf( msgs->peer->io, out, TRUE );
-                bytesWritten += n;
+                if( encryptOnCopy )
+                    tr_peerIoWriteBytes( msgs->peer->io, block, req.length, TRUE );
+                bytesWritten += msglen;
                 msgs->clientSentAnythingAt = now;
                 tr_historyAdd( msgs->peer->blocksSentToPeer, tr_time( ), 1 );
             }
 
+            if( encryptOnCopy )
+                tr_sessionReleaseBuffer( getSession( msgs ) );
+
             evbuffer_free( out );
 
             if( err )
@@ -40,6 +40,9 @@ void         tr_peerMsgsSetChoke( tr_peermsgs *, int doChoke );
 
 int          tr_peerMsgsIsReadingBlock( const tr_peermsgs * msgs, tr_block_index_t block );
 
+/** @return how many requests we're trying to keep outstanding to the peer */
+int          tr_peerMsgsGetDesiredRequestCount( const tr_peermsgs * msgs );
+
 void         tr_peerMsgsSetInterested( tr_peermsgs *, int isInterested );
 
 void         tr_peerMsgsHave( tr_peermsgs * msgs,
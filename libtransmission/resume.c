@@ -39,6 +39,7 @@
 #define KEY_PEERS6              "peers2-6"
 #define KEY_FILE_PRIORITIES     "priority"
 #define KEY_BANDWIDTH_PRIORITY  "bandwidth-priority"
+#define KEY_BANDWIDTH_GROUP     "bandwidth-group"
 #define KEY_PROGRESS            "progress"
 #define KEY_SPEEDLIMIT_OLD      "speed-limit"
 #define KEY_SPEEDLIMIT_UP       "speed-limit-up"
@@ -520,6 +521,8 @@ tr_torrentSaveResume( tr_torrent * tor )
     tr_bencDictAddInt( &top, KEY_UPLOADED, tor->uploadedPrev + tor->uploadedCur );
     tr_bencDictAddInt( &top, KEY_MAX_PEERS, tor->maxConnectedPeers );
     tr_bencDictAddInt( &top, KEY_BANDWIDTH_PRIORITY, tr_torrentGetPriority( tor ) );
+    if( tor->bandwidthGroup != NULL )
+        tr_bencDictAddStr( &top, KEY_BANDWIDTH_GROUP, tor->bandwidthGroup );
     tr_bencDictAddBool( &top, KEY_PAUSED, !tor->isRunning );
     savePeers( &top, tor );
     if( tr_torrentHasMetadata( tor ) )
@@ -662,6 +665,13 @@ loadFromFile( tr_torrent * tor,
         fieldsLoaded |= TR_FR_BANDWIDTH_PRIORITY;
     }
 
+    if( ( fieldsToLoad & TR_FR_BANDWIDTH_GROUP )
+      && tr_bencDictFindStr( &top, KEY_BANDWIDTH_GROUP, &str ) )
+    {
+        tr_torrentSetBandwidthGroup( tor, str );
+        fieldsLoaded |= TR_FR_BANDWIDTH_GROUP;
+    }
+
     if( fieldsToLoad & TR_FR_PEERS )
         fieldsLoaded |= loadPeers( &top, tor );
 
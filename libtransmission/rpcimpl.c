@@ -30,19 +30,22 @@
 #include <event2/buffer.h>
 
 #include "transmission.h"
+#include "announcer.h"
 #include "bencode.h"
 #include "completion.h"
 #include "fdlimit.h"
 #include "json.h"
+#include "peer-mgr.h"
 #include "rpcimpl.h"
 #include "session.h"
 #include "stats.h"
 #include "torrent.h"
+#include "tr-dht.h"
 #include "utils.h"
 #include "version.h"
 #include "web.h"
 
-#define RPC_VERSION     11
+#define RPC_VERSION     13
 #define RPC_VERSION_MIN 1
 
 #define RECENTLY_ACTIVE_SECONDS 60
@@ -461,7 +464,7 @@ addPeers( const tr_torrent * tor,
 
     for( i = 0; i < peerCount; ++i )
     {
-        tr_benc *            d = tr_bencListAddDict( list, 14 );
+        tr_benc *            d = tr_bencListAddDict( list, 21 );
         const tr_peer_stat * peer = peers + i;
         tr_bencDictAddStr ( d, "address", peer->addr );
         tr_bencDictAddStr ( d, "clientName", peer->client );
@@ -472,12 +475,18 @@ addPeers( const tr_torrent * tor,
         tr_bencDictAddBool( d, "isEncrypted", peer->isEncrypted );
         tr_bencDictAddBool( d, "isIncoming", peer->isIncoming );
         tr_bencDictAddBool( d, "isUploadingTo", peer->isUploadingTo );
+        tr_bencDictAddBool( d, "isUTP", peer->isUTP );
         tr_bencDictAddBool( d, "peerIsChoked", peer->peerIsChoked );
         tr_bencDictAddBool( d, "peerIsInterested", peer->peerIsInterested );
         tr_bencDictAddInt ( d, "port", peer->port );
         tr_bencDictAddReal( d, "progress", peer->progress );
         tr_bencDictAddInt ( d, "rateToClient", toSpeedBytes( peer->rateToClient_KBps ) );
         tr_bencDictAddInt ( d, "rateToPeer", toSpeedBytes( peer->rateToPeer_KBps ) );
+        tr_bencDictAddReal( d, "syscallsPerMB", peer->syscallsPerMB );
+        tr_bencDictAddReal( d, "rtt", peer->rtt_msec );
+        tr_bencDictAddInt ( d, "congestionWindow", peer->congestionWindow );
+        tr_bencDictAddReal( d, "requestRtt", peer->requestRtt_msec );
+        tr_bencDictAddInt ( d, "desiredRequests", peer->desiredReqsToPeer );
     }
 
     tr_torrentPeersFree( peers, peerCount );
@@ -499,6 +508,8 @@ addField( const tr_torrent * tor, tr_benc * d, const char * key )
         tr_bencDictAddInt( d, key, st->activityDate );
     else if( tr_streq( key, keylen, "addedDate" ) )
         tr_bencDictAddInt( d, key, st->addedDate );
+    else if( tr_streq( key, keylen, "bandwidthGroup" ) )
+        tr_bencDictAddStr( d, key, tr_torrentGetBandwidthGroup( tor ) ? tr_torrentGetBandwidthGroup( tor ) : "" );
     else if( tr_streq( key, keylen, "bandwidthPriority" ) )
         tr_bencDictAddInt( d, key, tr_torrentGetPriority( tor ) );
     else if( tr_streq( key, keylen, "comment" ) )
@@ -999,11 +1010,14 @@ torrentSet( tr_session               * session,
     {
         int64_t      tmp;
         double       d;
+        const char * str;
         tr_benc *    files;
         tr_benc *    trackers;
         tr_bool      boolVal;
         tr_torrent * tor = torrents[i];
 
+        if( tr_bencDictFindStr( args_in, "bandwidthGroup", &str ) )
+            tr_torrentSetBandwidthGroup( tor, str );
         if( tr_bencDictFindInt( args_in, "bandwidthPriority", &tmp ) )
             if( tr_isPriority( tmp ) )
                 tr_torrentSetPriority( tor, tmp );
@@ -1518,6 +1532,8 @@ sessionSet( tr_session               * session,
         tr_sessionSetTorrentDoneScriptEnabled( session, boolVal );
     if( tr_bencDictFindBool( args_in, TR_PREFS_KEY_TRASH_ORIGINAL, &boolVal ) )
         tr_sessionSetDeleteSource( session, boolVal );
+    if( tr_bencDictFindBool( args_in, TR_PREFS_KEY_UTP_ENABLED, &boolVal ) )
+        tr_sessionSetUTPEnabled( session, boolVal );
     if( tr_bencDictFindInt( args_in, TR_PREFS_KEY_DSPEED_KBps, &i ) )
         tr_sessionSetSpeedLimit_KBps( session, TR_DOWN, i );
     if( tr_bencDictFindBool( args_in, TR_PREFS_KEY_DSPEED_ENABLED, &boolVal ) )
@@ -1546,11 +1562,17 @@ sessionStats( tr_session               * session,
               tr_benc                  * args_out,
               struct tr_rpc_idle_data  * idle_data UNUSED )
 {
+    int i;
     int running = 0;
     int total = 0;
+    int hostCount;
     tr_benc * d;
+    tr_benc * list;
+    tr_tracker_host_stat * hosts;
     tr_session_stats currentStats = { 0.0f, 0, 0, 0, 0, 0 };
     tr_session_stats cumulativeStats = { 0.0f, 0, 0, 0, 0, 0 };
+    tr_peer_connection_stats connectionStats;
+    tr_dht_stats dhtStats;
     tr_torrent * tor = NULL;
 
     assert( idle_data == NULL );
@@ -1584,6 +1606,35 @@ sessionStats( tr_session               * session,
     tr_bencDictAddInt( d, "sessionCount", currentStats.sessionCount );
     tr_bencDictAddInt( d, "uploadedBytes", currentStats.uploadedBytes );
 
+    tr_peerMgrGetConnectionStats( session->peerMgr, &connectionStats );
+    d = tr_bencDictAddDict( args_out, "peer-connection-stats", 5 );
+    tr_bencDictAddInt( d, "candidateAtomsScanned", connectionStats.candidateAtomsScanned );
+    tr_bencDictAddInt( d, "candidatePulses", connectionStats.candidatePulses );
+    tr_bencDictAddInt( d, "candidatePulseUsec", connectionStats.candidatePulseUsec );
+    tr_bencDictAddInt( d, "candidatesConsidered", connectionStats.candidatesConsidered );
+    tr_bencDictAddInt( d, "lastCandidatePulseUsec", connectionStats.lastCandidatePulseUsec );
+
+    tr_dhtGetStats( &dhtStats );
+    d = tr_bencDictAddDict( args_out, "dht-stats", 7 );
+    tr_bencDictAddInt ( d, "searchesDone", dhtStats.searchesDone );
+    tr_bencDictAddInt ( d, "searchesFoundPeers", dhtStats.searchesFoundPeers );
+    tr_bencDictAddInt ( d, "searchesInFlight", dhtStats.searchesInFlight );
+    tr_bencDictAddInt ( d, "searchesQueued", dhtStats.searchesQueued );
+    tr_bencDictAddInt ( d, "searchesStarted", dhtStats.searchesStarted );
+    tr_bencDictAddInt ( d, "searchesTimedOut", dhtStats.searchesTimedOut );
+    tr_bencDictAddReal( d, "successRate", tr_getRatio( dhtStats.searchesFoundPeers, dhtStats.searchesDone ) );
+
+    hosts = tr_announcerHostStats( session, &hostCount );
+    list = tr_bencDictAddList( args_out, "tracker-hosts", hostCount );
+    for( i=0; i<hostCount; ++i ) {
+        d = tr_bencListAddDict( list, 4 );
+        tr_bencDictAddInt( d, "announcesQueued", hosts[i].announcesQueued );
+        tr_bencDictAddStr( d, "host", hosts[i].host );
+        tr_bencDictAddInt( d, "multiscrapeMax", hosts[i].multiscrapeMax );
+        tr_bencDictAddInt( d, "scrapesQueued", hosts[i].scrapesQueued );
+    }
+    tr_announcerHostStatsFree( hosts );
+
     return NULL;
 }
 
@@ -1630,6 +1681,7 @@ sessionGet( tr_session               * s,
     tr_bencDictAddBool( d, TR_PREFS_KEY_IDLE_LIMIT_ENABLED, tr_sessionIsIdleLimited( s ) );
     tr_bencDictAddBool( d, TR_PREFS_KEY_START, !tr_sessionGetPaused( s ) );
     tr_bencDictAddBool( d, TR_PREFS_KEY_TRASH_ORIGINAL, tr_sessionGetDeleteSource( s ) );
+    tr_bencDictAddBool( d, TR_PREFS_KEY_UTP_ENABLED, tr_sessionIsUTPEnabled( s ) );
     tr_bencDictAddInt ( d, TR_PREFS_KEY_USPEED_KBps, tr_sessionGetSpeedLimit_KBps( s, TR_UP ) );
     tr_bencDictAddBool( d, TR_PREFS_KEY_USPEED_ENABLED, tr_sessionIsSpeedLimited( s, TR_UP ) );
     tr_bencDictAddInt ( d, TR_PREFS_KEY_DSPEED_KBps, tr_sessionGetSpeedLimit_KBps( s, TR_DOWN ) );
@@ -1652,6 +1704,75 @@ sessionGet( tr_session               * s,
 ****
 ***/
 
+static const char*
+groupGet( tr_session               * session,
+          tr_benc                  * args_in,
+          tr_benc                  * args_out,
+          struct tr_rpc_idle_data  * idle_data UNUSED )
+{
+    size_t i, n;
+    tr_benc all;
+    tr_benc * names;
+    tr_benc * groups;
+
+    assert( idle_data == NULL );
+
+    tr_bencInitList( &all, 0 );
+    tr_sessionGetBandwidthGroups( session, &all );
+
+    if( !tr_bencDictFindList( args_in, "names", &names ) )
+        names = NULL;
+
+    groups = tr_bencDictAddList( args_out, "groups", tr_bencListSize( &all ) );
+    for( i=0, n=tr_bencListSize( &all ); i<n; ++i )
+    {
+        const char * name;
+        tr_bool wanted = names == NULL;
+        tr_benc * group = tr_bencListChild( &all, i );
+
+        if( !wanted && tr_bencDictFindStr( group, "name", &name ) )
+        {
+            size_t j;
+            const size_t jn = tr_bencListSize( names );
+
+            for( j=0; !wanted && j<jn; ++j )
+            {
+                const char * str;
+                if( tr_bencGetStr( tr_bencListChild( names, j ), &str ) )
+                    wanted = !strcmp( str, name );
+            }
+        }
+
+        if( wanted )
+            tr_bencMergeDicts( tr_bencListAddDict( groups, 0 ), group );
+    }
+
+    tr_bencFree( &all );
+    return NULL;
+}
+
+static const char*
+groupSet( tr_session               * session,
+          tr_benc                  * args_in,
+          tr_benc                  * args_out UNUSED,
+          struct tr_rpc_idle_data  * idle_data UNUSED )
+{
+    const char * name;
+
+    assert( idle_data == NULL );
+
+    if( !tr_bencDictFindStr( args_in, "name", &name ) || !*name )
+        return "no group name given";
+
+    tr_sessionSetBandwidthGroup( session, name, args_in );
+    notify( session, TR_RPC_SESSION_CHANGED, NULL );
+    return NULL;
+}
+
+/***
+****
+***/
+
 typedef const char* ( *handler )( tr_session*, tr_benc*, tr_benc*, struct tr_rpc_idle_data * );
 
 static struct method
@@ -1664,6 +1785,8 @@ methods[] =
 {
     { "port-test",             FALSE, portTest            },
     { "blocklist-update",      FALSE, blocklistUpdate     },
+    { "group-get",             TRUE,  groupGet            },
+    { "group-set",             TRUE,  groupSet            },
     { "session-get",           TRUE,  sessionGet          },
     { "session-set",           TRUE,  sessionSet          },
     { "session-stats",         TRUE,  sessionStats        },
@@ -12,6 +12,7 @@
 
 #include <assert.h>
 #include <errno.h> /* ENOENT */
+#include <inttypes.h> /* PRIu64 */
 #include <stdlib.h>
 #include <string.h> /* memcpy */
 
@@ -26,6 +27,7 @@
 //#define TR_SHOW_DEPRECATED
 #include "transmission.h"
 #include "announcer.h"
+#include "announcer-udp.h"
 #include "bandwidth.h"
 #include "bencode.h"
 #include "blocklist.h"
@@ -43,8 +45,10 @@
 #include "session.h"
 #include "stats.h"
 #include "torrent.h"
+#include "tr-dht.h"
 #include "tr-udp.h"
 #include "tr-lpd.h"
+#include "tr-utp.h"
 #include "trevent.h"
 #include "utils.h"
 #include "verify.h"
@@ -139,22 +143,43 @@ tr_sessionSetEncryption( tr_session *       session,
 ****
 ***/
 
+enum
+{
+    /* with TR_PREFS_KEY_PEER_PORT_REUSEPORT on, there's a listener per
+     * peer I/O thread, or this many if there aren't any threads */
+    DEFAULT_PEER_PORT_LISTENERS = 4,
+
+    MAX_PEER_PORT_LISTENERS = TR_MAX_PEER_IO_SHARDS,
+
+    /* accept at most this many connections per wakeup,
+     * so that a flood can't starve the rest of the event loop */
+    ACCEPT_BATCH_SIZE = 64
+};
+
 struct tr_bindinfo
 {
-    int socket;
     tr_address addr;
-    struct event * ev;
+    int socketCount;
+    int sockets[MAX_PEER_PORT_LISTENERS];
+    struct event * evs[MAX_PEER_PORT_LISTENERS];
 };
 
 
 static void
 close_bindinfo( struct tr_bindinfo * b )
 {
-    if( ( b != NULL ) && ( b->socket >=0 ) )
+    if( b != NULL )
     {
-        event_free( b->ev );
-        b->ev = NULL;
-        tr_netCloseSocket( b->socket );
+        int i;
+
+        for( i=0; i<b->socketCount; ++i )
+        {
+            event_free( b->evs[i] );
+            b->evs[i] = NULL;
+            tr_netCloseSocket( b->sockets[i] );
+        }
+
+        b->socketCount = 0;
     }
 }
 
@@ -180,43 +205,109 @@ free_incoming_peer_port( tr_session * session )
 static void
 accept_incoming_peer( int fd, short what UNUSED, void * vsession )
 {
+    int n;
     int clientSocket;
     tr_port clientPort;
     tr_address clientAddr;
     tr_session * session = vsession;
+    tr_accept_stats * stats = &session->acceptStats;
+
+    /* drain the backlog instead of taking one connection per wakeup */
+    for( n=0; n<ACCEPT_BATCH_SIZE; ++n )
+    {
+        clientSocket = tr_netAccept( session, fd, &clientAddr, &clientPort );
+        if( clientSocket < 0 )
+            break;
 
-    clientSocket = tr_netAccept( session, fd, &clientAddr, &clientPort );
-    if( clientSocket > 0 ) {
         tr_deepLog( __FILE__, __LINE__, NULL, "new incoming connection %d (%s)",
                    clientSocket, tr_peerIoAddrStr( &clientAddr, clientPort ) );
-        tr_peerMgrAddIncoming( session->peerMgr, &clientAddr, clientPort, clientSocket );
+        tr_peerMgrAddIncoming( session->peerMgr, &clientAddr, clientPort, clientSocket, NULL );
+    }
+
+    if( n > 0 )
+    {
+        ++stats->wakeups;
+        stats->accepted += n;
+        stats->max_per_wakeup = MAX( stats->max_per_wakeup, n );
     }
 }
 
 static void
-open_incoming_peer_port( tr_session * session )
+bind_incoming_peer_port( tr_session * session, struct tr_bindinfo * b )
 {
-    struct tr_bindinfo * b;
+    int i;
+    int n = 1;
 
-    /* bind an ipv4 port to listen for incoming peers... */
-    b = session->public_ipv4;
-    b->socket = tr_netBindTCP( &b->addr, session->private_peer_port, FALSE );
-    if( b->socket >= 0 ) {
-        b->ev = event_new( session->event_base, b->socket, EV_READ | EV_PERSIST, accept_incoming_peer, session );
-        event_add( b->ev, NULL );
+    if( session->peerPortReusePort )
+    {
+        n = tr_eventGetShardCount( session );
+        if( n < 1 )
+            n = DEFAULT_PEER_PORT_LISTENERS;
+        n = MIN( n, MAX_PEER_PORT_LISTENERS );
     }
 
-    /* and do the exact same thing for ipv6, if it's supported... */
-    if( tr_net_hasIPv6( session->private_peer_port ) ) {
-        b = session->public_ipv6;
-        b->socket = tr_netBindTCP( &b->addr, session->private_peer_port, FALSE );
-        if( b->socket >= 0 ) {
-            b->ev = event_new( session->event_base, b->socket, EV_READ | EV_PERSIST, accept_incoming_peer, session );
-            event_add( b->ev, NULL );
+    b->socketCount = 0;
+
+    if( n > 1 )
+    {
+        for( i=0; i<n; ++i )
+        {
+            const int fd = tr_netBindTCPReusePort( &b->addr, session->private_peer_port, TRUE );
+            if( fd < 0 )
+                break;
+            b->sockets[b->socketCount++] = fd;
         }
+
+        if( b->socketCount < n )
+            tr_ninf( "Peer port", "Only %d of %d listeners could share the port",
+                     b->socketCount, n );
+    }
+
+    /* no SO_REUSEPORT, or just one listener wanted */
+    if( b->socketCount == 0 )
+    {
+        const int fd = tr_netBindTCP( &b->addr, session->private_peer_port, FALSE );
+        if( fd >= 0 )
+            b->sockets[b->socketCount++] = fd;
+    }
+
+    for( i=0; i<b->socketCount; ++i )
+    {
+        b->evs[i] = event_new( session->event_base, b->sockets[i], EV_READ | EV_PERSIST, accept_incoming_peer, session );
+        event_add( b->evs[i], NULL );
     }
 }
 
+static void
+open_incoming_peer_port( tr_session * session )
+{
+    /* bind an ipv4 port to listen for incoming peers... */
+    bind_incoming_peer_port( session, session->public_ipv4 );
+
+    /* and do the exact same thing for ipv6, if it's supported... */
+    if( tr_net_hasIPv6( session->private_peer_port ) )
+        bind_incoming_peer_port( session, session->public_ipv6 );
+
+    memset( &session->acceptStats, 0, sizeof( tr_accept_stats ) );
+    session->acceptStatsSince = tr_time_msec( );
+    session->listenOverflowsBase = tr_netGetListenOverflows( );
+}
+
+void
+tr_sessionGetAcceptStats( const tr_session * session, tr_accept_stats * setme )
+{
+    const uint64_t elapsed = tr_time_msec( ) - session->acceptStatsSince;
+    const int64_t overflows = tr_netGetListenOverflows( );
+
+    *setme = session->acceptStats;
+    setme->listeners = session->public_ipv4->socketCount
+                     + session->public_ipv6->socketCount;
+    setme->accepts_per_sec = setme->accepted * 1000.0 / MAX( elapsed, 1 );
+    setme->listen_overflows = ( overflows >= 0 ) && ( session->listenOverflowsBase >= 0 )
+                            ? overflows - session->listenOverflowsBase
+                            : -1;
+}
+
 const tr_address*
 tr_sessionGetPublicAddress( const tr_session * session, int tr_af_type, tr_bool * is_default_value )
 {
@@ -263,6 +354,7 @@ tr_sessionGetDefaultSettings( const char * configDir UNUSED, tr_benc * d )
     assert( tr_bencIsDict( d ) );
 
     tr_bencDictReserve( d, 60 );
+    tr_bencDictAddInt ( d, TR_PREFS_KEY_ANNOUNCE_STARTUP_WINDOW,  300 );
     tr_bencDictAddBool( d, TR_PREFS_KEY_BLOCKLIST_ENABLED,        FALSE );
     tr_bencDictAddStr ( d, TR_PREFS_KEY_BLOCKLIST_URL,            "http://www.example.com/blocklist" );
     tr_bencDictAddInt ( d, TR_PREFS_KEY_MAX_CACHE_SIZE_MB,        DEFAULT_CACHE_SIZE_MB );
@@ -286,6 +378,9 @@ tr_sessionGetDefaultSettings( const char * configDir UNUSED, tr_benc * d )
     tr_bencDictAddInt ( d, TR_PREFS_KEY_PEER_PORT_RANDOM_LOW,     49152 );
     tr_bencDictAddInt ( d, TR_PREFS_KEY_PEER_PORT_RANDOM_HIGH,    65535 );
     tr_bencDictAddInt ( d, TR_PREFS_KEY_PEER_SOCKET_TOS,          atoi( TR_DEFAULT_PEER_SOCKET_TOS_STR ) );
+    tr_bencDictAddInt ( d, TR_PREFS_KEY_PEER_IO_THREADS,          0 );
+    tr_bencDictAddBool( d, TR_PREFS_KEY_PEER_SOCKET_KERNEL_SIZING, FALSE );
+    tr_bencDictAddBool( d, TR_PREFS_KEY_PEER_PORT_REUSEPORT,       FALSE );
     tr_bencDictAddBool( d, TR_PREFS_KEY_PEX_ENABLED,              TRUE );
     tr_bencDictAddBool( d, TR_PREFS_KEY_PORT_FORWARDING,          TRUE );
     tr_bencDictAddInt ( d, TR_PREFS_KEY_PREALLOCATION,            TR_PREALLOCATE_SPARSE );
@@ -321,6 +416,7 @@ tr_sessionGetDefaultSettings( const char * configDir UNUSED, tr_benc * d )
     tr_bencDictAddBool( d, TR_PREFS_KEY_USPEED_ENABLED,           FALSE );
     tr_bencDictAddInt ( d, TR_PREFS_KEY_UMASK,                    022 );
     tr_bencDictAddInt ( d, TR_PREFS_KEY_UPLOAD_SLOTS_PER_TORRENT, 14 );
+    tr_bencDictAddBool( d, TR_PREFS_KEY_UTP_ENABLED,              TRUE );
     tr_bencDictAddStr ( d, TR_PREFS_KEY_BIND_ADDRESS_IPV4,        TR_DEFAULT_BIND_ADDRESS_IPV4 );
     tr_bencDictAddStr ( d, TR_PREFS_KEY_BIND_ADDRESS_IPV6,        TR_DEFAULT_BIND_ADDRESS_IPV6 );
     tr_bencDictAddBool( d, TR_PREFS_KEY_START,                    TRUE );
@@ -333,6 +429,7 @@ tr_sessionGetSettings( tr_session * s, struct tr_benc * d )
     assert( tr_bencIsDict( d ) );
 
     tr_bencDictReserve( d, 60 );
+    tr_bencDictAddInt ( d, TR_PREFS_KEY_ANNOUNCE_STARTUP_WINDOW,  s->announceStartupWindowSecs );
     tr_bencDictAddBool( d, TR_PREFS_KEY_BLOCKLIST_ENABLED,        tr_blocklistIsEnabled( s ) );
     tr_bencDictAddStr ( d, TR_PREFS_KEY_BLOCKLIST_URL,            tr_blocklistGetURL( s ) );
     tr_bencDictAddInt ( d, TR_PREFS_KEY_MAX_CACHE_SIZE_MB,        tr_sessionGetCacheLimit_MB( s ) );
@@ -356,6 +453,9 @@ tr_sessionGetSettings( tr_session * s, struct tr_benc * d )
     tr_bencDictAddInt ( d, TR_PREFS_KEY_PEER_PORT_RANDOM_LOW,     s->randomPortLow );
     tr_bencDictAddInt ( d, TR_PREFS_KEY_PEER_PORT_RANDOM_HIGH,    s->randomPortHigh );
     tr_bencDictAddInt ( d, TR_PREFS_KEY_PEER_SOCKET_TOS,          s->peerSocketTOS );
+    tr_bencDictAddInt ( d, TR_PREFS_KEY_PEER_IO_THREADS,          tr_eventGetShardCount( s ) );
+    tr_bencDictAddBool( d, TR_PREFS_KEY_PEER_SOCKET_KERNEL_SIZING, s->peerSocketKernelSizing );
+    tr_bencDictAddBool( d, TR_PREFS_KEY_PEER_PORT_REUSEPORT,       s->peerPortReusePort );
     if(s->peer_congestion_algorithm && s->peer_congestion_algorithm[0])
         tr_bencDictAddStr ( d, TR_PREFS_KEY_PEER_CONGESTION_ALGORITHM, s->peer_congestion_algorithm );
     tr_bencDictAddBool( d, TR_PREFS_KEY_PEX_ENABLED,              s->isPexEnabled );
@@ -393,10 +493,13 @@ tr_sessionGetSettings( tr_session * s, struct tr_benc * d )
     tr_bencDictAddBool( d, TR_PREFS_KEY_USPEED_ENABLED,           tr_sessionIsSpeedLimited( s, TR_UP ) );
     tr_bencDictAddInt ( d, TR_PREFS_KEY_UMASK,                    s->umask );
     tr_bencDictAddInt ( d, TR_PREFS_KEY_UPLOAD_SLOTS_PER_TORRENT, s->uploadSlotsPerTorrent );
+    tr_bencDictAddBool( d, TR_PREFS_KEY_UTP_ENABLED,              s->isUTPEnabled );
     tr_bencDictAddStr ( d, TR_PREFS_KEY_BIND_ADDRESS_IPV4,        tr_ntop_non_ts( &s->public_ipv4->addr ) );
     tr_bencDictAddStr ( d, TR_PREFS_KEY_BIND_ADDRESS_IPV6,        tr_ntop_non_ts( &s->public_ipv6->addr ) );
     tr_bencDictAddBool( d, TR_PREFS_KEY_START,                    !tr_sessionGetPaused( s ) );
     tr_bencDictAddBool( d, TR_PREFS_KEY_TRASH_ORIGINAL,           tr_sessionGetDeleteSource( s ) );
+    if( !tr_ptrArrayEmpty( &s->bandwidthGroups ) )
+        tr_sessionGetBandwidthGroups( s, tr_bencDictAddList( d, TR_PREFS_KEY_BANDWIDTH_GROUPS, 0 ) );
 }
 
 tr_bool
@@ -540,6 +643,8 @@ tr_sessionInit( const char  * tag,
     session->udp_socket = -1;
     session->udp6_socket = -1;
     session->bandwidth = tr_bandwidthNew( session, NULL );
+    session->bandwidthGroups = TR_PTR_ARRAY_INIT;
+    session->torrentsByHash = TR_PTR_ARRAY_INIT;
     session->lock = tr_lockNew( );
     session->cache = tr_cacheNew( 1024*1024*2 );
     session->tag = tr_strdup( tag );
@@ -648,6 +753,8 @@ tr_sessionInitImpl( void * vdata )
 
     tr_setConfigDir( session, data->configDir );
 
+    tr_cryptoKeyPoolInit( );
+
     session->peerMgr = tr_peerMgrNew( session );
 
     session->shared = tr_sharedInit( session );
@@ -670,6 +777,8 @@ tr_sessionInitImpl( void * vdata )
 
     tr_announcerInit( session );
 
+    tr_announcerUdpInit( session );
+
     /* first %s is the application name
        second %s is the version number */
     tr_inf( _( "%s %s started" ), TR_NAME, LONG_VERSION_STRING );
@@ -680,6 +789,8 @@ tr_sessionInitImpl( void * vdata )
 
     tr_sessionSet( session, &settings );
 
+    tr_utpInit( session );
+
     tr_udpInit( session, &session->public_ipv4->addr );
 
     if( session->isLPDEnabled )
@@ -692,6 +803,7 @@ tr_sessionInitImpl( void * vdata )
 
 static void turtleBootstrap( tr_session *, struct tr_turtle_info * );
 static void setPeerPort( tr_session * session, tr_port port );
+static void setBandwidthGroupsFromSettings( tr_session *, tr_benc * list );
 
 static void
 sessionSetImpl( void * vdata )
@@ -700,6 +812,7 @@ sessionSetImpl( void * vdata )
     double  d;
     tr_bool boolVal;
     const char * str;
+    tr_benc * list;
     struct tr_bindinfo b;
     struct init_data * data = vdata;
     tr_session * session = data->session;
@@ -731,12 +844,22 @@ sessionSetImpl( void * vdata )
         tr_sessionSetDHTEnabled( session, boolVal );
     if( tr_bencDictFindBool( settings, TR_PREFS_KEY_LPD_ENABLED, &boolVal ) )
         tr_sessionSetLPDEnabled( session, boolVal );
+    if( tr_bencDictFindBool( settings, TR_PREFS_KEY_UTP_ENABLED, &boolVal ) )
+        tr_sessionSetUTPEnabled( session, boolVal );
     if( tr_bencDictFindInt( settings, TR_PREFS_KEY_ENCRYPTION, &i ) )
         tr_sessionSetEncryption( session, i );
     if( tr_bencDictFindInt( settings, TR_PREFS_KEY_PEER_SOCKET_TOS, &i ) )
         session->peerSocketTOS = i;
     if( tr_bencDictFindStr( settings, TR_PREFS_KEY_PEER_CONGESTION_ALGORITHM, &str ) )
         session->peer_congestion_algorithm = tr_strdup(str);
+    if( tr_bencDictFindInt( settings, TR_PREFS_KEY_PEER_IO_THREADS, &i ) )
+        tr_eventSetShardCount( session, i );
+    if( tr_bencDictFindBool( settings, TR_PREFS_KEY_PEER_SOCKET_KERNEL_SIZING, &boolVal ) )
+        session->peerSocketKernelSizing = boolVal;
+    if( tr_bencDictFindBool( settings, TR_PREFS_KEY_PEER_PORT_REUSEPORT, &boolVal ) )
+        session->peerPortReusePort = boolVal;
+    if( tr_bencDictFindInt( settings, TR_PREFS_KEY_ANNOUNCE_STARTUP_WINDOW, &i ) )
+        session->announceStartupWindowSecs = MAX( 0, i );
     if( tr_bencDictFindBool( settings, TR_PREFS_KEY_BLOCKLIST_ENABLED, &boolVal ) )
         tr_blocklistSetEnabled( session, boolVal );
     if( tr_bencDictFindStr( settings, TR_PREFS_KEY_BLOCKLIST_URL, &str ) )
@@ -745,6 +868,8 @@ sessionSetImpl( void * vdata )
         tr_sessionSetPaused( session, !boolVal );
     if( tr_bencDictFindBool( settings, TR_PREFS_KEY_TRASH_ORIGINAL, &boolVal) )
         tr_sessionSetDeleteSource( session, boolVal );
+    if( tr_bencDictFindList( settings, TR_PREFS_KEY_BANDWIDTH_GROUPS, &list ) )
+        setBandwidthGroupsFromSettings( session, list );
 
     /* files and directories */
     if( tr_bencDictFindInt( settings, TR_PREFS_KEY_PREALLOCATION, &i ) )
@@ -787,14 +912,14 @@ sessionSetImpl( void * vdata )
     tr_bencDictFindStr( settings, TR_PREFS_KEY_BIND_ADDRESS_IPV4, &str );
     if( !tr_pton( str, &b.addr ) || ( b.addr.type != TR_AF_INET ) )
         b.addr = tr_inaddr_any;
-    b.socket = -1;
+    b.socketCount = 0;
     session->public_ipv4 = tr_memdup( &b, sizeof( struct tr_bindinfo ) );
 
     str = TR_PREFS_KEY_BIND_ADDRESS_IPV6;
     tr_bencDictFindStr( settings, TR_PREFS_KEY_BIND_ADDRESS_IPV6, &str );
     if( !tr_pton( str, &b.addr ) || ( b.addr.type != TR_AF_INET6 ) )
         b.addr = tr_in6addr_any;
-    b.socket = -1;
+    b.socketCount = 0;
     session->public_ipv6 = tr_memdup( &b, sizeof( struct tr_bindinfo ) );
 
     /* incoming peer port */
@@ -1229,6 +1354,8 @@ updateBandwidth( tr_session * session, tr_direction dir )
     tr_bandwidthSetDesiredSpeed_Bps( session->bandwidth, dir, limit_Bps );
 }
 
+static void updateGroupBandwidth( tr_session *, tr_bandwidth_group *, tr_direction );
+
 enum
 {
     MINUTES_PER_HOUR = 60,
@@ -1264,6 +1391,7 @@ turtleUpdateTable( struct tr_turtle_info * t )
 static void
 altSpeedToggled( void * vsession )
 {
+    int i, n;
     tr_session * session = vsession;
     struct tr_turtle_info * t = &session->turtle;
 
@@ -1272,6 +1400,12 @@ altSpeedToggled( void * vsession )
     updateBandwidth( session, TR_UP );
     updateBandwidth( session, TR_DOWN );
 
+    for( i=0, n=tr_ptrArraySize( &session->bandwidthGroups ); i<n; ++i ) {
+        tr_bandwidth_group * group = tr_ptrArrayNth( &session->bandwidthGroups, i );
+        updateGroupBandwidth( session, group, TR_UP );
+        updateGroupBandwidth( session, group, TR_DOWN );
+    }
+
     if( t->callback != NULL )
         (*t->callback)( session, t->isEnabled, t->changedByUser, t->callbackUserData );
 }
@@ -1581,6 +1715,180 @@ tr_sessionClearAltSpeedFunc( tr_session * session )
     tr_sessionSetAltSpeedFunc( session, NULL, NULL );
 }
 
+/***
+****  Bandwidth groups
+***/
+
+#define GROUP_KEY_NAME "name"
+#define GROUP_KEY_PRIORITY "bandwidth-priority"
+#define GROUP_KEY_HONORS_SESSION_LIMITS "honors-session-limits"
+
+static int
+compareGroups( const void * va, const void * vb )
+{
+    const tr_bandwidth_group * a = va;
+    const tr_bandwidth_group * b = vb;
+    return strcmp( a->name, b->name );
+}
+
+static int
+compareGroupToName( const void * vgroup, const void * vname )
+{
+    const tr_bandwidth_group * group = vgroup;
+    return strcmp( group->name, vname );
+}
+
+static void
+groupFree( void * vgroup )
+{
+    tr_bandwidth_group * group = vgroup;
+
+    tr_bandwidthFree( group->bandwidth );
+    tr_free( group->name );
+    tr_free( group );
+}
+
+tr_bool
+tr_bandwidthGroupGetActiveSpeedLimit_Bps( const tr_session         * session,
+                                          const tr_bandwidth_group * group,
+                                          tr_direction               dir,
+                                          int                      * setme_Bps )
+{
+    int isLimited = TRUE;
+
+    assert( tr_isSession( session ) );
+    assert( tr_isDirection( dir ) );
+
+    if( group->altSpeedEnabled && tr_sessionUsesAltSpeed( session ) )
+        *setme_Bps = group->altSpeed_Bps[dir];
+    else if( group->speedLimitEnabled[dir] )
+        *setme_Bps = group->speedLimit_Bps[dir];
+    else
+        isLimited = FALSE;
+
+    return isLimited;
+}
+
+static void
+updateGroupBandwidth( tr_session * session, tr_bandwidth_group * group, tr_direction dir )
+{
+    int limit_Bps = 0;
+    const tr_bool isLimited = tr_bandwidthGroupGetActiveSpeedLimit_Bps( session, group, dir, &limit_Bps );
+    const tr_bool zeroCase = isLimited && !limit_Bps;
+
+    tr_bandwidthSetLimited( group->bandwidth, dir, isLimited && !zeroCase );
+
+    tr_bandwidthSetDesiredSpeed_Bps( group->bandwidth, dir, limit_Bps );
+}
+
+tr_bandwidth_group *
+tr_sessionFindBandwidthGroup( tr_session * session, const char * name, tr_bool create )
+{
+    tr_bandwidth_group * group;
+
+    assert( tr_isSession( session ) );
+    assert( name && *name );
+
+    group = tr_ptrArrayFindSorted( &session->bandwidthGroups, name, compareGroupToName );
+
+    if( ( group == NULL ) && create )
+    {
+        group = tr_new0( tr_bandwidth_group, 1 );
+        group->name = tr_strdup( name );
+        group->bandwidth = tr_bandwidthNew( session, session->bandwidth );
+        group->bandwidth->isGroup = TRUE;
+        tr_bandwidthHonorParentLimits( group->bandwidth, TR_UP, TRUE );
+        tr_bandwidthHonorParentLimits( group->bandwidth, TR_DOWN, TRUE );
+        tr_ptrArrayInsertSorted( &session->bandwidthGroups, group, compareGroups );
+    }
+
+    return group;
+}
+
+void
+tr_sessionSetBandwidthGroup( tr_session * session, const char * name, tr_benc * settings )
+{
+    int64_t i;
+    tr_bool boolVal;
+    tr_bandwidth_group * group;
+
+    assert( tr_isSession( session ) );
+    assert( tr_bencIsDict( settings ) );
+
+    if( !name || !*name )
+        return;
+
+    group = tr_sessionFindBandwidthGroup( session, name, TRUE );
+
+    if( tr_bencDictFindInt( settings, TR_PREFS_KEY_DSPEED_KBps, &i ) && ( i >= 0 ) )
+        group->speedLimit_Bps[TR_DOWN] = toSpeedBytes( i );
+    if( tr_bencDictFindBool( settings, TR_PREFS_KEY_DSPEED_ENABLED, &boolVal ) )
+        group->speedLimitEnabled[TR_DOWN] = boolVal;
+    if( tr_bencDictFindInt( settings, TR_PREFS_KEY_USPEED_KBps, &i ) && ( i >= 0 ) )
+        group->speedLimit_Bps[TR_UP] = toSpeedBytes( i );
+    if( tr_bencDictFindBool( settings, TR_PREFS_KEY_USPEED_ENABLED, &boolVal ) )
+        group->speedLimitEnabled[TR_UP] = boolVal;
+    if( tr_bencDictFindInt( settings, TR_PREFS_KEY_ALT_SPEED_DOWN_KBps, &i ) && ( i >= 0 ) )
+        group->altSpeed_Bps[TR_DOWN] = toSpeedBytes( i );
+    if( tr_bencDictFindInt( settings, TR_PREFS_KEY_ALT_SPEED_UP_KBps, &i ) && ( i >= 0 ) )
+        group->altSpeed_Bps[TR_UP] = toSpeedBytes( i );
+    if( tr_bencDictFindBool( settings, TR_PREFS_KEY_ALT_SPEED_ENABLED, &boolVal ) )
+        group->altSpeedEnabled = boolVal;
+    if( tr_bencDictFindInt( settings, GROUP_KEY_PRIORITY, &i ) && tr_isPriority( i ) )
+        group->bandwidth->priority = i;
+    if( tr_bencDictFindBool( settings, GROUP_KEY_HONORS_SESSION_LIMITS, &boolVal ) ) {
+        tr_bandwidthHonorParentLimits( group->bandwidth, TR_UP, boolVal );
+        tr_bandwidthHonorParentLimits( group->bandwidth, TR_DOWN, boolVal );
+    }
+
+    updateGroupBandwidth( session, group, TR_UP );
+    updateGroupBandwidth( session, group, TR_DOWN );
+}
+
+void
+tr_sessionGetBandwidthGroups( tr_session * session, tr_benc * list )
+{
+    int i, n;
+
+    assert( tr_isSession( session ) );
+    assert( tr_bencIsList( list ) );
+
+    tr_bencListReserve( list, tr_ptrArraySize( &session->bandwidthGroups ) );
+
+    for( i=0, n=tr_ptrArraySize( &session->bandwidthGroups ); i<n; ++i )
+    {
+        const tr_bandwidth_group * group = tr_ptrArrayNth( &session->bandwidthGroups, i );
+        tr_benc * d = tr_bencListAddDict( list, 10 );
+
+        tr_bencDictAddStr ( d, GROUP_KEY_NAME,                      group->name );
+        tr_bencDictAddInt ( d, TR_PREFS_KEY_DSPEED_KBps,            toSpeedKBps( group->speedLimit_Bps[TR_DOWN] ) );
+        tr_bencDictAddBool( d, TR_PREFS_KEY_DSPEED_ENABLED,         group->speedLimitEnabled[TR_DOWN] );
+        tr_bencDictAddInt ( d, TR_PREFS_KEY_USPEED_KBps,            toSpeedKBps( group->speedLimit_Bps[TR_UP] ) );
+        tr_bencDictAddBool( d, TR_PREFS_KEY_USPEED_ENABLED,         group->speedLimitEnabled[TR_UP] );
+        tr_bencDictAddInt ( d, TR_PREFS_KEY_ALT_SPEED_DOWN_KBps,    toSpeedKBps( group->altSpeed_Bps[TR_DOWN] ) );
+        tr_bencDictAddInt ( d, TR_PREFS_KEY_ALT_SPEED_UP_KBps,      toSpeedKBps( group->altSpeed_Bps[TR_UP] ) );
+        tr_bencDictAddBool( d, TR_PREFS_KEY_ALT_SPEED_ENABLED,      group->altSpeedEnabled );
+        tr_bencDictAddInt ( d, GROUP_KEY_PRIORITY,                  group->bandwidth->priority );
+        tr_bencDictAddBool( d, GROUP_KEY_HONORS_SESSION_LIMITS,     tr_bandwidthAreParentLimitsHonored( group->bandwidth, TR_UP ) );
+    }
+}
+
+static void
+setBandwidthGroupsFromSettings( tr_session * session, tr_benc * list )
+{
+    size_t i;
+    const size_t n = tr_bencListSize( list );
+
+    for( i=0; i<n; ++i )
+    {
+        const char * name;
+        tr_benc * d = tr_bencListChild( list, i );
+
+        if( tr_bencIsDict( d ) && tr_bencDictFindStr( d, GROUP_KEY_NAME, &name ) )
+            tr_sessionSetBandwidthGroup( session, name, d );
+    }
+}
+
 /***
 ****
 ***/
@@ -1702,6 +2010,40 @@ compareTorrentByCur( const void * va, const void * vb )
 
 static void closeBlocklists( tr_session * );
 
+static void
+sessionCloseImplFinish( tr_session * session )
+{
+    tr_announcerUdpUninit( session );
+    tr_udpUninit( session );
+    tr_utpUninit( session );
+    tr_cryptoKeyPoolUninit( );
+    tr_webClose( session, TR_WEB_CLOSE_WHEN_IDLE );
+
+    closeBlocklists( session );
+
+    tr_fdClose( session );
+
+    session->isClosed = TRUE;
+}
+
+static void
+sessionCloseImplWaitForUdp( int foo UNUSED, short bar UNUSED, void * vsession )
+{
+    tr_session * session = vsession;
+
+    /* keep the UDP sockets open until the udp:// trackers
+     * have heard our "stopped" messages or have timed out */
+    if( !tr_announcerUdpIsIdle( session->announcer_udp ) )
+    {
+        const struct timeval tv = { 0, 100000 };
+        event_base_once( session->event_base, -1, EV_TIMEOUT,
+                         sessionCloseImplWaitForUdp, session, &tv );
+        return;
+    }
+
+    sessionCloseImplFinish( session );
+}
+
 static void
 sessionCloseImpl( void * vsession )
 {
@@ -1712,12 +2054,33 @@ sessionCloseImpl( void * vsession )
 
     assert( tr_isSession( session ) );
 
+    if( session->acceptStats.wakeups > 0 )
+    {
+        tr_accept_stats st;
+        tr_sessionGetAcceptStats( session, &st );
+        tr_ndbg( "Peer port", "%"PRIu64" connections accepted on %d listeners in %"PRIu64
+                 " wakeups (at most %d at once), %.1f/sec; %"PRId64" listen queue overflows",
+                 st.accepted, st.listeners, st.wakeups, st.max_per_wakeup,
+                 st.accepts_per_sec, st.listen_overflows );
+    }
+
+    if( session->web != NULL )
+    {
+        tr_web_stats st;
+        tr_webGetStats( session, &st );
+        if( st.tasks > 0 )
+            tr_ndbg( "web", "%"PRIu64" tasks on %"PRIu64" new handles and %"PRIu64" pooled ones; "
+                     "%"PRIu64" connections opened, %"PRIu64" tasks reused one",
+                     st.tasks, st.handles_created, st.handles_reused,
+                     st.connections_opened, st.connections_reused );
+    }
+
     free_incoming_peer_port( session );
 
     if( session->isLPDEnabled )
         tr_lpdUninit( session );
 
-    tr_udpUninit( session );
+    tr_dhtUninit( session );
 
     event_free( session->saveTimer );
     session->saveTimer = NULL;
@@ -1747,13 +2110,9 @@ sessionCloseImpl( void * vsession )
     tr_announcerClose( session );
     tr_statsClose( session );
     tr_peerMgrFree( session->peerMgr );
-    tr_webClose( session, TR_WEB_CLOSE_WHEN_IDLE );
-
-    closeBlocklists( session );
-
-    tr_fdClose( session );
 
-    session->isClosed = TRUE;
+    tr_announcerUdpShutdown( session->announcer_udp );
+    sessionCloseImplWaitForUdp( 0, 0, session );
 }
 
 static int
@@ -1817,6 +2176,8 @@ tr_sessionClose( tr_session * session )
 
     /* free the session memory */
     tr_bencFree( &session->removedTorrents );
+    tr_ptrArrayDestruct( &session->bandwidthGroups, groupFree );
+    tr_ptrArrayDestruct( &session->torrentsByHash, NULL );
     tr_bandwidthFree( session->bandwidth );
     tr_bitfieldDestruct( &session->turtle.minutes );
     tr_lockFree( session->lock );
@@ -1993,6 +2354,34 @@ tr_sessionAllowsLPD( const tr_session * session )
 ****
 ***/
 
+void
+tr_sessionSetUTPEnabled( tr_session * session, tr_bool enabled )
+{
+    assert( tr_isSession( session ) );
+    assert( tr_isBool( enabled ) );
+
+    /* this only affects new connections; the ones we have are left alone */
+    session->isUTPEnabled = enabled;
+}
+
+tr_bool
+tr_sessionIsUTPEnabled( const tr_session * session )
+{
+    assert( tr_isSession( session ) );
+
+    return session->isUTPEnabled;
+}
+
+tr_bool
+tr_sessionAllowsUTP( const tr_session * session )
+{
+    return tr_sessionIsUTPEnabled( session ) && ( session->utp != NULL );
+}
+
+/***
+****
+***/
+
 void
 tr_sessionSetCacheLimit_MB( tr_session * session, int max_bytes )
 {
@@ -29,6 +29,7 @@
 
 #include "bencode.h"
 #include "bitfield.h"
+#include "ptrarray.h"
 #include "utils.h"
 
 typedef enum { TR_NET_OK, TR_NET_ERROR, TR_NET_WAIT } tr_tristate_t;
@@ -40,10 +41,28 @@ const uint8_t* tr_getPeerId( void );
 struct event_base;
 struct tr_address;
 struct tr_announcer;
+struct tr_announcer_udp;
 struct tr_bandwidth;
 struct tr_bindsockets;
 struct tr_cache;
 struct tr_fdInfo;
+struct tr_udp_batch;
+
+/** @see tr_sessionGetAcceptStats() */
+typedef struct tr_accept_stats
+{
+    int      listeners;          /* sockets listening on the peer port */
+    uint64_t wakeups;            /* accept events with at least one connection */
+    uint64_t accepted;
+    int      max_per_wakeup;
+    double   accepts_per_sec;    /* since the listeners were opened */
+
+    /* connections the kernel turned away because a listen queue was full,
+     * counted across the whole system since the listeners were opened.
+     * -1 if the platform doesn't say */
+    int64_t  listen_overflows;
+}
+tr_accept_stats;
 
 typedef void ( tr_web_config_func )( tr_session * session, void * curl_pointer, const char * url );
 
@@ -83,6 +102,23 @@ struct tr_turtle_info
     tr_bitfield minutes;
 };
 
+/** @brief a named set of speed limits shared by the torrents in it */
+typedef struct tr_bandwidth_group
+{
+    char * name;
+
+    /* a child of the session's bandwidth and the parent of its torrents' */
+    struct tr_bandwidth * bandwidth;
+
+    int speedLimit_Bps[2];
+    tr_bool speedLimitEnabled[2];
+
+    /* used instead of speedLimit_Bps while the session is in alt-speed mode */
+    int altSpeed_Bps[2];
+    tr_bool altSpeedEnabled;
+}
+tr_bandwidth_group;
+
 /** @brief handle to an active libtransmission session */
 struct tr_session
 {
@@ -90,6 +126,7 @@ struct tr_session
     tr_bool                      isPexEnabled;
     tr_bool                      isDHTEnabled;
     tr_bool                      isLPDEnabled;
+    tr_bool                      isUTPEnabled;
     tr_bool                      isBlocklistEnabled;
     tr_bool                      isProxyEnabled;
     tr_bool                      isProxyAuthEnabled;
@@ -134,6 +171,10 @@ struct tr_session
     unsigned char *              udp6_bound;
     struct event                 *udp_event;
     struct event                 *udp6_event;
+    struct tr_udp_batch          *udp_batch;
+
+    /* uTP connections, which share the UDP sockets */
+    struct tr_utp_context        *utp;
 
     /* The open port on the local machine for incoming peer requests */
     tr_port                      private_peer_port;
@@ -152,9 +193,15 @@ struct tr_session
     int                          proxyPort;
     int                          peerSocketTOS;
     char *                       peer_congestion_algorithm;
+    tr_bool                      peerSocketKernelSizing;
+    tr_bool                      peerPortReusePort;
+
+    /* how long after startup the trackers' "started" announces are spread */
+    int                          announceStartupWindowSecs;
 
     int                          torrentCount;
     tr_torrent *                 torrentList;
+    tr_ptrArray                  torrentsByHash; /* the same torrents, sorted by info hash */
 
     char *                       torrentDoneScript;
 
@@ -190,6 +237,9 @@ struct tr_session
 
     struct tr_announcer        * announcer;
 
+    /* talks to udp:// trackers over the UDP sockets */
+    struct tr_announcer_udp    * announcer_udp;
+
     tr_benc                    * metainfoLookup;
 
     struct event               * nowTimer;
@@ -198,6 +248,9 @@ struct tr_session
     /* monitors the "global pool" speeds */
     struct tr_bandwidth        * bandwidth;
 
+    /* tr_bandwidth_group, sorted by name */
+    tr_ptrArray                  bandwidthGroups;
+
     double                       desiredRatio;
 
     uint16_t                     idleLimitMinutes;
@@ -205,6 +258,10 @@ struct tr_session
     struct tr_bindinfo         * public_ipv4;
     struct tr_bindinfo         * public_ipv6;
 
+    tr_accept_stats              acceptStats;
+    uint64_t                     acceptStatsSince;      /* tr_time_msec() */
+    int64_t                      listenOverflowsBase;
+
     /* a page-aligned buffer for use by the libtransmission thread.
      * @see SESSION_BUFFER_SIZE */
     void * buffer;
@@ -224,6 +281,8 @@ tr_bool      tr_sessionAllowsDHT( const tr_session * session );
 
 tr_bool      tr_sessionAllowsLPD( const tr_session * session );
 
+tr_bool      tr_sessionAllowsUTP( const tr_session * session );
+
 const char * tr_sessionFindTorrentFile( const tr_session * session,
                                         const char *       hashString );
 
@@ -247,8 +306,31 @@ const struct tr_address*  tr_sessionGetPublicAddress( const tr_session  * sessio
 
 struct tr_bindsockets * tr_sessionGetBindSockets( tr_session * );
 
+/**
+ * @brief how the peer port's listeners are keeping up.
+ *
+ * Each wakeup accepts everything that's waiting, up to a limit, rather
+ * than one connection. With TR_PREFS_KEY_PEER_PORT_REUSEPORT on, the
+ * port has several SO_REUSEPORT listeners, each with its own backlog,
+ * so a burst of connections is less likely to overflow one queue.
+ */
+void tr_sessionGetAcceptStats( const tr_session * session, tr_accept_stats * setme );
+
 int tr_sessionCountTorrents( const tr_session * session );
 
+/**
+ * @return the named bandwidth group, or NULL if there isn't one
+ *         and `create' is false
+ */
+tr_bandwidth_group * tr_sessionFindBandwidthGroup( tr_session * session,
+                                                   const char * name,
+                                                   tr_bool      create );
+
+tr_bool tr_bandwidthGroupGetActiveSpeedLimit_Bps( const tr_session         * session,
+                                                  const tr_bandwidth_group * group,
+                                                  tr_direction               dir,
+                                                  int                      * setme_Bps );
+
 enum
 {
     SESSION_MAGIC_NUMBER = 3845,
@@ -71,29 +71,42 @@ tr_torrentFindFromId( tr_session * session, int id )
     return NULL;
 }
 
+static int
+compareTorrentByHash( const void * va, const void * vb )
+{
+    const tr_torrent * a = va;
+    const tr_torrent * b = vb;
+
+    return memcmp( a->info.hash, b->info.hash, SHA_DIGEST_LENGTH );
+}
+
+static int
+compareTorrentToHash( const void * va, const void * vb )
+{
+    const tr_torrent * a = va;
+    const uint8_t * hash = vb;
+
+    return memcmp( a->info.hash, hash, SHA_DIGEST_LENGTH );
+}
+
 tr_torrent*
 tr_torrentFindFromHashString( tr_session *  session, const char * str )
 {
-    tr_torrent * tor = NULL;
+    uint8_t hash[SHA_DIGEST_LENGTH];
 
-    while(( tor = tr_torrentNext( session, tor )))
-        if( !strcasecmp( str, tor->info.hashString ) )
-            return tor;
+    if( ( strlen( str ) != SHA_DIGEST_LENGTH * 2 )
+        || ( strspn( str, "0123456789abcdefABCDEF" ) != SHA_DIGEST_LENGTH * 2 ) )
+        return NULL;
 
-    return NULL;
+    tr_hex_to_sha1( hash, str );
+    return tr_torrentFindFromHash( session, hash );
 }
 
 tr_torrent*
 tr_torrentFindFromHash( tr_session * session, const uint8_t * torrentHash )
 {
-    tr_torrent * tor = NULL;
-
-    while(( tor = tr_torrentNext( session, tor )))
-        if( *tor->info.hash == *torrentHash )
-            if( !memcmp( tor->info.hash, torrentHash, SHA_DIGEST_LENGTH ) )
-                return tor;
-
-    return NULL;
+    return tr_ptrArrayFindSorted( &session->torrentsByHash, torrentHash,
+                                  compareTorrentToHash );
 }
 
 tr_torrent*
@@ -131,16 +144,27 @@ tr_torrentIsPieceTransferAllowed( const tr_torrent  * tor,
 {
     int limit;
     tr_bool allowed = TRUE;
+    const tr_bandwidth_group * group = NULL;
 
     if( tr_torrentUsesSpeedLimit( tor, direction ) )
         if( tr_torrentGetSpeedLimit_Bps( tor, direction ) <= 0 )
             allowed = FALSE;
 
-    if( tr_torrentUsesSessionLimits( tor ) )
-        if( tr_sessionGetActiveSpeedLimit_Bps( tor->session, direction, &limit ) )
+    if( tor->bandwidthGroup != NULL )
+        group = tr_sessionFindBandwidthGroup( tor->session, tor->bandwidthGroup, FALSE );
+
+    /* a group's limits apply whether or not its torrents honor the session's */
+    if( group != NULL )
+        if( tr_bandwidthGroupGetActiveSpeedLimit_Bps( tor->session, group, direction, &limit ) )
             if( limit <= 0 )
                 allowed = FALSE;
 
+    if( tr_torrentUsesSessionLimits( tor ) )
+        if( ( group == NULL ) || tr_bandwidthAreParentLimitsHonored( group->bandwidth, direction ) )
+            if( tr_sessionGetActiveSpeedLimit_Bps( tor->session, direction, &limit ) )
+                if( limit <= 0 )
+                    allowed = FALSE;
+
     return allowed;
 }
 
@@ -219,6 +243,40 @@ tr_torrentUsesSessionLimits( const tr_torrent * tor )
     return tr_bandwidthAreParentLimitsHonored( tor->bandwidth, TR_UP );
 }
 
+void
+tr_torrentSetBandwidthGroup( tr_torrent * tor, const char * name )
+{
+    tr_bandwidth * parent;
+
+    assert( tr_isTorrent( tor ) );
+
+    if( name && !*name )
+        name = NULL;
+
+    if( !tr_strcmp0( name, tor->bandwidthGroup ) )
+        return;
+
+    if( name == NULL )
+        parent = tor->session->bandwidth;
+    else
+        parent = tr_sessionFindBandwidthGroup( tor->session, name, TRUE )->bandwidth;
+
+    tr_bandwidthSetParent( tor->bandwidth, parent );
+
+    tr_free( tor->bandwidthGroup );
+    tor->bandwidthGroup = tr_strdup( name );
+
+    tr_torrentSetDirty( tor );
+}
+
+const char *
+tr_torrentGetBandwidthGroup( const tr_torrent * tor )
+{
+    assert( tr_isTorrent( tor ) );
+
+    return tor->bandwidthGroup;
+}
+
 /***
 ****
 ***/
@@ -864,6 +922,8 @@ torrentInit( tr_torrent * tor, const tr_ctor * ctor )
         else
             last->next = tor;
         ++session->torrentCount;
+        tr_ptrArrayInsertSorted( &session->torrentsByHash, tor,
+                                 compareTorrentByHash );
     }
 
     /* if we don't have a local .torrent file already, assume the torrent is new */
@@ -1503,6 +1563,7 @@ freeTorrent( tr_torrent * tor )
 
     tr_free( tor->downloadDir );
     tr_free( tor->incompleteDir );
+    tr_free( tor->bandwidthGroup );
     tr_free( tor->peer_id );
 
     if( tor == session->torrentList )
@@ -1514,6 +1575,8 @@ freeTorrent( tr_torrent * tor )
         }
     }
 
+    tr_ptrArrayRemoveSorted( &session->torrentsByHash, tor,
+                             compareTorrentByHash );
     assert( session->torrentCount >= 1 );
     session->torrentCount--;
 
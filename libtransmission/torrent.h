@@ -185,6 +185,8 @@ struct tr_torrent
     time_t                     dhtAnnounce6At;
     tr_bool                    dhtAnnounceInProgress;
     tr_bool                    dhtAnnounce6InProgress;
+    int                        dhtAnnouncePeers; /* learned in the current search */
+    int                        dhtAnnounce6Peers;
 
     time_t                     lpdAnnounceAt;
 
@@ -242,6 +244,10 @@ struct tr_torrent
 
     struct tr_bandwidth      * bandwidth;
 
+    /* the name of the bandwidth group that tor->bandwidth's parent
+     * belongs to, or NULL if its parent is the session's bandwidth */
+    char                     * bandwidthGroup;
+
     struct tr_torrent_peers  * torrentPeers;
 
     double                     desiredRatio;
@@ -26,6 +26,8 @@ THE SOFTWARE.
 /* ansi */
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h> /* qsort() */
+#include <string.h> /* memset() */
 
 /* posix */
 #include <signal.h> /* sig_atomic_t */
@@ -56,12 +58,31 @@ THE SOFTWARE.
 #include "session.h"
 #include "torrent.h" /* tr_torrentFindFromHash() */
 #include "tr-dht.h"
+#include "tr-udp.h"
 #include "trevent.h" /* tr_runInEventThread() */
 #include "utils.h"
 
+enum
+{
+    /* how many searches we let the DHT run at once, per address family.
+       Starting one for every torrent at the same time fills its search
+       table and most of them time out */
+    DHT_MAX_SEARCHES_IN_FLIGHT = 16,
+
+    /* a search that hasn't finished by now is given up on */
+    DHT_SEARCH_TIMEOUT_SECS = 5 * 60,
+
+    /* sparse swarms are searched more often, to find what peers there are;
+       healthy ones just need our announce refreshed before it expires */
+    DHT_REANNOUNCE_MIN_SECS = 10 * 60,
+    DHT_REANNOUNCE_MAX_SECS = 25 * 60,
+    DHT_HEALTHY_SWARM_PEERS = 50
+};
+
 static struct event *dht_timer = NULL;
 static unsigned char myid[20];
 static tr_session *session = NULL;
+static tr_dht_stats stats;
 
 static void timer_callback(int s, short type, void *ignore);
 
@@ -306,6 +327,7 @@ tr_dhtInit(tr_session *ss)
         goto fail;
 
     session = ss;
+    memset( &stats, 0, sizeof( tr_dht_stats ) );
 
     cl = tr_new( struct bootstrap_closure, 1 );
     cl->session = session;
@@ -336,6 +358,12 @@ tr_dhtUninit(tr_session *ss)
 
     tr_ndbg( "DHT", "Uninitializing DHT" );
 
+    if( stats.searchesStarted > 0 )
+        tr_ndbg( "DHT", "%"PRIu64" searches started, %"PRIu64" done, "
+                 "%"PRIu64" found peers, %"PRIu64" timed out",
+                 stats.searchesStarted, stats.searchesDone,
+                 stats.searchesFoundPeers, stats.searchesTimedOut );
+
     event_free( dht_timer );
     dht_timer = NULL;
 
@@ -499,6 +527,38 @@ tr_dhtPrintableStatus(int status)
     }
 }
 
+static int
+getReannounceInterval( tr_torrent * tor, int peersFound )
+{
+    const int known = MAX( peersFound, tr_peerMgrKnownPeerCount( tor ) );
+    const int health = MIN( known, DHT_HEALTHY_SWARM_PEERS );
+
+    return DHT_REANNOUNCE_MIN_SECS
+         + ( DHT_REANNOUNCE_MAX_SECS - DHT_REANNOUNCE_MIN_SECS ) * health
+                                                 / DHT_HEALTHY_SWARM_PEERS
+         + tr_cryptoWeakRandInt( 3 * 60 );
+}
+
+static void
+searchDone( tr_torrent * tor, int af )
+{
+    const int peersFound = af == AF_INET ? tor->dhtAnnouncePeers
+                                         : tor->dhtAnnounce6Peers;
+    const time_t nextAt = tr_time( ) + getReannounceInterval( tor, peersFound );
+
+    ++stats.searchesDone;
+    if( peersFound > 0 )
+        ++stats.searchesFoundPeers;
+
+    if( af == AF_INET ) {
+        tor->dhtAnnounceInProgress = FALSE;
+        tor->dhtAnnounceAt = nextAt;
+    } else {
+        tor->dhtAnnounce6InProgress = FALSE;
+        tor->dhtAnnounce6At = nextAt;
+    }
+}
+
 static void
 callback( void *ignore UNUSED, int event,
           unsigned char *info_hash, void *data, size_t data_len )
@@ -518,6 +578,10 @@ callback( void *ignore UNUSED, int event,
             for( i=0; i<n; ++i )
                 tr_peerMgrAddPex( tor, TR_PEER_FROM_DHT, pex+i, -1 );
             tr_free(pex);
+            if( event == DHT_EVENT_VALUES )
+                tor->dhtAnnouncePeers += n;
+            else
+                tor->dhtAnnounce6Peers += n;
             tr_tordbg(tor, "Learned %d%s peers from DHT",
                       (int)n,
                       event == DHT_EVENT_VALUES6 ? " IPv6" : "");
@@ -529,10 +593,12 @@ callback( void *ignore UNUSED, int event,
         if( tor ) {
             if( event == DHT_EVENT_SEARCH_DONE ) {
                 tr_torinf(tor, "DHT announce done");
-                tor->dhtAnnounceInProgress = 0;
+                if( tor->dhtAnnounceInProgress )
+                    searchDone( tor, AF_INET );
             } else {
                 tr_torinf(tor, "IPv6 DHT announce done");
-                tor->dhtAnnounce6InProgress = 0;
+                if( tor->dhtAnnounce6InProgress )
+                    searchDone( tor, AF_INET6 );
             }
         }
     }
@@ -561,10 +627,14 @@ tr_dhtAnnounce(tr_torrent *tor, int af, tr_bool announce)
             tr_torinf(tor, "Starting%s DHT announce (%s, %d nodes)",
                       af == AF_INET6 ? " IPv6" : "",
                       tr_dhtPrintableStatus(status), numnodes);
-            if(af == AF_INET)
+            if(af == AF_INET) {
                 tor->dhtAnnounceInProgress = TRUE;
-            else
+                tor->dhtAnnouncePeers = 0;
+            } else {
                 tor->dhtAnnounce6InProgress = TRUE;
+                tor->dhtAnnounce6Peers = 0;
+            }
+            ++stats.searchesStarted;
             ret = 1;
         } else {
             tr_torerr(tor, "%sDHT announce failed (%s, %d nodes): %s",
@@ -581,6 +651,124 @@ tr_dhtAnnounce(tr_torrent *tor, int af, tr_bool announce)
     return ret;
 }
 
+/***
+****  Announce scheduling
+***/
+
+struct dht_candidate
+{
+    tr_torrent * tor;
+    time_t announceAt;
+    int knownPeers;
+};
+
+/* torrents that know the fewest peers go first */
+static int
+compareCandidates( const void * va, const void * vb )
+{
+    const struct dht_candidate * a = va;
+    const struct dht_candidate * b = vb;
+
+    if( a->knownPeers != b->knownPeers )
+        return a->knownPeers < b->knownPeers ? -1 : 1;
+    if( a->announceAt != b->announceAt )
+        return a->announceAt < b->announceAt ? -1 : 1;
+    return 0;
+}
+
+static void
+announceMore( tr_session * ss, int af, time_t now )
+{
+    int i, n, slots;
+    int inFlight = 0;
+    tr_torrent * tor = NULL;
+    struct dht_candidate * candidates;
+
+    if( tr_dhtStatus( ss, af, NULL ) < TR_DHT_POOR )
+        return;
+
+    n = 0;
+    candidates = tr_new( struct dht_candidate, ss->torrentCount );
+    while(( tor = tr_torrentNext( ss, tor )))
+    {
+        tr_bool * inProgress = af == AF_INET ? &tor->dhtAnnounceInProgress
+                                             : &tor->dhtAnnounce6InProgress;
+        time_t * announceAt = af == AF_INET ? &tor->dhtAnnounceAt
+                                            : &tor->dhtAnnounce6At;
+
+        if( *inProgress )
+        {
+            if( *announceAt > now ) {
+                ++inFlight;
+                continue;
+            }
+
+            /* the DHT never told us that this one was done */
+            tr_tordbg( tor, "%sDHT announce timed out",
+                       af == AF_INET6 ? "IPv6 " : "" );
+            *inProgress = FALSE;
+            ++stats.searchesDone;
+            ++stats.searchesTimedOut;
+        }
+
+        if( ( *announceAt <= now ) && tor->isRunning
+                                   && tr_torrentAllowsDHT( tor ) )
+        {
+            struct dht_candidate * c = &candidates[n++];
+            c->tor = tor;
+            c->announceAt = *announceAt;
+            c->knownPeers = tr_peerMgrKnownPeerCount( tor );
+        }
+    }
+
+    slots = MAX( 0, DHT_MAX_SEARCHES_IN_FLIGHT - inFlight );
+    if( n > slots )
+        qsort( candidates, n, sizeof( struct dht_candidate ),
+               compareCandidates );
+
+    for( i=0; i<n && slots>0; ++i )
+    {
+        time_t * announceAt;
+
+        tor = candidates[i].tor;
+        announceAt = af == AF_INET ? &tor->dhtAnnounceAt
+                                   : &tor->dhtAnnounce6At;
+
+        if( tr_dhtAnnounce( tor, af, TRUE ) > 0 ) {
+            *announceAt = now + DHT_SEARCH_TIMEOUT_SECS;
+            ++inFlight;
+            --slots;
+        } else {
+            /* try again soon */
+            *announceAt = now + 5 + tr_cryptoWeakRandInt( 5 );
+        }
+    }
+
+    stats.searchesInFlight += inFlight;
+    stats.searchesQueued += n - i;
+
+    tr_free( candidates );
+}
+
+void
+tr_dhtAnnounceMore( tr_session * ss, time_t now )
+{
+    if( !tr_dhtEnabled( ss ) )
+        return;
+
+    stats.searchesInFlight = 0;
+    stats.searchesQueued = 0;
+
+    announceMore( ss, AF_INET, now );
+    announceMore( ss, AF_INET6, now );
+}
+
+void
+tr_dhtGetStats( tr_dht_stats * setme )
+{
+    *setme = stats;
+}
+
 void
 tr_dhtCallback(unsigned char *buf, int buflen,
                struct sockaddr *from, socklen_t fromlen,
@@ -638,3 +826,11 @@ dht_random_bytes( void * buf, size_t size )
     tr_cryptoRandBuf( buf, size );
     return size;
 }
+
+int
+dht_sendto( int s UNUSED, const void * buf, int len, int flags UNUSED,
+            const struct sockaddr * to, int tolen )
+{
+    /* go through tr-udp.c so that replies are batched with everything else */
+    return tr_udpSendToSockaddr( session, buf, len, to, tolen );
+}
@@ -36,6 +36,17 @@ enum
     TR_DHT_GOOD         = 4
 };
 
+typedef struct tr_dht_stats
+{
+    int searchesInFlight;
+    int searchesQueued;         /* due, but waiting for a free search slot */
+    uint64_t searchesStarted;
+    uint64_t searchesDone;      /* including the ones that timed out */
+    uint64_t searchesFoundPeers;
+    uint64_t searchesTimedOut;
+}
+tr_dht_stats;
+
 int  tr_dhtInit( tr_session * );
 void tr_dhtUninit( tr_session * );
 tr_bool tr_dhtEnabled( const tr_session * );
@@ -44,6 +55,8 @@ int tr_dhtStatus( tr_session *, int af, int * setme_nodeCount );
 const char *tr_dhtPrintableStatus(int status);
 int tr_dhtAddNode( tr_session *, const tr_address *, tr_port, tr_bool bootstrap );
 int tr_dhtAnnounce( tr_torrent *, int af, tr_bool announce );
+void tr_dhtAnnounceMore( tr_session *, time_t now );
 void tr_dhtCallback(unsigned char *buf, int buflen,
                     struct sockaddr *from, socklen_t fromlen,
                     void *sv);
+void tr_dhtGetStats( tr_dht_stats * setme );
@@ -61,7 +61,8 @@ THE SOFTWARE.
 * @file tr-lpd.c
 *
 * This module implements the Local Peer Discovery (LPD) protocol as supported by the
-* uTorrent client application. A typical LPD datagram is 119 bytes long.
+* uTorrent client application. A typical LPD datagram is 119 bytes long; announces
+* for several torrents share a datagram, with one Infohash header each.
 *
 * $Id$
 */
@@ -76,7 +77,11 @@ static tr_port lpd_port;
 static tr_torrent* lpd_torStaticType UNUSED; /* just a helper for static type analysis */
 static tr_session* session;
 
-enum { lpd_maxDatagramLength = 200 }; /**<the size an LPD datagram must not exceed */
+enum {
+    lpd_maxDatagramLength = 1400, /**<the size an LPD datagram must not exceed;
+                                       fits into an Ethernet frame with IP and UDP headers */
+    lpd_maxHashesPerDatagram = 25 /**<each "Infohash: ...\r\n" line takes 52 bytes */
+};
 const char lpd_mcastGroup[] = "239.192.152.143"; /**<LPD multicast group */
 const int lpd_mcastPort = 6771; /**<LPD source and destination UPD port */
 static struct sockaddr_in lpd_mcastAddr; /**<initialized from the above constants in tr_lpdInit */
@@ -98,7 +103,8 @@ enum lpd_enumTimeToLive {
 
 enum {
     lpd_announceInterval = 4 * 60, /**<4 min announce interval per torrent */
-    lpd_announceScope = lpd_ttlSameSubnet /**<the maximum scope for LPD datagrams */
+    lpd_announceScope = lpd_ttlSameSubnet, /**<the maximum scope for LPD datagrams */
+    lpd_sendCapFactor = 1 /**<send at most one datagram per second (interval average) */
 };
 
 
@@ -199,14 +205,18 @@ static const char* lpd_extractHeader( const char* s, struct lpd_protocolVersion*
 * @param[in] name Name of parameter to extract
 * @param[in] n Maximum available storage for value to return
 * @param[out] val Output parameter for the actual value
-* @return Returns 1 if value could be copied successfully
+* @return Returns a pointer to the "\r\n" that ends the value, or NULL if there is no
+*         such parameter
 *
 * Extracts the associated value of a named parameter from a HTTP-style header by
 * performing the following steps:
 *   - assemble search string "\r\nName: " and locate position
 *   - copy back value from end to next "\r\n"
+*
+* A parameter that is repeated can be walked by passing the returned pointer back in
+* as str.
 */
-static int lpd_extractParam( const char* const str, const char* const name, int n, char* const val )
+static const char* lpd_extractParam( const char* const str, const char* const name, int n, char* const val )
 {
     /* configure maximum length of search string here */
     enum { maxLength = 30 };
@@ -217,14 +227,14 @@ static int lpd_extractParam( const char* const str, const char* const name, int
     assert( val != NULL );
 
     if( strlen( name ) > maxLength - strlen( CRLF ": " ) )
-        return 0;
+        return NULL;
 
     /* compose the string token to search for */
     snprintf( sstr, maxLength, CRLF "%s: ", name );
 
     pos = strstr( str, sstr );
     if( pos == NULL )
-        return 0; /* search was not successful */
+        return NULL; /* search was not successful */
 
     {
         const char* const beg = pos + strlen( sstr );
@@ -240,10 +250,10 @@ static int lpd_extractParam( const char* const str, const char* const name, int
 
         strncpy( val, beg, n );
         val[n] = 0;
-    }
 
-    /* we successfully returned the value string */
-    return 1;
+        /* we successfully returned the value string */
+        return new_line;
+    }
 }
 
 /**
@@ -408,54 +418,63 @@ static inline void lpd_consistencyCheck( void )
 */
 
 /**
-* @brief Announce the given torrent on the local network
+* @brief Announce the given torrents on the local network
 *
-* @param[in] t Torrent to announce
+* @param[in] torrents Torrents to announce
+* @param[in] n Number of torrents, at most lpd_maxHashesPerDatagram
 * @return Returns TRUE on success
 *
-* Send a query for torrent t out to the LPD multicast group (or the LAN, for that
-* matter). A listening client on the same network might react by adding us to his
-* peer pool for torrent t.
+* Send a query for the torrents out to the LPD multicast group (or the LAN, for that
+* matter), one Infohash header per torrent. A listening client on the same network
+* might react by adding us to his peer pool for each of them.
 */
-tr_bool tr_lpdSendAnnounce( const tr_torrent* t )
+tr_bool tr_lpdSendAnnounce( tr_torrent** torrents, int n )
 {
-    size_t i;
+    int i;
+    size_t j, len;
     const char fmt[] =
         "BT-SEARCH * HTTP/%u.%u" CRLF
         "Host: %s:%u" CRLF
-        "Port: %u" CRLF
-        "Infohash: %s" CRLF
-        CRLF
-        CRLF;
+        "Port: %u" CRLF;
 
-    char hashString[lengthof( t->info.hashString )];
+    char hashString[lengthof( torrents[0]->info.hashString )];
     char query[lpd_maxDatagramLength + 1] = { };
 
-    if( t == NULL )
+    if( torrents == NULL || n < 1 )
         return FALSE;
 
-    /* make sure the hash string is normalized, just in case */
-    for( i = 0; i < sizeof hashString; i++ )
-        hashString[i] = toupper( t->info.hashString[i] );
+    assert( n <= lpd_maxHashesPerDatagram );
 
     /* prepare a zero-terminated announce message */
-    snprintf( query, lpd_maxDatagramLength + 1, fmt, 1, 1,
-        lpd_mcastGroup, lpd_mcastPort, lpd_port, hashString );
+    len = snprintf( query, lpd_maxDatagramLength + 1, fmt, 1, 1,
+        lpd_mcastGroup, lpd_mcastPort, lpd_port );
 
-    /* actually send the query out using [lpd_socket2] */
+    for( i = 0; i < n; i++ )
     {
-        const int len = strlen( query );
+        /* make sure the hash string is normalized, just in case */
+        for( j = 0; j < sizeof hashString; j++ )
+            hashString[j] = toupper( torrents[i]->info.hashString[j] );
+
+        len += snprintf( query + len, lpd_maxDatagramLength + 1 - len,
+            "Infohash: %s" CRLF, hashString );
+    }
+
+    len += snprintf( query + len, lpd_maxDatagramLength + 1 - len, CRLF CRLF );
+    assert( len <= lpd_maxDatagramLength );
 
+    /* actually send the query out using [lpd_socket2] */
+    {
         /* destination address info has already been set up in tr_lpdInit(),
          * so we refrain from preparing another sockaddr_in here */
         int res = sendto( lpd_socket2, query, len, 0,
             (const struct sockaddr*) &lpd_mcastAddr, sizeof lpd_mcastAddr );
 
-        if( res != len )
+        if( res != (int)len )
             return FALSE;
     }
 
-    tr_tordbg( t, "LPD announce message away" );
+    for( i = 0; i < n; i++ )
+        tr_tordbg( torrents[i], "LPD announce message away" );
 
     return TRUE;
 }
@@ -467,8 +486,8 @@ tr_bool tr_lpdSendAnnounce( const tr_torrent* t )
 * @param[in,out] peer Adress information of the peer to add
 * @param[in] msg The announcement message to consider
 * @return Returns 0 if any input parameter or the announce was invalid, 1 if the peer
-* was successfully added, -1 if not; a non-null return value indicates a side-effect to
-* the peer in/out parameter.
+* was added to at least one of the announced torrents, -1 if not; a non-null return
+* value indicates a side-effect to the peer in/out parameter.
 *
 * @note The port information gets added to the peer structure if tr_lpdConsiderAnnounce
 * is able to extract the necessary information from the announce message. That is, if
@@ -490,6 +509,7 @@ static int tr_lpdConsiderAnnounce( tr_pex* peer, const char* const msg )
     if( peer != NULL && msg != NULL )
     {
         tr_torrent* tor = NULL;
+        const char* pos;
 
         const char* params = lpd_extractHeader( msg, &ver );
         if( params == NULL || ver.major != 1 ) /* allow messages of protocol v1 */
@@ -497,7 +517,7 @@ static int tr_lpdConsiderAnnounce( tr_pex* peer, const char* const msg )
 
         /* save the effort to check Host, which seems to be optional anyway */
 
-        if( lpd_extractParam( params, "Port", maxValueLen, value ) == 0 )
+        if( lpd_extractParam( params, "Port", maxValueLen, value ) == NULL )
             return 0;
 
         /* determine announced peer port, refuse if value too large */
@@ -507,24 +527,26 @@ static int tr_lpdConsiderAnnounce( tr_pex* peer, const char* const msg )
         peer->port = htons( peerPort );
         res = -1; /* signal caller side-effect to peer->port via return != 0 */
 
-        if( lpd_extractParam( params, "Infohash", maxHashLen, hashString ) == 0 )
-            return res;
-
-        tor = tr_torrentFindFromHashString( session, hashString );
-
-        if( tr_isTorrent( tor ) && tr_torrentAllowsLPD( tor ) )
+        /* there's one Infohash header for each announced torrent */
+        pos = params;
+        while(( pos = lpd_extractParam( pos, "Infohash", maxHashLen, hashString ) ))
         {
-            /* we found a suitable peer, add it to the torrent */
-            tr_peerMgrAddPex( tor, TR_PEER_FROM_LPD, peer, -1 );
-            tr_tordbg( tor, "Learned %d local peer from LPD (%s:%u)",
-                1, inet_ntoa( peer->addr.addr.addr4 ), peerPort );
+            tor = tr_torrentFindFromHashString( session, hashString );
+
+            if( tr_isTorrent( tor ) && tr_torrentAllowsLPD( tor ) )
+            {
+                /* we found a suitable peer, add it to the torrent */
+                tr_peerMgrAddPex( tor, TR_PEER_FROM_LPD, peer, -1 );
+                tr_tordbg( tor, "Learned %d local peer from LPD (%s:%u)",
+                    1, inet_ntoa( peer->addr.addr.addr4 ), peerPort );
 
-            /* periodic reconnectPulse() deals with the rest... */
+                /* periodic reconnectPulse() deals with the rest... */
 
-            return 1;
+                res = 1;
+            }
+            else
+                tr_ndbg( "LPD", "Cannot serve torrent #%s", hashString );
         }
-        else
-            tr_ndbg( "LPD", "Cannot serve torrent #%s", hashString );
     }
 
     return res;
@@ -542,12 +564,18 @@ static int tr_lpdConsiderAnnounce( tr_pex* peer, const char* const msg )
 int tr_lpdAnnounceMore( const time_t now, const int interval )
 {
     tr_torrent* tor = NULL;
-    int announcesSent = 0;
+    tr_torrent** due;
+    int i, n = 0, announcesSent = 0;
+    const int maxAnnounces = MAX( 0, interval * lpd_sendCapFactor )
+                           * lpd_maxHashesPerDatagram;
 
     if( !tr_isSession( session ) )
         return -1;
 
-    while(( tor = tr_torrentNext( session, tor ) )
+    /* torrents that have just been announced aren't due again for a while,
+     * so walking the list from the top each time is round-robin enough */
+    due = tr_new( tr_torrent*, session->torrentCount );
+    while(( tor = tr_torrentNext( session, tor ) ) && ( n < maxAnnounces )
           && tr_sessionAllowsLPD( session ) )
     {
         if( tr_isTorrent( tor ) )
@@ -558,16 +586,25 @@ int tr_lpdAnnounceMore( const time_t now, const int interval )
                 continue;
 
             if( tor->lpdAnnounceAt <= now )
-            {
-                if( tr_lpdSendAnnounce( tor ) )
-                    announcesSent++;
-
-                tor->lpdAnnounceAt = now + lpd_announceInterval;
-                break; /* that's enough; for this interval */
-            }
+                due[n++] = tor;
         }
     }
 
+    /* pack as many of them into each datagram as fit */
+    for( i = 0; i < n; i += lpd_maxHashesPerDatagram )
+    {
+        const int batch = MIN( n - i, lpd_maxHashesPerDatagram );
+        int j;
+
+        if( tr_lpdSendAnnounce( due + i, batch ) )
+            announcesSent += batch;
+
+        for( j = i; j < i + batch; j++ )
+            due[j]->lpdAnnounceAt = now + lpd_announceInterval;
+    }
+
+    tr_free( due );
+
     /* perform housekeeping for the flood protection mechanism */
     {
         const int maxAnnounceCap = interval * lpd_announceCapFactor;
@@ -34,7 +34,7 @@ void tr_lpdUninit( tr_session* );
 
 tr_bool tr_lpdEnabled( const tr_session* );
 
-tr_bool tr_lpdSendAnnounce( const tr_torrent* );
+tr_bool tr_lpdSendAnnounce( tr_torrent**, int );
 
 int tr_lpdAnnounceMore( const time_t, const int );
 
@@ -21,16 +21,48 @@ THE SOFTWARE.
 
 */
 
+#define _GNU_SOURCE /* recvmmsg, sendmmsg */
+
+#include <errno.h>
 #include <unistd.h>
 #include <assert.h>
+#include <string.h> /* memcpy, memset */
+
+#include <sys/types.h>
+#include <sys/socket.h>
 
 #include <event2/event.h>
+#include <event2/util.h> /* evutil_make_socket_nonblocking */
 
 #include "transmission.h"
+#include "announcer-udp.h"
 #include "net.h"
 #include "session.h"
 #include "tr-dht.h"
 #include "tr-udp.h"
+#include "tr-utp.h"
+#include "trevent.h"
+#include "utils.h"
+
+/* uTP keeps a whole window of datagrams in flight on this socket,
+   so the kernel's default buffers are too small once it gets going. */
+
+#define RECV_BUFFER_SIZE (4 * 1024 * 1024)
+#define SEND_BUFFER_SIZE (1 * 1024 * 1024)
+
+static void
+set_socket_buffers(int fd)
+{
+    int size = RECV_BUFFER_SIZE;
+    if(setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0)
+        tr_ndbg("UDP", "Couldn't set receive buffer: %s",
+                tr_strerror(sockerrno));
+
+    size = SEND_BUFFER_SIZE;
+    if(setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) < 0)
+        tr_ndbg("UDP", "Couldn't set send buffer: %s",
+                tr_strerror(sockerrno));
+}
 
 /* BEP-32 has a rather nice explanation of why we need to bind to one
    IPv6 address, if I may say so myself. */
@@ -75,6 +107,9 @@ rebind_ipv6(tr_session *ss, tr_bool force)
     if(rc < 0)
         goto fail;
 
+    set_socket_buffers(s);
+    evutil_make_socket_nonblocking(s);
+
     if(ss->udp6_socket < 0) {
         ss->udp6_socket = s;
         s = -1;
@@ -105,41 +140,238 @@ rebind_ipv6(tr_session *ss, tr_bool force)
     }
 }
 
+/* Datagrams are read, dispatched and written in batches, so that a burst
+   of DHT queries or uTP packets costs one wakeup and a couple of system
+   calls rather than one recvfrom and one sendto apiece. */
+
+#define UDP_BATCH_SIZE 32
+#define UDP_RECV_SIZE 4096
+#define UDP_SEND_SIZE 2048
+
+enum { UDP_DHT, UDP_TRACKER, UDP_UTP, UDP_HANDLER_COUNT };
+
+struct udp_handler
+{
+    /* the first byte of the datagrams this handler wants,
+       or -1 for any datagram that nothing before it claimed */
+    int first_byte;
+
+    /* returns true if the datagram was meant for this handler */
+    tr_bool (*packet)(unsigned char *buf, int buflen,
+                      struct sockaddr *from, socklen_t fromlen,
+                      tr_session *ss);
+
+    /* called once after a batch in which packet() claimed something */
+    void (*flush)(tr_session *ss);
+};
+
+static tr_bool
+dht_packet(unsigned char *buf, int buflen,
+           struct sockaddr *from, socklen_t fromlen, tr_session *ss)
+{
+    /* The DHT wants a NUL-terminated buffer.  There's always room,
+       since we never read more than UDP_RECV_SIZE - 1 bytes. */
+    buf[buflen] = '\0';
+    tr_dhtCallback(buf, buflen, from, fromlen, ss);
+    return TRUE;
+}
+
+static tr_bool
+tracker_packet(unsigned char *buf, int buflen,
+               struct sockaddr *from, socklen_t fromlen, tr_session *ss)
+{
+    return tr_announcerUdpPacket(buf, buflen, from, fromlen, ss);
+}
+
+static tr_bool
+utp_packet(unsigned char *buf, int buflen,
+           struct sockaddr *from, socklen_t fromlen, tr_session *ss)
+{
+    return tr_utpPacket(buf, buflen, from, fromlen, ss);
+}
+
+/* In the order they're tried.  A UDP tracker's reply starts with an
+   action field whose first byte is zero, which is never a valid uTP
+   header; anything nobody else claims is probably uTP. */
+static const struct udp_handler udp_handlers[UDP_HANDLER_COUNT] = {
+    { 'd', dht_packet,     NULL },
+    { 0,   tracker_packet, NULL },
+    { -1,  utp_packet,     tr_utpIssueDeferredAcks }
+};
+
+struct udp_datagram
+{
+    int s;
+    int buflen;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+};
+
+struct tr_udp_batch
+{
+    /* datagrams read in this wakeup */
+    struct udp_datagram in[UDP_BATCH_SIZE];
+    unsigned char inbuf[UDP_BATCH_SIZE][UDP_RECV_SIZE];
+
+    /* datagrams waiting to be sent at the end of this wakeup */
+    struct udp_datagram out[UDP_BATCH_SIZE];
+    unsigned char outbuf[UDP_BATCH_SIZE][UDP_SEND_SIZE];
+    int out_count;
+
+    /* true while dispatching, when sends are queued instead of sent */
+    tr_bool is_dispatching;
+
+    tr_udp_stats stats;
+};
+
+static int
+read_batch(struct tr_udp_batch *b, int s)
+{
+    int i, n;
+
+#ifdef HAVE_RECVMMSG
+    struct mmsghdr msgs[UDP_BATCH_SIZE];
+    struct iovec iovs[UDP_BATCH_SIZE];
+
+    memset(msgs, 0, sizeof(msgs));
+    for(i = 0; i < UDP_BATCH_SIZE; ++i) {
+        iovs[i].iov_base = b->inbuf[i];
+        iovs[i].iov_len = UDP_RECV_SIZE - 1;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &b->in[i].addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(b->in[i].addr);
+    }
+
+    n = recvmmsg(s, msgs, UDP_BATCH_SIZE, MSG_DONTWAIT, NULL);
+    for(i = 0; i < n; ++i) {
+        b->in[i].s = s;
+        b->in[i].buflen = msgs[i].msg_len;
+        b->in[i].addrlen = msgs[i].msg_hdr.msg_namelen;
+    }
+#else
+    for(n = 0; n < UDP_BATCH_SIZE; ++n) {
+        struct udp_datagram *d = &b->in[n];
+        d->s = s;
+        d->addrlen = sizeof(d->addr);
+        d->buflen = recvfrom(s, b->inbuf[n], UDP_RECV_SIZE - 1, MSG_DONTWAIT,
+                             (struct sockaddr*)&d->addr, &d->addrlen);
+        if(d->buflen < 0)
+            break;
+    }
+#endif
+
+    return n;
+}
+
+/* Send everything in the out queue.  Datagrams that the kernel won't
+   take are dropped, just as they would be anywhere else on the path. */
+static void
+flush_sends(struct tr_udp_batch *b)
+{
+    int i = 0;
+
+    while(i < b->out_count) {
+        const int s = b->out[i].s;
+        int j, n, rc;
+
+        /* a run of datagrams for the same socket */
+        for(n = 1; i + n < b->out_count && b->out[i + n].s == s; ++n)
+            ;
+
+#ifdef HAVE_SENDMMSG
+        {
+            struct mmsghdr msgs[UDP_BATCH_SIZE];
+            struct iovec iovs[UDP_BATCH_SIZE];
+
+            memset(msgs, 0, sizeof(msgs));
+            for(j = 0; j < n; ++j) {
+                iovs[j].iov_base = b->outbuf[i + j];
+                iovs[j].iov_len = b->out[i + j].buflen;
+                msgs[j].msg_hdr.msg_iov = &iovs[j];
+                msgs[j].msg_hdr.msg_iovlen = 1;
+                msgs[j].msg_hdr.msg_name = &b->out[i + j].addr;
+                msgs[j].msg_hdr.msg_namelen = b->out[i + j].addrlen;
+            }
+
+            for(j = 0; j < n; j += rc) {
+                ++b->stats.send_calls;
+                rc = sendmmsg(s, msgs + j, n - j, 0);
+                if(rc <= 0)
+                    break;
+                b->stats.datagrams_sent += rc;
+            }
+        }
+#else
+        for(j = 0; j < n; ++j) {
+            ++b->stats.send_calls;
+            rc = sendto(s, b->outbuf[i + j], b->out[i + j].buflen, 0,
+                        (struct sockaddr*)&b->out[i + j].addr,
+                        b->out[i + j].addrlen);
+            if(rc >= 0)
+                ++b->stats.datagrams_sent;
+        }
+#endif
+
+        i += n;
+    }
+
+    b->out_count = 0;
+}
+
 static void
 event_callback(int s, short type, void *sv)
 {
     tr_session *ss = (tr_session*)sv;
-    unsigned char *buf;
-    struct sockaddr_storage from;
-    socklen_t fromlen;
-    int rc;
+    struct tr_udp_batch *b = ss->udp_batch;
+    tr_bool claimed[UDP_HANDLER_COUNT];
+    int i, h, n;
 
     assert(tr_isSession(ss));
     assert(type == EV_READ);
 
-    buf = malloc(4096);
-    if(buf == NULL) {
-        tr_nerr("UDP", "Couldn't allocate buffer");
+    n = read_batch(b, s);
+    if(n <= 0)
         return;
-    }
 
-    fromlen = sizeof(from);
-    rc = recvfrom(s, buf, 4096 - 1, 0,
-                  (struct sockaddr*)&from, &fromlen);
-    if(rc <= 0)
-        return;
+    ++b->stats.wakeups;
+    b->stats.datagrams_read += n;
+    if(b->stats.max_per_wakeup < n)
+        b->stats.max_per_wakeup = n;
+
+    memset(claimed, 0, sizeof(claimed));
+    b->is_dispatching = TRUE;
+
+    for(i = 0; i < n; ++i) {
+        unsigned char *buf = b->inbuf[i];
+        struct udp_datagram *d = &b->in[i];
+
+        if(d->buflen <= 0)
+            continue;
+
+        for(h = 0; h < UDP_HANDLER_COUNT; ++h) {
+            const struct udp_handler *handler = &udp_handlers[h];
+            if(handler->first_byte >= 0 && handler->first_byte != buf[0])
+                continue;
+            if(handler->packet(buf, d->buflen, (struct sockaddr*)&d->addr,
+                               d->addrlen, ss)) {
+                claimed[h] = TRUE;
+                ++b->stats.dispatched[h];
+                break;
+            }
+        }
 
-    if(buf[0] == 'd') {
-        /* DHT packet. */
-        buf[rc] = '\0';
-        tr_dhtCallback(buf, rc, (struct sockaddr*)&from, fromlen, sv);
-    } else {
-        /* Probably a UTP packet. */
-        /* Nothing yet. */
+        if(h == UDP_HANDLER_COUNT)
+            ++b->stats.unclaimed;
     }
 
-    free(buf);
-}    
+    for(h = 0; h < UDP_HANDLER_COUNT; ++h)
+        if(claimed[h] && udp_handlers[h].flush != NULL)
+            udp_handlers[h].flush(ss);
+
+    b->is_dispatching = FALSE;
+    flush_sends(b);
+}
 
 void
 tr_udpInit(tr_session *ss, const tr_address * addr)
@@ -154,6 +386,8 @@ tr_udpInit(tr_session *ss, const tr_address * addr)
     if(ss->udp_port <= 0)
         return;
 
+    ss->udp_batch = tr_new0(struct tr_udp_batch, 1);
+
     ss->udp_socket = socket(PF_INET, SOCK_DGRAM, 0);
     if(ss->udp_socket < 0) {
         tr_nerr("UDP", "Couldn't create IPv4 socket");
@@ -171,6 +405,8 @@ tr_udpInit(tr_session *ss, const tr_address * addr)
         ss->udp_socket = -1;
         goto ipv6;
     }
+    set_socket_buffers(ss->udp_socket);
+    evutil_make_socket_nonblocking(ss->udp_socket);
     ss->udp_event =
         event_new(ss->event_base, ss->udp_socket, EV_READ | EV_PERSIST,
                   event_callback, ss);
@@ -197,6 +433,68 @@ tr_udpInit(tr_session *ss, const tr_address * addr)
         event_add(ss->udp6_event, NULL);
 }
 
+int
+tr_udpSendToSockaddr(tr_session *ss, const void *buf, size_t buflen,
+                     const struct sockaddr *to, socklen_t tolen)
+{
+    struct tr_udp_batch *b = ss->udp_batch;
+    struct udp_datagram *d;
+    int s;
+
+    if(to->sa_family == AF_INET)
+        s = ss->udp_socket;
+    else if(to->sa_family == AF_INET6)
+        s = ss->udp6_socket;
+    else
+        s = -1;
+
+    if(s < 0 || b == NULL) {
+        errno = EAFNOSUPPORT;
+        return -1;
+    }
+
+    /* Outside of a wakeup there's nothing to batch with.  The DHT's
+       bootstrap thread sends from outside the event thread, too. */
+    if(!b->is_dispatching || !tr_amInEventThread(ss)
+                          || buflen > UDP_SEND_SIZE
+                          || tolen > (socklen_t)sizeof(d->addr)) {
+        ++b->stats.send_calls;
+        ++b->stats.datagrams_sent;
+        return sendto(s, buf, buflen, 0, to, tolen);
+    }
+
+    if(b->out_count == UDP_BATCH_SIZE)
+        flush_sends(b);
+
+    d = &b->out[b->out_count];
+    memcpy(b->outbuf[b->out_count], buf, buflen);
+    memcpy(&d->addr, to, tolen);
+    d->addrlen = tolen;
+    d->buflen = buflen;
+    d->s = s;
+    ++b->out_count;
+    return buflen;
+}
+
+void
+tr_udpSendTo(tr_session *ss, const void *buf, size_t buflen,
+             const tr_address *addr, tr_port port)
+{
+    struct sockaddr_storage to;
+    const socklen_t tolen = tr_netSetupSockaddr(addr, port, &to);
+
+    tr_udpSendToSockaddr(ss, buf, buflen, (struct sockaddr*)&to, tolen);
+}
+
+void
+tr_udpGetStats(const tr_session *ss, tr_udp_stats *setme)
+{
+    if(ss->udp_batch != NULL)
+        *setme = ss->udp_batch->stats;
+    else
+        memset(setme, 0, sizeof(tr_udp_stats));
+}
+
 void
 tr_udpUninit(tr_session *ss)
 {
@@ -226,4 +524,15 @@ tr_udpUninit(tr_session *ss)
         free(ss->udp6_bound);
         ss->udp6_bound = NULL;
     }
+
+    if(ss->udp_batch) {
+        const tr_udp_stats *st = &ss->udp_batch->stats;
+        if(st->wakeups > 0)
+            tr_ndbg("UDP", "%"PRIu64" datagrams read in %"PRIu64" wakeups "
+                    "(at most %d at once), %"PRIu64" sent in %"PRIu64" calls",
+                    st->datagrams_read, st->wakeups, st->max_per_wakeup,
+                    st->datagrams_sent, st->send_calls);
+        tr_free(ss->udp_batch);
+        ss->udp_batch = NULL;
+    }
 }
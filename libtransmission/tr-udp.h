@@ -28,3 +28,34 @@ THE SOFTWARE.
 void tr_udpInit( tr_session *, const tr_address *);
 void tr_udpUninit( tr_session * );
 
+/**
+ * @brief send a datagram on the session's UDP socket for addr's family.
+ *
+ * Datagrams sent while incoming ones are being dispatched are queued
+ * and go out together, with sendmmsg() where it's available, once the
+ * whole batch has been handled.
+ */
+void tr_udpSendTo( tr_session *, const void * buf, size_t buflen,
+                   const tr_address * addr, tr_port port );
+
+/** @brief like tr_udpSendTo(), but with a sockaddr; returns what sendto() would */
+int tr_udpSendToSockaddr( tr_session *, const void * buf, size_t buflen,
+                          const struct sockaddr * to, socklen_t tolen );
+
+typedef struct tr_udp_stats
+{
+    uint64_t wakeups;           /* read events with at least one datagram */
+    uint64_t datagrams_read;
+    int      max_per_wakeup;
+
+    /* datagrams claimed by the DHT, UDP trackers, and uTP, in that order */
+    uint64_t dispatched[3];
+    uint64_t unclaimed;
+
+    uint64_t datagrams_sent;
+    uint64_t send_calls;        /* sendto() and sendmmsg() calls */
+}
+tr_udp_stats;
+
+void tr_udpGetStats( const tr_session *, tr_udp_stats * setme );
+
@@ -0,0 +1,1301 @@
+/*
+ * This file Copyright (C) 2011 Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2(b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h> /* memcpy(), memset() */
+
+#include <event2/buffer.h>
+#include <event2/event.h>
+
+#include "transmission.h"
+#include "crypto.h" /* tr_cryptoWeakRandInt() */
+#include "net.h"
+#include "peer-mgr.h" /* tr_peerMgrAddIncoming() */
+#include "ptrarray.h"
+#include "session.h"
+#include "tr-udp.h" /* tr_udpSendTo() */
+#include "tr-utp.h"
+#include "utils.h"
+
+#define dbgmsg( ... ) \
+    do { \
+        if( tr_deepLoggingIsActive( ) ) \
+            tr_deepLog( __FILE__, __LINE__, "uTP", __VA_ARGS__ ); \
+    } while( 0 )
+
+enum
+{
+    UTP_VERSION = 1,
+
+    /* packet types */
+    ST_DATA = 0,
+    ST_FIN = 1,
+    ST_STATE = 2,
+    ST_RESET = 3,
+    ST_SYN = 4,
+
+    UTP_HEADER_SIZE = 20,
+
+    /* payload bytes per packet. This keeps the datagrams under the
+     * MTU of most tunnels and PPPoE links */
+    UTP_PAYLOAD_SIZE = 1380,
+
+    /* the most packets we'll have in flight, or hold for reordering.
+     * This must be a power of two */
+    UTP_WINDOW_PACKETS = 1024,
+    UTP_WINDOW_MASK = UTP_WINDOW_PACKETS - 1,
+
+    /* the largest receive window we'll advertise */
+    UTP_MAX_RECEIVE_WINDOW = 1024 * 1024,
+
+    /* LEDBAT: the queueing delay we're willing to add to the path,
+     * and the most the congestion window can grow per round trip */
+    LEDBAT_TARGET_USEC = 100000,
+    LEDBAT_GAIN_BYTES = 3000,
+
+    UTP_MIN_CWND = 2 * UTP_PAYLOAD_SIZE,
+    UTP_INITIAL_CWND = 4 * UTP_PAYLOAD_SIZE,
+    UTP_MAX_CWND = ( UTP_WINDOW_PACKETS - 2 ) * UTP_PAYLOAD_SIZE,
+
+    /* a delay sample is compared to the smallest one seen in
+     * the last two of these, to allow for clock drift */
+    BASE_DELAY_INTERVAL_MSEC = 60 * 1000,
+
+    /* the retransmission timeout */
+    UTP_RTO_INITIAL_MSEC = 1000,
+    UTP_RTO_MIN_MSEC = 500,
+    UTP_RTO_MAX_MSEC = 30 * 1000,
+
+    /* how many times a SYN is retried before we decide that the peer
+     * doesn't speak uTP, and how many timeouts in a row we'll sit
+     * through before giving up on an established connection */
+    UTP_SYN_RETRIES = 1,
+    UTP_MAX_RETRIES = 5,
+
+    UTP_DUP_ACK_THRESHOLD = 3,
+
+    /* acks are held back until a batch of packets has been processed,
+     * but like TCP, we ack at least every second packet. If a single ack
+     * for a whole window got lost, the peer would sit out a timeout */
+    UTP_DELAYED_ACK_PACKETS = 2,
+
+    UTP_TIMER_MSEC = 50,
+
+    /* keep NAT mappings open on idle connections */
+    UTP_KEEPALIVE_MSEC = 29 * 1000,
+
+    /* if the peer's receive window has been shut this long, send one
+     * packet anyway in case we missed the update that reopened it */
+    UTP_ZERO_WINDOW_MSEC = 1000,
+
+    /* how long a closed connection may wait for its last acks */
+    UTP_LINGER_MSEC = 30 * 1000
+};
+
+enum
+{
+    CS_SYN_SENT,
+    CS_CONNECTED,
+    CS_DEAD
+};
+
+struct utp_header
+{
+    uint8_t   type;
+    uint8_t   version;
+    uint8_t   extension;
+    uint16_t  connId;
+    uint32_t  timestamp;
+    uint32_t  timestampDiff;
+    uint32_t  wnd;
+    uint16_t  seq;
+    uint16_t  ack;
+};
+
+/* a packet that's in flight, or one that arrived out of order.
+ * data points to the header, and the payload follows it */
+struct utp_packet
+{
+    uint64_t   sentAt; /* usec */
+    size_t     payload;
+    int        transmissions;
+    uint16_t   seq;
+    uint8_t    type;
+    tr_bool    needResend;
+    uint8_t  * data;
+};
+
+struct tr_utp_socket
+{
+    tr_utp_context    * ctx;
+    tr_address          addr;
+    tr_port             port;
+    uint16_t            recvId;
+    uint16_t            sendId;
+    int                 state;
+
+    tr_utp_funcs        funcs;
+    void              * user;
+    tr_bool             isClosed; /* the owner has let go */
+    uint64_t            closedAt;
+
+    /* send side */
+    uint16_t            seqNr; /* the sequence number of the next packet */
+    int                 inFlight; /* packets sent but not acked */
+    int                 lostCount; /* in-flight packets waiting to be resent */
+    size_t              bytesInFlight; /* not counting the lost ones */
+    struct utp_packet * out[UTP_WINDOW_PACKETS];
+    size_t              cwnd;
+    size_t              ssthresh;
+    tr_bool             slowStart;
+    size_t              peerWnd;
+    int                 dupAcks;
+    tr_bool             inRecovery;
+    uint16_t            recoverySeq;
+    uint32_t            rtt; /* usec */
+    uint32_t            rttVar; /* usec */
+    uint32_t            rto; /* msec */
+    uint64_t            rtoTimeout; /* msec. zero when nothing's in flight */
+    int                 timeouts; /* in a row */
+    tr_bool             finSent;
+    uint64_t            lastSent;
+
+    /* queueing delay, for LEDBAT */
+    uint32_t            replyMicro; /* echoed back to the peer */
+    uint32_t            baseDelay[2];
+    uint64_t            baseDelayAt;
+    uint32_t            queueDelay; /* usec */
+
+    /* receive side */
+    uint16_t            ackNr; /* the last sequence number we got in order */
+    struct utp_packet * in[UTP_WINDOW_PACKETS];
+    size_t              reorderBytes;
+    tr_bool             gotFin;
+    uint16_t            finSeq;
+    tr_bool             eofReported;
+    tr_bool             ackPending;
+    int                 unackedPackets; /* in-order packets since our last ack */
+    size_t              lastWnd; /* the receive window we last advertised */
+    uint64_t            lastRecv;
+};
+
+struct tr_utp_context
+{
+    struct event       * timer;
+    tr_utp_sendto_func   sendto;
+    tr_utp_accept_func   accept;
+    void               * user;
+    tr_ptrArray          sockets; /* tr_utp_socket, sorted by compareSockets() */
+    tr_ptrArray          ackQueue; /* tr_utp_socket */
+};
+
+/***
+****
+***/
+
+static inline tr_bool
+seqBefore( uint16_t a, uint16_t b )
+{
+    return (int16_t)( a - b ) < 0;
+}
+
+static inline uint32_t
+getMicro( void )
+{
+    return (uint32_t) tr_time_usec( );
+}
+
+static void
+writeUint16( uint8_t * buf, uint16_t i )
+{
+    const uint16_t n = htons( i );
+    memcpy( buf, &n, sizeof( n ) );
+}
+
+static void
+writeUint32( uint8_t * buf, uint32_t i )
+{
+    const uint32_t n = htonl( i );
+    memcpy( buf, &n, sizeof( n ) );
+}
+
+static uint16_t
+readUint16( const uint8_t * buf )
+{
+    uint16_t n;
+    memcpy( &n, buf, sizeof( n ) );
+    return ntohs( n );
+}
+
+static uint32_t
+readUint32( const uint8_t * buf )
+{
+    uint32_t n;
+    memcpy( &n, buf, sizeof( n ) );
+    return ntohl( n );
+}
+
+static void
+writeHeader( uint8_t * buf, const struct utp_header * h )
+{
+    buf[0] = (uint8_t)( ( h->type << 4 ) | UTP_VERSION );
+    buf[1] = 0; /* we don't send any extensions */
+    writeUint16( buf + 2, h->connId );
+    writeUint32( buf + 4, h->timestamp );
+    writeUint32( buf + 8, h->timestampDiff );
+    writeUint32( buf + 12, h->wnd );
+    writeUint16( buf + 16, h->seq );
+    writeUint16( buf + 18, h->ack );
+}
+
+/* @return -1 if it's not a uTP packet, 0 if it's a bad one, 1 if it's good */
+static int
+readHeader( const uint8_t * buf, size_t buflen, struct utp_header * h, size_t * setme_offset )
+{
+    size_t offset = UTP_HEADER_SIZE;
+    uint8_t extension;
+
+    if( buflen < UTP_HEADER_SIZE )
+        return -1;
+
+    h->type = buf[0] >> 4;
+    h->version = buf[0] & 0x0f;
+    if( ( h->version != UTP_VERSION ) || ( h->type > ST_SYN ) )
+        return -1;
+
+    h->extension = buf[1];
+    h->connId = readUint16( buf + 2 );
+    h->timestamp = readUint32( buf + 4 );
+    h->timestampDiff = readUint32( buf + 8 );
+    h->wnd = readUint32( buf + 12 );
+    h->seq = readUint16( buf + 16 );
+    h->ack = readUint16( buf + 18 );
+
+    /* skip over the extensions, such as selective acks */
+    for( extension=h->extension; extension!=0; )
+    {
+        if( offset + 2 > buflen )
+            return 0;
+        extension = buf[offset];
+        offset += 2 + buf[offset+1];
+        if( offset > buflen )
+            return 0;
+    }
+
+    *setme_offset = offset;
+    return 1;
+}
+
+/***
+****  Sockets
+***/
+
+static int
+compareSockets( const void * va, const void * vb )
+{
+    const tr_utp_socket * a = va;
+    const tr_utp_socket * b = vb;
+
+    if( a->recvId != b->recvId )
+        return a->recvId < b->recvId ? -1 : 1;
+
+    if( a->port != b->port )
+        return a->port < b->port ? -1 : 1;
+
+    return tr_compareAddresses( &a->addr, &b->addr );
+}
+
+static tr_utp_socket*
+findSocket( tr_utp_context * ctx, const tr_address * addr, tr_port port, uint16_t recvId )
+{
+    tr_utp_socket key;
+
+    key.addr = *addr;
+    key.port = port;
+    key.recvId = recvId;
+    return tr_ptrArrayFindSorted( &ctx->sockets, &key, compareSockets );
+}
+
+/* a reset carries the id that the sender of the bad packet sent,
+ * which is our send id rather than our receive id */
+static tr_utp_socket*
+findSocketBySendId( tr_utp_context * ctx, const tr_address * addr, tr_port port, uint16_t sendId )
+{
+    int i;
+    const int n = tr_ptrArraySize( &ctx->sockets );
+
+    for( i=0; i<n; ++i )
+    {
+        tr_utp_socket * s = tr_ptrArrayNth( &ctx->sockets, i );
+
+        if( ( s->sendId == sendId ) && ( s->port == port ) && !tr_compareAddresses( &s->addr, addr ) )
+            return s;
+    }
+
+    return NULL;
+}
+
+static tr_utp_socket*
+socketNew( tr_utp_context * ctx, const tr_address * addr, tr_port port, uint16_t recvId, uint16_t sendId )
+{
+    const uint64_t now = tr_time_msec( );
+    tr_utp_socket * s = tr_new0( tr_utp_socket, 1 );
+
+    s->ctx = ctx;
+    s->addr = *addr;
+    s->port = port;
+    s->recvId = recvId;
+    s->sendId = sendId;
+    s->cwnd = UTP_INITIAL_CWND;
+    s->ssthresh = UTP_MAX_CWND;
+    s->slowStart = TRUE;
+    s->peerWnd = UTP_PAYLOAD_SIZE;
+    s->rto = UTP_RTO_INITIAL_MSEC;
+    s->lastSent = now;
+    s->lastRecv = now;
+    s->lastWnd = UTP_MAX_RECEIVE_WINDOW;
+    tr_ptrArrayInsertSorted( &ctx->sockets, s, compareSockets );
+
+    return s;
+}
+
+static void
+socketFree( tr_utp_socket * s )
+{
+    int i;
+
+    for( i=0; i<UTP_WINDOW_PACKETS; ++i ) {
+        tr_free( s->out[i] );
+        tr_free( s->in[i] );
+    }
+
+    memset( s, ~0, sizeof( tr_utp_socket ) );
+    tr_free( s );
+}
+
+static size_t
+getReceiveWindow( const tr_utp_socket * s )
+{
+    size_t wnd = UTP_MAX_RECEIVE_WINDOW;
+
+    if( !s->isClosed && ( s->funcs.getReceiveWindow != NULL ) )
+        wnd = MIN( wnd, s->funcs.getReceiveWindow( s->user ) );
+
+    return wnd > s->reorderBytes ? wnd - s->reorderBytes : 0;
+}
+
+static void
+notifyState( tr_utp_socket * s, tr_utp_state state )
+{
+    if( !s->isClosed && ( s->funcs.onState != NULL ) )
+        s->funcs.onState( s->user, state );
+}
+
+static void
+socketFail( tr_utp_socket * s, int err )
+{
+    dbgmsg( "connection %hu to %s failed: %s", s->recvId, tr_ntop_non_ts( &s->addr ), tr_strerror( err ) );
+
+    s->state = CS_DEAD;
+
+    if( !s->isClosed && ( s->funcs.onError != NULL ) )
+        s->funcs.onError( s->user, err );
+}
+
+/***
+****  Sending
+***/
+
+static void
+fillHeader( tr_utp_socket * s, uint8_t * buf, uint8_t type, uint16_t seq )
+{
+    struct utp_header h;
+
+    h.type = type;
+    h.connId = type == ST_SYN ? s->recvId : s->sendId;
+    h.timestamp = getMicro( );
+    h.timestampDiff = s->replyMicro;
+    h.wnd = s->lastWnd = getReceiveWindow( s );
+    h.seq = seq;
+    h.ack = s->ackNr;
+    writeHeader( buf, &h );
+}
+
+static void
+sendRaw( tr_utp_socket * s, const uint8_t * buf, size_t buflen )
+{
+    s->ctx->sendto( s->ctx->user, buf, buflen, &s->addr, s->port );
+    s->lastSent = tr_time_msec( );
+    s->ackPending = FALSE;
+    s->unackedPackets = 0;
+}
+
+static void
+sendState( tr_utp_socket * s )
+{
+    uint8_t buf[UTP_HEADER_SIZE];
+
+    fillHeader( s, buf, ST_STATE, s->seqNr );
+    sendRaw( s, buf, sizeof( buf ) );
+}
+
+static void
+sendReset( tr_utp_context * ctx, const tr_address * addr, tr_port port, uint16_t connId, uint16_t ack )
+{
+    uint8_t buf[UTP_HEADER_SIZE];
+    struct utp_header h;
+
+    memset( &h, 0, sizeof( h ) );
+    h.type = ST_RESET;
+    h.connId = connId;
+    h.timestamp = getMicro( );
+    h.seq = (uint16_t) tr_cryptoWeakRandInt( 0x10000 );
+    h.ack = ack;
+    writeHeader( buf, &h );
+    ctx->sendto( ctx->user, buf, sizeof( buf ), addr, port );
+}
+
+static void
+transmit( tr_utp_socket * s, struct utp_packet * pkt )
+{
+    fillHeader( s, pkt->data, pkt->type, pkt->seq );
+    sendRaw( s, pkt->data, UTP_HEADER_SIZE + pkt->payload );
+
+    ++pkt->transmissions;
+    pkt->sentAt = tr_time_usec( );
+
+    if( !s->rtoTimeout )
+        s->rtoTimeout = tr_time_msec( ) + s->rto;
+}
+
+static void
+queuePacket( tr_utp_socket * s, uint8_t type, struct evbuffer * buf, size_t len )
+{
+    struct utp_packet * pkt;
+
+    pkt = tr_malloc( sizeof( struct utp_packet ) + UTP_HEADER_SIZE + len );
+    pkt->data = (uint8_t*)( pkt + 1 );
+    pkt->payload = len;
+    pkt->transmissions = 0;
+    pkt->seq = s->seqNr++;
+    pkt->type = type;
+    pkt->needResend = FALSE;
+    if( len > 0 )
+        evbuffer_remove( buf, pkt->data + UTP_HEADER_SIZE, len );
+
+    assert( s->out[pkt->seq & UTP_WINDOW_MASK] == NULL );
+    s->out[pkt->seq & UTP_WINDOW_MASK] = pkt;
+    ++s->inFlight;
+    s->bytesInFlight += len;
+
+    transmit( s, pkt );
+}
+
+static tr_bool
+canSend( const tr_utp_socket * s, size_t len )
+{
+    /* each duplicate ack means that a packet has left the network,
+     * so sending a new one in its place keeps the acks coming */
+    const size_t left = MIN( s->bytesInFlight, (size_t)s->dupAcks * UTP_PAYLOAD_SIZE );
+    const size_t pipe = s->bytesInFlight - left;
+
+    if( s->inFlight >= UTP_WINDOW_PACKETS - 1 )
+        return FALSE;
+
+    if( pipe + len <= MIN( s->cwnd, s->peerWnd ) )
+        return TRUE;
+
+    /* always let one packet out, as long as the peer has room for it */
+    return ( pipe == 0 ) && ( len <= s->peerWnd );
+}
+
+static void
+markLost( tr_utp_socket * s, uint16_t seq )
+{
+    struct utp_packet * pkt = s->out[seq & UTP_WINDOW_MASK];
+
+    if( ( pkt != NULL ) && !pkt->needResend )
+    {
+        pkt->needResend = TRUE;
+        s->bytesInFlight -= pkt->payload;
+        ++s->lostCount;
+    }
+}
+
+/* resend lost packets, oldest first, as the window allows */
+static void
+resendLost( tr_utp_socket * s )
+{
+    int i;
+    const uint16_t oldest = s->seqNr - s->inFlight;
+
+    for( i=0; ( i<s->inFlight ) && ( s->lostCount > 0 ); ++i )
+    {
+        struct utp_packet * pkt = s->out[( oldest + i ) & UTP_WINDOW_MASK];
+
+        if( ( pkt == NULL ) || !pkt->needResend )
+            continue;
+
+        if( !canSend( s, pkt->payload ) )
+            break;
+
+        pkt->needResend = FALSE;
+        s->bytesInFlight += pkt->payload;
+        --s->lostCount;
+        transmit( s, pkt );
+    }
+}
+
+/* resend a lost packet whether or not there's room in the window.
+ * Otherwise a window full of packets that are stuck behind the lost
+ * one would keep it from ever being repaired */
+static void
+resendNow( tr_utp_socket * s, uint16_t seq )
+{
+    struct utp_packet * pkt = s->out[seq & UTP_WINDOW_MASK];
+
+    if( ( pkt != NULL ) && pkt->needResend )
+    {
+        pkt->needResend = FALSE;
+        s->bytesInFlight += pkt->payload;
+        --s->lostCount;
+        transmit( s, pkt );
+    }
+}
+
+static void
+scheduleAck( tr_utp_socket * s )
+{
+    if( ++s->unackedPackets >= UTP_DELAYED_ACK_PACKETS )
+    {
+        sendState( s );
+    }
+    else if( !s->ackPending )
+    {
+        s->ackPending = TRUE;
+        tr_ptrArrayAppend( &s->ctx->ackQueue, s );
+    }
+}
+
+/* if the peer might have stopped sending because our receive window was
+ * shut, tell it as soon as the window's open again */
+static void
+maybeSendWindowUpdate( tr_utp_socket * s )
+{
+    if( ( s->state == CS_CONNECTED )
+        && ( s->lastWnd < UTP_PAYLOAD_SIZE )
+        && ( getReceiveWindow( s ) >= UTP_PAYLOAD_SIZE ) )
+        sendState( s );
+}
+
+/***
+****  Congestion control
+***/
+
+static void
+updateRTT( tr_utp_socket * s, uint32_t sample )
+{
+    if( s->rtt == 0 )
+    {
+        s->rtt = sample;
+        s->rttVar = sample / 2;
+    }
+    else
+    {
+        const int32_t delta = (int32_t)s->rtt - (int32_t)sample;
+
+        s->rttVar += ( ( delta < 0 ? -delta : delta ) - (int32_t)s->rttVar ) / 4;
+        s->rtt += ( (int32_t)sample - (int32_t)s->rtt ) / 8;
+    }
+
+    s->rto = MAX( UTP_RTO_MIN_MSEC, ( s->rtt + 4 * s->rttVar ) / 1000 );
+}
+
+/* the peer's timestamp difference is its clock minus ours, plus the
+ * one-way delay. Subtracting the smallest one we've seen lately
+ * leaves just the queueing delay */
+static void
+updateDelay( tr_utp_socket * s, uint32_t sample, uint64_t now )
+{
+    uint32_t base;
+
+    if( !s->baseDelayAt )
+    {
+        s->baseDelay[0] = s->baseDelay[1] = sample;
+        s->baseDelayAt = now;
+    }
+    else if( now - s->baseDelayAt >= BASE_DELAY_INTERVAL_MSEC )
+    {
+        s->baseDelay[1] = s->baseDelay[0];
+        s->baseDelay[0] = sample;
+        s->baseDelayAt = now;
+    }
+    else if( (int32_t)( sample - s->baseDelay[0] ) < 0 )
+    {
+        s->baseDelay[0] = sample;
+    }
+
+    base = s->baseDelay[0];
+    if( (int32_t)( s->baseDelay[1] - base ) < 0 )
+        base = s->baseDelay[1];
+
+    s->queueDelay = sample - base;
+}
+
+static void
+onBytesAcked( tr_utp_socket * s, size_t bytesAcked, size_t flightBefore )
+{
+    double cwnd = s->cwnd;
+
+    /* if we weren't using the window, we don't know that it's safe to grow */
+    if( flightBefore < s->cwnd / 2 )
+        return;
+
+    if( s->slowStart && ( s->queueDelay > LEDBAT_TARGET_USEC / 2 ) )
+        s->slowStart = FALSE;
+
+    if( s->slowStart )
+    {
+        cwnd += bytesAcked;
+
+        if( cwnd >= s->ssthresh )
+            s->slowStart = FALSE;
+    }
+    else
+    {
+        /* LEDBAT. Grow while the queueing delay is under target and
+         * shrink when it's over, by at most LEDBAT_GAIN_BYTES per RTT */
+        const double offTarget = MAX( -1.0, ( LEDBAT_TARGET_USEC - (double)s->queueDelay ) / LEDBAT_TARGET_USEC );
+        const double windowFactor = (double)MIN( bytesAcked, s->cwnd ) / MAX( s->cwnd, bytesAcked );
+
+        cwnd += LEDBAT_GAIN_BYTES * offTarget * windowFactor;
+    }
+
+    s->cwnd = (size_t) MAX( UTP_MIN_CWND, MIN( UTP_MAX_CWND, cwnd ) );
+}
+
+static void
+onLoss( tr_utp_socket * s )
+{
+    if( !s->inRecovery )
+    {
+        s->cwnd = MAX( UTP_MIN_CWND, s->cwnd / 2 );
+        s->ssthresh = s->cwnd;
+        s->slowStart = FALSE;
+        s->inRecovery = TRUE;
+        s->recoverySeq = s->seqNr - 1;
+    }
+}
+
+/***
+****  Receiving
+***/
+
+/* @return true if the ack moved the window forward */
+static tr_bool
+processAck( tr_utp_socket * s, const struct utp_header * h )
+{
+    int i;
+    const uint16_t oldest = s->seqNr - s->inFlight;
+    const uint16_t acked = h->ack - oldest + 1;
+    const size_t flightBefore = s->bytesInFlight;
+    size_t bytesAcked = 0;
+    uint64_t rttSample = 0;
+    uint64_t now;
+    const tr_bool wasRepairing = s->inRecovery || ( s->lostCount > 0 );
+
+    if( acked == 0 )
+    {
+        /* a duplicate ack. After enough of them, assume that
+         * the oldest packet was lost and resend it right away */
+        if( ( h->type == ST_STATE ) && ( s->inFlight > 0 ) )
+        {
+            const struct utp_packet * pkt = s->out[oldest & UTP_WINDOW_MASK];
+
+            if( ++s->dupAcks == UTP_DUP_ACK_THRESHOLD )
+            {
+                onLoss( s );
+                markLost( s, oldest );
+                resendNow( s, oldest );
+            }
+            else if( ( s->dupAcks > UTP_DUP_ACK_THRESHOLD )
+                  && ( tr_time_usec( ) - pkt->sentAt > s->rtt + 4 * s->rttVar ) )
+            {
+                /* the packets behind it keep arriving, but a round trip
+                 * after it was resent, it still hasn't. It got lost again */
+                markLost( s, oldest );
+                resendNow( s, oldest );
+            }
+
+            resendLost( s );
+        }
+
+        return FALSE;
+    }
+
+    /* acking something we haven't sent? */
+    if( acked > s->inFlight )
+        return FALSE;
+
+    now = tr_time_usec( );
+
+    for( i=0; i<acked; ++i )
+    {
+        const int slot = ( oldest + i ) & UTP_WINDOW_MASK;
+        struct utp_packet * pkt = s->out[slot];
+
+        s->out[slot] = NULL;
+
+        /* Karn's algorithm: a resent packet's ack is ambiguous. And if
+         * we were filling a hole, the packets behind it were held up
+         * at the other end, so their acks say nothing about the RTT */
+        if( ( pkt->seq == h->ack ) && ( pkt->transmissions == 1 ) && !wasRepairing )
+            rttSample = now - pkt->sentAt;
+
+        if( pkt->needResend )
+            --s->lostCount;
+        else
+            s->bytesInFlight -= pkt->payload;
+
+        bytesAcked += pkt->payload;
+        tr_free( pkt );
+    }
+
+    s->inFlight -= acked;
+    s->dupAcks = 0;
+    s->timeouts = 0;
+
+    if( rttSample )
+        updateRTT( s, (uint32_t) rttSample );
+
+    s->rtoTimeout = s->inFlight ? tr_time_msec( ) + s->rto : 0;
+
+    if( s->inRecovery )
+    {
+        if( !seqBefore( h->ack, s->recoverySeq ) )
+            s->inRecovery = FALSE;
+        else { /* a partial ack means that the next packet was lost too */
+            markLost( s, h->ack + 1 );
+            resendNow( s, h->ack + 1 );
+        }
+    }
+    else if( bytesAcked > 0 )
+    {
+        onBytesAcked( s, bytesAcked, flightBefore );
+    }
+
+    resendLost( s );
+    return TRUE;
+}
+
+static void
+deliver( tr_utp_socket * s, const uint8_t * data, size_t len )
+{
+    if( ( len > 0 ) && !s->isClosed && ( s->funcs.onRead != NULL ) )
+        s->funcs.onRead( s->user, data, len );
+}
+
+static void
+processData( tr_utp_socket * s, const struct utp_header * h, const uint8_t * payload, size_t len )
+{
+    const uint16_t distance = h->seq - (uint16_t)( s->ackNr + 1 );
+    struct utp_packet * pkt;
+
+    /* something we already have. Our ack must have gotten lost */
+    if( distance >= 0x8000 ) {
+        sendState( s );
+        return;
+    }
+
+    if( distance >= UTP_WINDOW_PACKETS )
+        return;
+
+    if( s->gotFin && seqBefore( s->finSeq, h->seq ) )
+        return;
+
+    if( h->type == ST_FIN ) {
+        s->gotFin = TRUE;
+        s->finSeq = h->seq;
+    }
+
+    if( distance > 0 )
+    {
+        /* hold onto it until the gap's filled, and send a duplicate
+         * ack right away so that the peer can tell that there's a gap */
+        if( s->in[h->seq & UTP_WINDOW_MASK] == NULL )
+        {
+            pkt = tr_malloc( sizeof( struct utp_packet ) + len );
+            pkt->data = (uint8_t*)( pkt + 1 );
+            pkt->payload = len;
+            pkt->seq = h->seq;
+            pkt->type = h->type;
+            memcpy( pkt->data, payload, len );
+            s->in[h->seq & UTP_WINDOW_MASK] = pkt;
+            s->reorderBytes += len;
+        }
+
+        sendState( s );
+        return;
+    }
+
+    s->ackNr = h->seq;
+    deliver( s, payload, len );
+
+    while(( pkt = s->in[( s->ackNr + 1 ) & UTP_WINDOW_MASK] ))
+    {
+        s->in[pkt->seq & UTP_WINDOW_MASK] = NULL;
+        s->reorderBytes -= pkt->payload;
+        s->ackNr = pkt->seq;
+        deliver( s, pkt->data, pkt->payload );
+        tr_free( pkt );
+    }
+
+    scheduleAck( s );
+
+    if( s->gotFin && ( s->ackNr == s->finSeq ) && !s->eofReported )
+    {
+        s->eofReported = TRUE;
+        notifyState( s, TR_UTP_EOF );
+    }
+}
+
+static void
+processPacket( tr_utp_socket * s, const struct utp_header * h, const uint8_t * payload, size_t len )
+{
+    tr_bool connected = FALSE;
+    tr_bool progress;
+    const int oldDupAcks = s->dupAcks;
+    const size_t oldPeerWnd = s->peerWnd;
+    const uint64_t now = tr_time_msec( );
+
+    s->lastRecv = now;
+    s->replyMicro = getMicro( ) - h->timestamp;
+    s->peerWnd = h->wnd;
+
+    if( h->type == ST_RESET )
+    {
+        socketFail( s, s->state == CS_SYN_SENT ? ECONNREFUSED : ECONNRESET );
+        return;
+    }
+
+    if( s->state == CS_SYN_SENT )
+    {
+        /* a FIN acks our SYN too if the peer hung up while accepting it */
+        if( ( h->type != ST_STATE ) && ( h->type != ST_DATA ) && ( h->type != ST_FIN ) )
+            return;
+
+        /* the peer's first data packet will have this sequence number */
+        s->ackNr = h->seq - 1;
+        s->state = CS_CONNECTED;
+        connected = TRUE;
+        dbgmsg( "connected to %s", tr_ntop_non_ts( &s->addr ) );
+    }
+
+    if( h->timestampDiff != 0 )
+        updateDelay( s, h->timestampDiff, now );
+
+    progress = processAck( s, h );
+
+    if( connected )
+        notifyState( s, TR_UTP_CONNECT );
+
+    if( ( h->type == ST_DATA ) || ( h->type == ST_FIN ) )
+        processData( s, h, payload, len );
+
+    if( s->isClosed && s->finSent && !s->inFlight )
+        s->state = CS_DEAD;
+    else if( ( progress || ( s->dupAcks > oldDupAcks ) || ( s->peerWnd > oldPeerWnd ) ) && tr_utpIsWritable( s ) )
+        notifyState( s, TR_UTP_WRITABLE );
+}
+
+static void
+processSyn( tr_utp_context * ctx, const struct utp_header * h, const tr_address * from, tr_port port )
+{
+    tr_utp_socket * s = findSocket( ctx, from, port, h->connId + 1 );
+
+    /* if we've already got it, our reply must have gotten lost */
+    if( s != NULL ) {
+        if( s->state == CS_CONNECTED )
+            sendState( s );
+        return;
+    }
+
+    if( ctx->accept == NULL ) {
+        sendReset( ctx, from, port, h->connId, h->seq );
+        return;
+    }
+
+    s = socketNew( ctx, from, port, h->connId + 1, h->connId );
+    s->state = CS_CONNECTED;
+    s->seqNr = (uint16_t) tr_cryptoWeakRandInt( 0x10000 );
+    s->ackNr = h->seq;
+    s->peerWnd = h->wnd;
+    s->replyMicro = getMicro( ) - h->timestamp;
+
+    /* refuse it outright rather than accepting and then closing,
+     * so that the peer knows it's worth retrying over TCP */
+    if( !ctx->accept( ctx->user, s, from, port ) ) {
+        dbgmsg( "refused a connection from %s", tr_ntop_non_ts( from ) );
+        tr_ptrArrayRemoveSorted( &ctx->sockets, s, compareSockets );
+        socketFree( s );
+        sendReset( ctx, from, port, h->connId, h->seq );
+        return;
+    }
+
+    dbgmsg( "accepted a connection from %s", tr_ntop_non_ts( from ) );
+    sendState( s );
+}
+
+tr_bool
+tr_utpContextProcess( tr_utp_context   * ctx,
+                      const void       * vbuf,
+                      size_t             buflen,
+                      const tr_address * from,
+                      tr_port            port )
+{
+    int ret;
+    size_t offset = 0;
+    struct utp_header h;
+    tr_utp_socket * s;
+    const uint8_t * buf = vbuf;
+
+    if(( ret = readHeader( buf, buflen, &h, &offset )) <= 0 )
+        return ret == 0;
+
+    if( h.type == ST_SYN )
+    {
+        processSyn( ctx, &h, from, port );
+    }
+    else if(( s = findSocket( ctx, from, port, h.connId )))
+    {
+        if( s->state != CS_DEAD )
+            processPacket( s, &h, buf + offset, buflen - offset );
+    }
+    else if( h.type == ST_RESET )
+    {
+        if(( s = findSocketBySendId( ctx, from, port, h.connId )) && ( s->state != CS_DEAD ))
+            processPacket( s, &h, NULL, 0 );
+    }
+    else
+    {
+        sendReset( ctx, from, port, h.connId, h.seq );
+    }
+
+    return TRUE;
+}
+
+void
+tr_utpContextIssueDeferredAcks( tr_utp_context * ctx )
+{
+    int i;
+    const int n = tr_ptrArraySize( &ctx->ackQueue );
+
+    for( i=0; i<n; ++i )
+    {
+        tr_utp_socket * s = tr_ptrArrayNth( &ctx->ackQueue, i );
+
+        if( s->ackPending && ( s->state != CS_DEAD ) )
+            sendState( s );
+
+        s->ackPending = FALSE;
+    }
+
+    tr_ptrArrayClear( &ctx->ackQueue );
+}
+
+/***
+****  Timers
+***/
+
+static void
+checkTimeouts( tr_utp_socket * s, uint64_t now )
+{
+    if( s->rtoTimeout && ( now >= s->rtoTimeout ) )
+    {
+        int i;
+        const uint16_t oldest = s->seqNr - s->inFlight;
+        const int maxRetries = s->state == CS_SYN_SENT ? UTP_SYN_RETRIES : UTP_MAX_RETRIES;
+
+        if( ++s->timeouts > maxRetries ) {
+            socketFail( s, ETIMEDOUT );
+            return;
+        }
+
+        dbgmsg( "connection %hu to %s timed out; rto is %u", s->recvId, tr_ntop_non_ts( &s->addr ), s->rto );
+
+        /* start over from one packet, and resend everything in flight */
+        s->ssthresh = MAX( UTP_MIN_CWND, s->cwnd / 2 );
+        s->cwnd = UTP_MIN_CWND;
+        s->slowStart = TRUE;
+        s->inRecovery = FALSE;
+        s->dupAcks = 0;
+        s->rto = MIN( s->rto * 2, UTP_RTO_MAX_MSEC );
+        s->rtoTimeout = 0;
+
+        for( i=0; i<s->inFlight; ++i )
+            markLost( s, oldest + i );
+
+        /* the peer's window might be shut, but the oldest packet goes anyway */
+        if( s->inFlight )
+            resendNow( s, oldest );
+
+        resendLost( s );
+    }
+
+    if( s->isClosed && ( now - s->closedAt >= UTP_LINGER_MSEC ) ) {
+        s->state = CS_DEAD;
+        return;
+    }
+
+    if( s->state != CS_CONNECTED )
+        return;
+
+    if( !s->isClosed && !s->inFlight && ( s->peerWnd < UTP_PAYLOAD_SIZE )
+                     && ( now - s->lastRecv >= UTP_ZERO_WINDOW_MSEC ) )
+    {
+        s->peerWnd = UTP_PAYLOAD_SIZE;
+        notifyState( s, TR_UTP_WRITABLE );
+    }
+
+    maybeSendWindowUpdate( s );
+
+    if( now - s->lastSent >= UTP_KEEPALIVE_MSEC )
+        sendState( s );
+}
+
+static void
+onTimer( int foo UNUSED, short bar UNUSED, void * vctx )
+{
+    int i, n;
+    tr_utp_socket ** sockets;
+    tr_utp_context * ctx = vctx;
+    const uint64_t now = tr_time_msec( );
+
+    /* the callbacks can open new connections, so walk a copy */
+    n = tr_ptrArraySize( &ctx->sockets );
+    sockets = tr_memdup( tr_ptrArrayBase( &ctx->sockets ), n * sizeof( tr_utp_socket* ) );
+    for( i=0; i<n; ++i )
+        if( sockets[i]->state != CS_DEAD )
+            checkTimeouts( sockets[i], now );
+    tr_free( sockets );
+
+    tr_utpContextIssueDeferredAcks( ctx );
+
+    /* free the connections that are dead and that nobody's holding */
+    for( i=tr_ptrArraySize( &ctx->sockets )-1; i>=0; --i )
+    {
+        tr_utp_socket * s = tr_ptrArrayNth( &ctx->sockets, i );
+
+        if( ( s->state == CS_DEAD ) && s->isClosed ) {
+            tr_ptrArrayErase( &ctx->sockets, i, i+1 );
+            socketFree( s );
+        }
+    }
+}
+
+/***
+****  Public API
+***/
+
+tr_utp_context *
+tr_utpContextNew( struct event_base  * base,
+                  tr_utp_sendto_func   sendto,
+                  tr_utp_accept_func   accept,
+                  void               * user_data )
+{
+    struct timeval interval;
+    tr_utp_context * ctx = tr_new0( tr_utp_context, 1 );
+
+    ctx->sendto = sendto;
+    ctx->accept = accept;
+    ctx->user = user_data;
+    ctx->sockets = TR_PTR_ARRAY_INIT;
+    ctx->ackQueue = TR_PTR_ARRAY_INIT;
+
+    ctx->timer = event_new( base, -1, EV_PERSIST, onTimer, ctx );
+    interval.tv_sec = 0;
+    interval.tv_usec = UTP_TIMER_MSEC * 1000;
+    event_add( ctx->timer, &interval );
+
+    return ctx;
+}
+
+void
+tr_utpContextFree( tr_utp_context * ctx )
+{
+    if( ctx != NULL )
+    {
+        event_free( ctx->timer );
+        tr_ptrArrayDestruct( &ctx->ackQueue, NULL );
+        tr_ptrArrayDestruct( &ctx->sockets, (PtrArrayForeachFunc)socketFree );
+        tr_free( ctx );
+    }
+}
+
+tr_utp_socket *
+tr_utpConnect( tr_utp_context * ctx, const tr_address * addr, tr_port port )
+{
+    uint16_t recvId;
+    tr_utp_socket * s;
+
+    assert( tr_isAddress( addr ) );
+
+    do
+        recvId = (uint16_t) tr_cryptoWeakRandInt( 0x10000 );
+    while( findSocket( ctx, addr, port, recvId ) );
+
+    s = socketNew( ctx, addr, port, recvId, recvId + 1 );
+    s->state = CS_SYN_SENT;
+    s->seqNr = 1;
+    queuePacket( s, ST_SYN, NULL, 0 );
+
+    dbgmsg( "connecting to %s", tr_ntop_non_ts( addr ) );
+    return s;
+}
+
+void
+tr_utpSetFuncs( tr_utp_socket * s, const tr_utp_funcs * funcs, void * user_data )
+{
+    assert( s != NULL );
+    assert( !s->isClosed );
+
+    s->funcs = *funcs;
+    s->user = user_data;
+}
+
+size_t
+tr_utpWrite( tr_utp_socket * s, struct evbuffer * buf, size_t maxBytes )
+{
+    size_t n = 0;
+
+    if( ( s->state != CS_CONNECTED ) || s->isClosed || s->finSent )
+        return 0;
+
+    while( n < maxBytes )
+    {
+        const size_t len = MIN( UTP_PAYLOAD_SIZE, MIN( maxBytes - n, evbuffer_get_length( buf ) ) );
+
+        if( !len || !canSend( s, len ) )
+            break;
+
+        queuePacket( s, ST_DATA, buf, len );
+        n += len;
+    }
+
+    return n;
+}
+
+tr_bool
+tr_utpIsWritable( const tr_utp_socket * s )
+{
+    return ( s->state == CS_CONNECTED )
+        && !s->isClosed
+        && !s->finSent
+        && canSend( s, UTP_PAYLOAD_SIZE );
+}
+
+void
+tr_utpReadDrained( tr_utp_socket * s )
+{
+    maybeSendWindowUpdate( s );
+}
+
+void
+tr_utpGetInfo( const tr_utp_socket * s, tr_tcp_info * setme )
+{
+    setme->rtt_usec = s->rtt;
+    setme->rttvar_usec = s->rttVar;
+    setme->cwnd = MAX( 1, s->cwnd / UTP_PAYLOAD_SIZE );
+    setme->mss = UTP_PAYLOAD_SIZE;
+}
+
+void
+tr_utpClose( tr_utp_socket * s )
+{
+    if( s == NULL )
+        return;
+
+    assert( !s->isClosed );
+
+    memset( &s->funcs, 0, sizeof( tr_utp_funcs ) );
+    s->user = NULL;
+    s->isClosed = TRUE;
+    s->closedAt = tr_time_msec( );
+
+    if( s->state == CS_SYN_SENT )
+        s->state = CS_DEAD;
+    else if( ( s->state == CS_CONNECTED ) && !s->finSent ) {
+        s->finSent = TRUE;
+        queuePacket( s, ST_FIN, NULL, 0 );
+    }
+}
+
+/***
+****  The session's uTP context
+***/
+
+static void
+utpSendTo( void * vsession, const void * buf, size_t buflen, const tr_address * addr, tr_port port )
+{
+    tr_udpSendTo( vsession, buf, buflen, addr, port );
+}
+
+static tr_bool
+utpAccept( void * vsession, tr_utp_socket * socket, const tr_address * addr, tr_port port )
+{
+    tr_session * session = vsession;
+    tr_address from = *addr;
+
+    if( !tr_sessionIsUTPEnabled( session ) )
+        return FALSE;
+
+    tr_peerMgrAddIncoming( session->peerMgr, &from, port, -1, socket );
+    return TRUE;
+}
+
+void
+tr_utpInit( tr_session * session )
+{
+    assert( session->utp == NULL );
+
+    session->utp = tr_utpContextNew( session->event_base, utpSendTo, utpAccept, session );
+}
+
+void
+tr_utpUninit( tr_session * session )
+{
+    tr_utpContextFree( session->utp );
+    session->utp = NULL;
+}
+
+tr_bool
+tr_utpPacket( const unsigned char   * buf,
+              size_t                  buflen,
+              const struct sockaddr * from,
+              socklen_t               fromlen,
+              tr_session            * session )
+{
+    tr_port port;
+    tr_address addr;
+
+    return ( session->utp != NULL )
+        && tr_netAddressFromSockaddr( &addr, &port, from, fromlen )
+        && tr_utpContextProcess( session->utp, buf, buflen, &addr, port );
+}
+
+void
+tr_utpIssueDeferredAcks( tr_session * session )
+{
+    if( session->utp != NULL )
+        tr_utpContextIssueDeferredAcks( session->utp );
+}
@@ -0,0 +1,166 @@
+/*
+ * This file Copyright (C) 2011 Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2(b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#ifndef __TRANSMISSION__
+#error only libtransmission should #include this header.
+#endif
+
+#ifndef TR_UTP_H
+#define TR_UTP_H
+
+#include "transmission.h"
+#include "net.h" /* tr_address, tr_tcp_info */
+
+struct evbuffer;
+struct event_base;
+
+/**
+ * @addtogroup networked_io Networked IO
+ * @{
+ */
+
+/**
+ * uTP (BEP 29) is a reliable, ordered byte stream over UDP. It shares
+ * the session's UDP socket with the DHT, and uses LEDBAT congestion
+ * control so that it backs off as soon as it sees queueing delay,
+ * before it hurts the user's other traffic.
+ *
+ * A tr_utp_context owns a set of connections and runs their timers.
+ * It doesn't own a socket: incoming datagrams are handed to it with
+ * tr_utpContextProcess(), and it sends through a tr_utp_sendto_func.
+ * tr_session has one that's wired to the UDP socket in tr-udp.c.
+ */
+typedef struct tr_utp_context tr_utp_context;
+
+typedef struct tr_utp_socket tr_utp_socket;
+
+typedef void ( *tr_utp_sendto_func )( void             * user_data,
+                                      const void       * buf,
+                                      size_t             buflen,
+                                      const tr_address * addr,
+                                      tr_port            port );
+
+/**
+ * @brief a peer wants to connect to us.
+ * @return true if the callee takes ownership of the new socket,
+ *         or false to refuse the connection
+ */
+typedef tr_bool ( *tr_utp_accept_func )( void             * user_data,
+                                      tr_utp_socket    * socket,
+                                      const tr_address * addr,
+                                      tr_port            port );
+
+typedef enum
+{
+    TR_UTP_CONNECT,     /* the connection is up */
+    TR_UTP_WRITABLE,    /* there's room in the send window again */
+    TR_UTP_EOF          /* the peer closed the connection */
+}
+tr_utp_state;
+
+typedef struct tr_utp_funcs
+{
+    /* some in-order payload has arrived */
+    void    ( *onRead )( void * user_data, const void * data, size_t len );
+
+    /* how many more bytes the owner is willing to take right now.
+     * This becomes the receive window that we advertise to the peer */
+    size_t  ( *getReceiveWindow )( void * user_data );
+
+    void    ( *onState )( void * user_data, tr_utp_state state );
+
+    /* the connection failed. err is an errno value */
+    void    ( *onError )( void * user_data, int err );
+}
+tr_utp_funcs;
+
+tr_utp_context * tr_utpContextNew( struct event_base  * base,
+                                   tr_utp_sendto_func   sendto,
+                                   tr_utp_accept_func   accept,
+                                   void               * user_data );
+
+void    tr_utpContextFree( tr_utp_context * ctx );
+
+/**
+ * @brief hand a datagram that arrived on the UDP socket to uTP
+ * @return true if it was a uTP packet
+ */
+tr_bool tr_utpContextProcess( tr_utp_context   * ctx,
+                              const void       * buf,
+                              size_t             buflen,
+                              const tr_address * from,
+                              tr_port            port );
+
+/**
+ * @brief send the acks that tr_utpContextProcess() held back.
+ *
+ * Acks are deferred so that a batch of datagrams read at once
+ * can be acked together, so call this after each batch.
+ */
+void    tr_utpContextIssueDeferredAcks( tr_utp_context * ctx );
+
+/** @brief start an outgoing connection. Its result is reported to the funcs */
+tr_utp_socket * tr_utpConnect( tr_utp_context   * ctx,
+                               const tr_address * addr,
+                               tr_port            port );
+
+void    tr_utpSetFuncs( tr_utp_socket      * socket,
+                        const tr_utp_funcs * funcs,
+                        void               * user_data );
+
+/**
+ * @brief send up to maxBytes from the front of buf.
+ * @return how many bytes were taken, which is limited by the send window
+ */
+size_t  tr_utpWrite( tr_utp_socket   * socket,
+                     struct evbuffer * buf,
+                     size_t            maxBytes );
+
+/** @return true if tr_utpWrite() would take some bytes right now */
+tr_bool tr_utpIsWritable( const tr_utp_socket * socket );
+
+/** @brief the owner has made room for more input, so the receive window
+ *         may have opened up */
+void    tr_utpReadDrained( tr_utp_socket * socket );
+
+/** @brief get the connection's round-trip time and congestion window */
+void    tr_utpGetInfo( const tr_utp_socket * socket, tr_tcp_info * setme );
+
+/**
+ * @brief let go of the socket. No more funcs are called after this.
+ *
+ * The connection lingers until whatever's in flight has been acked and
+ * the peer has been told that we're done.
+ */
+void    tr_utpClose( tr_utp_socket * socket );
+
+/***
+****  The session's uTP context
+***/
+
+void    tr_utpInit( tr_session * session );
+
+void    tr_utpUninit( tr_session * session );
+
+/** @brief called by tr-udp.c for datagrams that aren't for the DHT */
+tr_bool tr_utpPacket( const unsigned char   * buf,
+                      size_t                  buflen,
+                      const struct sockaddr * from,
+                      socklen_t               fromlen,
+                      tr_session            * session );
+
+/** @brief send the acks held back while processing the last batch of packets */
+void    tr_utpIssueDeferredAcks( tr_session * session );
+
+/* @} */
+
+#endif
@@ -0,0 +1,390 @@
+#include <stdio.h>
+#include <stdlib.h> /* mkdtemp */
+#include <string.h> /* strcmp, memcmp */
+#include <unistd.h> /* fork, pipe, read, write */
+
+#include <dirent.h>
+#include <ifaddrs.h> /* getifaddrs */
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+
+#include "transmission.h"
+#include "bencode.h"
+#include "crypto.h"
+#include "net.h"
+#include "peer-mgr.h"
+#include "session.h"
+#include "utils.h"
+
+#undef VERBOSE
+
+static int test = 0;
+
+#ifdef VERBOSE
+  #define check( A ) \
+    { \
+        ++test; \
+        if( A ){ \
+            fprintf( stderr, "PASS test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+        } else { \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#else
+  #define check( A ) \
+    { \
+        ++test; \
+        if( !( A ) ){ \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#endif
+
+/**
+ * Whole transfers between two sessions over loopback, with peer I/O
+ * moved to worker threads.
+ *
+ * A forked child seeds, and this process downloads from it. Both sessions
+ * are closed while their peers are still connected, so that the threaded
+ * peer-io teardown races the freeing of the torrents and the session.
+ */
+
+enum
+{
+    PIECE_SIZE = 256 * 1024,
+
+    PEER_IO_THREADS = 2,
+
+    /* give up on a transfer after this long */
+    TRANSFER_TIMEOUT_SECS = 60
+};
+
+struct transfer
+{
+    const char * name;
+    tr_encryption_mode encryption;
+    size_t size;
+    int downLimit_KBps; /* 0 for unlimited */
+    tr_bool removeTorrent; /* remove it before closing the session */
+};
+
+static const struct transfer transfers[] =
+{
+    { "RC4-required",  TR_ENCRYPTION_REQUIRED,  8 * 1024 * 1024,    0, FALSE },
+    { "plaintext",     TR_CLEAR_PREFERRED,      8 * 1024 * 1024,    0, TRUE  },
+    { "rate-limited",  TR_ENCRYPTION_REQUIRED,  2 * 1024 * 1024, 1024, TRUE  }
+};
+
+/***
+****
+***/
+
+static void
+removeTree( const char * path )
+{
+    struct stat sb;
+
+    if( !stat( path, &sb ) && S_ISDIR( sb.st_mode ) )
+    {
+        DIR * odir = opendir( path );
+        struct dirent * d;
+        while( odir && ( d = readdir( odir ) ) )
+            if( strcmp( d->d_name, "." ) && strcmp( d->d_name, ".." ) ) {
+                char * child = tr_buildPath( path, d->d_name, NULL );
+                removeTree( child );
+                tr_free( child );
+            }
+        if( odir )
+            closedir( odir );
+        rmdir( path );
+    }
+    else
+    {
+        unlink( path );
+    }
+}
+
+/* a port that nothing's listening on right now, for the seed to take */
+static tr_port
+findFreePort( void )
+{
+    struct sockaddr_in sin;
+    socklen_t len = sizeof( sin );
+    const int fd = socket( AF_INET, SOCK_STREAM, 0 );
+    tr_port port = 0;
+
+    memset( &sin, 0, sizeof( sin ) );
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl( INADDR_ANY );
+    if( ( fd >= 0 )
+        && !bind( fd, (struct sockaddr*)&sin, sizeof( sin ) )
+        && !getsockname( fd, (struct sockaddr*)&sin, &len ) )
+        port = ntohs( sin.sin_port );
+
+    if( fd >= 0 )
+        close( fd );
+    return port;
+}
+
+/* Transmission won't connect to 127.0.0.1, so talk to ourselves
+ * through one of this machine's other addresses */
+static tr_bool
+findLocalAddress( tr_address * setme )
+{
+    tr_bool found = FALSE;
+    struct ifaddrs * ifs;
+    struct ifaddrs * walk;
+
+    if( getifaddrs( &ifs ) )
+        return FALSE;
+
+    for( walk=ifs; walk && !found; walk=walk->ifa_next ) {
+        tr_port unused;
+        if( ( walk->ifa_addr != NULL )
+            && ( walk->ifa_addr->sa_family == AF_INET )
+            && tr_netAddressFromSockaddr( setme, &unused, walk->ifa_addr, sizeof( struct sockaddr_in ) )
+            && tr_isValidPeerAddress( setme, htons( 1 ) ) )
+            found = TRUE;
+    }
+
+    freeifaddrs( ifs );
+    return found;
+}
+
+static tr_bool
+saveFile( const char * filename, const uint8_t * data, size_t size )
+{
+    tr_bool ok;
+    FILE * fp = fopen( filename, "wb" );
+
+    if( fp == NULL )
+        return FALSE;
+
+    ok = fwrite( data, 1, size, fp ) == size;
+    return ( fclose( fp ) == 0 ) && ok;
+}
+
+/* a single-file torrent of the given data */
+static char*
+makeMetainfo( const uint8_t * data, size_t size, int * len )
+{
+    size_t i;
+    char * ret;
+    tr_benc top;
+    tr_benc * info;
+    const size_t pieceCount = ( size + PIECE_SIZE - 1 ) / PIECE_SIZE;
+    uint8_t * pieces = tr_new( uint8_t, pieceCount * SHA_DIGEST_LENGTH );
+
+    for( i=0; i<pieceCount; ++i )
+        tr_sha1( pieces + i * SHA_DIGEST_LENGTH,
+                 data + i * PIECE_SIZE, (int)MIN( PIECE_SIZE, size - i * PIECE_SIZE ),
+                 NULL );
+
+    tr_bencInitDict( &top, 1 );
+    info = tr_bencDictAddDict( &top, "info", 4 );
+    tr_bencDictAddInt( info, "length", size );
+    tr_bencDictAddStr( info, "name", "transfer" );
+    tr_bencDictAddInt( info, "piece length", PIECE_SIZE );
+    tr_bencDictAddRaw( info, "pieces", pieces, pieceCount * SHA_DIGEST_LENGTH );
+    ret = tr_bencToStr( &top, TR_FMT_BENC, len );
+
+    tr_bencFree( &top );
+    tr_free( pieces );
+    return ret;
+}
+
+static tr_session*
+sessionNew( const char * dir, tr_port port, const struct transfer * t )
+{
+    tr_benc settings;
+    tr_session * session;
+
+    tr_bencInitDict( &settings, 0 );
+    tr_sessionGetDefaultSettings( dir, &settings );
+    tr_bencDictAddStr( &settings, TR_PREFS_KEY_DOWNLOAD_DIR, dir );
+    tr_bencDictAddBool( &settings, TR_PREFS_KEY_DHT_ENABLED, FALSE );
+    tr_bencDictAddBool( &settings, TR_PREFS_KEY_LPD_ENABLED, FALSE );
+    tr_bencDictAddBool( &settings, TR_PREFS_KEY_PEX_ENABLED, FALSE );
+    tr_bencDictAddBool( &settings, TR_PREFS_KEY_UTP_ENABLED, FALSE );
+    tr_bencDictAddBool( &settings, TR_PREFS_KEY_PORT_FORWARDING, FALSE );
+    tr_bencDictAddBool( &settings, TR_PREFS_KEY_RPC_ENABLED, FALSE );
+    tr_bencDictAddBool( &settings, TR_PREFS_KEY_PEER_PORT_RANDOM_ON_START, FALSE );
+    tr_bencDictAddInt ( &settings, TR_PREFS_KEY_PEER_PORT, port );
+    tr_bencDictAddInt ( &settings, TR_PREFS_KEY_PEER_IO_THREADS, PEER_IO_THREADS );
+    tr_bencDictAddInt ( &settings, TR_PREFS_KEY_ENCRYPTION, t->encryption );
+    tr_bencDictAddInt ( &settings, TR_PREFS_KEY_MSGLEVEL, TR_MSG_ERR );
+    if( t->downLimit_KBps > 0 ) {
+        tr_bencDictAddInt ( &settings, TR_PREFS_KEY_DSPEED_KBps, t->downLimit_KBps );
+        tr_bencDictAddBool( &settings, TR_PREFS_KEY_DSPEED_ENABLED, TRUE );
+    }
+    session = tr_sessionInit( "transfer-test", dir, FALSE, &settings );
+    tr_bencFree( &settings );
+
+    return session;
+}
+
+static tr_torrent*
+torrentNew( tr_session * session, const char * metainfo, int len )
+{
+    tr_torrent * tor;
+    tr_ctor * ctor = tr_ctorNew( session );
+
+    tr_ctorSetMetainfo( ctor, (const uint8_t*)metainfo, len );
+    tr_ctorSetPaused( ctor, TR_FORCE, FALSE );
+    tor = tr_torrentNew( ctor, NULL );
+    tr_ctorFree( ctor );
+
+    return tor;
+}
+
+static tr_bool
+waitForCompletion( tr_torrent * tor )
+{
+    const time_t deadline = time( NULL ) + TRANSFER_TIMEOUT_SECS;
+
+    while( time( NULL ) < deadline ) {
+        if( tr_torrentStat( tor )->percentDone >= 1.0 )
+            return TRUE;
+        tr_wait_msec( 50 );
+    }
+
+    return FALSE;
+}
+
+/***
+****  The child: seed until the parent hangs up
+***/
+
+static void
+runSeed( const char * dir, tr_port port, const struct transfer * t,
+         const char * metainfo, int len, int cmdFd, int replyFd )
+{
+    char cmd;
+    tr_session * session = sessionNew( dir, port, t );
+    tr_torrent * tor = torrentNew( session, metainfo, len );
+
+    tr_torrentVerify( tor );
+    cmd = waitForCompletion( tor ) ? 'r' : 'x';
+    if( write( replyFd, &cmd, 1 ) == 1 )
+        while( read( cmdFd, &cmd, 1 ) == 1 )
+            ;
+
+    /* close with the parent's connection still up */
+    tr_sessionClose( session );
+    _exit( 0 );
+}
+
+/***
+****  The parent: download from it
+***/
+
+static int
+transfer( const struct transfer * t, const tr_address * addr )
+{
+    pid_t pid;
+    int len;
+    int status;
+    int cmdPipe[2];
+    int replyPipe[2];
+    char reply = 'x';
+    char * metainfo;
+    char * filename;
+    uint8_t * got;
+    size_t gotLen = 0;
+    tr_pex pex;
+    tr_session * session;
+    tr_torrent * tor;
+    tr_bool isDone;
+    char leechDir[] = "/tmp/transfer-test-XXXXXX";
+    char seedDir[] = "/tmp/transfer-test-XXXXXX";
+    const tr_port port = findFreePort( );
+    uint8_t * data = tr_new( uint8_t, t->size );
+
+    check( port != 0 );
+    check( mkdtemp( leechDir ) != NULL );
+    check( mkdtemp( seedDir ) != NULL );
+    check( !pipe( cmdPipe ) && !pipe( replyPipe ) );
+
+    tr_cryptoRandBuf( data, t->size );
+    metainfo = makeMetainfo( data, t->size, &len );
+    filename = tr_buildPath( seedDir, "transfer", NULL );
+    check( saveFile( filename, data, t->size ) );
+    tr_free( filename );
+
+    /* fork before there's a session, so that the child doesn't inherit
+     * our peer_id or any of the session's threads */
+    if( !( pid = fork( ) ) ) {
+        close( cmdPipe[1] );
+        close( replyPipe[0] );
+        runSeed( seedDir, port, t, metainfo, len, cmdPipe[0], replyPipe[1] );
+    }
+    close( cmdPipe[0] );
+    close( replyPipe[1] );
+
+    /* wait for the seed to have verified its data */
+    check( read( replyPipe[0], &reply, 1 ) == 1 );
+    check( reply == 'r' );
+
+    session = sessionNew( leechDir, 0, t );
+    tor = torrentNew( session, metainfo, len );
+    memset( &pex, 0, sizeof( pex ) );
+    pex.addr = *addr;
+    pex.port = htons( port );
+    tr_peerMgrAddPex( tor, TR_PEER_FROM_TRACKER, &pex, -1 );
+
+    isDone = waitForCompletion( tor );
+    printf( "%-14s %s\n", t->name, isDone ? "done" : "timed out" );
+
+    filename = tr_buildPath( leechDir, "transfer", NULL );
+    got = tr_loadFile( filename, &gotLen );
+    tr_free( filename );
+
+    /* tear down with the seed still connected */
+    if( t->removeTorrent )
+        tr_torrentRemove( tor, FALSE, NULL );
+    tr_sessionClose( session );
+
+    close( cmdPipe[1] );
+    close( replyPipe[0] );
+    waitpid( pid, &status, 0 );
+    removeTree( leechDir );
+    removeTree( seedDir );
+
+    check( isDone );
+    check( got != NULL );
+    check( gotLen == t->size );
+    check( !memcmp( got, data, t->size ) );
+    check( WIFEXITED( status ) && ( WEXITSTATUS( status ) == 0 ) );
+
+    tr_free( got );
+    tr_free( metainfo );
+    tr_free( data );
+    return 0;
+}
+
+int
+main( void )
+{
+    int i, ret = 0;
+    tr_address addr;
+
+    /* the speed limits and tr_torrentStat()'s ETAs need these */
+    tr_formatter_mem_init( 1024, "KiB", "MiB", "GiB", "TiB" );
+    tr_formatter_size_init( 1024, "KiB", "MiB", "GiB", "TiB" );
+    tr_formatter_speed_init( 1024, "KiB/s", "MiB/s", "GiB/s", "TiB/s" );
+
+    if( !findLocalAddress( &addr ) ) {
+        fprintf( stderr, "no usable network address; skipping\n" );
+        return 77;
+    }
+
+    for( i=0; !ret && i<(int)( sizeof( transfers ) / sizeof( transfers[0] ) ); ++i )
+        ret = transfer( &transfers[i], &addr );
+
+    return ret;
+}
@@ -163,6 +163,8 @@ const char* tr_getDefaultDownloadDir( void );
 #define TR_PREFS_KEY_ALT_SPEED_TIME_ENABLED        "alt-speed-time-enabled"
 #define TR_PREFS_KEY_ALT_SPEED_TIME_END            "alt-speed-time-end"
 #define TR_PREFS_KEY_ALT_SPEED_TIME_DAY            "alt-speed-time-day"
+#define TR_PREFS_KEY_ANNOUNCE_STARTUP_WINDOW       "announce-startup-window"
+#define TR_PREFS_KEY_BANDWIDTH_GROUPS              "bandwidth-groups"
 #define TR_PREFS_KEY_BIND_ADDRESS_IPV4             "bind-address-ipv4"
 #define TR_PREFS_KEY_BIND_ADDRESS_IPV6             "bind-address-ipv6"
 #define TR_PREFS_KEY_BLOCKLIST_ENABLED             "blocklist-enabled"
@@ -185,8 +187,11 @@ const char* tr_getDefaultDownloadDir( void );
 #define TR_PREFS_KEY_PEER_PORT_RANDOM_ON_START     "peer-port-random-on-start"
 #define TR_PREFS_KEY_PEER_PORT_RANDOM_LOW          "peer-port-random-low"
 #define TR_PREFS_KEY_PEER_PORT_RANDOM_HIGH         "peer-port-random-high"
+#define TR_PREFS_KEY_PEER_PORT_REUSEPORT           "peer-port-reuseport"
 #define TR_PREFS_KEY_PEER_SOCKET_TOS               "peer-socket-tos"
 #define TR_PREFS_KEY_PEER_CONGESTION_ALGORITHM     "peer-congestion-algorithm"
+#define TR_PREFS_KEY_PEER_IO_THREADS               "peer-io-threads"
+#define TR_PREFS_KEY_PEER_SOCKET_KERNEL_SIZING     "peer-socket-kernel-sizing"
 #define TR_PREFS_KEY_PEX_ENABLED                   "pex-enabled"
 #define TR_PREFS_KEY_PORT_FORWARDING               "port-forwarding-enabled"
 #define TR_PREFS_KEY_PROXY_AUTH_ENABLED            "proxy-auth-enabled"
@@ -216,6 +221,7 @@ const char* tr_getDefaultDownloadDir( void );
 #define TR_PREFS_KEY_USPEED_KBps                   "speed-limit-up"
 #define TR_PREFS_KEY_USPEED_ENABLED                "speed-limit-up-enabled"
 #define TR_PREFS_KEY_UMASK                         "umask"
+#define TR_PREFS_KEY_UTP_ENABLED                   "utp-enabled"
 #define TR_PREFS_KEY_UPLOAD_SLOTS_PER_TORRENT      "upload-slots-per-torrent"
 #define TR_PREFS_KEY_START                         "start-added-torrents"
 #define TR_PREFS_KEY_TRASH_ORIGINAL                "trash-original-torrent-files"
@@ -626,6 +632,15 @@ void     tr_sessionSetDHTEnabled( tr_session * session, tr_bool );
 tr_bool  tr_sessionIsLPDEnabled( const tr_session * session );
 void     tr_sessionSetLPDEnabled( tr_session * session, tr_bool enabled );
 
+/**
+ * @brief Set whether or not to make and accept uTP (BEP 29) peer connections.
+ *
+ * uTP runs over the same UDP port as the DHT and backs off as soon as it
+ * sees queueing delay, so it doesn't starve the user's other traffic.
+ */
+tr_bool  tr_sessionIsUTPEnabled( const tr_session * session );
+void     tr_sessionSetUTPEnabled( tr_session * session, tr_bool enabled );
+
 void     tr_sessionSetCacheLimit_MB( tr_session * session, int mb );
 int      tr_sessionGetCacheLimit_MB( const tr_session * session );
 
@@ -738,6 +753,33 @@ tr_bool  tr_sessionGetActiveSpeedLimit_KBps( const tr_session  * session,
                                              tr_direction        dir,
                                              double            * setme );
 
+/***
+****  Bandwidth groups
+***/
+
+/**
+ * @brief Create or change a named bandwidth group.
+ *
+ * Torrents in a group share its speed limits. The group's limits are
+ * applied underneath the session's, and each torrent's own limits are
+ * applied underneath the group's.
+ *
+ * @param settings a dictionary of the group's keys to change, e.g.
+ *                 "speed-limit-down", "speed-limit-down-enabled",
+ *                 "speed-limit-up", "speed-limit-up-enabled",
+ *                 "alt-speed-down", "alt-speed-up", "alt-speed-enabled",
+ *                 "bandwidth-priority", and "honors-session-limits".
+ *                 Keys that aren't present are left unchanged.
+ * @see tr_torrentSetBandwidthGroup()
+ */
+void     tr_sessionSetBandwidthGroup  ( tr_session         * session,
+                                        const char         * name,
+                                        struct tr_benc     * settings );
+
+/** @brief Append a dictionary describing each bandwidth group to a benc list */
+void     tr_sessionGetBandwidthGroups ( tr_session         * session,
+                                        struct tr_benc     * list );
+
 /***
 ****
 ***/
@@ -1166,6 +1208,15 @@ tr_bool  tr_torrentUsesSpeedLimit     ( const tr_torrent *, tr_direction );
 void     tr_torrentUseSessionLimits   ( tr_torrent *, tr_bool );
 tr_bool  tr_torrentUsesSessionLimits  ( const tr_torrent * );
 
+/**
+ * @brief Move a torrent into a named bandwidth group, creating the group
+ *        if it doesn't exist. A NULL or empty name takes it out of its group.
+ */
+void         tr_torrentSetBandwidthGroup( tr_torrent *, const char * name );
+
+/** @return the torrent's bandwidth group's name, or NULL if it isn't in one */
+const char * tr_torrentGetBandwidthGroup( const tr_torrent * );
+
 
 /****
 *****  Ratio Limits
@@ -1448,6 +1499,7 @@ typedef struct tr_peer_stat
     tr_bool  clientIsChoked;
     tr_bool  clientIsInterested;
     tr_bool  isIncoming;
+    tr_bool  isUTP;
 
     uint8_t  from;
     tr_port  port;
@@ -1480,6 +1532,21 @@ typedef struct tr_peer_stat
 
     /* how many requests we've made and are currently awaiting a response for */
     int      pendingReqsToPeer;
+
+    /* how many system calls the peer's socket has needed per MiB it moved */
+    double   syscallsPerMB;
+
+    /* the kernel's smoothed round-trip time for this peer, or 0 if unknown */
+    double   rtt_msec;
+
+    /* the connection's congestion window in bytes, or 0 if unknown */
+    uint32_t congestionWindow;
+
+    /* how long the peer takes to answer a block request, or 0 if unknown */
+    double   requestRtt_msec;
+
+    /* how many requests we're trying to keep outstanding to the peer */
+    int      desiredReqsToPeer;
 }
 tr_peer_stat;
 
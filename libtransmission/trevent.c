@@ -144,6 +144,15 @@ typedef struct tr_event_handle
     tr_thread *  thread;
     struct event_base * base;
     struct event * pipeEvent;
+
+    /* peer I/O shards. Only the main handle has these */
+    int          shardCount;
+    struct tr_event_handle ** shards;
+
+    /* for shards: protects the state shared by the shard's
+     * peers and the main thread, and counts those peers */
+    tr_lock *    ioLock;
+    int          ioCount;
 }
 tr_event_handle;
 
@@ -219,6 +228,31 @@ logFunc( int severity, const char * message )
         tr_dbg( "%s", message );
 }
 
+static void
+shardThreadFunc( void * veh )
+{
+    tr_event_handle * eh = veh;
+
+#ifndef WIN32
+    signal( SIGPIPE, SIG_IGN );
+#endif
+
+    /* listen to the pipe's read fd */
+    eh->pipeEvent = event_new( eh->base, eh->fds[0], EV_READ | EV_PERSIST, readFromPipe, veh );
+    event_add( eh->pipeEvent, NULL );
+
+    /* loop until all the events are done */
+    while( !eh->die )
+        event_base_dispatch( eh->base );
+
+    /* shut down the thread */
+    tr_lockFree( eh->ioLock );
+    tr_lockFree( eh->lock );
+    event_base_free( eh->base );
+    tr_free( eh );
+    tr_dbg( "Closing peer I/O shard thread" );
+}
+
 static void
 libeventThreadFunc( void * veh )
 {
@@ -248,6 +282,7 @@ libeventThreadFunc( void * veh )
     tr_lockFree( eh->lock );
     event_base_free( base );
     eh->session->events = NULL;
+    tr_free( eh->shards );
     tr_free( eh );
     tr_dbg( "Closing libevent thread" );
 }
@@ -277,8 +312,16 @@ tr_eventInit( tr_session * session )
 void
 tr_eventClose( tr_session * session )
 {
+    int i;
+
     assert( tr_isSession( session ) );
 
+    for( i=0; i<session->events->shardCount; ++i ) {
+        tr_event_handle * shard = session->events->shards[i];
+        shard->die = TRUE;
+        tr_netCloseSocket( shard->fds[1] );
+    }
+
     session->events->die = TRUE;
     tr_deepLog( __FILE__, __LINE__, NULL, "closing trevent pipe" );
     tr_netCloseSocket( session->events->fds[1] );
@@ -301,22 +344,18 @@ tr_amInEventThread( const tr_session * session )
 ***
 **/
 
-void
-tr_runInEventThread( tr_session * session,
-                     void func( void* ), void * user_data )
+static void
+runInThread( tr_event_handle * eh, void func( void* ), void * user_data )
 {
-    assert( tr_isSession( session ) );
-    assert( session->events != NULL );
-
-    if( tr_amInThread( session->events->thread ) )
+    if( tr_amInThread( eh->thread ) )
     {
         (func)( user_data );
     }
     else
     {
         const char         ch = 'r';
-        int                fd = session->events->fds[1];
-        tr_lock *          lock = session->events->lock;
+        int                fd = eh->fds[1];
+        tr_lock *          lock = eh->lock;
         struct tr_run_data data;
 
         tr_lockLock( lock );
@@ -335,3 +374,132 @@ tr_runInEventThread( tr_session * session,
         tr_lockUnlock( lock );
     }
 }
+
+void
+tr_runInEventThread( tr_session * session,
+                     void func( void* ), void * user_data )
+{
+    assert( tr_isSession( session ) );
+    assert( session->events != NULL );
+
+    runInThread( session->events, func, user_data );
+}
+
+/***
+****  Peer I/O shards
+***/
+
+void
+tr_eventSetShardCount( tr_session * session, int count )
+{
+    int i;
+    tr_event_handle * eh;
+
+    assert( tr_isSession( session ) );
+    assert( tr_amInEventThread( session ) );
+
+    eh = session->events;
+
+    /* the shards can't be changed once peers have been given to them */
+    if( eh->shardCount > 0 )
+        return;
+
+    if( count > TR_MAX_PEER_IO_SHARDS )
+        count = TR_MAX_PEER_IO_SHARDS;
+
+    if( count > 0 )
+        eh->shards = tr_new0( tr_event_handle*, count );
+
+    for( i=0; i<count; ++i )
+    {
+        tr_event_handle * shard = tr_new0( tr_event_handle, 1 );
+
+        if( pipe( shard->fds ) == -1 )
+        {
+            const int err = errno;
+            tr_err( _( "Pipe creation failed: %s" ), tr_strerror( err ) );
+            tr_free( shard );
+            break;
+        }
+
+        shard->session = session;
+        shard->lock = tr_lockNew( );
+        shard->ioLock = tr_lockNew( );
+        shard->base = event_base_new( );
+        shard->thread = tr_threadNew( shardThreadFunc, shard );
+        eh->shards[eh->shardCount++] = shard;
+    }
+
+    if( eh->shardCount > 0 )
+        tr_inf( "Using %d threads for peer I/O", eh->shardCount );
+}
+
+int
+tr_eventGetShardCount( const tr_session * session )
+{
+    assert( tr_isSession( session ) );
+
+    return session->events->shardCount;
+}
+
+tr_event_handle *
+tr_eventAcquireShard( tr_session * session )
+{
+    int i;
+    int bestCount = 0;
+    tr_event_handle * eh = session->events;
+    tr_event_handle * best = NULL;
+
+    /* ioCount is also changed from the shard threads, in tr_eventReleaseShard() */
+    for( i=0; i<eh->shardCount; ++i ) {
+        int count;
+        tr_lockLock( eh->shards[i]->ioLock );
+        count = eh->shards[i]->ioCount;
+        tr_lockUnlock( eh->shards[i]->ioLock );
+        if( !best || ( count < bestCount ) ) {
+            best = eh->shards[i];
+            bestCount = count;
+        }
+    }
+
+    if( best != NULL ) {
+        tr_lockLock( best->ioLock );
+        ++best->ioCount;
+        tr_lockUnlock( best->ioLock );
+    }
+
+    return best;
+}
+
+void
+tr_eventReleaseShard( tr_event_handle * shard )
+{
+    tr_lockLock( shard->ioLock );
+    --shard->ioCount;
+    tr_lockUnlock( shard->ioLock );
+}
+
+struct event_base *
+tr_eventShardGetBase( tr_event_handle * shard )
+{
+    return shard->base;
+}
+
+tr_lock *
+tr_eventShardGetLock( tr_event_handle * shard )
+{
+    return shard->ioLock;
+}
+
+tr_bool
+tr_amInShardThread( const tr_event_handle * shard )
+{
+    return tr_amInThread( shard->thread );
+}
+
+void
+tr_runInShardThread( tr_event_handle * shard,
+                     void func( void* ), void * user_data )
+{
+    runInThread( shard, func, user_data );
+}
@@ -31,4 +31,35 @@ tr_bool   tr_amInEventThread( const tr_session * );
 
 void      tr_runInEventThread( tr_session *, void func( void* ), void * user_data );
 
+/**
+***  Peer I/O shards.
+***
+***  These are extra threads, each with its own event base, that do the
+***  socket reads & writes and the RC4 work for the peers assigned to them.
+***  Everything else stays in the main libevent thread.
+**/
+
+enum { TR_MAX_PEER_IO_SHARDS = 64 };
+
+struct tr_event_handle;
+
+/** @brief start `count' shard threads. This only works once per session. */
+void      tr_eventSetShardCount( tr_session *, int count );
+
+int       tr_eventGetShardCount( const tr_session * );
+
+/** @return the least busy shard, or NULL if sharding isn't enabled */
+struct tr_event_handle * tr_eventAcquireShard( tr_session * );
+
+void      tr_eventReleaseShard( struct tr_event_handle * );
+
+struct event_base * tr_eventShardGetBase( struct tr_event_handle * );
+
+/** @brief the lock for state shared between a shard and the main thread */
+struct tr_lock * tr_eventShardGetLock( struct tr_event_handle * );
+
+tr_bool   tr_amInShardThread( const struct tr_event_handle * );
+
+void      tr_runInShardThread( struct tr_event_handle *, void func( void* ), void * user_data );
+
 #endif
@@ -1,3 +1,4 @@
+#include <limits.h> /* INT_MAX, INT_MIN */
 #include <math.h>
 #include <stdio.h> /* fprintf */
 #include <string.h> /* strcmp */
@@ -284,6 +285,39 @@ test_lowerbound( void )
     return 0;
 }
 
+static int
+test_quickfindFirstK( void )
+{
+    int i, k, n;
+    int A[100];
+    const int N = sizeof(A) / sizeof(A[0]);
+
+    for( n=0; n<3; ++n )
+    {
+        for( k=0; k<=N; k+=7 )
+        {
+            int maxLeft = INT_MIN;
+            int minRight = INT_MAX;
+
+            /* random values, then lots of duplicates, then all duplicates */
+            for( i=0; i<N; ++i )
+                A[i] = n==0 ? tr_cryptoWeakRandInt( 1000 )
+                     : n==1 ? tr_cryptoWeakRandInt( 4 )
+                     : 3;
+
+            tr_quickfindFirstK( A, N, sizeof(int), compareInts, k );
+
+            for( i=0; i<k; ++i )
+                maxLeft = MAX( maxLeft, A[i] );
+            for( i=k; i<N; ++i )
+                minRight = MIN( minRight, A[i] );
+            check( k==0 || k==N || maxLeft <= minRight )
+        }
+    }
+
+    return 0;
+}
+
 static int
 test_memmem( void )
 {
@@ -433,6 +467,8 @@ main( void )
         return i;
     if( ( i = test_lowerbound( ) ) )
         return i;
+    if( ( i = test_quickfindFirstK( ) ) )
+        return i;
     if( ( i = test_strip_positional_args( ) ) )
         return i;
     if( ( i = test_strstrip( ) ) )
@@ -872,6 +872,15 @@ tr_time_msec( void )
     return (uint64_t) tv.tv_sec * 1000 + ( tv.tv_usec / 1000 );
 }
 
+uint64_t
+tr_time_usec( void )
+{
+    struct timeval tv;
+
+    gettimeofday( &tv, NULL );
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
 void
 tr_wait_msec( long int msec )
 {
@@ -1019,7 +1028,7 @@ isValidURLChars( const char * url, int url_len )
     return TRUE;
 }
 
-/** @brief return TRUE if the url is a http or https url that Transmission understands */
+/** @brief return TRUE if the url is a http, https, or udp url that Transmission understands */
 tr_bool
 tr_urlIsValidTracker( const char * url )
 {
@@ -1030,7 +1039,7 @@ tr_urlIsValidTracker( const char * url )
     valid = isValidURLChars( url, len )
          && !tr_urlParse( url, len, &scheme, NULL, NULL, NULL )
          && ( scheme != NULL )
-         && ( !strcmp(scheme,"http") || !strcmp(scheme,"https") );
+         && ( !strcmp(scheme,"http") || !strcmp(scheme,"https") || !strcmp(scheme,"udp") );
 
     tr_free( scheme );
     return valid;
@@ -1255,6 +1264,71 @@ tr_lowerBound( const void * key,
     return first;
 }
 
+static inline void
+swapElements( char * a, char * b, size_t size )
+{
+    if( a != b )
+    {
+        while( size-- )
+        {
+            const char tmp = *a;
+            *a++ = *b;
+            *b++ = tmp;
+        }
+    }
+}
+
+/* quickselect with a three-way partition, so that arrays with
+ * many equal elements don't degrade to quadratic time */
+void
+tr_quickfindFirstK( void   * vbase,
+                    size_t   nmemb,
+                    size_t   size,
+                    int   (* compar)(const void *, const void *),
+                    size_t   k )
+{
+    char * base = vbase;
+    char * pivot;
+    size_t left = 0;
+    size_t right = nmemb;
+
+    if( ( k == 0 ) || ( k >= nmemb ) )
+        return;
+
+    pivot = tr_new( char, size );
+
+    while( right - left > 1 )
+    {
+        size_t lt = left;
+        size_t gt = right;
+        size_t i = left;
+
+        memcpy( pivot, base + size * ( left + ( right - left ) / 2 ), size );
+
+        /* [left,lt) < pivot, [lt,i) == pivot, [gt,right) > pivot */
+        while( i < gt )
+        {
+            const int c = compar( base + size * i, pivot );
+
+            if( c < 0 )
+                swapElements( base + size * lt++, base + size * i++, size );
+            else if( c > 0 )
+                swapElements( base + size * i, base + size * --gt, size );
+            else
+                ++i;
+        }
+
+        if( k < lt )
+            right = lt;
+        else if( k >= gt )
+            left = gt;
+        else
+            break;
+    }
+
+    tr_free( pivot );
+}
+
 /***
 ****
 ***/
@@ -270,6 +270,9 @@ void tr_timerAddMsec( struct event * timer, int milliseconds ) TR_GNUC_NONNULL(1
 /** @brief return the current date in milliseconds */
 uint64_t tr_time_msec( void );
 
+/** @brief return the current date in microseconds, for timing short operations */
+uint64_t tr_time_usec( void );
+
 /** @brief sleep the specified number of milliseconds */
 void tr_wait_msec( long int delay_milliseconds );
 
@@ -367,6 +370,18 @@ int tr_lowerBound( const void * key,
                    int       (* compar)(const void* key, const void* arrayMember),
                    tr_bool    * exact_match ) TR_GNUC_HOT TR_GNUC_NONNULL(1,5,6);
 
+/**
+ * @brief partially sort an array so that its first k elements are its k smallest
+ *
+ * This is faster than qsort() when only the best few items are needed.
+ * The first k elements are in no particular order.
+ */
+void tr_quickfindFirstK( void   * base,
+                         size_t   nmemb,
+                         size_t   size,
+                         int   (* compar)(const void *, const void *),
+                         size_t   k ) TR_GNUC_NONNULL(1,4);
+
 
 /**
  * @brief sprintf() a string into a newly-allocated buffer large enough to hold it
@@ -454,7 +469,7 @@ void tr_hex_to_sha1( uint8_t * out, const char * hex ) TR_GNUC_NONNULL(1,2);
 /** @brief convenience function to determine if an address is an IP address (IPv4 or IPv6) */
 tr_bool tr_addressIsIP( const char * address );
 
-/** @brief return TRUE if the url is a http or https url that Transmission understands */
+/** @brief return TRUE if the url is a http, https, or udp url that Transmission understands */
 tr_bool tr_urlIsValidTracker( const char * url ) TR_GNUC_NONNULL(1);
 
 /** @brief return TRUE if the url is a [ http, https, ftp, ftps ] url that Transmission understands */
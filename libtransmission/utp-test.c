@@ -0,0 +1,470 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h> /* memset, strcmp */
+#include <unistd.h> /* close */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h> /* htonl */
+
+#include <event2/buffer.h>
+#include <event2/event.h>
+
+#include "transmission.h"
+#include "net.h"
+#include "tr-utp.h"
+#include "utils.h"
+
+#undef VERBOSE
+
+static int test = 0;
+
+#ifdef VERBOSE
+  #define check( A ) \
+    { \
+        ++test; \
+        if( A ){ \
+            fprintf( stderr, "PASS test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+        } else { \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#else
+  #define check( A ) \
+    { \
+        ++test; \
+        if( !( A ) ){ \
+            fprintf( stderr, "FAIL test #%d (%s, %d)\n", test, __FILE__, __LINE__ ); \
+            return test; \
+        } \
+    }
+#endif
+
+enum
+{
+    /* how much output the sender keeps queued for uTP */
+    SEND_CHUNK = 64 * 1024,
+
+    /* the receive window that the receiver advertises */
+    RECEIVE_WINDOW = 1024 * 1024,
+
+    /* give up on a transfer after this long */
+    DEADLINE_SECS = 60
+};
+
+/***
+****  A uTP context on its own loopback UDP socket
+***/
+
+struct endpoint
+{
+    int fd;
+    tr_port port;
+    tr_address addr;
+    struct event * event;
+    tr_utp_context * ctx;
+
+    /* handed to the accept func */
+    void * user_data;
+
+    /* if nonzero, every nth datagram we send is dropped */
+    int dropEvery;
+    int sendCount;
+};
+
+static void
+endpointSendTo( void * vendpoint, const void * buf, size_t buflen,
+                const tr_address * addr, tr_port port )
+{
+    struct endpoint * e = vendpoint;
+
+    if( e->dropEvery && !( ++e->sendCount % e->dropEvery ) )
+        return;
+
+    {
+        struct sockaddr_storage to;
+        const socklen_t tolen = tr_netSetupSockaddr( addr, port, &to );
+        sendto( e->fd, buf, buflen, 0, (struct sockaddr*)&to, tolen );
+    }
+}
+
+static void
+endpointRead( int fd, short what UNUSED, void * vendpoint )
+{
+    struct endpoint * e = vendpoint;
+    unsigned char buf[4096];
+
+    for( ;; )
+    {
+        tr_port port;
+        tr_address addr;
+        struct sockaddr_storage from;
+        socklen_t fromlen = sizeof( from );
+        const ssize_t n = recvfrom( fd, buf, sizeof( buf ), 0, (struct sockaddr*)&from, &fromlen );
+
+        if( n <= 0 )
+            break;
+
+        if( tr_netAddressFromSockaddr( &addr, &port, (struct sockaddr*)&from, fromlen ) )
+            tr_utpContextProcess( e->ctx, buf, n, &addr, port );
+    }
+
+    tr_utpContextIssueDeferredAcks( e->ctx );
+}
+
+static tr_bool
+endpointInit( struct endpoint     * e,
+              struct event_base   * base,
+              tr_utp_accept_func    accept,
+              void                * user_data,
+              int                   dropEvery )
+{
+    struct sockaddr_in sin;
+    socklen_t len = sizeof( sin );
+
+    memset( e, 0, sizeof( struct endpoint ) );
+    e->user_data = user_data;
+    e->dropEvery = dropEvery;
+
+    if(( e->fd = socket( AF_INET, SOCK_DGRAM, 0 )) < 0 )
+        return FALSE;
+
+    memset( &sin, 0, sizeof( sin ) );
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    if( bind( e->fd, (struct sockaddr*)&sin, sizeof( sin ) ) < 0 )
+        return FALSE;
+    if( getsockname( e->fd, (struct sockaddr*)&sin, &len ) < 0 )
+        return FALSE;
+
+    evutil_make_socket_nonblocking( e->fd );
+    tr_netAddressFromSockaddr( &e->addr, &e->port, (struct sockaddr*)&sin, len );
+
+    e->ctx = tr_utpContextNew( base, endpointSendTo, accept, e );
+    e->event = event_new( base, e->fd, EV_READ | EV_PERSIST, endpointRead, e );
+    event_add( e->event, NULL );
+    return TRUE;
+}
+
+static void
+endpointDestruct( struct endpoint * e )
+{
+    tr_utpContextFree( e->ctx );
+    event_free( e->event );
+    close( e->fd );
+}
+
+/***
+****  Send a patterned stream from one endpoint to the other
+***/
+
+struct transfer
+{
+    struct event_base * base;
+
+    tr_utp_socket * sender;
+    struct evbuffer * out;
+    size_t total;
+    size_t queued;
+    tr_tcp_info senderInfo;
+
+    size_t received;
+    tr_bool corrupt;
+    tr_bool gotEOF;
+    tr_bool timedOut;
+    int error;
+};
+
+static uint8_t
+patternByte( size_t offset )
+{
+    return (uint8_t)( offset % 251 );
+}
+
+static void
+pumpSender( struct transfer * t )
+{
+    for( ;; )
+    {
+        size_t len = evbuffer_get_length( t->out );
+
+        while( ( len < SEND_CHUNK ) && ( t->queued < t->total ) )
+        {
+            const uint8_t ch = patternByte( t->queued++ );
+            evbuffer_add( t->out, &ch, 1 );
+            ++len;
+        }
+
+        if( !len || !tr_utpWrite( t->sender, t->out, len ) )
+            break;
+    }
+
+    /* when it's all been handed over, let go. The socket lingers
+     * to finish sending it and then tells the receiver we're done */
+    if( !evbuffer_get_length( t->out ) && ( t->queued == t->total ) )
+    {
+        tr_utpGetInfo( t->sender, &t->senderInfo );
+        tr_utpClose( t->sender );
+        t->sender = NULL;
+    }
+}
+
+static void
+senderOnState( void * vt, tr_utp_state state )
+{
+    struct transfer * t = vt;
+
+    if( ( state == TR_UTP_CONNECT ) || ( state == TR_UTP_WRITABLE ) )
+        pumpSender( t );
+}
+
+static void
+senderOnError( void * vt, int err )
+{
+    struct transfer * t = vt;
+
+    t->error = err;
+    event_base_loopbreak( t->base );
+}
+
+static void
+receiverOnRead( void * vt, const void * data, size_t len )
+{
+    size_t i;
+    struct transfer * t = vt;
+    const uint8_t * bytes = data;
+
+    for( i=0; i<len; ++i )
+        if( bytes[i] != patternByte( t->received + i ) )
+            t->corrupt = TRUE;
+
+    t->received += len;
+}
+
+static size_t
+receiverGetReceiveWindow( void * vt UNUSED )
+{
+    return RECEIVE_WINDOW;
+}
+
+static void
+receiverOnState( void * vt, tr_utp_state state )
+{
+    struct transfer * t = vt;
+
+    if( state == TR_UTP_EOF )
+    {
+        t->gotEOF = TRUE;
+        event_base_loopbreak( t->base );
+    }
+}
+
+static void
+receiverOnError( void * vt, int err )
+{
+    struct transfer * t = vt;
+
+    t->error = err;
+    event_base_loopbreak( t->base );
+}
+
+static tr_utp_socket * receiver = NULL;
+
+static tr_bool
+receiverAccept( void * vendpoint, tr_utp_socket * socket,
+                const tr_address * addr UNUSED, tr_port port UNUSED )
+{
+    struct endpoint * e = vendpoint;
+    static const tr_utp_funcs funcs = { receiverOnRead,
+                                        receiverGetReceiveWindow,
+                                        receiverOnState,
+                                        receiverOnError };
+
+    assert( receiver == NULL );
+    receiver = socket;
+    tr_utpSetFuncs( socket, &funcs, e->user_data );
+    return TRUE;
+}
+
+static void
+onDeadline( int fd UNUSED, short what UNUSED, void * vt )
+{
+    struct transfer * t = vt;
+
+    t->timedOut = TRUE;
+    event_base_loopbreak( t->base );
+}
+
+/* send `total' bytes from one endpoint to the other, dropping every
+ * `dropEvery'th datagram in both directions if dropEvery is nonzero.
+ * Returns how many microseconds it took */
+static uint64_t
+runTransfer( struct transfer * t, size_t total, int dropEvery )
+{
+    uint64_t begin;
+    struct event * deadline;
+    struct endpoint client, server;
+    struct timeval tv = { DEADLINE_SECS, 0 };
+    static const tr_utp_funcs senderFuncs = { NULL, NULL, senderOnState, senderOnError };
+
+    memset( t, 0, sizeof( struct transfer ) );
+    t->base = event_base_new( );
+    t->out = evbuffer_new( );
+    t->total = total;
+    receiver = NULL;
+
+    if( !endpointInit( &client, t->base, NULL, NULL, dropEvery )
+     || !endpointInit( &server, t->base, receiverAccept, t, dropEvery ) )
+    {
+        t->error = errno;
+        return 0;
+    }
+
+    deadline = evtimer_new( t->base, onDeadline, t );
+    evtimer_add( deadline, &tv );
+
+    begin = tr_time_usec( );
+    t->sender = tr_utpConnect( client.ctx, &server.addr, server.port );
+    tr_utpSetFuncs( t->sender, &senderFuncs, t );
+    event_base_dispatch( t->base );
+    begin = tr_time_usec( ) - begin;
+
+    tr_utpClose( t->sender );
+    tr_utpClose( receiver );
+    receiver = NULL;
+    event_free( deadline );
+    endpointDestruct( &server );
+    endpointDestruct( &client );
+    evbuffer_free( t->out );
+    event_base_free( t->base );
+    return begin;
+}
+
+static int
+test_transfer( void )
+{
+    struct transfer t;
+    const size_t total = 8 * 1024 * 1024;
+
+    runTransfer( &t, total, 0 );
+    check( !t.timedOut );
+    check( !t.error );
+    check( t.gotEOF );
+    check( t.received == total );
+    check( !t.corrupt );
+    check( t.senderInfo.rtt_usec > 0 );
+    check( t.senderInfo.mss > 0 );
+
+    return 0;
+}
+
+static int
+test_lossy_transfer( void )
+{
+    struct transfer t;
+    const size_t total = 2 * 1024 * 1024;
+
+    /* lose one datagram in 20, in both directions */
+    runTransfer( &t, total, 20 );
+    check( !t.timedOut );
+    check( !t.error );
+    check( t.gotEOF );
+    check( t.received == total );
+    check( !t.corrupt );
+
+    return 0;
+}
+
+/***
+****  A peer that doesn't take connections says so with a reset
+***/
+
+static void
+refusedOnError( void * vt, int err )
+{
+    struct transfer * t = vt;
+
+    t->error = err;
+    event_base_loopbreak( t->base );
+}
+
+static tr_bool
+refuseAccept( void * vendpoint UNUSED, tr_utp_socket * socket UNUSED,
+              const tr_address * addr UNUSED, tr_port port UNUSED )
+{
+    return FALSE;
+}
+
+static int
+test_refused( tr_utp_accept_func accept )
+{
+    struct transfer t;
+    struct event * deadline;
+    struct endpoint client, server;
+    struct timeval tv = { DEADLINE_SECS, 0 };
+    static const tr_utp_funcs funcs = { NULL, NULL, NULL, refusedOnError };
+
+    memset( &t, 0, sizeof( struct transfer ) );
+    t.base = event_base_new( );
+    check( endpointInit( &client, t.base, NULL, NULL, 0 ) );
+    check( endpointInit( &server, t.base, accept, NULL, 0 ) );
+    deadline = evtimer_new( t.base, onDeadline, &t );
+    evtimer_add( deadline, &tv );
+
+    t.sender = tr_utpConnect( client.ctx, &server.addr, server.port );
+    tr_utpSetFuncs( t.sender, &funcs, &t );
+    event_base_dispatch( t.base );
+    check( !t.timedOut );
+    check( t.error == ECONNREFUSED );
+
+    tr_utpClose( t.sender );
+    event_free( deadline );
+    endpointDestruct( &server );
+    endpointDestruct( &client );
+    event_base_free( t.base );
+    return 0;
+}
+
+static void
+benchmark( void )
+{
+    int i;
+    static const int drops[] = { 0, 100, 20 };
+    const size_t total = 64 * 1024 * 1024;
+
+    for( i=0; i<(int)(sizeof(drops)/sizeof(drops[0])); ++i )
+    {
+        struct transfer t;
+        const uint64_t usec = runTransfer( &t, total, drops[i] );
+
+        printf( "loss 1/%-3d %7.1f MiB/s, %s, rtt %.2f msec, cwnd %u packets\n",
+                drops[i],
+                usec ? ( t.received / ( 1024.0 * 1024.0 ) ) / ( usec / 1000000.0 ) : 0.0,
+                t.received == total && !t.corrupt ? "ok" : "FAILED",
+                t.senderInfo.rtt_usec / 1000.0,
+                t.senderInfo.cwnd );
+    }
+}
+
+int
+main( int argc, char ** argv )
+{
+    int i;
+
+    if( ( i = test_transfer( ) ) )
+        return i;
+    if( ( i = test_lossy_transfer( ) ) )
+        return i;
+    if( ( i = test_refused( NULL ) ) )
+        return i;
+    if( ( i = test_refused( refuseAccept ) ) )
+        return i;
+
+    if( ( argc > 1 ) && !strcmp( argv[1], "--benchmark" ) )
+        benchmark( );
+
+    return 0;
+}
@@ -10,6 +10,8 @@
  * $Id$
  */
 
+#include <assert.h>
+
 #ifdef WIN32
   #include <ws2tcpip.h>
 #else
@@ -19,6 +21,7 @@
 #include <curl/curl.h>
 
 #include <event2/buffer.h>
+#include <event2/event.h>
 
 #include "transmission.h"
 #include "list.h"
@@ -37,6 +40,12 @@
 enum
 {
     THREADFUNC_MAX_SLEEP_MSEC = 1000,
+
+    /* how many idle CURL handles we keep around */
+    POOL_MAX_HANDLES = 16,
+
+    /* drop the idle handles if none have been needed in this long */
+    POOL_IDLE_SECS = 120
 };
 
 #if 0
@@ -59,11 +68,74 @@ enum
 
 struct tr_web
 {
+    tr_bool threaded; /* see tr_webInit() */
     int close_mode;
-    tr_list * tasks;
+    tr_list * tasks; /* tr_web_task */
+    CURLM * multi;
+
+    /* evented backend */
+    tr_list * sockets; /* struct event */
+    struct event * timer;
+
+    /* threaded backend.  taskLock guards the queue of tasks waiting for
+     * the web thread, and the stats */
     tr_lock * taskLock;
+    tr_list * queue; /* tr_web_task */
+
+    /* DNS lookups, cookies, and SSL session IDs shared by every handle.
+     * Only one thread touches it, so it doesn't need lock callbacks */
+    CURLSH * share;
+
+    /* idle CURL handles.  Open connections are kept in the multi's
+     * connection cache and TLS sessions in the share, not in these, so
+     * all a pooled handle saves is a curl_easy_init() */
+    CURL * pool[POOL_MAX_HANDLES];
+    int poolCount;
+    time_t poolUsedAt;
+
+    tr_web_stats stats;
 };
 
+/***
+****
+***/
+
+static CURL *
+poolTake( struct tr_web * web, time_t now )
+{
+    web->poolUsedAt = now;
+
+    return web->poolCount ? web->pool[--web->poolCount] : NULL;
+}
+
+static void
+poolGive( struct tr_web * web, CURL * e, time_t now )
+{
+    web->poolUsedAt = now;
+
+    if( web->poolCount < POOL_MAX_HANDLES )
+        web->pool[web->poolCount++] = e;
+    else
+        curl_easy_cleanup( e );
+}
+
+static void
+poolClear( struct tr_web * web )
+{
+    while( web->poolCount > 0 )
+        curl_easy_cleanup( web->pool[--web->poolCount] );
+}
+
+static void
+poolPrune( struct tr_web * web, time_t now )
+{
+    if( web->poolCount && ( web->poolUsedAt + POOL_IDLE_SECS <= now ) )
+    {
+        dbgmsg( "closing %d idle handles", web->poolCount );
+        poolClear( web );
+    }
+}
+
 
 /***
 ****
@@ -76,6 +148,7 @@ struct tr_web_task
     struct evbuffer * freebuf;
     char * url;
     char * range;
+    CURL * easy;
     tr_session * session;
     tr_web_done_func * done_func;
     void * done_func_user_data;
@@ -149,15 +222,28 @@ getTimeoutFromURL( const struct tr_web_task * task )
     return timeout;
 }
 
+/* called with web->taskLock held by the threaded backend */
 static CURL *
 createEasy( tr_session * s, struct tr_web_task * task )
 {
     const tr_address * addr;
     tr_bool is_default_value;
-    CURL * e = curl_easy_init( );
+    struct tr_web * web = s->web;
+    CURL * e;
     const long verbose = getenv( "TR_CURL_VERBOSE" ) != NULL;
     char * cookie_filename = tr_buildPath( s->configDir, "cookies.txt", NULL );
 
+    if(( e = poolTake( web, tr_time( ) ))) {
+        curl_easy_reset( e );
+        ++web->stats.handles_reused;
+    } else {
+        e = curl_easy_init( );
+        ++web->stats.handles_created;
+    }
+
+    if( web->share != NULL )
+        curl_easy_setopt( e, CURLOPT_SHARE, web->share );
+
     if( !task->range && s->isProxyEnabled ) {
         const long proxyType = getCurlProxyType( s->proxyType );
         curl_easy_setopt( e, CURLOPT_PROXY, s->proxy );
@@ -228,50 +314,209 @@ task_finish_func( void * vtask )
     task_free( task );
 }
 
-/****
-*****
-****/
+/***
+****  Both backends share a CURLM in web->multi and keep the tasks it's
+****  running in web->tasks.  The evented one uses them only from the
+****  libtransmission thread; the threaded one only from the web thread.
+***/
 
-void
-tr_webRun( tr_session         * session,
-           const char         * url,
-           const char         * range,
-           tr_web_done_func     done_func,
-           void               * done_func_user_data )
+static void
+webFree( tr_session * session )
 {
-    tr_webRunWithBuffer( session, url, range,
-                         done_func, done_func_user_data,
-                         NULL );
+    struct event * ev;
+    struct tr_web_task * task;
+    struct tr_web * web = session->web;
+
+    /* tasks that are still queued or running are dropped without a callback */
+    while(( task = tr_list_pop_front( &web->queue )))
+        task_free( task );
+    while(( task = tr_list_pop_front( &web->tasks )))
+    {
+        curl_multi_remove_handle( web->multi, task->easy );
+        curl_easy_cleanup( task->easy );
+        task_free( task );
+    }
+
+    /* the handles have to go before the share they point to */
+    curl_multi_cleanup( web->multi );
+    poolClear( web );
+    if( web->share != NULL )
+        curl_share_cleanup( web->share );
+
+    while(( ev = tr_list_pop_front( &web->sockets )))
+        event_free( ev );
+    if( web->timer != NULL )
+        event_free( web->timer );
+    if( web->taskLock != NULL )
+        tr_lockFree( web->taskLock );
+
+    tr_free( web );
+    session->web = NULL;
 }
 
-void
-tr_webRunWithBuffer( tr_session         * session,
-                     const char         * url,
-                     const char         * range,
-                     tr_web_done_func     done_func,
-                     void               * done_func_user_data,
-                     struct evbuffer    * buffer )
+static void
+startTask( struct tr_web * web, struct tr_web_task * task )
 {
+    dbgmsg( "adding task to curl: [%s]", task->url );
+    task->easy = createEasy( task->session, task );
+    tr_list_append( &web->tasks, task );
+    curl_multi_add_handle( web->multi, task->easy );
+}
+
+/* take a finished transfer out of the multi and return its task */
+static struct tr_web_task *
+takeCompletedTask( struct tr_web * web, CURLMsg * msg, time_t now )
+{
+    long connects = 0;
+    struct tr_web_task * task;
+    CURL * e = msg->easy_handle;
+
+    curl_easy_getinfo( e, CURLINFO_PRIVATE, (void*)&task );
+    curl_easy_getinfo( e, CURLINFO_RESPONSE_CODE, &task->code );
+    curl_easy_getinfo( e, CURLINFO_NUM_CONNECTS, &connects );
+    curl_multi_remove_handle( web->multi, e );
+    poolGive( web, e, now );
+    tr_list_remove_data( &web->tasks, task );
+
+    /* a transfer that got an answer without making a
+     * new connection must have reused an open one */
+    if( web->taskLock != NULL )
+        tr_lockLock( web->taskLock );
+    ++web->stats.tasks;
+    web->stats.connections_opened += connects;
+    if( !connects && ( msg->data.result == CURLE_OK ) )
+        ++web->stats.connections_reused;
+    if( web->taskLock != NULL )
+        tr_lockUnlock( web->taskLock );
+
+    return task;
+}
+
+/***
+****  Evented backend: curl_multi_socket_action() glue.
+****
+****  Everything below runs in the libtransmission thread: curl tells us
+****  which sockets and timeouts it cares about, we watch them with
+****  libevent, and tell curl when they fire.
+***/
+
+/* hand finished transfers to their callbacks */
+static void
+pumpCompletedTasks( tr_session * session )
+{
+    int unused;
+    CURLMsg * msg;
+    const time_t now = tr_time( );
     struct tr_web * web = session->web;
 
-    if( web != NULL )
+    while(( msg = curl_multi_info_read( web->multi, &unused )))
+        if(( msg->msg == CURLMSG_DONE ) && ( msg->easy_handle != NULL ))
+            task_finish_func( takeCompletedTask( web, msg, now ) );
+
+    poolPrune( web, now );
+
+    if( ( web->close_mode == TR_WEB_CLOSE_WHEN_IDLE ) && ( web->tasks == NULL ) )
+        webFree( session );
+}
+
+static void
+onSocketEvent( int fd, short what, void * vsession )
+{
+    int unused;
+    tr_session * session = vsession;
+    const int flags = ( what & EV_READ ? CURL_CSELECT_IN : 0 )
+                    | ( what & EV_WRITE ? CURL_CSELECT_OUT : 0 );
+
+    curl_multi_socket_action( session->web->multi, fd, flags, &unused );
+    pumpCompletedTasks( session );
+}
+
+static void
+onTimer( int fd UNUSED, short what UNUSED, void * vsession )
+{
+    int unused;
+    tr_session * session = vsession;
+
+    curl_multi_socket_action( session->web->multi, CURL_SOCKET_TIMEOUT, 0, &unused );
+    pumpCompletedTasks( session );
+}
+
+/* CURLMOPT_SOCKETFUNCTION */
+static int
+socketFunc( CURL * e UNUSED, curl_socket_t fd, int action,
+            void * vsession, void * vevent )
+{
+    tr_session * session = vsession;
+    struct tr_web * web = session->web;
+    struct event * ev = vevent;
+
+    if( action == CURL_POLL_REMOVE )
     {
-        struct tr_web_task * task = tr_new0( struct tr_web_task, 1 );
+        if( ev != NULL )
+        {
+            tr_list_remove_data( &web->sockets, ev );
+            event_free( ev );
+        }
+    }
+    else
+    {
+        short events = EV_PERSIST;
+        if( action & CURL_POLL_IN ) events |= EV_READ;
+        if( action & CURL_POLL_OUT ) events |= EV_WRITE;
 
-        task->session = session;
-        task->url = tr_strdup( url );
-        task->range = tr_strdup( range );
-        task->done_func = done_func;
-        task->done_func_user_data = done_func_user_data;
-        task->response = buffer ? buffer : evbuffer_new( );
-        task->freebuf = buffer ? NULL : task->response;
+        if( ev == NULL )
+        {
+            ev = event_new( session->event_base, fd, events, onSocketEvent, session );
+            tr_list_append( &web->sockets, ev );
+            curl_multi_assign( web->multi, fd, ev );
+        }
+        else
+        {
+            event_del( ev );
+            event_assign( ev, session->event_base, fd, events, onSocketEvent, session );
+        }
 
-        tr_lockLock( web->taskLock );
-        tr_list_append( &web->tasks, task );
-        tr_lockUnlock( web->taskLock );
+        event_add( ev, NULL );
     }
+
+    return 0;
+}
+
+/* CURLMOPT_TIMERFUNCTION */
+static int
+timerFunc( CURLM * multi UNUSED, long timeout_msec, void * vsession )
+{
+    tr_session * session = vsession;
+
+    /* curl doesn't want us to call it back from inside this function,
+     * so even a zero timeout goes through the event loop */
+    if( timeout_msec < 0 )
+        evtimer_del( session->web->timer );
+    else
+        tr_timerAddMsec( session->web->timer, timeout_msec );
+
+    return 0;
+}
+
+static void
+addTask( void * vtask )
+{
+    struct tr_web_task * task = vtask;
+    struct tr_web * web = task->session->web;
+
+    if( web == NULL )
+        task_free( task );
+    else
+        startTask( web, task );
 }
 
+/***
+****  Threaded backend: a thread of its own that polls curl with select().
+****
+****  Used when libcurl resolves hostnames synchronously, since a slow
+****  DNS lookup would otherwise stall the libtransmission thread.
+***/
+
 /**
  * Portability wrapper for select().
  *
@@ -309,49 +554,31 @@ static void
 tr_webThreadFunc( void * vsession )
 {
     int unused;
-    CURLM * multi;
-    struct tr_web * web;
-    int taskCount = 0;
     tr_session * session = vsession;
-
-    /* try to enable ssl for https support; but if that fails,
-     * try a plain vanilla init */
-    if( curl_global_init( CURL_GLOBAL_SSL ) )
-        curl_global_init( 0 );
-
-    web = tr_new0( struct tr_web, 1 );
-    web->close_mode = ~0;
-    web->taskLock = tr_lockNew( );
-    web->tasks = NULL;
-    multi = curl_multi_init( );
-    session->web = web;
+    struct tr_web * web = session->web;
 
     for( ;; )
     {
         long msec;
+        time_t now;
         CURLMsg * msg;
         CURLMcode mcode;
         struct tr_web_task * task;
 
-        if( web->close_mode == TR_WEB_CLOSE_NOW )
-            break;
-        if( ( web->close_mode == TR_WEB_CLOSE_WHEN_IDLE ) && !taskCount )
-            break;
-
         /* add tasks from the queue */
         tr_lockLock( web->taskLock );
-        while(( task = tr_list_pop_front( &web->tasks )))
-        {
-            dbgmsg( "adding task to curl: [%s]\n", task->url );
-            curl_multi_add_handle( multi, createEasy( session, task ));
-            /*fprintf( stderr, "adding a task.. taskCount is now %d\n", taskCount );*/
-            ++taskCount;
-        }
+        while(( task = tr_list_pop_front( &web->queue )))
+            startTask( web, task );
         tr_lockUnlock( web->taskLock );
 
+        if( web->close_mode == TR_WEB_CLOSE_NOW )
+            break;
+        if( ( web->close_mode == TR_WEB_CLOSE_WHEN_IDLE ) && ( web->tasks == NULL ) )
+            break;
+
         /* maybe wait a little while before calling curl_multi_perform() */
         msec = 0;
-        curl_multi_timeout( multi, &msec );
+        curl_multi_timeout( web->multi, &msec );
         if( msec < 0 )
             msec = THREADFUNC_MAX_SLEEP_MSEC;
         if( msec > 0 )
@@ -365,7 +592,7 @@ tr_webThreadFunc( void * vsession )
             FD_ZERO( &r_fd_set );
             FD_ZERO( &w_fd_set );
             FD_ZERO( &c_fd_set );
-            curl_multi_fdset( multi, &r_fd_set, &w_fd_set, &c_fd_set, &max_fd );
+            curl_multi_fdset( web->multi, &r_fd_set, &w_fd_set, &c_fd_set, &max_fd );
 
             if( msec > THREADFUNC_MAX_SLEEP_MSEC )
                 msec = THREADFUNC_MAX_SLEEP_MSEC;
@@ -379,50 +606,176 @@ tr_webThreadFunc( void * vsession )
 
         /* call curl_multi_perform() */
         do {
-            mcode = curl_multi_perform( multi, &unused );
+            mcode = curl_multi_perform( web->multi, &unused );
         } while( mcode == CURLM_CALL_MULTI_PERFORM );
 
         /* pump completed tasks from the multi */
-        while(( msg = curl_multi_info_read( multi, &unused )))
-        {
+        now = time( NULL );
+        while(( msg = curl_multi_info_read( web->multi, &unused )))
             if(( msg->msg == CURLMSG_DONE ) && ( msg->easy_handle != NULL ))
-            {
-                struct tr_web_task * task;
-                CURL * e = msg->easy_handle;
-                curl_easy_getinfo( e, CURLINFO_PRIVATE, (void*)&task );
-                curl_easy_getinfo( e, CURLINFO_RESPONSE_CODE, &task->code );
-                curl_multi_remove_handle( multi, e );
-                curl_easy_cleanup( e );
-/*fprintf( stderr, "removing a completed task.. taskCount is now %d (response code: %d, response len: %d)\n", taskCount, (int)task->code, (int)evbuffer_get_length(task->response) );*/
-                tr_runInEventThread( task->session, task_finish_func, task );
-                --taskCount;
-            }
-        }
+                tr_runInEventThread( session, task_finish_func,
+                                     takeCompletedTask( web, msg, now ) );
+
+        poolPrune( web, now );
     }
 
-    /* cleanup */
-    curl_multi_cleanup( multi );
-    tr_lockFree( web->taskLock );
-    tr_free( web );
-    session->web = NULL;
+    webFree( session );
+}
+
+/****
+*****
+****/
+
+void
+tr_webRun( tr_session         * session,
+           const char         * url,
+           const char         * range,
+           tr_web_done_func     done_func,
+           void               * done_func_user_data )
+{
+    tr_webRunWithBuffer( session, url, range,
+                         done_func, done_func_user_data,
+                         NULL );
+}
+
+void
+tr_webRunWithBuffer( tr_session         * session,
+                     const char         * url,
+                     const char         * range,
+                     tr_web_done_func     done_func,
+                     void               * done_func_user_data,
+                     struct evbuffer    * buffer )
+{
+    struct tr_web * web = session->web;
+
+    if( web != NULL )
+    {
+        struct tr_web_task * task = tr_new0( struct tr_web_task, 1 );
+
+        task->session = session;
+        task->url = tr_strdup( url );
+        task->range = tr_strdup( range );
+        task->done_func = done_func;
+        task->done_func_user_data = done_func_user_data;
+        task->response = buffer ? buffer : evbuffer_new( );
+        task->freebuf = buffer ? NULL : task->response;
+
+        if( web->threaded )
+        {
+            tr_lockLock( web->taskLock );
+            tr_list_append( &web->queue, task );
+            tr_lockUnlock( web->taskLock );
+        }
+        else
+        {
+            tr_runInEventThread( session, addTask, task );
+        }
+    }
 }
 
 void
 tr_webInit( tr_session * session )
 {
-    tr_threadNew( tr_webThreadFunc, session );
+    struct tr_web * web;
+    const curl_version_info_data * info;
+
+    assert( tr_amInEventThread( session ) );
+
+    /* try to enable ssl for https support; but if that fails,
+     * try a plain vanilla init */
+    if( curl_global_init( CURL_GLOBAL_SSL ) )
+        curl_global_init( 0 );
+
+    web = tr_new0( struct tr_web, 1 );
+    web->close_mode = ~0;
+    web->tasks = NULL;
+    web->queue = NULL;
+    web->sockets = NULL;
+    web->share = curl_share_init( );
+    if( web->share != NULL ) {
+        curl_share_setopt( web->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS );
+        curl_share_setopt( web->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_COOKIE );
+        curl_share_setopt( web->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION );
+    }
+    web->multi = curl_multi_init( );
+
+    /* without an asynchronous resolver, every DNS lookup would block the
+     * libtransmission thread, so keep curl in a thread of its own */
+    info = curl_version_info( CURLVERSION_NOW );
+    web->threaded = !( info->features & CURL_VERSION_ASYNCHDNS );
+    session->web = web;
+
+    if( web->threaded )
+    {
+        tr_ninf( "web", "libcurl %s has no asynchronous resolver; "
+                        "running web tasks in their own thread", info->version );
+        web->taskLock = tr_lockNew( );
+        tr_threadNew( tr_webThreadFunc, session );
+    }
+    else
+    {
+        web->timer = evtimer_new( session->event_base, onTimer, session );
+        curl_multi_setopt( web->multi, CURLMOPT_SOCKETFUNCTION, socketFunc );
+        curl_multi_setopt( web->multi, CURLMOPT_SOCKETDATA, session );
+        curl_multi_setopt( web->multi, CURLMOPT_TIMERFUNCTION, timerFunc );
+        curl_multi_setopt( web->multi, CURLMOPT_TIMERDATA, session );
+    }
+}
+
+void
+tr_webGetStats( const tr_session * session, tr_web_stats * setme )
+{
+    struct tr_web * web = session->web;
+
+    if( web == NULL )
+        memset( setme, 0, sizeof( tr_web_stats ) );
+    else if( web->taskLock == NULL )
+        *setme = web->stats;
+    else {
+        tr_lockLock( web->taskLock );
+        *setme = web->stats;
+        tr_lockUnlock( web->taskLock );
+    }
+}
+
+static void
+webCloseNow( void * vsession )
+{
+    tr_session * session = vsession;
+
+    if( session->web != NULL )
+        webFree( session );
 }
 
 void
 tr_webClose( tr_session * session, tr_web_close_mode close_mode )
 {
-    if( session->web != NULL )
+    struct tr_web * web = session->web;
+
+    if( web != NULL )
     {
-        session->web->close_mode = close_mode;
+        if( web->threaded )
+        {
+            /* the web thread notices this and frees the web itself */
+            web->close_mode = close_mode;
 
-        if( close_mode == TR_WEB_CLOSE_NOW )
+            if( close_mode == TR_WEB_CLOSE_NOW )
+                while( session->web != NULL )
+                    tr_wait_msec( 100 );
+        }
+        else if( close_mode == TR_WEB_CLOSE_NOW )
+        {
+            tr_runInEventThread( session, webCloseNow, session );
             while( session->web != NULL )
                 tr_wait_msec( 100 );
+        }
+        else
+        {
+            assert( tr_amInEventThread( session ) );
+            web->close_mode = close_mode;
+            if( web->tasks == NULL )
+                webFree( session );
+        }
     }
 }
 
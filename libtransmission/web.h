@@ -42,6 +42,18 @@ void tr_sessionSetWebConfigFunc( tr_session * session, void (*config)(tr_session
 
 void tr_webClose( tr_session * session, tr_web_close_mode close_mode );
 
+typedef struct tr_web_stats
+{
+    uint64_t tasks;              /* transfers that finished */
+    uint64_t handles_created;    /* CURL handles made from scratch */
+    uint64_t handles_reused;     /* tasks that ran on a pooled handle */
+    uint64_t connections_opened;
+    uint64_t connections_reused; /* tasks that didn't need a new connection */
+}
+tr_web_stats;
+
+void tr_webGetStats( const tr_session * session, tr_web_stats * setme );
+
 typedef void ( tr_web_done_func )( tr_session       * session,
                                    long               response_code,
                                    const void       * response,
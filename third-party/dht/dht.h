@@ -55,3 +55,5 @@ void dht_hash(void *hash_return, int hash_size,
               const void *v2, int len2,
               const void *v3, int len3);
 int dht_random_bytes(void *buf, size_t size);
+int dht_sendto(int s, const void *buf, int len, int flags,
+               const struct sockaddr *to, int tolen);